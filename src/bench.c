@@ -0,0 +1,1238 @@
+/*
+ * bench.c - Measure the performance of the image engines and NBD serving.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#define _GNU_SOURCE 1 /* For O_DIRECT */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#    include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
+#include "libchecksum.h"
+#include "libimage.h"
+#include "sysdep_posix.h"
+/*
+ * ntfsclone.h and partclone.h both define IMAGE_MAGIC, so take the
+ * ntfsclone magic before partclone.h redefines it.
+ */
+#include "ntfsclone.h"
+static const char ntfs_magic[IMAGE_MAGIC_SIZE] = IMAGE_MAGIC;
+#undef IMAGE_MAGIC
+#undef IMAGE_MAGIC_SIZE
+#undef VERSION_SIZE
+#include "partclone.h"
+
+/*
+ * Defaults.
+ */
+#define BENCH_SIZE_DEFAULT      (256 * 1024 * 1024)
+#define BENCH_BLOCKSIZE_DEFAULT 4096
+#define BENCH_DENSITY_DEFAULT   50
+#define BENCH_RUNLEN_DEFAULT    64
+#define BENCH_BPC_DEFAULT       64
+#define BENCH_CHUNK_DEFAULT     256
+#define BENCH_READS_DEFAULT     20000
+#define BENCH_WRITES_DEFAULT    5000
+#define BENCH_REQUEST_DEFAULT   4096
+#define BENCH_SECONDS_DEFAULT   10
+#define BENCH_MAXJOBS           64
+#define BENCH_ALIGN             4096
+#define BENCH_HIST_BUCKETS      40
+#define BENCH_MAXLAT            (1024 * 1024) /* Latencies kept per job */
+
+/*
+ * Image types which can be generated.
+ */
+typedef enum bench_image_type {
+    BENCH_V1   = 0,
+    BENCH_V2   = 1,
+    BENCH_NTFS = 2,
+    BENCH_RAW  = 3,
+    BENCH_NTYPES
+} bench_image_type_t;
+
+static const char *const type_names[BENCH_NTYPES] = {"v1", "v2", "ntfs",
+                                                     "raw"};
+
+/*
+ * Tests run on each image.
+ */
+#define BT_OPEN     0x0001 /* Open and verify */
+#define BT_SEQ      0x0002 /* Sequential reads */
+#define BT_RAND     0x0004 /* Random reads */
+#define BT_SEEK     0x0008 /* Random seeks */
+#define BT_CFWRITE  0x0010 /* Random writes to a change file */
+#define BT_CFREAD   0x0020 /* Random reads of changed blocks */
+#define BT_CFSEQ    0x0040 /* Sequential reads through a change file */
+#define BT_ALLTESTS 0x007f
+
+static const struct bench_test_name {
+    const char *btn_name;
+    int         btn_flag;
+} test_names[] = {
+    {"open", BT_OPEN},         {"seq_read", BT_SEQ},     {"rand_read", BT_RAND},
+    {"seek", BT_SEEK},         {"cf_write", BT_CFWRITE}, {"cf_read", BT_CFREAD},
+    {"cf_seq_read", BT_CFSEQ},
+};
+
+/*
+ * Patterns driven through an NBD device.
+ */
+#define BP_SEQREAD   0x0001
+#define BP_RANDREAD  0x0002
+#define BP_SEQWRITE  0x0004
+#define BP_RANDWRITE 0x0008
+
+static const struct bench_test_name pattern_names[] = {
+    {"seqread", BP_SEQREAD},
+    {"randread", BP_RANDREAD},
+    {"seqwrite", BP_SEQWRITE},
+    {"randwrite", BP_RANDWRITE},
+};
+
+/*
+ * Latencies of a run of operations, in nanoseconds.
+ */
+typedef struct bench_latency {
+    uint64_t *bl_ns;    /* One per operation */
+    uint64_t  bl_count; /* Operations recorded */
+    uint64_t  bl_max;   /* Operations there's room for */
+} bench_latency_t;
+
+/*
+ * Run context for program.
+ */
+typedef struct bench_context {
+    char *             bc_progname;
+    const char *       bc_dir;        /* Where images are generated */
+    bench_image_type_t bc_type;       /* Image being measured */
+    char *             bc_path;       /* Its path */
+    char *             bc_cfpath;     /* Its change file's path */
+    int                bc_tests;      /* BT_* */
+    int                bc_keep;       /* Leave the images behind */
+    int                bc_drop;       /* Drop cached image data per test */
+    int                bc_checkreads; /* Verify data as it's read */
+    uint64_t           bc_size;       /* Bytes of device to generate */
+    uint64_t           bc_blocksize;  /* Generated block size */
+    uint64_t           bc_nblocks;    /* Generated blocks */
+    uint64_t           bc_nused;      /* Generated used blocks */
+    uint64_t           bc_density;    /* Percentage of blocks used */
+    uint64_t           bc_runlen;     /* Average run of used or unused */
+    uint64_t           bc_bpc;        /* Version 2 blocks per checksum */
+    uint64_t           bc_seed;       /* Seed for usage and contents */
+    uint64_t           bc_chunk;      /* Blocks per sequential read */
+    uint64_t           bc_reads;      /* Random reads and seeks */
+    uint64_t           bc_writes;     /* Random change file writes */
+    uint64_t           bc_cachesize;  /* Image cache bytes */
+    int64_t            bc_iblocksize; /* Block size of open image */
+    int64_t            bc_iblocks;    /* Block count of open image */
+} bench_context_t;
+
+/*
+ * One job driving an NBD device.
+ */
+typedef struct bench_job {
+    const char *    bj_device;  /* Device path */
+    int             bj_pattern; /* BP_* */
+    uint64_t        bj_request; /* Bytes per request */
+    uint64_t        bj_devsize; /* Bytes of device */
+    uint64_t        bj_start;   /* Where sequential patterns start */
+    double          bj_seconds; /* How long to run */
+    uint64_t        bj_seed;    /* Seed for random offsets */
+    uint64_t        bj_ops;     /* Requests done */
+    bench_latency_t bj_lat;     /* Their latencies */
+    int             bj_error;   /* First error */
+} bench_job_t;
+
+/*
+ * Seconds since an arbitrary point.
+ */
+static double
+bench_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1e9);
+}
+
+/*
+ * xorshift64*: fast and plenty random for our purposes.  The state must
+ * not be zero.
+ */
+static uint64_t
+bench_random(uint64_t *statep) {
+    uint64_t x = *statep;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *statep = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t
+bench_random_seed(uint64_t seed) {
+    return (seed * 0x9E3779B97F4A7C15ULL) | 1;
+}
+
+/*
+ * Contents of block "blockno": distinct for every block and seed, so that
+ * misplaced blocks are noticed.
+ */
+static void
+bench_block_fill(unsigned char *buf, uint64_t bsize, uint64_t seed,
+                 uint64_t blockno) {
+    uint64_t state = bench_random_seed(seed ^ (blockno + 1));
+    uint64_t word;
+    uint64_t i;
+
+    for (i = 0; i + sizeof(word) <= bsize; i += sizeof(word)) {
+        word = bench_random(&state);
+        memcpy(&buf[i], &word, sizeof(word));
+    }
+    for (; i < bsize; i++)
+        buf[i] = bench_random(&state);
+}
+
+/*
+ * Record latencies.
+ */
+static int
+bench_latency_init(bench_latency_t *blp, uint64_t max) {
+    blp->bl_count = 0;
+    blp->bl_max   = max;
+    return ((blp->bl_ns = (uint64_t *)malloc((max + 1) * sizeof(uint64_t))) ==
+            NULL)
+               ? ENOMEM
+               : 0;
+}
+
+static void
+bench_latency_add(bench_latency_t *blp, double start, double end) {
+    if (blp->bl_count < blp->bl_max)
+        blp->bl_ns[blp->bl_count++] = (end - start) * 1e9;
+}
+
+static void
+bench_latency_free(bench_latency_t *blp) {
+    free(blp->bl_ns);
+    blp->bl_ns = (uint64_t *)NULL;
+}
+
+static int
+bench_ns_compare(const void *a, const void *b) {
+    uint64_t na = *(const uint64_t *)a;
+    uint64_t nb = *(const uint64_t *)b;
+
+    return (na < nb) ? -1 : (na > nb);
+}
+
+/*
+ * Print the latencies as percentiles, and as a histogram with buckets
+ * doubling in width: [N, C] counts C operations taking under N
+ * microseconds (and at least N/2).  Empty buckets are left out.
+ */
+static void
+bench_latency_print(bench_latency_t *blp) {
+    static const double pcts[]  = {50, 90, 99, 99.9};
+    static const char * pnames[] = {"p50", "p90", "p99", "p999"};
+    uint64_t            hist[BENCH_HIST_BUCKETS];
+    uint64_t            i;
+    int                 b;
+    int                 first = 1;
+
+    if (!blp->bl_count)
+        return;
+    qsort(blp->bl_ns, blp->bl_count, sizeof(uint64_t), bench_ns_compare);
+    printf(",\"lat_us\":{\"min\":%.3f", blp->bl_ns[0] / 1e3);
+    for (b = 0; b < (sizeof(pcts) / sizeof(pcts[0])); b++)
+        printf(",\"%s\":%.3f", pnames[b],
+               blp->bl_ns[(uint64_t)((blp->bl_count - 1) * pcts[b] / 100)] /
+                   1e3);
+    printf(",\"max\":%.3f}", blp->bl_ns[blp->bl_count - 1] / 1e3);
+
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < blp->bl_count; i++) {
+        uint64_t us = blp->bl_ns[i] / 1000;
+
+        for (b = 0; (b < (BENCH_HIST_BUCKETS - 1)) && (us >= (1ULL << b)); b++)
+            ;
+        hist[b]++;
+    }
+    printf(",\"hist_us\":[");
+    for (b = 0; b < BENCH_HIST_BUCKETS; b++) {
+        if (hist[b]) {
+            printf("%s[%llu,%" PRIu64 "]", (first) ? "" : ",", 1ULL << b,
+                   hist[b]);
+            first = 0;
+        }
+    }
+    printf("]");
+}
+
+/*
+ * Start a result line for "test" on the current image.  The caller adds
+ * its measurements and bench_json_end() finishes the line.
+ */
+static void
+bench_json_start(bench_context_t *bcp, const char *test) {
+    printf("{\"image\":\"%s\",\"test\":\"%s\",\"blocksize\":%" PRId64
+           ",\"blocks\":%" PRId64 ",\"used\":%" PRIu64,
+           type_names[bcp->bc_type], test, bcp->bc_iblocksize,
+           bcp->bc_iblocks, bcp->bc_nused);
+}
+
+static void
+bench_json_rate(uint64_t ops, uint64_t bytes, double seconds) {
+    printf(",\"ops\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"seconds\":%.6f", ops,
+           bytes, seconds);
+    if (seconds > 0)
+        printf(",\"iops\":%.1f,\"mb_per_s\":%.2f", ops / seconds,
+               bytes / (seconds * 1e6));
+}
+
+static void
+bench_json_end(int error) {
+    if (error)
+        printf(",\"error\":\"%s\"", strerror(error));
+    printf("}\n");
+    fflush(stdout);
+}
+
+/*
+ * Decide which blocks are used: runs averaging bc_runlen blocks, each used
+ * with probability bc_density percent.  Unused blocks of raw images are
+ * written as zeroes.  ntfsclone images always use the boot cluster.
+ */
+static int
+bench_usage(bench_context_t *bcp, unsigned char **usedp) {
+    unsigned char *used;
+    uint64_t       state = bench_random_seed(bcp->bc_seed);
+    uint64_t       bi    = 0;
+
+    if ((used = (unsigned char *)malloc(bcp->bc_nblocks + 1)) == NULL)
+        return ENOMEM;
+    bcp->bc_nused = 0;
+    while (bi < bcp->bc_nblocks) {
+        uint64_t run = 1 + (bench_random(&state) % (2 * bcp->bc_runlen));
+        int inuse    = (bench_random(&state) % 100) < bcp->bc_density;
+
+        if (run > (bcp->bc_nblocks - bi))
+            run = bcp->bc_nblocks - bi;
+        memset(&used[bi], inuse, run);
+        bi += run;
+    }
+    if ((bcp->bc_type == BENCH_NTFS) && bcp->bc_nblocks)
+        used[0] = 1;
+    for (bi = 0; bi < bcp->bc_nblocks; bi++)
+        bcp->bc_nused += used[bi];
+    *usedp = used;
+
+    return 0;
+}
+
+static int
+bench_fwrite(FILE *fp, const void *buf, size_t len) {
+    return (fwrite(buf, 1, len, fp) == len) ? 0 : errno;
+}
+
+/*
+ * The headers and maps which precede the block data.
+ */
+static int
+bench_write_v1_head(bench_context_t *bcp, FILE *fp,
+                    const unsigned char *used) {
+    image_head_v1 head;
+    int           error;
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
+    strncpy(head.fs, extfs_MAGIC, FS_MAGIC_SIZE);
+    memcpy(head.version, IMAGE_VERSION, VERSION_SIZE);
+    head.block_size  = bcp->bc_blocksize;
+    head.device_size = bcp->bc_size;
+    head.totalblock  = bcp->bc_nblocks;
+    head.usedblocks  = bcp->bc_nused;
+    if (!(error = bench_fwrite(fp, &head, sizeof(head))) &&
+        !(error = bench_fwrite(fp, used, bcp->bc_nblocks)))
+        error = bench_fwrite(fp, BIT_MAGIC, BIT_MAGIC_SIZE);
+
+    return error;
+}
+
+static int
+bench_write_v2_head(bench_context_t *bcp, FILE *fp,
+                    const unsigned char *used) {
+    image_head_v2  head;
+    uint64_t       bmsize = (bcp->bc_nblocks + 7) / 8;
+    unsigned char *bitmap;
+    crc32_t        bmcrc;
+    uint64_t       bi;
+    int            error;
+
+    if ((bitmap = (unsigned char *)calloc(1, bmsize + 1)) == NULL)
+        return ENOMEM;
+    for (bi = 0; bi < bcp->bc_nblocks; bi++)
+        if (used[bi])
+            bitmap[bi / 8] |= V2_BM_BIT << (bi % 8);
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
+#ifdef PACKAGE_VERSION
+    strncpy(head.ptc_version, PACKAGE_VERSION, PARTCLONE_VERSION_SIZE);
+#endif /* PACKAGE_VERSION */
+    memcpy(head.version, IMAGE_VERSION_2, VERSION_SIZE);
+    head.endianess = ENDIAN_MAGIC;
+    strncpy(head.fs, extfs_MAGIC, FS_MAGIC_SIZE);
+    head.device_size         = bcp->bc_size;
+    head.totalblock          = bcp->bc_nblocks;
+    head.usedblocks          = bcp->bc_nused;
+    head.used_bitmap         = bcp->bc_nused;
+    head.block_size          = bcp->bc_blocksize;
+    head.feature_size        = offsetof(image_head_v2, crc) -
+                               offsetof(image_head_v2, feature_size);
+    head.image_version       = 2;
+    head.cpu_bits            = sizeof(unsigned long) * 8;
+    head.checksum_mode       = V2_CSM_CRC32;
+    head.checksum_size       = CRC_SIZE;
+    head.blocks_per_checksum = bcp->bc_bpc;
+    head.reseed_checksum     = 1;
+    head.bitmap_mode         = V2_BM_BIT;
+    head.crc = update_crc32(init_crc32(), &head, sizeof(head) - CRC_SIZE);
+    bmcrc    = update_crc32(init_crc32(), bitmap, bmsize);
+    if (!(error = bench_fwrite(fp, &head, sizeof(head))) &&
+        !(error = bench_fwrite(fp, bitmap, bmsize)))
+        error = bench_fwrite(fp, &bmcrc, sizeof(bmcrc));
+    free(bitmap);
+
+    return error;
+}
+
+static int
+bench_write_ntfs_head(bench_context_t *bcp, FILE *fp) {
+    image_hdr head;
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, ntfs_magic, sizeof(ntfs_magic));
+    head.major_ver    = NTFSCLONE_IMG_VER_MAJOR;
+    head.minor_ver    = NTFSCLONE_IMG_VER_MINOR;
+    head.cluster_size = bcp->bc_blocksize;
+    head.device_size  = bcp->bc_size;
+    /*
+     * ntfsclone counts the clusters after the first.
+     */
+    head.nr_clusters          = bcp->bc_nblocks - 1;
+    head.inuse                = bcp->bc_nused;
+    head.offset_to_image_data = sizeof(head);
+
+    return bench_fwrite(fp, &head, sizeof(head));
+}
+
+/*
+ * Generate the image.
+ */
+static int
+bench_generate(bench_context_t *bcp) {
+    FILE *         fp;
+    unsigned char *used  = (unsigned char *)NULL;
+    unsigned char *block = (unsigned char *)NULL;
+    crc32_t        crc   = init_crc32();
+    uint64_t       ngroup = 0;
+    uint64_t       bi;
+    int            error;
+
+    if ((error = bench_usage(bcp, &used)))
+        return error;
+    if ((block = (unsigned char *)malloc(bcp->bc_blocksize)) == NULL) {
+        free(used);
+        return ENOMEM;
+    }
+    (void)unlink(bcp->bc_path);
+    if ((fp = fopen(bcp->bc_path, "w")) == NULL) {
+        error = errno;
+    } else {
+        (void)setvbuf(fp, (char *)NULL, _IOFBF, 1024 * 1024);
+        switch (bcp->bc_type) {
+        case BENCH_V1:
+            error = bench_write_v1_head(bcp, fp, used);
+            break;
+        case BENCH_V2:
+            error = bench_write_v2_head(bcp, fp, used);
+            break;
+        case BENCH_NTFS:
+            error = bench_write_ntfs_head(bcp, fp);
+            break;
+        default:
+            break;
+        }
+        for (bi = 0; !error && (bi < bcp->bc_nblocks); bi++) {
+            if (used[bi]) {
+                bench_block_fill(block, bcp->bc_blocksize, bcp->bc_seed, bi);
+                if ((bcp->bc_type == BENCH_NTFS) && (fputc(1, fp) == EOF)) {
+                    error = errno;
+                    break;
+                }
+                if ((error = bench_fwrite(fp, block, bcp->bc_blocksize)))
+                    break;
+                if (bcp->bc_type == BENCH_V1) {
+                    crc32_t bcrc = repeat_crc32(init_crc32(), block[0],
+                                                bcp->bc_blocksize);
+
+                    error = bench_fwrite(fp, &bcrc, sizeof(bcrc));
+                } else if (bcp->bc_type == BENCH_V2) {
+                    crc = update_crc32(crc, block, bcp->bc_blocksize);
+                    if (++ngroup == bcp->bc_bpc) {
+                        error  = bench_fwrite(fp, &crc, sizeof(crc));
+                        crc    = init_crc32();
+                        ngroup = 0;
+                    }
+                }
+            } else if (bcp->bc_type == BENCH_NTFS) {
+                uint64_t gap;
+
+                for (gap = 1; ((bi + gap) < bcp->bc_nblocks) && !used[bi + gap];
+                     gap++)
+                    ;
+                if ((fputc(0, fp) == EOF) ||
+                    (error = bench_fwrite(fp, &gap, sizeof(gap))))
+                    error = (error) ? error : errno;
+                bi += gap - 1;
+            } else if (bcp->bc_type == BENCH_RAW) {
+                memset(block, 0, bcp->bc_blocksize);
+                error = bench_fwrite(fp, block, bcp->bc_blocksize);
+            }
+        }
+        if (!error && (bcp->bc_type == BENCH_V2) && ngroup)
+            error = bench_fwrite(fp, &crc, sizeof(crc));
+        /*
+         * Opening an image reads a version 1 header's worth, so a tiny
+         * image is padded out.
+         */
+        if (!error && (ftell(fp) < sizeof(image_head_v1)) &&
+            (ftruncate(fileno(fp), sizeof(image_head_v1)) < 0))
+            error = errno;
+        if ((fflush(fp) == EOF) && !error)
+            error = errno;
+        if ((fsync(fileno(fp)) < 0) && !error)
+            error = errno;
+        if ((fclose(fp) == EOF) && !error)
+            error = errno;
+    }
+    free(block);
+    free(used);
+
+    return error;
+}
+
+/*
+ * Drop the cached contents of "path", so that a test starts cold.
+ */
+static void
+bench_drop(bench_context_t *bcp, const char *path) {
+    int fd;
+
+    if (bcp->bc_drop && ((fd = open(path, O_RDONLY)) >= 0)) {
+        (void)fdatasync(fd);
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static void
+bench_drop_all(bench_context_t *bcp) {
+    bench_drop(bcp, bcp->bc_path);
+    bench_drop(bcp, bcp->bc_cfpath);
+}
+
+/*
+ * Open and verify the image, with the change file if "cfpath" is given.
+ */
+static int
+bench_open(bench_context_t *bcp, const char *cfpath, void **rpp) {
+    int error;
+
+    if (!(error = image_open(bcp->bc_path, cfpath,
+                             (cfpath) ? SYSDEP_OPEN_RW : SYSDEP_OPEN_RO,
+                             &posix_dispatch, bcp->bc_type == BENCH_RAW,
+                             rpp))) {
+        /*
+         * Not every type can check its reads.
+         */
+        if (bcp->bc_checkreads &&
+            ((error = image_verify_reads(*rpp)) == ENOTSUP))
+            error = 0;
+        if (!error && !(error = image_verify(*rpp))) {
+            bcp->bc_iblocksize = image_blocksize(*rpp);
+            bcp->bc_iblocks    = image_blockcount(*rpp);
+            if (bcp->bc_cachesize)
+                error = image_cache_enable(*rpp, bcp->bc_cachesize, 0);
+        }
+        if (error) {
+            image_close(*rpp);
+            *rpp = (void *)NULL;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Time opening and verifying the image.  The first open may leave
+ * something behind (an ntfsclone index) which speeds up the second.
+ */
+static int
+bench_test_open(bench_context_t *bcp) {
+    void * rp;
+    double t0, t1;
+    int    error = 0;
+    int    pass;
+
+    for (pass = 0; !error && (pass < 2); pass++) {
+        bench_drop_all(bcp);
+        t0 = bench_now();
+        if (!(error = bench_open(bcp, (const char *)NULL, &rp)))
+            image_close(rp);
+        t1 = bench_now();
+        bench_json_start(bcp, (pass) ? "reopen" : "open");
+        printf(",\"seconds\":%.6f", t1 - t0);
+        bench_json_end(error);
+    }
+
+    return error;
+}
+
+/*
+ * Read the whole image in order, bc_chunk blocks at a time.
+ */
+static int
+bench_test_seq(bench_context_t *bcp, void *rp, const char *test) {
+    unsigned char *buf;
+    uint64_t       bi;
+    uint64_t       nops = 0;
+    double         t0, t1;
+    int            error = 0;
+
+    if ((buf = (unsigned char *)malloc(bcp->bc_chunk * bcp->bc_iblocksize)) ==
+        NULL)
+        return ENOMEM;
+    bench_drop_all(bcp);
+    t0 = bench_now();
+    for (bi = 0; !error && (bi < bcp->bc_iblocks); bi += bcp->bc_chunk) {
+        uint64_t n = bcp->bc_iblocks - bi;
+
+        if (n > bcp->bc_chunk)
+            n = bcp->bc_chunk;
+        error = image_readblocks_at(rp, bi, buf, n);
+        nops++;
+    }
+    t1 = bench_now();
+    free(buf);
+    bench_json_start(bcp, test);
+    printf(",\"chunk\":%" PRIu64, bcp->bc_chunk);
+    bench_json_rate(nops, bi * bcp->bc_iblocksize, t1 - t0);
+    bench_json_end(error);
+
+    return error;
+}
+
+/*
+ * Seek to random blocks, and read a block there unless "seekonly".
+ */
+static int
+bench_test_rand(bench_context_t *bcp, void *rp, int seekonly) {
+    unsigned char * buf;
+    uint64_t        state = bench_random_seed(bcp->bc_seed + 1);
+    uint64_t        i;
+    bench_latency_t lat;
+    double          t0, t1, ts;
+    int             error;
+
+    if (!bcp->bc_iblocks)
+        return 0;
+    if ((buf = (unsigned char *)malloc(bcp->bc_iblocksize)) == NULL)
+        return ENOMEM;
+    if ((error = bench_latency_init(&lat, bcp->bc_reads))) {
+        free(buf);
+        return error;
+    }
+    bench_drop_all(bcp);
+    t0 = bench_now();
+    for (i = 0; !error && (i < bcp->bc_reads); i++) {
+        uint64_t bi = bench_random(&state) % bcp->bc_iblocks;
+
+        ts = bench_now();
+        if (!(error = image_seek(rp, bi)) && !seekonly)
+            error = image_readblocks(rp, buf, 1);
+        bench_latency_add(&lat, ts, bench_now());
+    }
+    t1 = bench_now();
+    bench_json_start(bcp, (seekonly) ? "seek" : "rand_read");
+    bench_json_rate(i, (seekonly) ? 0 : i * bcp->bc_iblocksize, t1 - t0);
+    bench_latency_print(&lat);
+    bench_json_end(error);
+    bench_latency_free(&lat);
+    free(buf);
+
+    return error;
+}
+
+/*
+ * Write random blocks through a change file, then read them back.  The
+ * blocks written are remembered so that the reads can be checked.
+ */
+static int
+bench_test_cf(bench_context_t *bcp) {
+    void *          rp;
+    unsigned char * buf;
+    unsigned char * check;
+    uint64_t *      blocks;
+    uint64_t        state = bench_random_seed(bcp->bc_seed + 2);
+    uint64_t        wseed = bcp->bc_seed + 3;
+    uint64_t        nbad  = 0;
+    uint64_t        i;
+    bench_latency_t lat;
+    double          t0, t1, t2, ts;
+    int             error;
+
+    (void)unlink(bcp->bc_cfpath);
+    if ((error = bench_open(bcp, bcp->bc_cfpath, &rp)))
+        return error;
+    if (!bcp->bc_iblocks) {
+        image_close(rp);
+        return 0;
+    }
+    buf    = (unsigned char *)malloc(bcp->bc_iblocksize);
+    check  = (unsigned char *)malloc(bcp->bc_iblocksize);
+    blocks = (uint64_t *)malloc((bcp->bc_writes + 1) * sizeof(uint64_t));
+    if (!buf || !check || !blocks ||
+        (error = bench_latency_init(&lat, bcp->bc_writes))) {
+        error = (error) ? error : ENOMEM;
+    } else {
+        if (bcp->bc_tests & BT_CFWRITE) {
+            t0 = bench_now();
+            for (i = 0; !error && (i < bcp->bc_writes); i++) {
+                blocks[i] = bench_random(&state) % bcp->bc_iblocks;
+                bench_block_fill(buf, bcp->bc_iblocksize, wseed, blocks[i]);
+                ts = bench_now();
+                if (!(error = image_seek(rp, blocks[i])))
+                    error = image_writeblocks(rp, buf, 1);
+                bench_latency_add(&lat, ts, bench_now());
+            }
+            t1 = bench_now();
+            if (!error)
+                error = image_sync(rp);
+            t2 = bench_now();
+            bench_json_start(bcp, "cf_write");
+            bench_json_rate(i, i * bcp->bc_iblocksize, t2 - t0);
+            printf(",\"sync_seconds\":%.6f", t2 - t1);
+            bench_latency_print(&lat);
+            bench_json_end(error);
+        }
+        /*
+         * A block's contents depend only on its number, so blocks written
+         * more than once read back the same whichever write is found.
+         */
+        if (!error && (bcp->bc_tests & BT_CFREAD) &&
+            (bcp->bc_tests & BT_CFWRITE)) {
+            lat.bl_count = 0;
+            bench_drop_all(bcp);
+            t0 = bench_now();
+            for (i = 0; !error && (i < bcp->bc_writes); i++) {
+                ts = bench_now();
+                error = image_readblocks_at(rp, blocks[i], buf, 1);
+                bench_latency_add(&lat, ts, bench_now());
+                bench_block_fill(check, bcp->bc_iblocksize, wseed, blocks[i]);
+                if (!error && memcmp(buf, check, bcp->bc_iblocksize))
+                    nbad++;
+            }
+            t1 = bench_now();
+            bench_json_start(bcp, "cf_read");
+            bench_json_rate(bcp->bc_writes, bcp->bc_writes * bcp->bc_iblocksize,
+                            t1 - t0);
+            printf(",\"mismatches\":%" PRIu64, nbad);
+            bench_latency_print(&lat);
+            bench_json_end((!error && nbad) ? EIO : error);
+            if (nbad)
+                error = EIO;
+        }
+        if (!error && (bcp->bc_tests & BT_CFSEQ))
+            error = bench_test_seq(bcp, rp, "cf_seq_read");
+        bench_latency_free(&lat);
+    }
+    free(blocks);
+    free(check);
+    free(buf);
+    image_close(rp);
+
+    return error;
+}
+
+/*
+ * Generate one image and run the tests on it.
+ */
+static int
+bench_image(bench_context_t *bcp) {
+    void * rp;
+    double t0, t1;
+    int    error;
+
+    bcp->bc_nblocks = bcp->bc_size / bcp->bc_blocksize;
+    bcp->bc_size    = bcp->bc_nblocks * bcp->bc_blocksize;
+    if ((bcp->bc_path = (char *)malloc(strlen(bcp->bc_dir) + 64)) == NULL)
+        return ENOMEM;
+    if ((bcp->bc_cfpath = (char *)malloc(strlen(bcp->bc_dir) + 64)) == NULL) {
+        free(bcp->bc_path);
+        return ENOMEM;
+    }
+    sprintf(bcp->bc_path, "%s/bench-%s-%d.img", bcp->bc_dir,
+            type_names[bcp->bc_type], (int)getpid());
+    sprintf(bcp->bc_cfpath, "%s.cf", bcp->bc_path);
+
+    bcp->bc_iblocksize = bcp->bc_blocksize;
+    bcp->bc_iblocks    = bcp->bc_nblocks;
+    t0                 = bench_now();
+    error              = bench_generate(bcp);
+    t1                 = bench_now();
+    bench_json_start(bcp, "generate");
+    printf(",\"path\":\"%s\",\"seconds\":%.6f", bcp->bc_path, t1 - t0);
+    bench_json_end(error);
+
+    if (!error && (bcp->bc_tests & BT_OPEN))
+        error = bench_test_open(bcp);
+    if (!error && (bcp->bc_tests & (BT_SEQ | BT_RAND | BT_SEEK)) &&
+        !(error = bench_open(bcp, (const char *)NULL, &rp))) {
+        if (!error && (bcp->bc_tests & BT_SEQ))
+            error = bench_test_seq(bcp, rp, "seq_read");
+        if (!error && (bcp->bc_tests & BT_RAND))
+            error = bench_test_rand(bcp, rp, 0);
+        if (!error && (bcp->bc_tests & BT_SEEK))
+            error = bench_test_rand(bcp, rp, 1);
+        image_close(rp);
+    }
+    if (!error && (bcp->bc_tests & (BT_CFWRITE | BT_CFREAD | BT_CFSEQ)))
+        error = bench_test_cf(bcp);
+    if (error)
+        fprintf(stderr, "%s: %s: %s\n", bcp->bc_progname, bcp->bc_path,
+                strerror(error));
+
+    if (!bcp->bc_keep) {
+        char *ipath = (char *)malloc(strlen(bcp->bc_path) + sizeof(".ntfsidx"));
+
+        (void)unlink(bcp->bc_path);
+        (void)unlink(bcp->bc_cfpath);
+        if (ipath) {
+            sprintf(ipath, "%s.ntfsidx", bcp->bc_path);
+            (void)unlink(ipath);
+            free(ipath);
+        }
+    }
+    free(bcp->bc_cfpath);
+    free(bcp->bc_path);
+
+    return error;
+}
+
+/*
+ * Drive the device with one job's pattern until its time is up.
+ */
+static void *
+bench_job_run(void *arg) {
+    bench_job_t *  bjp     = (bench_job_t *)arg;
+    int            writing = bjp->bj_pattern & (BP_SEQWRITE | BP_RANDWRITE);
+    int            random  = bjp->bj_pattern & (BP_RANDREAD | BP_RANDWRITE);
+    uint64_t       nreqs   = bjp->bj_devsize / bjp->bj_request;
+    uint64_t       state   = bench_random_seed(bjp->bj_seed);
+    uint64_t       offset  = bjp->bj_start;
+    void *         buf     = (void *)NULL;
+    double         t0, ts, te;
+    int            fd;
+    ssize_t        n;
+
+    if ((fd = open(bjp->bj_device,
+                   ((writing) ? O_RDWR : O_RDONLY) | O_DIRECT)) < 0) {
+        bjp->bj_error = errno;
+        return (void *)NULL;
+    }
+    if ((bjp->bj_error = posix_memalign(&buf, BENCH_ALIGN, bjp->bj_request))) {
+        close(fd);
+        return (void *)NULL;
+    }
+    memset(buf, 0x5a, bjp->bj_request);
+    t0 = te = bench_now();
+    while ((te - t0) < bjp->bj_seconds) {
+        if (random)
+            offset = (bench_random(&state) % nreqs) * bjp->bj_request;
+        else if ((offset + bjp->bj_request) > bjp->bj_devsize)
+            offset = 0;
+        ts = bench_now();
+        n  = (writing) ? pwrite(fd, buf, bjp->bj_request, offset)
+                       : pread(fd, buf, bjp->bj_request, offset);
+        te = bench_now();
+        if (n != (ssize_t)bjp->bj_request) {
+            bjp->bj_error = (n < 0) ? errno : EIO;
+            break;
+        }
+        bench_latency_add(&bjp->bj_lat, ts, te);
+        bjp->bj_ops++;
+        offset += bjp->bj_request;
+    }
+    if (writing && !bjp->bj_error && (fdatasync(fd) < 0))
+        bjp->bj_error = errno;
+    free(buf);
+    close(fd);
+
+    return (void *)NULL;
+}
+
+/*
+ * Run "pattern" on an NBD device (presumably served by imagemount) with
+ * "njobs" jobs at once.  Sequential jobs start at evenly spaced offsets.
+ */
+static int
+bench_nbd(const char *device, const char *pname, int pattern, int njobs,
+          uint64_t request, double seconds, uint64_t seed) {
+    bench_job_t     jobs[BENCH_MAXJOBS];
+    bench_latency_t lat;
+    uint64_t        devsize;
+    uint64_t        ops = 0;
+    uint64_t        maxops;
+    double          t0, t1;
+    int             error = 0;
+    int             fd;
+    int             j;
+#ifdef HAVE_LIBPTHREAD
+    pthread_t threads[BENCH_MAXJOBS];
+    int       nstarted;
+#endif /* HAVE_LIBPTHREAD */
+
+    if ((fd = open(device, O_RDONLY)) < 0)
+        return errno;
+    devsize = (uint64_t)lseek(fd, 0, SEEK_END);
+    close(fd);
+    if ((devsize == (uint64_t)-1) || (devsize < request))
+        return ENOSPC;
+
+    /*
+     * Latencies are only kept for the first requests of a long run.
+     */
+    maxops = seconds * 1e6;
+    if (maxops > BENCH_MAXLAT)
+        maxops = BENCH_MAXLAT;
+    memset(jobs, 0, sizeof(jobs));
+    for (j = 0; !error && (j < njobs); j++) {
+        jobs[j].bj_device  = device;
+        jobs[j].bj_pattern = pattern;
+        jobs[j].bj_request = request;
+        jobs[j].bj_devsize = devsize;
+        jobs[j].bj_start   = ((devsize / request) * j / njobs) * request;
+        jobs[j].bj_seconds = seconds;
+        jobs[j].bj_seed    = seed + j;
+        error              = bench_latency_init(&jobs[j].bj_lat, maxops);
+    }
+    t0 = bench_now();
+#ifdef HAVE_LIBPTHREAD
+    for (nstarted = 0; !error && (nstarted < njobs); nstarted++)
+        if ((error = pthread_create(&threads[nstarted], (pthread_attr_t *)NULL,
+                                    bench_job_run, &jobs[nstarted])))
+            break;
+    while (nstarted--)
+        (void)pthread_join(threads[nstarted], (void **)NULL);
+#else  /* HAVE_LIBPTHREAD */
+    for (j = 0; !error && (j < njobs); j++)
+        (void)bench_job_run(&jobs[j]);
+#endif /* HAVE_LIBPTHREAD */
+    t1 = bench_now();
+
+    for (j = 0; j < njobs; j++) {
+        ops += jobs[j].bj_ops;
+        if (!error)
+            error = jobs[j].bj_error;
+    }
+    if (!bench_latency_init(&lat, ops)) {
+        for (j = 0; j < njobs; j++) {
+            memcpy(&lat.bl_ns[lat.bl_count], jobs[j].bj_lat.bl_ns,
+                   jobs[j].bj_lat.bl_count * sizeof(uint64_t));
+            lat.bl_count += jobs[j].bj_lat.bl_count;
+        }
+        printf("{\"device\":\"%s\",\"test\":\"%s\",\"request\":%" PRIu64
+               ",\"jobs\":%d,\"devsize\":%" PRIu64,
+               device, pname, request, njobs, devsize);
+        bench_json_rate(ops, ops * request, t1 - t0);
+        bench_latency_print(&lat);
+        bench_json_end(error);
+        bench_latency_free(&lat);
+    }
+    for (j = 0; j < njobs; j++)
+        bench_latency_free(&jobs[j].bj_lat);
+
+    return error;
+}
+
+/*
+ * Parse a comma-separated list of names from "table" into flags.
+ */
+static int
+bench_parse_list(const char *list, const struct bench_test_name *table,
+                 int tsize, int *flagsp) {
+    const char *cp = list;
+    int         t;
+
+    *flagsp = 0;
+    while (*cp) {
+        size_t len = strcspn(cp, ",");
+
+        for (t = 0; t < tsize; t++)
+            if ((strlen(table[t].btn_name) == len) &&
+                !strncmp(cp, table[t].btn_name, len))
+                break;
+        if (t == tsize)
+            return EINVAL;
+        *flagsp |= table[t].btn_flag;
+        cp += len + (cp[len] == ',');
+    }
+
+    return (*flagsp) ? 0 : EINVAL;
+}
+
+/*
+ * Parse a size with an optional K, M or G suffix.
+ */
+static int
+bench_parse_size(const char *str, uint64_t *sizep) {
+    char *end;
+
+    *sizep = strtoull(str, &end, 0);
+    switch (*end) {
+    case 'g':
+    case 'G':
+        *sizep *= 1024;
+        /* FALLTHROUGH */
+    case 'm':
+    case 'M':
+        *sizep *= 1024;
+        /* FALLTHROUGH */
+    case 'k':
+    case 'K':
+        *sizep *= 1024;
+        end++;
+        /* FALLTHROUGH */
+    default:
+        break;
+    }
+
+    return ((end == str) || *end) ? EINVAL : 0;
+}
+
+static void
+usage(const char *pname) {
+    fprintf(stderr,
+            "%s: usage: %s [-t types] [-T tests] [-s size] [-b blocksize] "
+            "[-d density] [-l runlength] [-k bpc] [-S seed] [-D dir] "
+            "[-c chunk] [-r reads] [-w writes] [-m cachemb] [-FKC]\n",
+            pname, pname);
+    fprintf(stderr,
+            "%s: usage: %s -N device [-p patterns] [-B request] "
+            "[-L seconds] [-j jobs] [-S seed]\n",
+            pname, pname);
+    fprintf(stderr, "\ttypes are v1, v2, ntfs and raw\n");
+    fprintf(stderr, "\ttests are open, seq_read, rand_read, seek, cf_write, "
+                    "cf_read and cf_seq_read\n");
+    fprintf(stderr, "\tpatterns are seqread, randread, seqwrite and "
+                    "randwrite; writes change the device\n");
+}
+
+/*
+ * Generate images and measure the image library, or measure a served
+ * device.  Results go to stdout, one JSON object per line.
+ */
+int
+main(int argc, char *argv[]) {
+    int             option;
+    extern char *   optarg;
+    extern int      optind;
+    const char *    device   = (const char *)NULL;
+    int             types    = (1 << BENCH_NTYPES) - 1;
+    int             patterns = BP_SEQREAD | BP_RANDREAD;
+    int             njobs    = 1;
+    uint64_t        request  = BENCH_REQUEST_DEFAULT;
+    uint64_t        seconds  = BENCH_SECONDS_DEFAULT;
+    int             error    = 0;
+    int             p;
+    bench_context_t bc;
+
+    memset(&bc, 0, sizeof(bc));
+    bc.bc_progname  = argv[0];
+    bc.bc_dir       = "/tmp";
+    bc.bc_tests     = BT_ALLTESTS;
+    bc.bc_size      = BENCH_SIZE_DEFAULT;
+    bc.bc_blocksize = BENCH_BLOCKSIZE_DEFAULT;
+    bc.bc_density   = BENCH_DENSITY_DEFAULT;
+    bc.bc_runlen    = BENCH_RUNLEN_DEFAULT;
+    bc.bc_bpc       = BENCH_BPC_DEFAULT;
+    bc.bc_seed      = 1;
+    bc.bc_chunk     = BENCH_CHUNK_DEFAULT;
+    bc.bc_reads     = BENCH_READS_DEFAULT;
+    bc.bc_writes    = BENCH_WRITES_DEFAULT;
+
+    /*
+     * Parse options.
+     */
+    while ((option = getopt(argc, argv,
+                            "b:c:d:j:k:l:m:p:r:s:t:w:B:D:L:N:S:T:CFK")) !=
+           -1) {
+        switch (option) {
+        case 'b':
+            if (bench_parse_size(optarg, &bc.bc_blocksize) ||
+                (bc.bc_blocksize < 512) || (bc.bc_blocksize > UINT32_MAX))
+                error = 1;
+            break;
+        case 'c':
+            if ((sscanf(optarg, "%" SCNu64, &bc.bc_chunk) != 1) ||
+                !bc.bc_chunk)
+                error = 1;
+            break;
+        case 'd':
+            if ((sscanf(optarg, "%" SCNu64, &bc.bc_density) != 1) ||
+                (bc.bc_density > 100))
+                error = 1;
+            break;
+        case 'j':
+            if ((sscanf(optarg, "%d", &njobs) != 1) || (njobs < 1) ||
+                (njobs > BENCH_MAXJOBS))
+                error = 1;
+            break;
+        case 'k':
+            if ((sscanf(optarg, "%" SCNu64, &bc.bc_bpc) != 1) || !bc.bc_bpc ||
+                (bc.bc_bpc > UINT32_MAX))
+                error = 1;
+            break;
+        case 'l':
+            if ((sscanf(optarg, "%" SCNu64, &bc.bc_runlen) != 1) ||
+                !bc.bc_runlen)
+                error = 1;
+            break;
+        case 'm':
+            if (sscanf(optarg, "%" SCNu64, &bc.bc_cachesize) != 1)
+                error = 1;
+            bc.bc_cachesize *= 1024 * 1024;
+            break;
+        case 'p':
+            if (bench_parse_list(optarg, pattern_names,
+                                 sizeof(pattern_names) /
+                                     sizeof(pattern_names[0]),
+                                 &patterns))
+                error = 1;
+            break;
+        case 'r':
+            if (sscanf(optarg, "%" SCNu64, &bc.bc_reads) != 1)
+                error = 1;
+            break;
+        case 's':
+            if (bench_parse_size(optarg, &bc.bc_size))
+                error = 1;
+            break;
+        case 't':
+            if (strcmp(optarg, "all")) {
+                struct bench_test_name tt[BENCH_NTYPES];
+
+                for (p = 0; p < BENCH_NTYPES; p++) {
+                    tt[p].btn_name = type_names[p];
+                    tt[p].btn_flag = 1 << p;
+                }
+                if (bench_parse_list(optarg, tt, BENCH_NTYPES, &types))
+                    error = 1;
+            }
+            break;
+        case 'w':
+            if (sscanf(optarg, "%" SCNu64, &bc.bc_writes) != 1)
+                error = 1;
+            break;
+        case 'B':
+            if (bench_parse_size(optarg, &request) || !request ||
+                (request % 512))
+                error = 1;
+            break;
+        case 'D':
+            bc.bc_dir = optarg;
+            break;
+        case 'L':
+            if ((sscanf(optarg, "%" SCNu64, &seconds) != 1) || !seconds)
+                error = 1;
+            break;
+        case 'N':
+            device = optarg;
+            break;
+        case 'S':
+            if (sscanf(optarg, "%" SCNu64, &bc.bc_seed) != 1)
+                error = 1;
+            break;
+        case 'T':
+            if (bench_parse_list(optarg, test_names,
+                                 sizeof(test_names) / sizeof(test_names[0]),
+                                 &bc.bc_tests))
+                error = 1;
+            break;
+        case 'C':
+            bc.bc_checkreads = !bc.bc_checkreads;
+            break;
+        case 'F':
+            bc.bc_drop = !bc.bc_drop;
+            break;
+        case 'K':
+            bc.bc_keep = !bc.bc_keep;
+            break;
+        default:
+            error = 1;
+            break;
+        }
+    }
+    if (error || (optind != argc) ||
+        (!device && (bc.bc_size < (2 * bc.bc_blocksize)))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (device) {
+        for (p = 0; p < (sizeof(pattern_names) / sizeof(pattern_names[0]));
+             p++) {
+            if (!(patterns & pattern_names[p].btn_flag))
+                continue;
+            if ((error = bench_nbd(device, pattern_names[p].btn_name,
+                                   pattern_names[p].btn_flag, njobs, request,
+                                   seconds, bc.bc_seed))) {
+                fprintf(stderr, "%s: %s: %s: %s\n", argv[0], device,
+                        pattern_names[p].btn_name, strerror(error));
+                break;
+            }
+        }
+    } else {
+        for (p = 0; p < BENCH_NTYPES; p++) {
+            if (!(types & (1 << p)))
+                continue;
+            bc.bc_type = (bench_image_type_t)p;
+            if ((error = bench_image(&bc)))
+                break;
+        }
+    }
+
+    return (error) ? 1 : 0;
+}
@@ -1,4 +1,5 @@
 #include "changefileint.h"
+#include "libchecksum.h"
 #include "libimage.h"
 #include "sysdep_int.h"
 #include "sysdep_posix.h"
@@ -20,34 +21,6 @@ dump_header(char *n, cf_header_t *h) {
            h->cf_total_blocks);
 }
 
-static int      crcinitdone = 0;
-static uint32_t xcrc_tab32[CRC_TABLE_LEN];
-static inline uint32_t
-xcrc32(uint32_t crc, unsigned char *buf, uint64_t size) {
-    int      i;
-    uint64_t s;
-    uint32_t tmp;
-
-    if (!crcinitdone) {
-        for (i = 0; i < CRC_TABLE_LEN; i++) {
-            int      j;
-            uint32_t init_crc = (uint32_t)i;
-            for (j = 0; j < CRC_UNIT_BITS; j++) {
-                init_crc = (init_crc & 0x00000001L)
-                               ? (init_crc >> 1) ^ 0xEDB88320L
-                               : (init_crc >> 1);
-            }
-            xcrc_tab32[i] = init_crc;
-        }
-    }
-    for (s = 0; s < size; s++) {
-        tmp = crc ^ (((uint32_t)buf[s]) & 0x000000ffL);
-        crc = (crc >> 8) ^ xcrc_tab32[tmp & 0xff];
-    }
-
-    return crc;
-}
-
 int
 verify_block(void *cf, uint64_t offs, uint64_t index, void *rbuffer,
              uint64_t bsize) {
@@ -63,7 +36,7 @@ verify_block(void *cf, uint64_t offs, uint64_t index, void *rbuffer,
                 (nread == sizeof(btrail))) {
                 if ((btrail.cfb_curblock == index) &&
                     (btrail.cfb_magic == CF_MAGIC_3) &&
-                    (btrail.cfb_crc == xcrc32(0L, rbuffer, bsize))) {
+                    (btrail.cfb_crc == update_crc32(0, rbuffer, bsize))) {
                     error = 0;
                 } else {
                     error = 1;
@@ -87,12 +60,19 @@ dump_blocks(cf_header_t *h, uint64_t *bm, void *cf, void *rw, void *ro) {
     for (bi = 0; bi < h->cf_total_blocks; bi++) {
         if (bm[bi]) {
             int good = 0;
-            printf("%lu: offset 0x%016lx: ", bi, bm[bi]);
             nfound++;
-            if (!verify_block(cf, bm[bi], bi, rbuffer, bsize)) {
-                good = 1;
+            if (bm[bi] == CF_MAP_ZERO) {
+                printf("%lu: zero\n", bi);
+            } else if (bm[bi] & CF_MAP_PARTIAL) {
+                printf("%lu: partial, offset 0x%016llx\n", bi,
+                       CF_ENTRY_OFFSET(bm[bi]));
+            } else {
+                printf("%lu: offset 0x%016lx: ", bi, bm[bi]);
+                if (!verify_block(cf, bm[bi], bi, rbuffer, bsize)) {
+                    good = 1;
+                }
+                printf("%s\n", (good) ? "ok" : "INVALID");
             }
-            printf("%s\n", (good) ? "ok" : "INVALID");
             (void)image_seek(rw, bi);
             (void)image_seek(ro, bi);
             if (((error = image_readblocks(rw, wbuffer, 1)) == 0) &&
@@ -0,0 +1,273 @@
+/*
+ * cfcompact.c - Rewrite a change file with its blocks in block order.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#include "changefile.h"
+#include "changefileint.h"
+#include "libchecksum.h"
+#include "sysdep_int.h"
+#include "sysdep_posix.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+const sysdep_dispatch_t *sysdep = &posix_dispatch;
+
+/*
+ * Blocks gathered per write to the new file.
+ */
+#define CC_BATCH 256
+
+/*
+ * Size of the slot of block map entry "entry", for "bsize" byte blocks.
+ */
+static inline uint64_t
+slot_size(uint64_t entry, uint64_t bsize) {
+    return bsize + CF_TRAILER_SIZE +
+           ((entry & CF_MAP_PARTIAL) ? cf_mask_size(bsize) : 0);
+}
+
+/*
+ * Check that the slot of block map entry "entry" holds block "index",
+ * "bsize" bytes long.  The slot is read into "sbuf".
+ */
+static int
+slot_check(void *cf, uint64_t entry, uint64_t index, unsigned char *sbuf,
+           uint64_t bsize) {
+    int                error;
+    uint64_t           nread;
+    uint64_t           dsize = slot_size(entry, bsize) - CF_TRAILER_SIZE;
+    cf_block_trailer_t btrail;
+
+    if ((entry & CF_MAP_PARTIAL) && !cf_mask_size(bsize))
+        return ESRCH;
+    if (!(error = (*sysdep->sys_pread)(cf, sbuf, dsize + sizeof(btrail),
+                                       CF_ENTRY_OFFSET(entry), &nread))) {
+        memcpy(&btrail, sbuf + dsize, sizeof(btrail));
+        error = ((btrail.cfb_curblock == index) &&
+                 (btrail.cfb_magic ==
+                  ((entry & CF_MAP_PARTIAL) ? CF_MAGIC_4 : CF_MAGIC_3)) &&
+                 (btrail.cfb_crc == update_crc32(0, sbuf, dsize)))
+                    ? 0
+                    : ESRCH;
+    }
+
+    return error;
+}
+
+/*
+ * The block size isn't recorded in the change file: find it from the
+ * first block present.
+ */
+static int
+find_blocksize(cf_header_t *h, uint64_t *bm, void *cf, uint64_t *bsizep) {
+    int            error = 0;
+    uint64_t       bi;
+    uint64_t       bsize;
+    unsigned char *sbuf = (unsigned char *)NULL;
+
+    *bsizep = 0;
+    for (bi = 0; (bi < h->cf_total_blocks) &&
+                 (!bm[bi] || (bm[bi] == CF_MAP_ZERO));
+         bi++)
+        ;
+    if (bi < h->cf_total_blocks) {
+        error = ENODEV;
+        for (bsize = 512; (error == ENODEV) && (bsize < (128 * 1024 * 1024));
+             bsize *= 2) {
+            if ((error = (*sysdep->sys_malloc)(&sbuf,
+                                               slot_size(bm[bi], bsize))))
+                break;
+            if (!slot_check(cf, bm[bi], bi, sbuf, bsize))
+                *bsizep = bsize;
+            else
+                error = ENODEV;
+            (void)(*sysdep->sys_free)(sbuf);
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Copy the blocks of "cf" to "ncf" in block order, following the header
+ * and block map, and write the new block map and header last.  The number
+ * of blocks in the new file is left in "*nusedp".
+ */
+static int
+compact(cf_header_t *h, uint64_t *bm, void *cf, void *ncf, uint64_t bsize,
+        uint64_t *nusedp) {
+    int            error;
+    uint64_t       slot  = slot_size(CF_MAP_PARTIAL, bsize); /* Largest */
+    uint64_t       mapsz = h->cf_total_blocks * sizeof(uint64_t);
+    uint64_t       woffs = h->cf_blockmap_offset + mapsz;
+    uint64_t       nused = 0;
+    uint64_t       nbuf  = 0;
+    uint64_t       wlen  = 0;
+    uint64_t       bi;
+    uint64_t       nwritten;
+    unsigned char *wbuf  = (unsigned char *)NULL;
+    cf_header_t    nh    = *h;
+
+    if ((error = (*sysdep->sys_malloc)(&wbuf, (slot * CC_BATCH) + 1)))
+        return error;
+    for (bi = 0; !error && (bi < h->cf_total_blocks); bi++) {
+        if (bm[bi] == CF_MAP_ZERO) {
+            nused++;
+        } else if (bm[bi]) {
+            uint64_t ssize = slot_size(bm[bi], bsize);
+
+            if ((error = slot_check(cf, bm[bi], bi, wbuf + wlen, bsize))) {
+                fprintf(stderr, "block %" PRIu64 ": INVALID\n", bi);
+                break;
+            }
+            /*
+             * Partial blocks stay partial, in their larger slots.
+             */
+            bm[bi] = (woffs + wlen) | (bm[bi] & CF_MAP_PARTIAL);
+            wlen += ssize;
+            nused++;
+            if (++nbuf == CC_BATCH) {
+                if (!(error = (*sysdep->sys_pwrite)(ncf, wbuf, wlen, woffs,
+                                                    &nwritten)))
+                    woffs += wlen;
+                nbuf = 0;
+                wlen = 0;
+            }
+        }
+    }
+    if (!error && wlen)
+        error = (*sysdep->sys_pwrite)(ncf, wbuf, wlen, woffs, &nwritten);
+    (void)(*sysdep->sys_free)(wbuf);
+    nh.cf_used_blocks = nused;
+    nh.cf_flags &= ~CF_HEADER_DIRTY;
+    /*
+     * Leave the pages of the block map with nothing in them as holes, so
+     * they don't have to be read when the file is opened.  The last one is
+     * always written, so the file covers the whole map.
+     */
+    for (bi = 0; !error && (bi < h->cf_total_blocks); bi += CF_MAP_ENTRIES) {
+        uint64_t nent = h->cf_total_blocks - bi;
+        uint64_t i;
+
+        if (nent > CF_MAP_ENTRIES)
+            nent = CF_MAP_ENTRIES;
+        for (i = 0; (i < nent) && !bm[bi + i]; i++)
+            ;
+        if ((i < nent) || ((bi + nent) == h->cf_total_blocks))
+            error = (*sysdep->sys_pwrite)(
+                ncf, &bm[bi], nent * sizeof(uint64_t),
+                h->cf_blockmap_offset + (bi * sizeof(uint64_t)), &nwritten);
+    }
+    if (!error && !(error = (*sysdep->sys_sync)(ncf)) &&
+        !(error = (*sysdep->sys_pwrite)(ncf, &nh, sizeof(nh), 0, &nwritten)))
+        error = (*sysdep->sys_sync)(ncf);
+    if (!error && (h->cf_used_blocks != nused))
+        fprintf(stderr, "WARNING: %" PRIu64 " found, %" PRIu64 " used blocks\n",
+                nused, h->cf_used_blocks);
+    *nusedp = nused;
+
+    return error;
+}
+
+static void
+usage(const char *pname) {
+    fprintf(stderr, "%s: usage %s CHANGE-FILE [NEW-CHANGE-FILE]\n", pname,
+            pname);
+}
+
+/*
+ * Rewrite the change file in block order.  Without a new file name, the
+ * result replaces the original once it is complete.
+ */
+int
+main(int argc, char *argv[]) {
+    void *      cfp;
+    void *      ncfp;
+    char *      npath;
+    cf_header_t header;
+    uint64_t *  blockmap = (uint64_t *)NULL;
+    uint64_t    bmsize;
+    uint64_t    bsize;
+    uint64_t    nread;
+    uint64_t    osize = 0;
+    uint64_t    nsize = 0;
+    uint64_t    nused = 0;
+    int         error = EINVAL;
+
+    if ((argc < 2) || (argc > 3)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if ((npath = malloc(strlen(argv[(argc == 3) ? 2 : 1]) +
+                        sizeof(".compact"))) == NULL)
+        return 1;
+    if (argc == 3)
+        strcpy(npath, argv[2]);
+    else
+        sprintf(npath, "%s.compact", argv[1]);
+    if ((error = (*sysdep->sys_open)(&cfp, argv[1], SYSDEP_OPEN_RO)) != 0) {
+        fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[1]);
+        return 1;
+    }
+    if (((error = (*sysdep->sys_pread)(cfp, &header, sizeof(header), 0,
+                                       &nread)) != 0) ||
+        (header.cf_magic != CF_MAGIC_1) || (header.cf_magic2 != CF_MAGIC_2)) {
+        fprintf(stderr, "%s: invalid header\n", argv[1]);
+        error = (error) ? error : ENODEV;
+    } else if (header.cf_flags & CF_HEADER_DIRTY) {
+        /*
+         * The block map on disk may not describe the last writes.
+         */
+        fprintf(stderr, "%s: not cleanly closed\n", argv[1]);
+        error = EBUSY;
+    } else {
+        bmsize = header.cf_total_blocks * sizeof(uint64_t);
+        if ((error = (*sysdep->sys_malloc)(&blockmap, bmsize + 1)) ||
+            (error = (*sysdep->sys_pread)(cfp, blockmap, bmsize,
+                                          header.cf_blockmap_offset, &nread))) {
+            fprintf(stderr, "%s: cannot read blockmap\n", argv[1]);
+        } else if ((error = find_blocksize(&header, blockmap, cfp, &bsize))) {
+            fprintf(stderr, "%s: cannot determine block size\n", argv[1]);
+        } else {
+            (void)unlink(npath);
+            if ((error = (*sysdep->sys_open)(&ncfp, npath, SYSDEP_CREATE))) {
+                fprintf(stderr, "%s: cannot create %s\n", argv[0], npath);
+            } else {
+                error = compact(&header, blockmap, cfp, ncfp, bsize, &nused);
+                (void)(*sysdep->sys_file_size)(cfp, &osize);
+                (void)(*sysdep->sys_file_size)(ncfp, &nsize);
+                (void)(*sysdep->sys_close)(ncfp);
+                if (!error && (argc == 2))
+                    error = (*sysdep->sys_rename)(npath, argv[1]);
+                if (error)
+                    (void)unlink(npath);
+            }
+        }
+        if (blockmap)
+            (void)(*sysdep->sys_free)(blockmap);
+    }
+    (void)(*sysdep->sys_close)(cfp);
+    if (error) {
+        fprintf(stderr, "%s: %s compaction failed: %s\n", argv[0], argv[1],
+                strerror(error));
+    } else {
+        printf("%s: %" PRIu64 " blocks, %" PRIu64 " bytes -> %" PRIu64
+               " bytes\n",
+               (argc == 3) ? argv[2] : argv[1], nused, osize, nsize);
+    }
+    free(npath);
+
+    return (error) ? 1 : 0;
+}
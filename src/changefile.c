@@ -9,123 +9,345 @@
 #endif /* HAVE_CONFIG_H */
 #include "changefile.h"
 #include "changefileint.h"
+#include "libchecksum.h"
+#include "libstats.h"
 #include <errno.h>
 #include <string.h>
 
 /*
- * Initialize change file handling.
- *
- * Allocate and initialize change file handle.
+ * Look up the change file offset of a block; zero if not present.
  */
-int
-cf_init(const char *cfpath, const sysdep_dispatch_t *sysdep, uint64_t blocksize,
-        uint64_t blockcount, void **cfpp) {
-    int           error = EINVAL;
-    cf_context_t *cfp   = (cf_context_t *)NULL;
+static inline uint64_t
+cf_map_lookup(const cf_context_t *cfp, uint64_t blockno) {
+    const uint64_t *page = cfp->cfc_mappages[blockno >> CF_MAP_SHIFT];
 
-    if ((error = (*sysdep->sys_malloc)(&cfp, sizeof(*cfp))) == 0) {
-        int i;
-        memset(cfp, 0, sizeof(*cfp));
+    return (page) ? page[blockno & CF_MAP_MASK] : 0;
+}
 
-        /*
-         * Open the file.
-         */
-        if ((error = (*sysdep->sys_open)(&cfp->cfc_fd, cfpath,
-                                         SYSDEP_OPEN_RW)) == 0) {
-            cfp->cfc_sysdep     = sysdep;
-            cfp->cfc_blocksize  = blocksize;
-            cfp->cfc_blockcount = blockcount;
-            /*
-             * Initialize the CRC table.
-             */
-            for (i = 0; i < CRC_TABLE_LEN; i++) {
-                int      j;
-                uint32_t init_crc = (uint32_t)i;
-                for (j = 0; j < CRC_UNIT_BITS; j++) {
-                    init_crc = (init_crc & 0x00000001L)
-                                   ? (init_crc >> 1) ^ 0xEDB88320L
-                                   : (init_crc >> 1);
-                }
-                cfp->cfc_crc_tab32[i] = init_crc;
-            }
+/*
+ * Does a block map entry say the block reads as zeroes?
+ */
+static inline int
+cf_entry_zero(uint64_t entry) {
+    return CF_ENTRY_OFFSET(entry) == CF_MAP_ZERO;
+}
+
+/*
+ * Is a block map entry one of the top file's own, rather than absent or
+ * from a file under it?
+ */
+static inline int
+cf_entry_own(uint64_t entry) {
+    return entry && !CF_ENTRY_LAYER(entry);
+}
+
+/*
+ * Does a block map entry refer to a partial block?
+ */
+static inline int
+cf_entry_partial(uint64_t entry) {
+    return (entry & CF_MAP_PARTIAL) ? 1 : 0;
+}
+
+/*
+ * The file handle holding a block map entry's slot.
+ */
+static inline void *
+cf_entry_fd(const cf_context_t *cfp, uint64_t entry) {
+    return (CF_ENTRY_LAYER(entry))
+               ? cfp->cfc_lower[CF_ENTRY_LAYER(entry) - 1]->cfc_fd
+               : cfp->cfc_fd;
+}
+
+/*
+ * Is the slot for block map entry "boffs" still in the log buffer?
+ */
+static inline int
+cf_logged(const cf_context_t *cfp, uint64_t boffs) {
+    return cfp->cfc_loglen && !CF_ENTRY_LAYER(boffs) &&
+           (CF_ENTRY_OFFSET(boffs) >= cfp->cfc_logbase);
+}
+
+/*
+ * Size of a block's slot in the change file: the block and its trailer,
+ * and for a partial block, its mask.
+ */
+static inline uint64_t
+cf_slotsize(const cf_context_t *cfp, int partial) {
+    return cfp->cfc_blocksize + sizeof(cf_block_trailer_t) +
+           ((partial) ? cfp->cfc_masksize : 0);
+}
+
+/*
+ * Write out the log buffer, with one write.
+ */
+static int
+cf_log_flush(cf_context_t *cfp) {
+    int      error = 0;
+    uint64_t nwritten;
+
+    if (cfp->cfc_loglen) {
+        if (((error = (*cfp->cfc_sysdep->sys_pwrite)(
+                  cfp->cfc_fd, cfp->cfc_log, cfp->cfc_loglen,
+                  cfp->cfc_logbase, &nwritten)) == 0) &&
+            (nwritten == cfp->cfc_loglen)) {
+            cfp->cfc_logbase += cfp->cfc_loglen;
+            cfp->cfc_loglen = 0;
         } else {
-            (void)(*sysdep->sys_free)(cfp);
-            cfp = (cf_context_t *)NULL;
+            if (!error)
+                error = EIO;
         }
     }
-    if (!error && cfp)
-        *cfpp = (void *)cfp;
+
     return error;
 }
 
 /*
- * Verify the change file.
- *
- * - Load the blockmap.
+ * Find the block map page "pageno", allocating it if necessary.
  */
-int
-cf_verify(void *vcp) {
-    int           error = EINVAL;
-    cf_context_t *cfp   = (cf_context_t *)vcp;
-    uint64_t      nread;
+static int
+cf_map_page(cf_context_t *cfp, uint64_t pageno, uint64_t **pagep) {
+    int error = 0;
+
+    if (!cfp->cfc_mappages[pageno]) {
+        uint64_t *page = (uint64_t *)NULL;
 
-    /*
-     * Make sure we're at the beginning of the file.
-     */
-    (void)(*cfp->cfc_sysdep->sys_seek)(cfp->cfc_fd, 0, SYSDEP_SEEK_ABSOLUTE,
-                                       (uint64_t *)NULL);
-    if (((error = (*cfp->cfc_sysdep->sys_read)(cfp->cfc_fd, &cfp->cfc_header,
-                                               sizeof(cfp->cfc_header),
-                                               &nread)) == 0) &&
-        (nread == sizeof(cfp->cfc_header))) {
         /*
-         * Verify read header.
+         * Only make the page visible once it is cleared.
          */
-        if ((cfp->cfc_header.cf_magic == CF_MAGIC_1) &&
-            (cfp->cfc_header.cf_magic2 == CF_MAGIC_2) &&
-            /* [2013-12] ntfs chicanery could have added the trailing block */
-            ((cfp->cfc_header.cf_total_blocks == cfp->cfc_blockcount) ||
-             (cfp->cfc_header.cf_total_blocks == (cfp->cfc_blockcount + 1)))) {
-            uint64_t bhsize =
-                cfp->cfc_header.cf_total_blocks * sizeof(*cfp->cfc_blockmap);
+        if ((error = (*cfp->cfc_sysdep->sys_malloc)(
+                 &page, CF_MAP_ENTRIES * sizeof(uint64_t))) == 0) {
+            memset(page, 0, CF_MAP_ENTRIES * sizeof(uint64_t));
+            __atomic_store_n(&cfp->cfc_mappages[pageno], page,
+                             __ATOMIC_RELEASE);
+        }
+    }
+    if (!error)
+        *pagep = cfp->cfc_mappages[pageno];
+    return error;
+}
+
+/*
+ * Free the in-core block map.
+ */
+static void
+cf_map_free(cf_context_t *cfp) {
+    uint64_t pageno;
+
+    if (cfp->cfc_mappages) {
+        for (pageno = 0; pageno < cfp->cfc_mapcount; pageno++)
+            if (cfp->cfc_mappages[pageno])
+                (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_mappages[pageno]);
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_mappages);
+        cfp->cfc_mappages = (uint64_t **)NULL;
+    }
+    if (cfp->cfc_mapdirty) {
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_mapdirty);
+        cfp->cfc_mapdirty = (unsigned char *)NULL;
+    }
+    cfp->cfc_mapcount = 0;
+}
+
+/*
+ * Find the first page of the on-disk block map of "lcp", from "pageno" on,
+ * that isn't in a hole in the file.  Pages which were never written are
+ * left as holes, so a map with few blocks in it is mostly skipped.  If the
+ * file can't say where its holes are, "*holesp" is cleared and every page
+ * is read from then on.
+ */
+static uint64_t
+cf_map_next(cf_context_t *lcp, uint64_t pageno, int *holesp) {
+    uint64_t mapoffs = lcp->cfc_header.cf_blockmap_offset;
+    uint64_t psize   = CF_MAP_ENTRIES * sizeof(uint64_t);
+    uint64_t doffs;
+    int      error;
+
+    if (*holesp) {
+        error = (*lcp->cfc_sysdep->sys_seek)(lcp->cfc_fd,
+                                             mapoffs + (pageno * psize),
+                                             SYSDEP_SEEK_DATA, &doffs);
+        if (error == ENXIO)
+            pageno = UINT64_MAX >> CF_MAP_SHIFT;
+        else if (error)
+            *holesp = 0;
+        else
+            pageno = (doffs - mapoffs) / psize;
+    }
+
+    return pageno;
+}
+
+/*
+ * Merge the block map of "lcp" into the in-core block map of "cfp", tagging
+ * its entries with "layer".  Only the pages which have a block present are
+ * kept.  "rbuf" has room for CF_MAP_READ pages.
+ */
+static int
+cf_map_merge(cf_context_t *cfp, cf_context_t *lcp, uint64_t layer,
+             uint64_t *rbuf) {
+    int      error  = 0;
+    uint64_t total  = cfp->cfc_header.cf_total_blocks;
+    uint64_t npages = cfp->cfc_mapcount;
+    int      holes  = 1;
+    uint64_t pageno;
+
+    if (lcp->cfc_header.cf_total_blocks < total)
+        total = lcp->cfc_header.cf_total_blocks;
+    for (pageno = cf_map_next(lcp, 0, &holes);
+         !error && (pageno < npages) && ((pageno << CF_MAP_SHIFT) < total);
+         pageno = cf_map_next(lcp, pageno + CF_MAP_READ, &holes)) {
+        uint64_t first = pageno << CF_MAP_SHIFT;
+        uint64_t nent  = total - first;
+        uint64_t nread;
+
+        if (nent > (CF_MAP_READ * CF_MAP_ENTRIES))
+            nent = CF_MAP_READ * CF_MAP_ENTRIES;
+        if (((error = (*cfp->cfc_sysdep->sys_pread)(
+                  lcp->cfc_fd, rbuf, nent * sizeof(uint64_t),
+                  lcp->cfc_header.cf_blockmap_offset +
+                      (first * sizeof(uint64_t)),
+                  &nread)) == 0) &&
+            (nread == (nent * sizeof(uint64_t)))) {
+            uint64_t i;
             /*
-             * Allocate, find and read the blockmap.
+             * Keep each page that has an entry in it.
              */
-            if ((error = (*cfp->cfc_sysdep->sys_malloc)(&cfp->cfc_blockmap,
-                                                        bhsize)) == 0) {
-                if ((error = (*cfp->cfc_sysdep->sys_seek)(
-                         cfp->cfc_fd, cfp->cfc_header.cf_blockmap_offset,
-                         SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) {
-                    if (((error = (*cfp->cfc_sysdep->sys_read)(
-                              cfp->cfc_fd, cfp->cfc_blockmap, bhsize,
-                              &nread)) == 0) &&
-                        (nread == bhsize)) {
-                        /* xxx */
-                    } else {
-                        if (error == 0)
-                            error = EIO;
+            for (i = 0; !error && (i < nent); i += CF_MAP_ENTRIES) {
+                uint64_t  pent = nent - i;
+                uint64_t  j;
+                uint64_t *page;
+
+                if (pent > CF_MAP_ENTRIES)
+                    pent = CF_MAP_ENTRIES;
+                for (j = 0; (j < pent) && !rbuf[i + j]; j++)
+                    ;
+                if ((j < pent) &&
+                    ((error = cf_map_page(cfp, pageno + (i >> CF_MAP_SHIFT),
+                                          &page)) == 0)) {
+                    for (; !error && (j < pent); j++) {
+                        if (!rbuf[i + j])
+                            continue;
+                        /*
+                         * A partial block goes over the image: it can't be
+                         * over a block from a file under it.
+                         */
+                        if (cf_entry_partial(rbuf[i + j])) {
+                            if (page[j])
+                                error = EINVAL;
+                            cfp->cfc_partials = 1;
+                        }
+                        page[j] = rbuf[i + j] | (layer << CF_LAYER_SHIFT);
                     }
                 }
             }
         } else {
-            error = ENODEV;
+            if (error == 0)
+                error = EIO;
         }
-    } else {
-        if (error == 0) {
-            /* Implies rsize != sizeof(cfp->cfc_header) */
-            error = EIO;
+    }
+
+    return error;
+}
+
+/*
+ * Load the block map, merging in those of the files under this one from
+ * the bottom up.
+ */
+static int
+cf_map_load(cf_context_t *cfp) {
+    int       error;
+    uint64_t  total  = cfp->cfc_header.cf_total_blocks;
+    uint64_t  npages = (total + CF_MAP_MASK) >> CF_MAP_SHIFT;
+    uint64_t  dsize  = (npages) ? npages : 1;
+    uint64_t *rbuf   = (uint64_t *)NULL;
+
+    cf_map_free(cfp);
+    if (((error = (*cfp->cfc_sysdep->sys_malloc)(
+              &cfp->cfc_mappages, dsize * sizeof(uint64_t *))) == 0) &&
+        ((error = (*cfp->cfc_sysdep->sys_malloc)(&cfp->cfc_mapdirty,
+                                                 dsize)) == 0) &&
+        ((error = (*cfp->cfc_sysdep->sys_malloc)(
+              &rbuf, CF_MAP_READ * CF_MAP_ENTRIES * sizeof(uint64_t))) == 0)) {
+        uint32_t layer;
+
+        memset(cfp->cfc_mappages, 0, dsize * sizeof(uint64_t *));
+        memset(cfp->cfc_mapdirty, 0, dsize);
+        cfp->cfc_mapcount = npages;
+        for (layer = cfp->cfc_nlower; !error && (layer > 0); layer--)
+            error = cf_map_merge(cfp, cfp->cfc_lower[layer - 1], layer, rbuf);
+        if (!error)
+            error = cf_map_merge(cfp, cfp, 0, rbuf);
+    }
+    if (rbuf)
+        (void)(*cfp->cfc_sysdep->sys_free)(rbuf);
+    if (error)
+        cf_map_free(cfp);
+    return error;
+}
+
+/*
+ * Close a change file handle and those under it.
+ */
+static void
+cf_close(cf_context_t *cfp) {
+    uint32_t layer;
+
+    if (cfp->cfc_lower) {
+        for (layer = 0; layer < cfp->cfc_nlower; layer++)
+            if (cfp->cfc_lower[layer])
+                cf_close(cfp->cfc_lower[layer]);
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_lower);
+    }
+    cf_map_free(cfp);
+    if (cfp->cfc_log)
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_log);
+    if (cfp->cfc_partbuf)
+        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_partbuf);
+    if (cfp->cfc_fd)
+        (void)(*cfp->cfc_sysdep->sys_close)(cfp->cfc_fd);
+    (void)(*cfp->cfc_sysdep->sys_free)(cfp);
+}
+
+/*
+ * Allocate a change file handle for the "len" byte path "cfpath", and open
+ * the file with "omode".
+ */
+static int
+cf_open(const char *cfpath, size_t len, const sysdep_dispatch_t *sysdep,
+        sysdep_open_mode_t omode, uint64_t blocksize, uint64_t blockcount,
+        cf_context_t **cfpp) {
+    int           error;
+    cf_context_t *cfp  = (cf_context_t *)NULL;
+    char *        path = (char *)NULL;
+
+    if ((error = (*sysdep->sys_malloc)(&path, len + 1)) == 0) {
+        memcpy(path, cfpath, len);
+        path[len] = '\0';
+        if ((error = (*sysdep->sys_malloc)(&cfp, sizeof(*cfp))) == 0) {
+            memset(cfp, 0, sizeof(*cfp));
+            if ((error = (*sysdep->sys_open)(&cfp->cfc_fd, path, omode)) ==
+                0) {
+                cfp->cfc_sysdep     = sysdep;
+                cfp->cfc_blocksize  = blocksize;
+                cfp->cfc_blockcount = blockcount;
+                cfp->cfc_masksize   = cf_mask_size(blocksize);
+                *cfpp               = cfp;
+            } else {
+                (void)(*sysdep->sys_free)(cfp);
+            }
         }
+        (void)(*sysdep->sys_free)(path);
     }
 
     return error;
 }
 
 /*
- * Create change file if necessary.
+ * Create an empty change file, unless there's one already.
  */
-int
-cf_create(const char *cfpath, const sysdep_dispatch_t *sysdep,
-          uint64_t blocksize, uint64_t blockcount, void **cfpp) {
+static int
+cf_create_file(const char *cfpath, const sysdep_dispatch_t *sysdep,
+               uint64_t blockcount) {
     int   error;
     void *cfh = (void *)NULL;
 
@@ -138,7 +360,8 @@ cf_create(const char *cfpath, const sysdep_dispatch_t *sysdep,
          */
         if ((error = (*sysdep->sys_open)(&cfh, cfpath, SYSDEP_CREATE)) == 0) {
             cf_header_t ncfh;
-            uint64_t *  bmp;
+            uint64_t    nullent = 0;
+            uint64_t    nwritten;
             /*
              * A new file!
              */
@@ -149,38 +372,168 @@ cf_create(const char *cfpath, const sysdep_dispatch_t *sysdep,
             ncfh.cf_used_blocks     = 0;
             ncfh.cf_blockmap_offset = sizeof(ncfh);
             ncfh.cf_magic2          = CF_MAGIC_2;
-            if ((error = (*sysdep->sys_malloc)(
-                     &bmp, blockcount * sizeof(uint64_t))) == 0) {
-                uint64_t nwritten;
-                memset(bmp, 0, blockcount * sizeof(uint64_t));
-                if (((error = (*sysdep->sys_write)(cfh, &ncfh, sizeof(ncfh),
-                                                   &nwritten)) == 0) &&
-                    (nwritten == sizeof(ncfh)) &&
-                    ((error = (*sysdep->sys_write)(
-                          cfh, bmp, blockcount * sizeof(uint64_t),
-                          &nwritten)) == 0) &&
-                    (nwritten == (blockcount * sizeof(uint64_t)))) {
-                    /* close it - we'll open it again below. */
-                    (void)(*sysdep->sys_close)(cfh);
-                }
-                (void)(*sysdep->sys_free)(bmp);
+            /*
+             * Rather than writing out an empty block map, just extend the
+             * file over it so that it reads back as zeroes.
+             */
+            if (((error = (*sysdep->sys_write)(cfh, &ncfh, sizeof(ncfh),
+                                               &nwritten)) == 0) &&
+                (nwritten == sizeof(ncfh)) &&
+                (!blockcount ||
+                 (((error = (*sysdep->sys_pwrite)(
+                        cfh, &nullent, sizeof(nullent),
+                        ncfh.cf_blockmap_offset +
+                            ((blockcount - 1) * sizeof(nullent)),
+                        &nwritten)) == 0) &&
+                  (nwritten == sizeof(nullent))))) {
+                /* close it - we'll open it again below. */
+                (void)(*sysdep->sys_close)(cfh);
             }
         }
+    } else {
+        (void)(*sysdep->sys_close)(cfh);
+    }
+
+    return error;
+}
+
+/*
+ * Initialize change file handling.
+ *
+ * Allocate and initialize change file handle.  For a chain, open the files
+ * under the top one read-only, and create the top one if need be.  ENOENT
+ * means there's no change file yet.
+ */
+int
+cf_init(const char *cfpath, const sysdep_dispatch_t *sysdep, uint64_t blocksize,
+        uint64_t blockcount, void **cfpp) {
+    int           error = EINVAL;
+    cf_context_t *cfp   = (cf_context_t *)NULL;
+    const char *  top   = strrchr(cfpath, CF_CHAIN_SEP);
+    const char *  cp;
+    uint32_t      nlower = 0;
+
+    for (cp = cfpath; top && (cp <= top); cp++)
+        if (*cp == CF_CHAIN_SEP)
+            nlower++;
+    top = (top) ? top + 1 : cfpath;
+    if (nlower > CF_MAX_LOWER)
+        return E2BIG;
+    if ((top == cfpath) ||
+        ((error = cf_create_file(top, sysdep, blockcount)) == 0)) {
+        error = cf_open(top, strlen(top), sysdep, SYSDEP_OPEN_RW, blocksize,
+                        blockcount, &cfp);
+    }
+    if (!error && nlower &&
+        ((error = (*sysdep->sys_malloc)(&cfp->cfc_lower,
+                                        nlower * sizeof(cf_context_t *))) ==
+         0)) {
+        memset(cfp->cfc_lower, 0, nlower * sizeof(cf_context_t *));
+        cfp->cfc_nlower = nlower;
+        /*
+         * The path lists the files bottom up; the nearest one goes first.
+         */
+        for (cp = cfpath; !error && (cp < (top - 1)); nlower--) {
+            const char *ep = strchr(cp, CF_CHAIN_SEP);
+
+            error = cf_open(cp, ep - cp, sysdep, SYSDEP_OPEN_RO, blocksize,
+                            blockcount, &cfp->cfc_lower[nlower - 1]);
+            cp = ep + 1;
+        }
+        /*
+         * A missing top file just hasn't been written yet, but a missing
+         * file under it is an error: don't report it the same way.
+         */
+        if (error == ENOENT)
+            error = ENODEV;
     }
     if (!error) {
+        *cfpp = (void *)cfp;
+    } else if (cfp) {
+        cf_close(cfp);
+    }
+    return error;
+}
+
+/*
+ * Read and check a change file's header.
+ */
+static int
+cf_read_header(cf_context_t *cfp) {
+    int      error;
+    uint64_t nread;
+
+    if (((error = (*cfp->cfc_sysdep->sys_pread)(
+              cfp->cfc_fd, &cfp->cfc_header, sizeof(cfp->cfc_header), 0,
+              &nread)) == 0) &&
+        (nread == sizeof(cfp->cfc_header))) {
         /*
-         * If we are successful thus far, then we have a
-         * candidate change file.
+         * Verify read header.
          */
-        if ((error = cf_init(cfpath, sysdep, blocksize, blockcount, cfpp)) ==
-            0) {
-            error = cf_verify(*cfpp);
+        if (!((cfp->cfc_header.cf_magic == CF_MAGIC_1) &&
+              (cfp->cfc_header.cf_magic2 == CF_MAGIC_2) &&
+              /* [2013-12] ntfs chicanery could have added the trailing block */
+              ((cfp->cfc_header.cf_total_blocks == cfp->cfc_blockcount) ||
+               (cfp->cfc_header.cf_total_blocks ==
+                (cfp->cfc_blockcount + 1)))))
+            error = ENODEV;
+    } else {
+        if (error == 0) {
+            /* Implies rsize != sizeof(cfp->cfc_header) */
+            error = EIO;
         }
     }
 
     return error;
 }
 
+/*
+ * Verify the change file.
+ *
+ * - Check the headers of it and those under it.
+ * - Load the blockmap.
+ */
+int
+cf_verify(void *vcp) {
+    int           error = EINVAL;
+    cf_context_t *cfp   = (cf_context_t *)vcp;
+    uint32_t      layer;
+
+    error = cf_read_header(cfp);
+    for (layer = 0; !error && (layer < cfp->cfc_nlower); layer++)
+        error = cf_read_header(cfp->cfc_lower[layer]);
+    /*
+     * Load the blockmap.  New slots go at the end of the file.
+     */
+    if (!error && ((error = cf_map_load(cfp)) == 0))
+        error = (*cfp->cfc_sysdep->sys_file_size)(cfp->cfc_fd,
+                                                  &cfp->cfc_logbase);
+
+    return error;
+}
+
+/*
+ * Create change file if necessary.
+ */
+int
+cf_create(const char *cfpath, const sysdep_dispatch_t *sysdep,
+          uint64_t blocksize, uint64_t blockcount, void **cfpp) {
+    int         error;
+    const char *top = strrchr(cfpath, CF_CHAIN_SEP);
+
+    /*
+     * If we are successful, then we have a candidate change file.
+     */
+    if (((error = cf_create_file((top) ? top + 1 : cfpath, sysdep,
+                                 blockcount)) == 0) &&
+        ((error = cf_init(cfpath, sysdep, blocksize, blockcount, cfpp)) ==
+         0)) {
+        error = cf_verify(*cfpp);
+    }
+
+    return error;
+}
+
 /*
  * Sync change file changes to image.
  */
@@ -190,28 +543,68 @@ cf_sync(void *vcp) {
     cf_context_t *cfp     = (cf_context_t *)vcp;
     cf_header_t   oheader = cfp->cfc_header;
     uint64_t      nwritten;
+    uint64_t *    wpage = (uint64_t *)NULL;
 
     oheader.cf_flags &= ~CF_HEADER_DIRTY;
     /*
-     * Seek and write the sanitized header and block map.
+     * Entries from the files under this one are left out of its block map.
+     */
+    if (cfp->cfc_nlower &&
+        ((error = (*cfp->cfc_sysdep->sys_malloc)(
+              &wpage, CF_MAP_ENTRIES * sizeof(uint64_t))) != 0))
+        return error;
+    /*
+     * Make the logged blocks durable before the block map refers to them.
+     * Then write the sanitized header and the block map pages which have
+     * changed.
      */
-    if (((error = (*cfp->cfc_sysdep->sys_seek)(
-              cfp->cfc_fd, 0, SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) &&
-        ((error = (*cfp->cfc_sysdep->sys_write)(
-              cfp->cfc_fd, &oheader, sizeof(oheader), &nwritten)) == 0) &&
-        (nwritten == sizeof(oheader)) &&
-        ((error = (*cfp->cfc_sysdep->sys_seek)(
-              cfp->cfc_fd, oheader.cf_blockmap_offset, SYSDEP_SEEK_ABSOLUTE,
-              (uint64_t *)NULL)) == 0) &&
-        ((error = (*cfp->cfc_sysdep->sys_write)(
-              cfp->cfc_fd, cfp->cfc_blockmap,
-              oheader.cf_total_blocks * sizeof(uint64_t), &nwritten)) == 0) &&
-        (nwritten == (oheader.cf_total_blocks * sizeof(uint64_t)))) {
+    if (((error = cf_log_flush(cfp)) == 0) &&
+        ((error = (*cfp->cfc_sysdep->sys_sync)(cfp->cfc_fd)) == 0) &&
+        ((error = (*cfp->cfc_sysdep->sys_pwrite)(
+              cfp->cfc_fd, &oheader, sizeof(oheader), 0, &nwritten)) == 0) &&
+        (nwritten == sizeof(oheader))) {
+        uint64_t pageno;
+
+        for (pageno = 0; !error && (pageno < cfp->cfc_mapcount); pageno++) {
+            if (cfp->cfc_mapdirty[pageno]) {
+                uint64_t  first = pageno << CF_MAP_SHIFT;
+                uint64_t  wsize = oheader.cf_total_blocks - first;
+                uint64_t *page  = cfp->cfc_mappages[pageno];
+
+                if (wsize > CF_MAP_ENTRIES)
+                    wsize = CF_MAP_ENTRIES;
+                if (wpage) {
+                    uint64_t i;
+
+                    for (i = 0; i < wsize; i++)
+                        wpage[i] = (CF_ENTRY_LAYER(page[i])) ? 0 : page[i];
+                    page = wpage;
+                }
+                wsize *= sizeof(uint64_t);
+                if (((error = (*cfp->cfc_sysdep->sys_pwrite)(
+                          cfp->cfc_fd, page, wsize,
+                          oheader.cf_blockmap_offset +
+                              (first * sizeof(uint64_t)),
+                          &nwritten)) == 0) &&
+                    (nwritten == wsize)) {
+                    cfp->cfc_mapdirty[pageno] = 0;
+                } else {
+                    if (!error)
+                        error = EIO;
+                }
+            }
+        }
         /*
          * If successful, then we're no longer dirty.
          */
-        cfp->cfc_header.cf_flags &= ~CF_HEADER_DIRTY;
+        if (!error && !(error = (*cfp->cfc_sysdep->sys_sync)(cfp->cfc_fd)))
+            cfp->cfc_header.cf_flags &= ~CF_HEADER_DIRTY;
+    } else {
+        if (!error)
+            error = EIO;
     }
+    if (wpage)
+        (void)(*cfp->cfc_sysdep->sys_free)(wpage);
 
     return error;
 }
@@ -230,10 +623,8 @@ cf_finish(void *vcp) {
      */
     if (cfp->cfc_header.cf_flags & CF_HEADER_DIRTY)
         (void)cf_sync(vcp);
-    if (cfp->cfc_blockmap)
-        (void)(*cfp->cfc_sysdep->sys_free)(cfp->cfc_blockmap);
-    (void)(*cfp->cfc_sysdep->sys_close)(cfp->cfc_fd);
-    return (*cfp->cfc_sysdep->sys_free)(cfp);
+    cf_close(cfp);
+    return 0;
 }
 
 /*
@@ -255,73 +646,214 @@ cf_seek(void *vcp, uint64_t blockno) {
  * CRC routine.
  */
 static inline uint32_t
-cf_crc32(cf_context_t *cfp, uint32_t crc, unsigned char *buf, uint64_t size) {
-    uint64_t s;
-    uint32_t tmp;
-
-    for (s = 0; s < size; s++) {
-        tmp = crc ^ (((uint32_t)buf[s]) & 0x000000ffL);
-        crc = (crc >> 8) ^ cfp->cfc_crc_tab32[tmp & 0xff];
-    }
-
-    return crc;
+cf_crc32(const void *buf, uint64_t size) {
+    return update_crc32(0, buf, size);
 }
 
 /*
- * Read the block at the current position.
+ * Read the specified block.  This does not change the current position.
+ * A partial block has only part of what's needed: EAGAIN.  Read what the
+ * image has for it, then apply it with cf_overlay().
  */
 int
-cf_readblock(void *vcp, void *buffer) {
+cf_readblock_at(void *vcp, uint64_t blockno, void *buffer) {
     int           error = EINVAL;
     cf_context_t *cfp   = (cf_context_t *)vcp;
+    uint64_t      start;
 
+    if ((blockno < cfp->cfc_header.cf_total_blocks) &&
+        cf_entry_partial(cf_map_lookup(cfp, blockno)))
+        return EAGAIN;
     /*
      * Check the block map for an offset.
      */
-    if (cfp->cfc_blockmap[cfp->cfc_curpos]) {
+    start = stats_start();
+    if ((blockno < cfp->cfc_header.cf_total_blocks) &&
+        cf_entry_zero(cf_map_lookup(cfp, blockno))) {
+        memset(buffer, 0, cfp->cfc_blocksize);
+        error = 0;
+    } else if ((blockno < cfp->cfc_header.cf_total_blocks) &&
+               cf_logged(cfp, cf_map_lookup(cfp, blockno))) {
+        memcpy(buffer,
+               cfp->cfc_log + (cf_map_lookup(cfp, blockno) - cfp->cfc_logbase),
+               cfp->cfc_blocksize);
+        error = 0;
+    } else if ((blockno < cfp->cfc_header.cf_total_blocks) &&
+               cf_map_lookup(cfp, blockno)) {
+        uint64_t           entry = cf_map_lookup(cfp, blockno);
+        uint64_t           boffs = CF_ENTRY_OFFSET(entry);
+        void *             fd    = cf_entry_fd(cfp, entry);
+        uint64_t           rsize = cfp->cfc_blocksize;
+        cf_block_trailer_t btrail;
+        uint64_t           nread;
+
         /*
-         * If present, seek and read the block and trailer.
+         * If present, read the block and trailer.
          */
-        if ((error = (*cfp->cfc_sysdep->sys_seek)(
-                 cfp->cfc_fd, cfp->cfc_blockmap[cfp->cfc_curpos],
-                 SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) {
-            uint64_t           rsize = cfp->cfc_blocksize;
-            cf_block_trailer_t btrail;
-            uint64_t           nread;
-            if (((error = (*cfp->cfc_sysdep->sys_read)(cfp->cfc_fd, buffer,
-                                                       rsize, &nread)) == 0) &&
-                (nread == rsize)) {
-                rsize = sizeof(cf_block_trailer_t);
-                if (((error = (*cfp->cfc_sysdep->sys_read)(
-                          cfp->cfc_fd, &btrail, rsize, &nread)) == 0) &&
-                    (nread == rsize)) {
-                    /*
-                     * Verify the trailer.
-                     */
-                    if ((btrail.cfb_curblock == cfp->cfc_curpos) &&
-                        (btrail.cfb_magic == CF_MAGIC_3) &&
-                        (btrail.cfb_crc ==
-                         cf_crc32(cfp, 0L, buffer, cfp->cfc_blocksize))) {
-                        error = 0;
-                    } else {
-                        error = ESRCH;
-                    }
+        if (((error = (*cfp->cfc_sysdep->sys_pread)(fd, buffer, rsize, boffs,
+                                                    &nread)) == 0) &&
+            (nread == rsize)) {
+            if (((error = (*cfp->cfc_sysdep->sys_pread)(
+                      fd, &btrail, sizeof(btrail), boffs + rsize, &nread)) ==
+                 0) &&
+                (nread == sizeof(btrail))) {
+                /*
+                 * Verify the trailer.
+                 */
+                if ((btrail.cfb_curblock == blockno) &&
+                    (btrail.cfb_magic == CF_MAGIC_3) &&
+                    (btrail.cfb_crc ==
+                     cf_crc32(buffer, cfp->cfc_blocksize))) {
+                    error = 0;
                 } else {
-                    if (!error)
-                        error = EIO;
+                    error = ESRCH;
                 }
             } else {
                 if (!error)
                     error = EIO;
             }
+        } else {
+            if (!error)
+                error = EIO;
         }
     } else {
         error = ENXIO;
     }
+    stats_end(STATS_CF_READ, start, 1, error);
+
+    return error;
+}
+
+typedef char cf_trailer_size_check[(sizeof(cf_block_trailer_t) ==
+                                    CF_TRAILER_SIZE)
+                                       ? 1
+                                       : -1];
+
+/*
+ * Describe the reads of the specified block and its trailer, so that the
+ * caller can batch them with others.  "trailer" must have room for
+ * CF_TRAILER_SIZE bytes.  After the reads, call cf_readblock_check().
+ * Blocks which read as zeroes, or which are still in the log buffer, have
+ * nothing to read: ENODATA.  Use cf_readblock_at() for those.  Partial
+ * blocks are EAGAIN, as for cf_readblock_at().
+ */
+int
+cf_readblock_io(void *vcp, uint64_t blockno, void *buffer, void *trailer,
+                sysdep_io_t *iop) {
+    cf_context_t *cfp   = (cf_context_t *)vcp;
+    int           error = ENXIO;
+
+    if ((blockno < cfp->cfc_header.cf_total_blocks) &&
+        cf_entry_partial(cf_map_lookup(cfp, blockno))) {
+        error = EAGAIN;
+    } else if ((blockno < cfp->cfc_header.cf_total_blocks) &&
+               (cf_entry_zero(cf_map_lookup(cfp, blockno)) ||
+         cf_logged(cfp, cf_map_lookup(cfp, blockno)))) {
+        error = ENODATA;
+    } else if ((blockno < cfp->cfc_header.cf_total_blocks) &&
+               cf_map_lookup(cfp, blockno)) {
+        uint64_t entry = cf_map_lookup(cfp, blockno);
+        uint64_t boffs = CF_ENTRY_OFFSET(entry);
+
+        iop[0].io_rh     = cf_entry_fd(cfp, entry);
+        iop[0].io_buf    = buffer;
+        iop[0].io_len    = cfp->cfc_blocksize;
+        iop[0].io_offset = boffs;
+        iop[1].io_rh     = iop[0].io_rh;
+        iop[1].io_buf    = trailer;
+        iop[1].io_len    = sizeof(cf_block_trailer_t);
+        iop[1].io_offset = boffs + cfp->cfc_blocksize;
+        error            = 0;
+    }
 
     return error;
 }
 
+/*
+ * Verify a block read as described by cf_readblock_io().
+ */
+int
+cf_readblock_check(void *vcp, uint64_t blockno, const void *buffer,
+                   const void *trailer) {
+    cf_context_t *     cfp = (cf_context_t *)vcp;
+    cf_block_trailer_t btrail;
+
+    memcpy(&btrail, trailer, sizeof(btrail));
+    return ((btrail.cfb_curblock == blockno) &&
+            (btrail.cfb_magic == CF_MAGIC_3) &&
+            (btrail.cfb_crc == cf_crc32(buffer, cfp->cfc_blocksize)))
+               ? 0
+               : ESRCH;
+}
+
+/*
+ * Read the block at the current position.
+ */
+int
+cf_readblock(void *vcp, void *buffer) {
+    cf_context_t *cfp = (cf_context_t *)vcp;
+
+    return cf_readblock_at(vcp, cfp->cfc_curpos, buffer);
+}
+
+/*
+ * Is the specified block in use?
+ */
+int
+cf_blockused_at(void *vcp, uint64_t blockno) {
+    cf_context_t *cfp = (cf_context_t *)vcp;
+
+    stats_count(STATS_CF_LOOKUP, 1);
+    return ((blockno < cfp->cfc_header.cf_total_blocks) &&
+            cf_map_lookup(cfp, blockno))
+               ? 1
+               : 0;
+}
+
+/*
+ * Does the specified block read as zeroes, without data in the change file?
+ */
+int
+cf_blockzero_at(void *vcp, uint64_t blockno) {
+    cf_context_t *cfp = (cf_context_t *)vcp;
+
+    return ((blockno < cfp->cfc_header.cf_total_blocks) &&
+            cf_entry_zero(cf_map_lookup(cfp, blockno)))
+               ? 1
+               : 0;
+}
+
+/*
+ * Count the blocks starting at "blockno", up to "maxrun", which are present
+ * in the change file if "present" is set, or absent if it is not.  Absent
+ * map pages are skipped whole.
+ */
+uint64_t
+cf_run(void *vcp, uint64_t blockno, uint64_t maxrun, int present) {
+    cf_context_t *cfp   = (cf_context_t *)vcp;
+    uint64_t      limit = 0;
+    uint64_t      run   = 0;
+
+    if (blockno < cfp->cfc_header.cf_total_blocks)
+        limit = cfp->cfc_header.cf_total_blocks - blockno;
+    if (maxrun < limit)
+        limit = maxrun;
+    while (run < limit) {
+        uint64_t        pos  = blockno + run;
+        const uint64_t *page = cfp->cfc_mappages[pos >> CF_MAP_SHIFT];
+
+        if (!page && !present) {
+            run += CF_MAP_ENTRIES - (pos & CF_MAP_MASK);
+        } else if ((page && page[pos & CF_MAP_MASK]) ? present : !present) {
+            run++;
+        } else {
+            break;
+        }
+    }
+
+    return (run < limit) ? run : limit;
+}
+
 /*
  * Is the current block in use?
  */
@@ -329,7 +861,103 @@ int
 cf_blockused(void *vcp) {
     cf_context_t *cfp = (cf_context_t *)vcp;
 
-    return (cfp->cfc_blockmap[cfp->cfc_curpos]) ? 1 : 0;
+    return cf_blockused_at(vcp, cfp->cfc_curpos);
+}
+
+/*
+ * Make sure the log buffer is there.  It holds a whole number of full
+ * slots, and at least one partial one.
+ */
+static int
+cf_log_alloc(cf_context_t *cfp) {
+    int error = 0;
+
+    if (!cfp->cfc_log) {
+        uint64_t fslot = cf_slotsize(cfp, 0);
+        uint64_t lsize = CF_LOG_SIZE - (CF_LOG_SIZE % fslot);
+
+        if (lsize < cf_slotsize(cfp, 1))
+            lsize = cf_slotsize(cfp, 1);
+        if ((error = (*cfp->cfc_sysdep->sys_malloc)(&cfp->cfc_log, lsize)) ==
+            0)
+            cfp->cfc_logsize = lsize;
+    }
+
+    return error;
+}
+
+/*
+ * Point block "blockno" at its new slot "nboffs", in place of "oboffs", on
+ * its map page "page".
+ */
+static void
+cf_map_set(cf_context_t *cfp, uint64_t *page, uint64_t blockno,
+           uint64_t oboffs, uint64_t nboffs) {
+    page[blockno & CF_MAP_MASK]                = nboffs;
+    cfp->cfc_mapdirty[blockno >> CF_MAP_SHIFT] = 1;
+    if (!cf_entry_own(oboffs))
+        cfp->cfc_header.cf_used_blocks++;
+    if (cf_entry_partial(nboffs)) {
+        cfp->cfc_partials          = 1;
+        cfp->cfc_header.cf_version = CF_VERSION_3;
+    }
+    cfp->cfc_header.cf_flags |= CF_HEADER_DIRTY;
+}
+
+/*
+ * Put block "blockno" in the log: "buffer", and for a partial block its
+ * sub-block "mask".  A slot of the same kind which is still in the log is
+ * replaced there; otherwise the block gets a new slot in the log, and any
+ * earlier slot for it is no longer referenced.
+ */
+static int
+cf_log_slot(cf_context_t *cfp, uint64_t blockno, const void *buffer,
+            const uint64_t *mask) {
+    int                error  = 0;
+    uint64_t           bsize  = cfp->cfc_blocksize;
+    uint64_t           msize  = (mask) ? cfp->cfc_masksize : 0;
+    uint64_t           slot   = cf_slotsize(cfp, mask != (uint64_t *)NULL);
+    uint64_t           oboffs = cf_map_lookup(cfp, blockno);
+    uint64_t           nboffs;
+    uint64_t *         page;
+    cf_block_trailer_t btrail;
+
+    if (cf_logged(cfp, oboffs) &&
+        (cf_entry_partial(oboffs) == (mask != (uint64_t *)NULL))) {
+        nboffs = oboffs;
+    } else {
+        /*
+         * Make sure there's room in the log, and that the map page is there.
+         */
+        error = cf_log_alloc(cfp);
+        if (!error && ((cfp->cfc_loglen + slot) > cfp->cfc_logsize))
+            error = cf_log_flush(cfp);
+        if (!error &&
+            !(error = cf_map_page(cfp, blockno >> CF_MAP_SHIFT, &page))) {
+            nboffs = (cfp->cfc_logbase + cfp->cfc_loglen) |
+                     ((mask) ? CF_MAP_PARTIAL : 0);
+            cfp->cfc_loglen += slot;
+        }
+    }
+    if (!error) {
+        unsigned char *lp =
+            cfp->cfc_log + (CF_ENTRY_OFFSET(nboffs) - cfp->cfc_logbase);
+
+        btrail.cfb_curblock = blockno;
+        btrail.cfb_crc      = cf_crc32(buffer, bsize);
+        btrail.cfb_magic    = CF_MAGIC_3;
+        memcpy(lp, buffer, bsize);
+        if (mask) {
+            btrail.cfb_crc   = update_crc32(btrail.cfb_crc, mask, msize);
+            btrail.cfb_magic = CF_MAGIC_4;
+            memcpy(lp + bsize, mask, msize);
+        }
+        memcpy(lp + bsize + msize, &btrail, sizeof(btrail));
+        if (nboffs != oboffs)
+            cf_map_set(cfp, page, blockno, oboffs, nboffs);
+    }
+
+    return error;
 }
 
 /*
@@ -337,36 +965,304 @@ cf_blockused(void *vcp) {
  */
 int
 cf_writeblock(void *vcp, void *buffer) {
-    int           error   = EROFS;
-    cf_context_t *cfp     = (cf_context_t *)vcp;
-    uint64_t      nbloffs = cfp->cfc_blockmap[cfp->cfc_curpos];
-    uint64_t      curpos;
-
-    if ((error = (*cfp->cfc_sysdep->sys_seek)(
-             cfp->cfc_fd, nbloffs,
-             (nbloffs) ? SYSDEP_SEEK_ABSOLUTE : SYSDEP_SEEK_END, &curpos)) ==
-        0) {
-        cf_block_trailer_t btrail = {
-            cfp->cfc_curpos, cf_crc32(cfp, 0, buffer, cfp->cfc_blocksize),
-            CF_MAGIC_3};
-        uint64_t nwritten;
-        if (((error = (*cfp->cfc_sysdep->sys_write)(
-                  cfp->cfc_fd, buffer, cfp->cfc_blocksize, &nwritten)) == 0) &&
-            (nwritten == cfp->cfc_blocksize) &&
-            ((error = (*cfp->cfc_sysdep->sys_write)(
-                  cfp->cfc_fd, &btrail, sizeof(btrail), &nwritten)) == 0) &&
-            (nwritten == sizeof(btrail))) {
+    int           error = ENXIO;
+    cf_context_t *cfp   = (cf_context_t *)vcp;
+    uint64_t      start = stats_start();
+
+    if (cfp->cfc_curpos < cfp->cfc_header.cf_total_blocks)
+        error = cf_log_slot(cfp, cfp->cfc_curpos, buffer, (uint64_t *)NULL);
+    stats_end(STATS_CF_WRITE, start, 1, error);
+
+    return error;
+}
+
+/*
+ * Does block map entry "boffs" need a new slot for a whole block, rather
+ * than being replaced in the log?
+ */
+static inline int
+cf_needs_slot(const cf_context_t *cfp, uint64_t boffs) {
+    return !cf_logged(cfp, boffs) || cf_entry_partial(boffs);
+}
+
+/*
+ * Write "nblocks" blocks from "blockno", each followed by its trailer,
+ * straight to the end of the file with one write, and point the map at
+ * them.  The log must be empty.
+ */
+static int
+cf_write_direct(cf_context_t *cfp, uint64_t blockno, unsigned char *buffer,
+                uint64_t nblocks) {
+    int                error = 0;
+    uint64_t           bsize = cfp->cfc_blocksize;
+    uint64_t           slot  = cf_slotsize(cfp, 0);
+    sysdep_iovec_t     iov[2 * CF_WRITEV_BLOCKS];
+    cf_block_trailer_t btrail[CF_WRITEV_BLOCKS];
+    uint64_t           bidx, nwritten;
+    uint64_t *         page;
+
+    /*
+     * Work out the trailers as the write is put together.
+     */
+    for (bidx = 0; bidx < nblocks; bidx++) {
+        btrail[bidx].cfb_curblock = blockno + bidx;
+        btrail[bidx].cfb_crc      = cf_crc32(buffer + (bidx * bsize), bsize);
+        btrail[bidx].cfb_magic    = CF_MAGIC_3;
+        iov[2 * bidx].iv_base     = buffer + (bidx * bsize);
+        iov[2 * bidx].iv_len      = bsize;
+        iov[2 * bidx + 1].iv_base = &btrail[bidx];
+        iov[2 * bidx + 1].iv_len  = sizeof(btrail[bidx]);
+    }
+    if (((error = (*cfp->cfc_sysdep->sys_pwritev)(
+              cfp->cfc_fd, iov, (uint32_t)(2 * nblocks), cfp->cfc_logbase,
+              &nwritten)) == 0) &&
+        (nwritten == (nblocks * slot))) {
+        uint64_t base = cfp->cfc_logbase;
+
+        cfp->cfc_logbase += nwritten;
+        for (bidx = 0; !error && (bidx < nblocks); bidx++) {
+            uint64_t b = blockno + bidx;
+
+            if (!(error = cf_map_page(cfp, b >> CF_MAP_SHIFT, &page)))
+                cf_map_set(cfp, page, b, cf_map_lookup(cfp, b),
+                           base + (bidx * slot));
+        }
+    } else {
+        if (!error)
+            error = EIO;
+    }
+
+    return error;
+}
+
+/*
+ * Write "nblocks" blocks from "blockno".  This does not change the current
+ * position.
+ *
+ * Blocks still in the log are replaced there, and runs of blocks needing
+ * new slots are logged.  A run of large blocks too long for what's left of
+ * the log is written straight to the file after it instead, so that long
+ * sequential writes aren't copied.
+ */
+int
+cf_writeblocks(void *vcp, uint64_t blockno, void *buffer, uint64_t nblocks) {
+    int            error = ENXIO;
+    cf_context_t * cfp   = (cf_context_t *)vcp;
+    uint64_t       start = stats_start();
+    unsigned char *bp    = (unsigned char *)buffer;
+    uint64_t       total = cfp->cfc_header.cf_total_blocks;
+    uint64_t       bsize = cfp->cfc_blocksize;
+    uint64_t       slot  = cf_slotsize(cfp, 0);
+    uint64_t       count = nblocks;
+
+    if ((blockno <= total) && (nblocks <= (total - blockno)))
+        error = cf_log_alloc(cfp);
+    while (!error && nblocks) {
+        uint64_t run = 0;
+
+        while ((run < nblocks) &&
+               cf_needs_slot(cfp, cf_map_lookup(cfp, blockno + run)))
+            run++;
+        if ((bsize >= CF_WRITEV_MIN) &&
+            ((run * slot) > (cfp->cfc_logsize - cfp->cfc_loglen))) {
             /*
-             * Write success.
+             * The log is written out first, so the run follows its slots.
              */
-            if (!nbloffs) {
-                /*
-                 * We made a new block.
-                 */
-                cfp->cfc_blockmap[cfp->cfc_curpos] = curpos;
-                cfp->cfc_header.cf_used_blocks++;
-                cfp->cfc_header.cf_flags |= CF_HEADER_DIRTY;
+            uint64_t done, n;
+
+            error = cf_log_flush(cfp);
+            for (done = 0; !error && (done < run); done += n) {
+                n = ((run - done) > CF_WRITEV_BLOCKS) ? CF_WRITEV_BLOCKS
+                                                      : (run - done);
+                error = cf_write_direct(cfp, blockno + done,
+                                        bp + (done * bsize), n);
             }
+        } else {
+            uint64_t bidx;
+
+            if (!run)
+                run = 1;
+            for (bidx = 0; !error && (bidx < run); bidx++)
+                error = cf_log_slot(cfp, blockno + bidx, bp + (bidx * bsize),
+                                    (uint64_t *)NULL);
+        }
+        blockno += run;
+        bp += run * bsize;
+        nblocks -= run;
+    }
+    stats_end(STATS_CF_WRITE, start, count, error);
+
+    return error;
+}
+
+/*
+ * Read the partial block at block map entry "entry" into "sbuf": the block
+ * and its mask, then its trailer, which are checked.
+ */
+static int
+cf_partial_read(cf_context_t *cfp, uint64_t blockno, uint64_t entry,
+                unsigned char *sbuf) {
+    int                error = 0;
+    uint64_t           bsize = cfp->cfc_blocksize;
+    uint64_t           msize = cfp->cfc_masksize;
+    uint64_t           rsize = cf_slotsize(cfp, 1);
+    uint64_t           nread;
+    cf_block_trailer_t btrail;
+
+    if (cf_logged(cfp, entry)) {
+        memcpy(sbuf, cfp->cfc_log + (CF_ENTRY_OFFSET(entry) - cfp->cfc_logbase),
+               rsize);
+    } else if (((error = (*cfp->cfc_sysdep->sys_pread)(
+                     cf_entry_fd(cfp, entry), sbuf, rsize,
+                     CF_ENTRY_OFFSET(entry), &nread)) == 0) &&
+               (nread != rsize)) {
+        error = EIO;
+    }
+    if (!error) {
+        memcpy(&btrail, sbuf + bsize + msize, sizeof(btrail));
+        if ((btrail.cfb_curblock != blockno) ||
+            (btrail.cfb_magic != CF_MAGIC_4) ||
+            (btrail.cfb_crc !=
+             update_crc32(cf_crc32(sbuf, bsize), sbuf + bsize, msize)))
+            error = ESRCH;
+    }
+
+    return error;
+}
+
+/*
+ * Write "length" bytes at "offset" in block "blockno", leaving the rest
+ * of it as it is, without reading the image.  Where the rest is the
+ * image's, the block is kept as a partial block; where the block is in
+ * the change file, it's merged with what's there.  This does not change
+ * the current position.
+ *
+ * Returns:
+ * - 0: Success.
+ * - ENOTSUP: The bytes aren't whole sub-blocks, or the block is a partial
+ *   block in a file under this one.  Write the whole block instead.
+ * - error: Otherwise.
+ */
+int
+cf_writepartial(void *vcp, uint64_t blockno, uint64_t offset,
+                uint64_t length, const void *buffer) {
+    int            error = 0;
+    cf_context_t * cfp   = (cf_context_t *)vcp;
+    uint64_t       bsize = cfp->cfc_blocksize;
+    uint64_t       nsub  = bsize >> CF_SUBBLOCK_SHIFT;
+    uint64_t       start = stats_start();
+    uint64_t       entry, sb;
+    unsigned char *pbp;
+    uint64_t *     mask;
+    int            full;
+
+    if ((blockno >= cfp->cfc_header.cf_total_blocks) || (offset > bsize) ||
+        (length > (bsize - offset)))
+        return ENXIO;
+    entry = cf_map_lookup(cfp, blockno);
+    if (!cfp->cfc_masksize || ((offset | length) & (CF_SUBBLOCK_SIZE - 1)) ||
+        (cf_entry_partial(entry) && CF_ENTRY_LAYER(entry)))
+        return ENOTSUP;
+    if (!cfp->cfc_partbuf &&
+        (error = (*cfp->cfc_sysdep->sys_malloc)(&cfp->cfc_partbuf,
+                                                cf_slotsize(cfp, 1))))
+        return error;
+    pbp  = cfp->cfc_partbuf;
+    mask = (uint64_t *)(pbp + bsize);
+    /*
+     * Start from what the change file has for the block.
+     */
+    full = (entry && !cf_entry_partial(entry));
+    if (cf_entry_partial(entry))
+        error = cf_partial_read(cfp, blockno, entry, pbp);
+    else if (full)
+        error = cf_readblock_at(vcp, blockno, pbp);
+    else
+        memset(pbp, 0, bsize + cfp->cfc_masksize);
+    if (!error) {
+        memcpy(pbp + offset, buffer, length);
+        for (sb = offset >> CF_SUBBLOCK_SHIFT;
+             sb < ((offset + length) >> CF_SUBBLOCK_SHIFT); sb++)
+            mask[sb / 64] |= 1ULL << (sb % 64);
+        for (sb = 0; !full && (sb < nsub); sb++)
+            if (!(mask[sb / 64] & (1ULL << (sb % 64))))
+                break;
+        error = cf_log_slot(cfp, blockno, pbp,
+                            (full || (sb == nsub)) ? (uint64_t *)NULL : mask);
+    }
+    stats_end(STATS_CF_WRITE, start, 1, error);
+
+    return error;
+}
+
+/*
+ * Apply the partial blocks among the "nblocks" blocks from "blockno" to
+ * "buffer", which holds what the image has for them.
+ */
+int
+cf_overlay(void *vcp, uint64_t blockno, void *buffer, uint64_t nblocks) {
+    int            error = 0;
+    cf_context_t * cfp   = (cf_context_t *)vcp;
+    uint64_t       bsize = cfp->cfc_blocksize;
+    unsigned char *sbuf  = (unsigned char *)NULL;
+    uint64_t       bindex;
+
+    if (!cfp->cfc_partials)
+        return 0;
+    for (bindex = 0; !error && (bindex < nblocks) &&
+                     ((blockno + bindex) < cfp->cfc_header.cf_total_blocks);
+         bindex++) {
+        uint64_t entry = cf_map_lookup(cfp, blockno + bindex);
+
+        if (cf_entry_partial(entry) &&
+            (sbuf || !(error = (*cfp->cfc_sysdep->sys_malloc)(
+                           &sbuf, cf_slotsize(cfp, 1)))) &&
+            !(error = cf_partial_read(cfp, blockno + bindex, entry, sbuf))) {
+            const uint64_t *mask = (const uint64_t *)(sbuf + bsize);
+            unsigned char * bp   = (unsigned char *)buffer + (bindex * bsize);
+            uint64_t        sb;
+
+            for (sb = 0; sb < (bsize >> CF_SUBBLOCK_SHIFT); sb++)
+                if (mask[sb / 64] & (1ULL << (sb % 64)))
+                    memcpy(bp + (sb << CF_SUBBLOCK_SHIFT),
+                           sbuf + (sb << CF_SUBBLOCK_SHIFT), CF_SUBBLOCK_SIZE);
+        }
+    }
+    if (sbuf)
+        (void)(*cfp->cfc_sysdep->sys_free)(sbuf);
+
+    return error;
+}
+
+/*
+ * Make "nblocks" blocks from "blockno" read as zeroes.  Only the block map
+ * changes: nothing is written for them, and space used by earlier data
+ * for them is simply no longer referenced.  This does not change the
+ * current position.
+ */
+int
+cf_zeroblocks(void *vcp, uint64_t blockno, uint64_t nblocks) {
+    int           error = 0;
+    cf_context_t *cfp   = (cf_context_t *)vcp;
+    uint64_t      bindex;
+
+    if ((blockno > cfp->cfc_header.cf_total_blocks) ||
+        (nblocks > (cfp->cfc_header.cf_total_blocks - blockno)))
+        return ENXIO;
+    for (bindex = 0; !error && (bindex < nblocks); bindex++) {
+        uint64_t  curblock = blockno + bindex;
+        uint64_t *page;
+
+        if (((error = cf_map_page(cfp, curblock >> CF_MAP_SHIFT, &page)) ==
+             0) &&
+            (page[curblock & CF_MAP_MASK] != CF_MAP_ZERO)) {
+            if (!cf_entry_own(page[curblock & CF_MAP_MASK]))
+                cfp->cfc_header.cf_used_blocks++;
+            page[curblock & CF_MAP_MASK]                = CF_MAP_ZERO;
+            cfp->cfc_mapdirty[curblock >> CF_MAP_SHIFT] = 1;
+            if (cfp->cfc_header.cf_version < CF_VERSION_2)
+                cfp->cfc_header.cf_version = CF_VERSION_2;
+            cfp->cfc_header.cf_flags |= CF_HEADER_DIRTY;
         }
     }
 
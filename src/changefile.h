@@ -17,6 +17,19 @@
 #include "sysdep_int.h"
 #include <sys/types.h>
 
+/*
+ * Size of the trailer following each block in the change file.
+ */
+#define CF_TRAILER_SIZE 16
+
+/*
+ * A change file path may name a chain of change files, separated by
+ * CF_CHAIN_SEP and listed from the bottom up.  Blocks are read from the
+ * topmost file which has them, and only the last file is written; it is
+ * created if need be.
+ */
+#define CF_CHAIN_SEP ':'
+
 int cf_init(const char *, const sysdep_dispatch_t *, uint64_t, uint64_t,
             void **);
 int cf_create(const char *, const sysdep_dispatch_t *, uint64_t, uint64_t,
@@ -28,5 +41,15 @@ int cf_seek(void *, uint64_t);
 int cf_readblock(void *, void *);
 int cf_blockused(void *);
 int cf_writeblock(void *, void *);
+int cf_writeblocks(void *, uint64_t, void *, uint64_t);
+int cf_writepartial(void *, uint64_t, uint64_t, uint64_t, const void *);
+int cf_overlay(void *, uint64_t, void *, uint64_t);
+int cf_readblock_at(void *, uint64_t, void *);
+int cf_blockused_at(void *, uint64_t);
+int cf_blockzero_at(void *, uint64_t);
+int cf_zeroblocks(void *, uint64_t, uint64_t);
+uint64_t cf_run(void *, uint64_t, uint64_t, int);
+int cf_readblock_io(void *, uint64_t, void *, void *, sysdep_io_t *);
+int cf_readblock_check(void *, uint64_t, const void *, const void *);
 
 #endif /* _CHANGEFILE_H_ */
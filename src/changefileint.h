@@ -15,16 +15,16 @@
 
 #include "sysdep_int.h"
 
-#define CRC_UNIT_BITS 8
-#define CRC_TABLE_LEN (1 << CRC_UNIT_BITS)
-
 /*
  * Change file header.
  */
 #define CF_MAGIC_1      0xdeadbeef
 #define CF_MAGIC_2      0xfeedf00d
 #define CF_MAGIC_3      0x3a070045
+#define CF_MAGIC_4      0x3a070046 /* Trailer of a partial block */
 #define CF_VERSION_1    1
+#define CF_VERSION_2    2 /* Block map may hold CF_MAP_ZERO */
+#define CF_VERSION_3    3 /* ...and partial blocks */
 #define CF_HEADER_DIRTY 1
 typedef struct change_file_header {
     uint32_t cf_magic;           /* 0x00 - magic */
@@ -36,15 +36,98 @@ typedef struct change_file_header {
     uint32_t cf_magic2;          /* 0x1c - magic2 */
 } cf_header_t;                   /* 0x20 - total size */
 
+/*
+ * The in-core block map is a sparse two-level table: a directory of
+ * pointers to pages of CF_MAP_ENTRIES offsets.  A page is only allocated
+ * once one of its blocks is present in the change file, and pages modified
+ * since the last sync are flagged in cfc_mapdirty so that cf_sync only
+ * writes those back.  The on-disk format is unchanged.
+ */
+#define CF_MAP_SHIFT   9
+#define CF_MAP_ENTRIES (1 << CF_MAP_SHIFT)
+#define CF_MAP_MASK    (CF_MAP_ENTRIES - 1)
+#define CF_MAP_READ    64 /* Pages read per call while loading */
+
+/*
+ * Block map entry for a block which reads as zeroes and has no data in the
+ * change file: it was trimmed or zeroed.  Blocks are always stored past the
+ * header, so no real offset is this small.
+ */
+#define CF_MAP_ZERO 1
+
+/*
+ * With a chain of change files, the in-core block map of the top file
+ * holds the entries of those under it too, so that a lookup costs the same
+ * however deep the chain is.  Such entries carry the layer they came from
+ * (1 for the file just below the top, and so on) in their top bits; the
+ * top file's own entries have none, and are all that cf_sync writes.
+ */
+#define CF_LAYER_SHIFT      56
+#define CF_OFFSET_MASK      (CF_MAP_PARTIAL - 1)
+#define CF_MAX_LOWER        255
+#define CF_ENTRY_LAYER(_e)  ((_e) >> CF_LAYER_SHIFT)
+#define CF_ENTRY_OFFSET(_e) ((_e)&CF_OFFSET_MASK)
+
+/*
+ * A block only partly written, where what's under the rest of it is the
+ * image's, is kept at the granularity of CF_SUBBLOCK_SIZE sub-blocks, so
+ * that the image needn't be read to fill it in.  Its slot holds the block,
+ * with only the sub-blocks written filled in, then a mask with a bit for
+ * each of those, then the trailer, with CF_MAGIC_4 and the CRC of both.
+ * Its block map entry has CF_MAP_PARTIAL set.  Reads apply it over what the
+ * image has for the block.
+ */
+#define CF_MAP_PARTIAL    (1ULL << 55)
+#define CF_SUBBLOCK_SHIFT 9
+#define CF_SUBBLOCK_SIZE  (1 << CF_SUBBLOCK_SHIFT)
+
+/*
+ * Size of the sub-block mask of a partial block, in bytes; zero when
+ * blocks can't be split.
+ */
+static inline uint64_t
+cf_mask_size(uint64_t blocksize) {
+    return ((blocksize > CF_SUBBLOCK_SIZE) &&
+            !(blocksize & (CF_SUBBLOCK_SIZE - 1)))
+               ? (((blocksize >> CF_SUBBLOCK_SHIFT) + 63) / 64) *
+                     sizeof(uint64_t)
+               : 0;
+}
+
+/*
+ * Blocks are written as a log: each write goes to a new slot at the end of
+ * the file, so that what was on disk at the last sync stays intact until
+ * the block map is next written.  Writes are gathered in a buffer of up to
+ * CF_LOG_SIZE bytes, from the end of the file onward, and only written
+ * when it fills or at cf_sync.  Runs of new blocks too long for what's
+ * left of the buffer skip it, and are written straight after it, up to
+ * CF_WRITEV_BLOCKS blocks and their trailers at a time.  Blocks smaller
+ * than CF_WRITEV_MIN are always gathered, as copying them costs less than
+ * handing the system so many small pieces.
+ */
+#define CF_LOG_SIZE      (1024 * 1024)
+#define CF_WRITEV_BLOCKS 256
+#define CF_WRITEV_MIN    4096
+
 typedef struct change_file_context {
-    cf_header_t              cfc_header;
-    const sysdep_dispatch_t *cfc_sysdep;
-    void *                   cfc_fd;
-    uint64_t *               cfc_blockmap;
-    uint64_t                 cfc_blocksize;
-    uint64_t                 cfc_blockcount;
-    uint64_t                 cfc_curpos;
-    uint32_t                 cfc_crc_tab32[CRC_TABLE_LEN];
+    cf_header_t                   cfc_header;
+    const sysdep_dispatch_t *     cfc_sysdep;
+    void *                        cfc_fd;
+    uint64_t **                   cfc_mappages; /* Block map page directory */
+    unsigned char *               cfc_mapdirty; /* Pages changed since sync */
+    uint64_t                      cfc_mapcount; /* Number of map pages */
+    uint64_t                      cfc_blocksize;
+    uint64_t                      cfc_blockcount;
+    uint64_t                      cfc_curpos;
+    unsigned char *               cfc_log;      /* Slots not yet written */
+    uint64_t                      cfc_logsize;  /* Size of cfc_log */
+    uint64_t                      cfc_loglen;   /* Bytes used in cfc_log */
+    uint64_t                      cfc_logbase;  /* File offset of cfc_log */
+    struct change_file_context ** cfc_lower;    /* Files below, nearest first */
+    uint32_t                      cfc_nlower;
+    uint64_t                      cfc_masksize; /* Partial block mask size */
+    unsigned char *               cfc_partbuf;  /* For building partials */
+    int                           cfc_partials; /* Map has partial blocks */
 } cf_context_t;
 
 typedef struct change_file_block_trailer {
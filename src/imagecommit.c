@@ -0,0 +1,666 @@
+/*
+ * imagecommit.c - Fold a change file into a new partclone image.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#    include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
+#include "libchecksum.h"
+#include "libimage.h"
+#include "partclone.h"
+#include "sysdep_posix.h"
+
+/*
+ * Default size of each transfer buffer and checksum group, the most
+ * checksum threads and the most checksum groups per writev().
+ */
+#define COMMIT_BUFSIZE_DEFAULT (16 * 1024 * 1024)
+#define COMMIT_BPC_DEFAULT     256
+#define COMMIT_NBUFS           4
+#define COMMIT_MAXSUM          16
+#define COMMIT_IOV_GROUPS      256
+
+/*
+ * A buffer is filled with used blocks by the reader, has the checksums of
+ * its groups computed, and is then written out.
+ */
+typedef enum commit_state {
+    CB_FREE   = 0,
+    CB_FILLED = 1,
+    CB_SUMMED = 2
+} commit_state_t;
+
+typedef struct commit_buffer {
+    unsigned char *cb_data;    /* Used blocks, packed */
+    crc32_t *      cb_crcs;    /* Checksum of each group */
+    uint64_t       cb_nblocks; /* Number of blocks */
+    uint64_t       cb_ngroups; /* Number of groups */
+    int            cb_error;   /* Reader error */
+    int            cb_last;    /* No more buffers follow */
+#ifdef HAVE_LIBPTHREAD
+    commit_state_t cb_state;
+    uint64_t       cb_seq;        /* Order in which it was filled */
+    uint64_t       cb_nextgroup;  /* Next group to checksum */
+    uint64_t       cb_donegroups; /* Groups checksummed */
+#endif                            /* HAVE_LIBPTHREAD */
+} commit_buffer_t;
+
+/*
+ * Run context for program.
+ */
+typedef struct commit_context {
+    char *          cc_progname;
+    void *          cc_image;
+    int             cc_fd;
+    int             cc_verbose;
+    uint64_t        cc_blocksize;
+    uint64_t        cc_blockcount;
+    uint64_t        cc_bpc;        /* Blocks per checksum */
+    uint64_t        cc_bufblocks;  /* Blocks per buffer */
+    uint64_t        cc_nextblock;  /* Next block for the reader */
+    uint64_t        cc_usedblocks; /* Blocks set in the bitmap */
+    uint64_t        cc_written;    /* Bytes written */
+    unsigned char * cc_bitmap;
+    uint64_t        cc_bitmapsize;
+    commit_buffer_t cc_bufs[COMMIT_NBUFS];
+#ifdef HAVE_LIBPTHREAD
+    int             cc_nsum; /* Checksum threads */
+    pthread_mutex_t cc_mutex;
+    pthread_cond_t  cc_cond;
+    uint64_t        cc_seq;   /* Buffers filled */
+    int             cc_abort; /* Writer has given up */
+    int             cc_done;  /* Writer has finished */
+#endif                        /* HAVE_LIBPTHREAD */
+} commit_context_t;
+
+/*
+ * Write out "niov" vectors, sequentially.
+ */
+static int
+commit_writev(commit_context_t *ccp, struct iovec *iov, int niov) {
+    while (niov) {
+        ssize_t nwritten = writev(ccp->cc_fd, iov, niov);
+
+        if (nwritten < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (nwritten == 0)
+            return EIO;
+        ccp->cc_written += nwritten;
+        while (niov && ((size_t)nwritten >= iov->iov_len)) {
+            nwritten -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov) {
+            iov->iov_base = (unsigned char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Build the bitmap from the blocks in use in the image and its change file.
+ */
+static int
+commit_bitmap(commit_context_t *ccp) {
+    uint64_t blockno = 0;
+    uint64_t nrun;
+    int      used;
+
+    ccp->cc_bitmapsize = (ccp->cc_blockcount + 7) / 8;
+    if ((ccp->cc_bitmap = (unsigned char *)calloc(ccp->cc_bitmapsize + 1, 1)) ==
+        NULL)
+        return ENOMEM;
+    while (blockno < ccp->cc_blockcount) {
+        if ((used = image_block_extent(ccp->cc_image, blockno,
+                                       ccp->cc_blockcount - blockno, &nrun)) <
+            0)
+            return EIO;
+        if (used) {
+            uint64_t end = blockno + nrun;
+
+            ccp->cc_usedblocks += nrun;
+            for (; (blockno < end) && (blockno & 7); blockno++)
+                ccp->cc_bitmap[blockno / 8] |= 1 << (blockno & 7);
+            if ((end - blockno) >= 8) {
+                memset(&ccp->cc_bitmap[blockno / 8], 0xff, (end - blockno) / 8);
+                blockno += (end - blockno) & ~7ULL;
+            }
+            for (; blockno < end; blockno++)
+                ccp->cc_bitmap[blockno / 8] |= 1 << (blockno & 7);
+        } else {
+            blockno += nrun;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Label the new image with the file system of the original, if that's a
+ * partclone image.
+ */
+static void
+commit_label(commit_context_t *ccp, const char *file, image_head_v2 *hp) {
+    const char *type = image_type_name(ccp->cc_image);
+
+    hp->device_size = ccp->cc_blocksize * ccp->cc_blockcount;
+    if (type && (strncmp(type, "partclone", 9) == 0)) {
+        union {
+            image_head_v1 v1;
+            image_head_v2 v2;
+        } ohead;
+        int fd;
+
+        if ((fd = open(file, O_RDONLY)) >= 0) {
+            if (pread(fd, &ohead, sizeof(ohead), 0) == sizeof(ohead)) {
+                if (memcmp(ohead.v1.version, IMAGE_VERSION, VERSION_SIZE) ==
+                    0) {
+                    memcpy(hp->fs, ohead.v1.fs, FS_MAGIC_SIZE);
+                    hp->device_size = ohead.v1.device_size;
+                } else {
+                    memcpy(hp->fs, ohead.v2.fs, FS_MAGIC_SIZE);
+                    hp->device_size = ohead.v2.device_size;
+                }
+            }
+            close(fd);
+        }
+    } else if (type && (strncmp(type, "ntfsclone", 9) == 0)) {
+        strcpy(hp->fs, ntfs_MAGIC);
+    }
+    if (!hp->fs[0])
+        strcpy(hp->fs, raw_MAGIC);
+}
+
+/*
+ * Write the version 2 header, the bitmap and its checksum.  Groups are
+ * reseeded, so that they can be checksummed independently.
+ */
+static int
+commit_head(commit_context_t *ccp, const char *file) {
+    image_head_v2 head;
+    crc32_t       bmcrc;
+    struct iovec  iov[3];
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
+#ifdef PACKAGE_VERSION
+    strncpy(head.ptc_version, PACKAGE_VERSION, PARTCLONE_VERSION_SIZE);
+#endif /* PACKAGE_VERSION */
+    memcpy(head.version, IMAGE_VERSION_2, VERSION_SIZE);
+    head.endianess = ENDIAN_MAGIC;
+    commit_label(ccp, file, &head);
+    head.totalblock          = ccp->cc_blockcount;
+    head.usedblocks          = ccp->cc_usedblocks;
+    head.used_bitmap         = ccp->cc_usedblocks;
+    head.block_size          = ccp->cc_blocksize;
+    head.feature_size        = offsetof(image_head_v2, crc) -
+                               offsetof(image_head_v2, feature_size);
+    head.image_version       = 2;
+    head.cpu_bits            = sizeof(unsigned long) * 8;
+    head.checksum_mode       = V2_CSM_CRC32;
+    head.checksum_size       = CRC_SIZE;
+    head.blocks_per_checksum = ccp->cc_bpc;
+    head.reseed_checksum     = 1;
+    head.bitmap_mode         = V2_BM_BIT;
+    head.crc = update_crc32(init_crc32(), &head, sizeof(head) - CRC_SIZE);
+    bmcrc    = update_crc32(init_crc32(), ccp->cc_bitmap, ccp->cc_bitmapsize);
+
+    iov[0].iov_base = &head;
+    iov[0].iov_len  = sizeof(head);
+    iov[1].iov_base = ccp->cc_bitmap;
+    iov[1].iov_len  = ccp->cc_bitmapsize;
+    iov[2].iov_base = &bmcrc;
+    iov[2].iov_len  = sizeof(bmcrc);
+    return commit_writev(ccp, iov, 3);
+}
+
+/*
+ * Fill the next buffer with used blocks, read in runs as long as the
+ * buffer allows.
+ */
+static void
+commit_fill(commit_context_t *ccp, commit_buffer_t *cbp) {
+    uint64_t blockno = ccp->cc_nextblock;
+    uint64_t filled  = 0;
+    int      error   = 0;
+
+    while (!error && (blockno < ccp->cc_blockcount) &&
+           (filled < ccp->cc_bufblocks)) {
+        uint64_t nrun;
+        int      used;
+
+        if ((used = image_block_extent(ccp->cc_image, blockno,
+                                       ccp->cc_blockcount - blockno, &nrun)) <
+            0) {
+            error = EIO;
+            break;
+        }
+        if (used) {
+            if (nrun > (ccp->cc_bufblocks - filled))
+                nrun = ccp->cc_bufblocks - filled;
+            error = image_readblocks_at(
+                ccp->cc_image, blockno,
+                &cbp->cb_data[filled * ccp->cc_blocksize], nrun);
+            filled += nrun;
+        }
+        blockno += nrun;
+    }
+    cbp->cb_nblocks    = filled;
+    cbp->cb_ngroups    = (filled + ccp->cc_bpc - 1) / ccp->cc_bpc;
+    cbp->cb_error      = error;
+    cbp->cb_last       = error || (blockno >= ccp->cc_blockcount);
+    ccp->cc_nextblock  = blockno;
+}
+
+/*
+ * Checksum one group of a buffer.  The last group may be short.
+ */
+static void
+commit_sum(commit_context_t *ccp, commit_buffer_t *cbp, uint64_t group) {
+    uint64_t first   = group * ccp->cc_bpc;
+    uint64_t nblocks = cbp->cb_nblocks - first;
+
+    if (nblocks > ccp->cc_bpc)
+        nblocks = ccp->cc_bpc;
+    cbp->cb_crcs[group] =
+        update_crc32(init_crc32(), &cbp->cb_data[first * ccp->cc_blocksize],
+                     nblocks * ccp->cc_blocksize);
+}
+
+/*
+ * Write out one buffer, each group followed by its checksum.
+ */
+static int
+commit_drain(commit_context_t *ccp, commit_buffer_t *cbp) {
+    int          error = cbp->cb_error;
+    uint64_t     group = 0;
+    struct iovec iov[2 * COMMIT_IOV_GROUPS];
+
+    while (!error && (group < cbp->cb_ngroups)) {
+        int niov = 0;
+
+        for (; (group < cbp->cb_ngroups) && (niov < (2 * COMMIT_IOV_GROUPS));
+             group++) {
+            uint64_t first   = group * ccp->cc_bpc;
+            uint64_t nblocks = cbp->cb_nblocks - first;
+
+            if (nblocks > ccp->cc_bpc)
+                nblocks = ccp->cc_bpc;
+            iov[niov].iov_base   = &cbp->cb_data[first * ccp->cc_blocksize];
+            iov[niov++].iov_len  = nblocks * ccp->cc_blocksize;
+            iov[niov].iov_base   = &cbp->cb_crcs[group];
+            iov[niov++].iov_len  = CRC_SIZE;
+        }
+        error = commit_writev(ccp, iov, niov);
+    }
+    return error;
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * Checksum the next group waiting, taking the oldest buffer first.  Called
+ * with cc_mutex held, which is dropped while checksumming.
+ *
+ * Returns nonzero if there was a group to checksum.
+ */
+static int
+commit_sum_next(commit_context_t *ccp) {
+    commit_buffer_t *cbp = (commit_buffer_t *)NULL;
+    uint64_t         group;
+    int              bidx;
+
+    for (bidx = 0; bidx < COMMIT_NBUFS; bidx++) {
+        commit_buffer_t *bp = &ccp->cc_bufs[bidx];
+
+        if ((bp->cb_state == CB_FILLED) &&
+            (bp->cb_nextgroup < bp->cb_ngroups) &&
+            (!cbp || (bp->cb_seq < cbp->cb_seq)))
+            cbp = bp;
+    }
+    if (!cbp)
+        return 0;
+    group = cbp->cb_nextgroup++;
+    pthread_mutex_unlock(&ccp->cc_mutex);
+    commit_sum(ccp, cbp, group);
+    pthread_mutex_lock(&ccp->cc_mutex);
+    if (++cbp->cb_donegroups == cbp->cb_ngroups) {
+        cbp->cb_state = CB_SUMMED;
+        pthread_cond_broadcast(&ccp->cc_cond);
+    }
+    return 1;
+}
+
+/*
+ * The reader thread keeps filling buffers ahead of the checksum threads.
+ */
+static void *
+commit_reader(void *arg) {
+    commit_context_t *ccp = (commit_context_t *)arg;
+    int               bidx;
+    int               done = 0;
+
+    for (bidx = 0; !done; bidx = (bidx + 1) % COMMIT_NBUFS) {
+        commit_buffer_t *cbp = &ccp->cc_bufs[bidx];
+
+        pthread_mutex_lock(&ccp->cc_mutex);
+        while ((cbp->cb_state != CB_FREE) && !ccp->cc_abort)
+            pthread_cond_wait(&ccp->cc_cond, &ccp->cc_mutex);
+        done = ccp->cc_abort;
+        pthread_mutex_unlock(&ccp->cc_mutex);
+        if (done)
+            break;
+
+        commit_fill(ccp, cbp);
+        done = cbp->cb_last;
+
+        pthread_mutex_lock(&ccp->cc_mutex);
+        cbp->cb_seq        = ccp->cc_seq++;
+        cbp->cb_nextgroup  = 0;
+        cbp->cb_donegroups = 0;
+        cbp->cb_state = (cbp->cb_error || !cbp->cb_ngroups) ? CB_SUMMED
+                                                            : CB_FILLED;
+        pthread_cond_broadcast(&ccp->cc_cond);
+        pthread_mutex_unlock(&ccp->cc_mutex);
+    }
+    return (void *)NULL;
+}
+
+/*
+ * Checksum threads take groups from filled buffers until the writer is
+ * finished.
+ */
+static void *
+commit_summer(void *arg) {
+    commit_context_t *ccp = (commit_context_t *)arg;
+
+    pthread_mutex_lock(&ccp->cc_mutex);
+    while (!ccp->cc_done) {
+        if (!commit_sum_next(ccp))
+            pthread_cond_wait(&ccp->cc_cond, &ccp->cc_mutex);
+    }
+    pthread_mutex_unlock(&ccp->cc_mutex);
+    return (void *)NULL;
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/*
+ * Copy the used blocks to the new image.  With threads, the reader fills
+ * buffers ahead while the checksum threads work on the groups of those
+ * already filled, and the writer (which checksums while it waits) writes
+ * them out in order.
+ */
+static int
+commit_image(commit_context_t *ccp) {
+    int error = 0;
+    int bidx;
+    int done = 0;
+#ifdef HAVE_LIBPTHREAD
+    pthread_t reader;
+    pthread_t summers[COMMIT_MAXSUM];
+    int       nsum;
+
+    pthread_mutex_init(&ccp->cc_mutex, (pthread_mutexattr_t *)NULL);
+    pthread_cond_init(&ccp->cc_cond, (pthread_condattr_t *)NULL);
+    if ((error = pthread_create(&reader, (pthread_attr_t *)NULL,
+                                commit_reader, ccp)) != 0) {
+        pthread_cond_destroy(&ccp->cc_cond);
+        pthread_mutex_destroy(&ccp->cc_mutex);
+        return error;
+    }
+    /*
+     * The writer checksums too, so it doesn't matter if none start.
+     */
+    for (nsum = 0; (nsum < ccp->cc_nsum) &&
+                   !pthread_create(&summers[nsum], (pthread_attr_t *)NULL,
+                                   commit_summer, ccp);
+         nsum++)
+        ;
+    for (bidx = 0; !done; bidx = (bidx + 1) % COMMIT_NBUFS) {
+        commit_buffer_t *cbp = &ccp->cc_bufs[bidx];
+
+        pthread_mutex_lock(&ccp->cc_mutex);
+        while (cbp->cb_state != CB_SUMMED) {
+            if (!commit_sum_next(ccp))
+                pthread_cond_wait(&ccp->cc_cond, &ccp->cc_mutex);
+        }
+        pthread_mutex_unlock(&ccp->cc_mutex);
+
+        error = commit_drain(ccp, cbp);
+        done  = error || cbp->cb_last;
+
+        pthread_mutex_lock(&ccp->cc_mutex);
+        cbp->cb_state = CB_FREE;
+        if (error)
+            ccp->cc_abort = 1;
+        if (done)
+            ccp->cc_done = 1;
+        pthread_cond_broadcast(&ccp->cc_cond);
+        pthread_mutex_unlock(&ccp->cc_mutex);
+    }
+    pthread_join(reader, (void **)NULL);
+    while (nsum)
+        pthread_join(summers[--nsum], (void **)NULL);
+    pthread_cond_destroy(&ccp->cc_cond);
+    pthread_mutex_destroy(&ccp->cc_mutex);
+#else  /* HAVE_LIBPTHREAD */
+    for (bidx = 0; !done; bidx = (bidx + 1) % COMMIT_NBUFS) {
+        commit_buffer_t *cbp = &ccp->cc_bufs[bidx];
+        uint64_t         group;
+
+        commit_fill(ccp, cbp);
+        for (group = 0; !cbp->cb_error && (group < cbp->cb_ngroups); group++)
+            commit_sum(ccp, cbp, group);
+        error = commit_drain(ccp, cbp);
+        done  = error || cbp->cb_last;
+    }
+#endif /* HAVE_LIBPTHREAD */
+
+    /*
+     * Opening an image reads a version 1 header's worth, so a tiny image
+     * is padded out.
+     */
+    if (!error && (ccp->cc_written < sizeof(image_head_v1)) &&
+        (ftruncate(ccp->cc_fd, sizeof(image_head_v1)) < 0))
+        error = errno;
+    if (!error && (fsync(ccp->cc_fd) < 0))
+        error = errno;
+    return error;
+}
+
+/*
+ * Open the new image and size the buffers.  Buffers hold whole groups.
+ */
+static int
+commit_setup(commit_context_t *ccp, const char *file, const char *target,
+             uint64_t bufsize) {
+    int         error = 0;
+    int         bidx;
+    struct stat isbuf;
+    struct stat tsbuf;
+
+    /*
+     * Don't truncate the image we're reading.
+     */
+    if ((stat(file, &isbuf) == 0) && (stat(target, &tsbuf) == 0) &&
+        (isbuf.st_dev == tsbuf.st_dev) && (isbuf.st_ino == tsbuf.st_ino))
+        return EEXIST;
+    if ((ccp->cc_fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0)
+        return errno;
+
+    ccp->cc_bufblocks = (bufsize / ccp->cc_blocksize) / ccp->cc_bpc;
+    if (!ccp->cc_bufblocks)
+        ccp->cc_bufblocks = 1;
+    ccp->cc_bufblocks *= ccp->cc_bpc;
+    for (bidx = 0; !error && (bidx < COMMIT_NBUFS); bidx++) {
+        commit_buffer_t *cbp = &ccp->cc_bufs[bidx];
+
+        if (((cbp->cb_data = (unsigned char *)malloc(
+                  ccp->cc_bufblocks * ccp->cc_blocksize)) == NULL) ||
+            ((cbp->cb_crcs = (crc32_t *)malloc(
+                  (ccp->cc_bufblocks / ccp->cc_bpc) * sizeof(crc32_t))) ==
+             NULL))
+            error = ENOMEM;
+    }
+    return error;
+}
+
+int
+main(int argc, char *argv[]) {
+    int              option;
+    extern char *    optarg;
+    extern int       optind;
+    char *           cfile   = (char *)NULL;
+    uint64_t         bufsize = COMMIT_BUFSIZE_DEFAULT;
+    int              check   = 0;
+    int              raw     = 0;
+    int              error   = 0;
+    int              bidx;
+    commit_context_t cc;
+
+    memset(&cc, 0, sizeof(cc));
+    cc.cc_progname = argv[0];
+    cc.cc_fd       = -1;
+    cc.cc_bpc      = COMMIT_BPC_DEFAULT;
+#ifdef HAVE_LIBPTHREAD
+    cc.cc_nsum = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (cc.cc_nsum > COMMIT_MAXSUM)
+        cc.cc_nsum = COMMIT_MAXSUM;
+#endif /* HAVE_LIBPTHREAD */
+
+    /*
+     * Parse options.
+     */
+    while ((option = getopt(argc, argv, "b:c:j:k:v:CR")) != -1) {
+        switch (option) {
+        case 'b':
+            if ((sscanf(optarg, "%" SCNu64, &bufsize) != 1) || !bufsize)
+                error = 1;
+            bufsize *= 1024 * 1024;
+            break;
+        case 'c':
+            cfile = optarg;
+            break;
+        case 'j':
+#ifdef HAVE_LIBPTHREAD
+            if ((sscanf(optarg, "%d", &cc.cc_nsum) != 1) ||
+                (cc.cc_nsum < 0) || (cc.cc_nsum > COMMIT_MAXSUM))
+                error = 1;
+#endif /* HAVE_LIBPTHREAD */
+            break;
+        case 'k':
+            if ((sscanf(optarg, "%" SCNu64, &cc.cc_bpc) != 1) || !cc.cc_bpc ||
+                (cc.cc_bpc > UINT32_MAX))
+                error = 1;
+            break;
+        case 'v':
+            sscanf(optarg, "%d", &cc.cc_verbose);
+            break;
+        case 'C':
+            check = !check;
+            break;
+        case 'R':
+            raw = !raw;
+            break;
+        default:
+            error = 1;
+            break;
+        }
+    }
+
+    if (!error && ((argc - optind) == 2)) {
+        const char *    file   = argv[optind];
+        const char *    target = argv[optind + 1];
+        struct timespec t0, t1;
+
+        /*
+         * The change file is only opened for a writable image; nothing is
+         * written to either.
+         */
+        if (!(error = image_open(file, cfile,
+                                 (cfile) ? SYSDEP_OPEN_RW : SYSDEP_OPEN_RO,
+                                 &posix_dispatch, raw, &cc.cc_image))) {
+            if (check)
+                (void)image_verify_reads(cc.cc_image);
+            if (!(error = image_verify(cc.cc_image))) {
+                cc.cc_blocksize  = image_blocksize(cc.cc_image);
+                cc.cc_blockcount = image_blockcount(cc.cc_image);
+                if (!(error = commit_setup(&cc, file, target, bufsize))) {
+                    clock_gettime(CLOCK_MONOTONIC, &t0);
+                    if (!(error = commit_bitmap(&cc)) &&
+                        !(error = commit_head(&cc, file)))
+                        error = commit_image(&cc);
+                    clock_gettime(CLOCK_MONOTONIC, &t1);
+                    if (!error && (cc.cc_verbose > 0)) {
+                        double secs = (t1.tv_sec - t0.tv_sec) +
+                                      (t1.tv_nsec - t0.tv_nsec) / 1e9;
+                        fprintf(stderr,
+                                "%s: %" PRIu64 " of %" PRIu64
+                                " blocks used, %" PRIu64
+                                " bytes written, %.3f seconds\n",
+                                target, cc.cc_usedblocks, cc.cc_blockcount,
+                                cc.cc_written, secs);
+                    }
+                    if (error) {
+                        fprintf(stderr, "%s: cannot commit: %s\n", target,
+                                strerror(error));
+                        (void)unlink(target);
+                    }
+                } else {
+                    fprintf(stderr, "%s: cannot open: %s\n", target,
+                            strerror(error));
+                }
+            } else {
+                fprintf(stderr, "%s: cannot verify: %s\n", file,
+                        strerror(error));
+            }
+            image_close(cc.cc_image);
+        } else {
+            fprintf(stderr, "%s: cannot open: %s\n", file, strerror(error));
+        }
+        if ((cc.cc_fd >= 0) && (close(cc.cc_fd) < 0) && !error) {
+            error = errno;
+            fprintf(stderr, "%s: cannot close: %s\n", target,
+                    strerror(error));
+        }
+        for (bidx = 0; bidx < COMMIT_NBUFS; bidx++) {
+            free(cc.cc_bufs[bidx].cb_data);
+            free(cc.cc_bufs[bidx].cb_crcs);
+        }
+        free(cc.cc_bitmap);
+    } else {
+        fprintf(stderr,
+                "%s: usage %s [-c cfile] [-b bufmb] [-j threads] "
+                "[-k blocks-per-checksum] [-v verbose] [-CR] image target\n",
+                argv[0], argv[0]);
+        error = 1;
+    }
+
+    return error;
+}
@@ -0,0 +1,520 @@
+/*
+ * imageexport.c - Write out the contents of a filesystem block image.
+ */
+/*
+ * Copyright (c) 2010, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#define _GNU_SOURCE 1 /* For O_DIRECT and fallocate() */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#    include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
+#include "libimage.h"
+#include "sysdep_posix.h"
+#include "sysdep_uring.h"
+
+/*
+ * Default size of each transfer buffer, and the smallest run of unused
+ * blocks which is skipped rather than written out as zeroes.
+ */
+#define EXPORT_BUFSIZE_DEFAULT (8 * 1024 * 1024)
+#define EXPORT_HOLE_MIN        (64 * 1024)
+#define EXPORT_ALIGN           4096
+#define EXPORT_NBUFS           2
+
+/*
+ * Holes are skipped (leaving whatever is in the target), punched out of the
+ * target or written as zeroes.  Holes are always written as zeroes if the
+ * target cannot seek.
+ */
+typedef enum export_hole_mode {
+    EXPORT_HOLE_SKIP  = 0,
+    EXPORT_HOLE_PUNCH = 1,
+    EXPORT_HOLE_ZERO  = 2
+} export_hole_mode_t;
+
+/*
+ * Each buffer holds either a run of blocks to write out or a hole.  Unused
+ * blocks too short to be worth a hole are zeroed in the buffer.
+ */
+typedef struct export_buffer {
+    unsigned char *eb_data;    /* Block data */
+    uint64_t       eb_blockno; /* First block */
+    uint64_t       eb_nblocks; /* Number of blocks */
+    int            eb_hole;    /* Nothing to write */
+    int            eb_error;   /* Reader error */
+    int            eb_last;    /* No more buffers follow */
+} export_buffer_t;
+
+/*
+ * Run context for program.
+ */
+typedef struct export_context {
+    char *             exp_progname;
+    void *             exp_image;
+    int                exp_fd;
+    int                exp_seekable;
+    int                exp_regular;
+    int                exp_verbose;
+    export_hole_mode_t exp_holes;
+    uint64_t           exp_blocksize;
+    uint64_t           exp_blockcount;
+    uint64_t           exp_bufblocks;  /* Blocks per buffer */
+    uint64_t           exp_holeblocks; /* Smallest hole, in blocks */
+    uint64_t           exp_nextblock;  /* Next block for the reader */
+    uint64_t           exp_written;    /* Bytes written */
+    uint64_t           exp_skipped;    /* Bytes in holes */
+    unsigned char *    exp_zeroes;     /* Zero buffer for holes */
+    export_buffer_t    exp_bufs[EXPORT_NBUFS];
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_t exp_mutex;
+    pthread_cond_t  exp_cond;
+    int             exp_filled[EXPORT_NBUFS]; /* Buffer ready for writer */
+    int             exp_abort;                /* Writer has given up */
+#endif /* HAVE_LIBPTHREAD */
+} export_context_t;
+
+/*
+ * Fill the next buffer from the image.
+ *
+ * Used extents are read directly behind one another with large reads, and
+ * short unused extents are zeroed between them.  An unused extent of at
+ * least exp_holeblocks ends the buffer; the following buffer then describes
+ * the whole hole.
+ */
+static void
+export_fill(export_context_t *ecp, export_buffer_t *ebp) {
+    uint64_t blockno = ecp->exp_nextblock;
+    uint64_t filled  = 0;
+    int      error   = 0;
+
+    ebp->eb_blockno = blockno;
+    ebp->eb_hole    = 0;
+    while (!error && (blockno < ecp->exp_blockcount) &&
+           (filled < ecp->exp_bufblocks)) {
+        uint64_t want = ecp->exp_bufblocks - filled;
+        uint64_t nrun;
+        int      used;
+
+        if (want < ecp->exp_holeblocks)
+            want = ecp->exp_holeblocks;
+        if (want > (ecp->exp_blockcount - blockno))
+            want = ecp->exp_blockcount - blockno;
+        if ((used = image_block_extent(ecp->exp_image, blockno, want,
+                                       &nrun)) < 0) {
+            error = EIO;
+            break;
+        }
+        if (!used && (nrun >= ecp->exp_holeblocks)) {
+            /*
+             * A hole.  Finish the data we have first.
+             */
+            if (filled)
+                break;
+            blockno += nrun;
+            while (blockno < ecp->exp_blockcount) {
+                if ((used = image_block_extent(ecp->exp_image, blockno,
+                                               ecp->exp_blockcount - blockno,
+                                               &nrun)) != 0) {
+                    if (used < 0)
+                        error = EIO;
+                    break;
+                }
+                blockno += nrun;
+            }
+            ebp->eb_hole = 1;
+            filled       = blockno - ebp->eb_blockno;
+            break;
+        }
+        if (nrun > (ecp->exp_bufblocks - filled))
+            nrun = ecp->exp_bufblocks - filled;
+        if (used)
+            error = image_readblocks_at(ecp->exp_image, blockno,
+                                        &ebp->eb_data[filled *
+                                                      ecp->exp_blocksize],
+                                        nrun);
+        else
+            memset(&ebp->eb_data[filled * ecp->exp_blocksize], 0,
+                   nrun * ecp->exp_blocksize);
+        filled += nrun;
+        blockno += nrun;
+    }
+    ebp->eb_nblocks    = filled;
+    ebp->eb_error      = error;
+    ebp->eb_last       = error || (blockno >= ecp->exp_blockcount);
+    ecp->exp_nextblock = blockno;
+}
+
+/*
+ * Write "len" bytes at "offset" in the target, or at the current position
+ * if the target cannot seek.
+ */
+static int
+export_write(export_context_t *ecp, const unsigned char *buf, uint64_t len,
+             uint64_t offset) {
+    while (len) {
+        ssize_t nwritten = (ecp->exp_seekable)
+                               ? pwrite(ecp->exp_fd, buf, len, offset)
+                               : write(ecp->exp_fd, buf, len);
+
+        if (nwritten < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (nwritten == 0)
+            return EIO;
+        buf += nwritten;
+        len -= nwritten;
+        offset += nwritten;
+    }
+    return 0;
+}
+
+/*
+ * Dispose of a hole in the target.
+ */
+static int
+export_hole(export_context_t *ecp, uint64_t offset, uint64_t len) {
+    int error = 0;
+
+    ecp->exp_skipped += len;
+    if (ecp->exp_seekable && (ecp->exp_holes == EXPORT_HOLE_SKIP))
+        return 0;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (ecp->exp_seekable && (ecp->exp_holes == EXPORT_HOLE_PUNCH)) {
+        if (fallocate(ecp->exp_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      offset, len) == 0)
+            return 0;
+        if ((errno != EOPNOTSUPP) && (errno != ENOSYS))
+            return errno;
+        /*
+         * Not supported by the target - write zeroes instead.
+         */
+    }
+#endif /* FALLOC_FL_PUNCH_HOLE */
+    while (!error && len) {
+        uint64_t n = (len < (ecp->exp_bufblocks * ecp->exp_blocksize))
+                         ? len
+                         : ecp->exp_bufblocks * ecp->exp_blocksize;
+
+        error = export_write(ecp, ecp->exp_zeroes, n, offset);
+        offset += n;
+        len -= n;
+    }
+    return error;
+}
+
+/*
+ * Write out one filled buffer.
+ */
+static int
+export_drain(export_context_t *ecp, export_buffer_t *ebp) {
+    uint64_t offset = ebp->eb_blockno * ecp->exp_blocksize;
+    uint64_t len    = ebp->eb_nblocks * ecp->exp_blocksize;
+    int      error;
+
+    if ((error = ebp->eb_error) == 0) {
+        if (ebp->eb_hole) {
+            error = export_hole(ecp, offset, len);
+        } else if ((error = export_write(ecp, ebp->eb_data, len, offset)) ==
+                   0) {
+            ecp->exp_written += len;
+        }
+    }
+    return error;
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * The reader thread keeps filling buffers ahead of the writer.
+ */
+static void *
+export_reader(void *arg) {
+    export_context_t *ecp = (export_context_t *)arg;
+    int               bidx;
+    int               done = 0;
+
+    for (bidx = 0; !done; bidx = (bidx + 1) % EXPORT_NBUFS) {
+        pthread_mutex_lock(&ecp->exp_mutex);
+        while (ecp->exp_filled[bidx] && !ecp->exp_abort)
+            pthread_cond_wait(&ecp->exp_cond, &ecp->exp_mutex);
+        done = ecp->exp_abort;
+        pthread_mutex_unlock(&ecp->exp_mutex);
+        if (done)
+            break;
+
+        export_fill(ecp, &ecp->exp_bufs[bidx]);
+        done = ecp->exp_bufs[bidx].eb_last;
+
+        pthread_mutex_lock(&ecp->exp_mutex);
+        ecp->exp_filled[bidx] = 1;
+        pthread_cond_broadcast(&ecp->exp_cond);
+        pthread_mutex_unlock(&ecp->exp_mutex);
+    }
+    return (void *)NULL;
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/*
+ * Copy the image to the target.  With threads, the reader fills one buffer
+ * while the writer drains the other.
+ */
+static int
+export_image(export_context_t *ecp) {
+    int error = 0;
+    int bidx;
+    int done = 0;
+#ifdef HAVE_LIBPTHREAD
+    pthread_t reader;
+
+    pthread_mutex_init(&ecp->exp_mutex, (pthread_mutexattr_t *)NULL);
+    pthread_cond_init(&ecp->exp_cond, (pthread_condattr_t *)NULL);
+    if ((error = pthread_create(&reader, (pthread_attr_t *)NULL,
+                                export_reader, ecp)) != 0) {
+        pthread_cond_destroy(&ecp->exp_cond);
+        pthread_mutex_destroy(&ecp->exp_mutex);
+        return error;
+    }
+    for (bidx = 0; !done; bidx = (bidx + 1) % EXPORT_NBUFS) {
+        pthread_mutex_lock(&ecp->exp_mutex);
+        while (!ecp->exp_filled[bidx])
+            pthread_cond_wait(&ecp->exp_cond, &ecp->exp_mutex);
+        pthread_mutex_unlock(&ecp->exp_mutex);
+
+        error = export_drain(ecp, &ecp->exp_bufs[bidx]);
+        done  = error || ecp->exp_bufs[bidx].eb_last;
+
+        pthread_mutex_lock(&ecp->exp_mutex);
+        ecp->exp_filled[bidx] = 0;
+        if (error)
+            ecp->exp_abort = 1;
+        pthread_cond_broadcast(&ecp->exp_cond);
+        pthread_mutex_unlock(&ecp->exp_mutex);
+    }
+    pthread_join(reader, (void **)NULL);
+    pthread_cond_destroy(&ecp->exp_cond);
+    pthread_mutex_destroy(&ecp->exp_mutex);
+#else  /* HAVE_LIBPTHREAD */
+    for (bidx = 0; !done; bidx = (bidx + 1) % EXPORT_NBUFS) {
+        export_fill(ecp, &ecp->exp_bufs[bidx]);
+        error = export_drain(ecp, &ecp->exp_bufs[bidx]);
+        done  = error || ecp->exp_bufs[bidx].eb_last;
+    }
+#endif /* HAVE_LIBPTHREAD */
+
+    /*
+     * A regular file gets its full size even if it ends with a hole.
+     */
+    if (!error && ecp->exp_regular &&
+        (ftruncate(ecp->exp_fd, ecp->exp_blocksize * ecp->exp_blockcount) <
+         0))
+        error = errno;
+    return error;
+}
+
+/*
+ * Open the target and size the buffers.
+ */
+static int
+export_setup(export_context_t *ecp, const char *target, uint64_t bufsize,
+             int direct) {
+    int         error = 0;
+    int         bidx;
+    struct stat sbuf;
+
+    if (strcmp(target, "-") == 0) {
+        ecp->exp_fd = STDOUT_FILENO;
+    } else {
+        int flags = O_WRONLY | O_CREAT;
+#ifdef O_DIRECT
+        if (direct)
+            flags |= O_DIRECT;
+#else  /* O_DIRECT */
+        if (direct)
+            return ENOTSUP;
+#endif /* O_DIRECT */
+        if ((ecp->exp_fd = open(target, flags, 0640)) < 0)
+            return errno;
+    }
+    if (fstat(ecp->exp_fd, &sbuf) < 0)
+        return errno;
+    ecp->exp_regular  = S_ISREG(sbuf.st_mode);
+    ecp->exp_seekable = ecp->exp_regular || S_ISBLK(sbuf.st_mode);
+    /*
+     * Skipped holes in a regular file must read back as zeroes.
+     */
+    if (ecp->exp_regular && (ftruncate(ecp->exp_fd, 0) < 0))
+        return errno;
+
+    ecp->exp_bufblocks = bufsize / ecp->exp_blocksize;
+    if (!ecp->exp_bufblocks)
+        ecp->exp_bufblocks = 1;
+    ecp->exp_holeblocks = EXPORT_HOLE_MIN / ecp->exp_blocksize;
+    if (!ecp->exp_holeblocks)
+        ecp->exp_holeblocks = 1;
+    bufsize = ecp->exp_bufblocks * ecp->exp_blocksize;
+    for (bidx = 0; !error && (bidx < EXPORT_NBUFS); bidx++)
+        error = posix_memalign((void **)&ecp->exp_bufs[bidx].eb_data,
+                               EXPORT_ALIGN, bufsize);
+    if (!error &&
+        !(error = posix_memalign((void **)&ecp->exp_zeroes, EXPORT_ALIGN,
+                                 bufsize)))
+        memset(ecp->exp_zeroes, 0, bufsize);
+    return error;
+}
+
+int
+main(int argc, char *argv[]) {
+    int                      option;
+    extern char *            optarg;
+    extern int               optind;
+    char *                   cfile   = (char *)NULL;
+    uint64_t                 bufsize = EXPORT_BUFSIZE_DEFAULT;
+    int                      direct  = 0;
+    int                      raw     = 0;
+    int                      uring   = 0;
+    int                      error   = 0;
+    const sysdep_dispatch_t *sysdep  = &posix_dispatch;
+    int                      bidx;
+    export_context_t         ec;
+
+    memset(&ec, 0, sizeof(ec));
+    ec.exp_progname = argv[0];
+    ec.exp_fd       = -1;
+
+    /*
+     * Parse options.
+     */
+    while ((option = getopt(argc, argv, "b:c:v:opuzR")) != -1) {
+        switch (option) {
+        case 'b':
+            if ((sscanf(optarg, "%" SCNu64, &bufsize) != 1) || !bufsize)
+                error = 1;
+            bufsize *= 1024 * 1024;
+            break;
+        case 'c':
+            cfile = optarg;
+            break;
+        case 'v':
+            sscanf(optarg, "%d", &ec.exp_verbose);
+            break;
+        case 'o':
+            direct = 1;
+            break;
+        case 'p':
+            ec.exp_holes = EXPORT_HOLE_PUNCH;
+            break;
+        case 'u':
+            uring = !uring;
+            break;
+        case 'z':
+            ec.exp_holes = EXPORT_HOLE_ZERO;
+            break;
+        case 'R':
+            raw = !raw;
+            break;
+        default:
+            error = 1;
+            break;
+        }
+    }
+
+    if (!error && ((argc - optind) == 2)) {
+        const char *    file   = argv[optind];
+        const char *    target = argv[optind + 1];
+        struct timespec t0, t1;
+
+        /*
+         * Use io_uring for image I/O (if specified and available).
+         */
+        if (uring && (error = sysdep_uring_init(&sysdep))) {
+            fprintf(stderr, "%s: io_uring not available: %s\n", argv[0],
+                    strerror(error));
+            error = 0;
+        }
+        /*
+         * The change file is only opened for a writable image; nothing is
+         * written to either.
+         */
+        if (!(error = image_open(file, cfile,
+                                 (cfile) ? SYSDEP_OPEN_RW : SYSDEP_OPEN_RO,
+                                 sysdep, raw, &ec.exp_image))) {
+            if (!(error = image_verify(ec.exp_image))) {
+                ec.exp_blocksize  = image_blocksize(ec.exp_image);
+                ec.exp_blockcount = image_blockcount(ec.exp_image);
+                if (!(error = export_setup(&ec, target, bufsize, direct))) {
+                    if (sysdep != &posix_dispatch) {
+                        for (bidx = 0; bidx < EXPORT_NBUFS; bidx++)
+                            (void)sysdep_uring_register_buffer(
+                                ec.exp_bufs[bidx].eb_data,
+                                ec.exp_bufblocks * ec.exp_blocksize);
+                    }
+                    clock_gettime(CLOCK_MONOTONIC, &t0);
+                    error = export_image(&ec);
+                    clock_gettime(CLOCK_MONOTONIC, &t1);
+                    if (!error && (ec.exp_verbose > 0)) {
+                        double secs = (t1.tv_sec - t0.tv_sec) +
+                                      (t1.tv_nsec - t0.tv_nsec) / 1e9;
+                        fprintf(stderr,
+                                "%s: %" PRIu64 " bytes written, %" PRIu64
+                                " bytes in holes, %.3f seconds\n",
+                                target, ec.exp_written, ec.exp_skipped, secs);
+                    }
+                    if (error)
+                        fprintf(stderr, "%s: cannot export: %s\n", target,
+                                strerror(error));
+                } else {
+                    fprintf(stderr, "%s: cannot open: %s\n", target,
+                            strerror(error));
+                }
+            } else {
+                fprintf(stderr, "%s: cannot verify: %s\n", file,
+                        strerror(error));
+            }
+            image_close(ec.exp_image);
+        } else {
+            fprintf(stderr, "%s: cannot open: %s\n", file, strerror(error));
+        }
+        if ((ec.exp_fd >= 0) && (ec.exp_fd != STDOUT_FILENO) &&
+            (close(ec.exp_fd) < 0) && !error) {
+            error = errno;
+            fprintf(stderr, "%s: cannot close: %s\n", target,
+                    strerror(error));
+        }
+        if (sysdep != &posix_dispatch) {
+            for (bidx = 0; bidx < EXPORT_NBUFS; bidx++)
+                (void)sysdep_uring_unregister_buffer(ec.exp_bufs[bidx].eb_data);
+            sysdep_uring_finish();
+        }
+        for (bidx = 0; bidx < EXPORT_NBUFS; bidx++)
+            free(ec.exp_bufs[bidx].eb_data);
+        free(ec.exp_zeroes);
+    } else {
+        fprintf(stderr,
+                "%s: usage %s [-c cfile] [-b bufmb] [-v verbose] [-opuzR] "
+                "image target\n",
+                argv[0], argv[0]);
+        error = 1;
+    }
+
+    return error;
+}
@@ -18,7 +18,10 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
-#include <linux/nbd.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -26,24 +29,62 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <syslog.h>
 #include <unistd.h>
 #ifdef HAVE_SYS_CAPABILITY_H
 #    include <sys/capability.h>
 #endif /* HAVE_SYS_CAPABILITY_H */
+#ifdef HAVE_LIBPTHREAD
+#    include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
 #include "libimage.h"
+#include "libstats.h"
+#include "nbdproto.h"
+#include "sysdep_pool.h"
 #include "sysdep_posix.h"
+#include "sysdep_uring.h"
 
 #ifndef RUNDIR
 #    define RUNDIR "/var/run"
 #endif /* RUNDIR */
 
 /*
- * Initial size of the read buffer.  Grows to larger values as required.
+ * Smallest request buffer.  Buffers come from a pool set up when serving
+ * starts, in sizes doubling from this up to the largest request.
  */
-#define READBUF_INITIAL 8192
+#define NBD_MIN_BUFFER (64 * 1024)
+/*
+ * Most segments a read reply is sent from without copying, and most pieces
+ * of a reply handed to one writev().
+ */
+#define NBD_MAX_SEGS 32
+#define NBD_MAX_IOV  16
+/*
+ * Largest request we'll take, and largest option during negotiation.
+ */
+#define NBD_MAX_REQUEST (32 * 1024 * 1024)
+#define NBD_MAX_OPTION  4096
+/*
+ * Most extents in a block status reply, and the id of the one metadata
+ * context we have.
+ */
+#define NBD_MAX_EXTENTS        1024
+#define NBD_META_ID_ALLOCATION 1
+/*
+ * Block sizes we'll give NBD, and the default largest.  A request is at
+ * most NBD_MAX_RANGES ranges to write: parts of blocks at either end, and
+ * the whole blocks in between.
+ */
+#define NBD_MIN_BLOCKSIZE 512
+#define NBD_DEF_BLOCKSIZE 4096
+#define NBD_MAX_BLOCKSIZE (64 * 1024)
+#define NBD_MAX_RANGES    3
 /*
  * NTOHLL - ntohl for 64 bit values.
  */
@@ -58,27 +99,46 @@ static const cap_value_t required_capabilities[] = {
 };
 #endif /* HAVE_SYS_CAPABILITY_H */
 
+/*
+ * Lazy loading modes (-L).
+ */
+#define SVC_LAZY_FAST   1 /* Serve while loading the bitmap */
+#define SVC_LAZY_STRICT 2 /* ...waiting for it all to be checked */
+
 /*
  * Run context for program.
  */
 typedef struct nbd_context {
-    char *   svc_progname;
-    char *   svc_mount;
-    char *   svc_mtype;
-    char *   nbd_dev;
-    int      nbd_fh;
-    int      nbd_timeout;
-    int      svc_fh;
-    int      svc_verbose;
-    int      svc_daemon_mode;
-    int      svc_rdonly;
-    int      svc_tolerant;
-    int      svc_raw_available;
-    uint64_t svc_blocksize;
-    uint64_t svc_blockcount;
-    uint64_t svc_offsetmask;
-    uint64_t svc_blockmask;
-    pid_t    svc_toreap;
+    char *         svc_progname;
+    char *         svc_mount;
+    char *         svc_mtype;
+    char *         nbd_dev;
+    char *         svc_listen;
+    char *         svc_export;
+    char *         svc_statsfile;
+    int            nbd_fh;
+    int            nbd_timeout;
+    int            svc_fh;
+    int            svc_verbose;
+    int            svc_daemon_mode;
+    int            svc_rdonly;
+    int            svc_tolerant;
+    int            svc_verify_reads;
+    int            svc_lazy;
+    int            svc_raw_available;
+    int            svc_nworkers;
+    int            svc_structured;
+    int            svc_allocation;
+    int            svc_statsinterval;
+    uint64_t       svc_cachesize;
+    uint64_t       svc_readahead;
+    uint64_t       svc_blocksize;
+    uint64_t       svc_blockcount;
+    uint64_t       svc_offsetmask;
+    uint64_t       svc_blockmask;
+    uint64_t       svc_nbdblocksize;
+    pid_t          svc_toreap;
+    sysdep_pool_t *svc_bufpool;
 } nbd_context_t;
 
 /*
@@ -131,7 +191,8 @@ my_strrchr(const char *s, char c) {
 static inline void
 create_pid_file(nbd_context_t *ncp, pid_t cpid, char **pidfilenamep) {
     const char *pbasename = my_strrchr(ncp->svc_progname, '/');
-    const char *dbasename = my_strrchr(ncp->nbd_dev, '/');
+    const char *dbasename =
+        my_strrchr((ncp->nbd_dev) ? ncp->nbd_dev : ncp->svc_listen, '/');
     size_t pfnamelen = strlen(pbasename) + strlen(dbasename) + strlen(RUNDIR) +
                        strlen(pidfiletrailer) + 4;
     if ((*pidfilenamep = (char *)malloc(pfnamelen))) {
@@ -168,6 +229,46 @@ nbdev_open(nbd_context_t *ncp) {
     return error;
 }
 
+/*
+ * Find the image geometry, and the block size to give NBD.  That's the
+ * image's block size, up to NBD_DEF_BLOCKSIZE, unless another is asked
+ * for: the kernel takes no more than a page, and some file systems, as
+ * FAT, need it no larger than their sectors.  Requests needn't be whole
+ * image blocks, as parts of blocks are written as they are.  It's made
+ * smaller if need be to divide the size of the image.
+ */
+static void
+nbd_geometry(nbd_context_t *ncp, void *pctx) {
+    uint64_t size;
+
+    ncp->svc_blocksize  = image_blocksize(pctx);
+    ncp->svc_blockcount = image_blockcount(pctx);
+    ncp->svc_offsetmask = ncp->svc_blocksize - 1;
+    ncp->svc_blockmask  = ~ncp->svc_offsetmask;
+    size                = ncp->svc_blockcount * ncp->svc_blocksize;
+    if (!ncp->svc_nbdblocksize) {
+        ncp->svc_nbdblocksize = NBD_DEF_BLOCKSIZE;
+        while ((ncp->svc_nbdblocksize > ncp->svc_blocksize) &&
+               (ncp->svc_nbdblocksize > NBD_MIN_BLOCKSIZE))
+            ncp->svc_nbdblocksize >>= 1;
+    }
+    while ((size % ncp->svc_nbdblocksize) &&
+           (ncp->svc_nbdblocksize > NBD_MIN_BLOCKSIZE))
+        ncp->svc_nbdblocksize >>= 1;
+}
+
+/*
+ * The transmission flags for our export.  Read-only exports can be used
+ * over several connections at once: there's nothing to keep coherent.
+ */
+static uint16_t
+nbd_export_flags(nbd_context_t *ncp) {
+    return NBD_FLAG_HAS_FLAGS |
+           ((ncp->svc_rdonly) ? (NBD_FLAG_READ_ONLY | NBD_FLAG_CAN_MULTI_CONN)
+                              : (NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_TRIM |
+                                 NBD_FLAG_SEND_WRITE_ZEROES));
+}
+
 /*
  * Connect the nbd device.
  */
@@ -182,10 +283,7 @@ nbd_connect(nbd_context_t *ncp, void *pctx) {
                 /*
                  * setup the nbd connection.
                  */
-                ncp->svc_blocksize  = image_blocksize(pctx);
-                ncp->svc_blockcount = image_blockcount(pctx);
-                ncp->svc_offsetmask = ncp->svc_blocksize - 1;
-                ncp->svc_blockmask  = ~ncp->svc_offsetmask;
+                nbd_geometry(ncp, pctx);
                 /*
                  * if requested, set NBD connection timeout - avoid slow NBD
                  * server disconnect
@@ -201,12 +299,24 @@ nbd_connect(nbd_context_t *ncp, void *pctx) {
                     }
                     logmsg(ncp, 1, "NBD_TIMEOUT %d\n", ncp->nbd_timeout);
                 }
+                /*
+                 * Tell the kernel what we can do, so that it sends trims
+                 * and flushes.  Older kernels manage without.
+                 */
+                if (ioctl(ncp->nbd_fh, NBD_SET_FLAGS, nbd_export_flags(ncp)) ==
+                    -1) {
+                    logmsg(ncp, 2,
+                           "nbd_connect: ioctl NBD_SET_FLAGS fail with %d "
+                           "(%s)\n",
+                           errno, strerror(errno));
+                }
                 if ((ioctl(ncp->nbd_fh, NBD_CLEAR_SOCK) == -1) ||
                     (ioctl(ncp->nbd_fh, NBD_SET_SOCK, spair[0]) == -1) ||
-                    (ioctl(ncp->nbd_fh, NBD_SET_BLKSIZE, ncp->svc_blocksize) ==
-                     -1) ||
+                    (ioctl(ncp->nbd_fh, NBD_SET_BLKSIZE,
+                           ncp->svc_nbdblocksize) == -1) ||
                     (ioctl(ncp->nbd_fh, NBD_SET_SIZE_BLOCKS,
-                           ncp->svc_blockcount) == -1)) {
+                           (ncp->svc_blockcount * ncp->svc_blocksize) /
+                               ncp->svc_nbdblocksize) == -1)) {
                     error = errno;
                     logmsg(ncp, 2,
                            "nbd_connect: ioctl chain fail with %d (%s)\n",
@@ -302,403 +412,2157 @@ nbd_reapchild(int sig, siginfo_t *si, void *vp) {
 }
 
 /*
- * Handle NBD resquest
- *
- * The main work processing loop.  This is very
- * serial and very unrobust.
+ * Per-request state.
  */
-static int
-nbd_service_requests(nbd_context_t *ncp, void *pctx) {
-    char *           readbuf      = (char *)malloc(READBUF_INITIAL);
-    char *           pidfile      = (char *)NULL;
-    size_t           readbuf_size = READBUF_INITIAL;
-    int              error        = 0;
-    volatile int     timetoleave  = 0;
-    volatile int     someonedied  = 0;
-    volatile pid_t   whodied      = 0;
-    struct sigaction newsig, oldsig;
+typedef struct nbd_job {
+    struct nbd_request nj_request;    /* Request from the kernel */
+    uint32_t           nj_type;       /* Request type */
+    uint32_t           nj_flags;      /* Command flags */
+    off_t              nj_offset;     /* Byte offset of request */
+    size_t             nj_length;     /* Byte length of request */
+    uint64_t           nj_sboffs;     /* Offset into first block */
+    uint64_t           nj_eboffs;     /* Offset into last block */
+    uint64_t           nj_startblock; /* First block */
+    uint64_t           nj_blockcount; /* Number of blocks */
+    char *             nj_buf;        /* I/O buffer, from the pool */
+    char *             nj_edge;       /* A block of zeroes */
+    image_segment_t    nj_segs[NBD_MAX_SEGS]; /* Where read data lives */
+    uint32_t           nj_nsegs;      /* Segments, if read wasn't copied */
+    uint32_t           nj_nextents;   /* Block status extents in buffer */
+    int                nj_error;      /* Result */
+    int                nj_busy;       /* Dispatched and not complete */
+    struct nbd_job *   nj_next;       /* Queue linkage */
+} nbd_job_t;
 
-    /*
-     * Prepare termination signal handlers.
-     */
-    finishflag = (int *)&timetoleave;
-    memset(&newsig, 0, sizeof(newsig));
-    newsig.sa_sigaction = nbd_finish;
-    sigaction(SIGINT, &newsig, &oldsig);
-    sigaction(SIGHUP, &newsig, &oldsig);
-    sigaction(SIGTERM, &newsig, &oldsig);
-    sigaction(SIGQUIT, &newsig, &oldsig);
+/*
+ * Calculate the start/end blocks of a request.
+ */
+static void
+nbd_job_setup(nbd_context_t *ncp, nbd_job_t *jp, struct nbd_request *rqp) {
+    uint64_t startblockoffs, endblockoffs;
+
+    jp->nj_request = *rqp;
+    jp->nj_type    = ntohl(rqp->type) & 0xffff;
+    jp->nj_flags   = ntohl(rqp->type) >> 16;
+    jp->nj_offset  = NTOHLL(rqp->from);
+    jp->nj_length  = ntohl(rqp->len);
+    jp->nj_error    = 0;
+    jp->nj_nsegs    = 0;
+    jp->nj_nextents = 0;
+    startblockoffs = jp->nj_offset & ncp->svc_blockmask;
+    jp->nj_sboffs  = jp->nj_offset & ncp->svc_offsetmask;
+    endblockoffs = (jp->nj_offset + jp->nj_length - 1) & ncp->svc_blockmask;
+    jp->nj_eboffs = (jp->nj_offset + jp->nj_length - 1) & ncp->svc_offsetmask;
+    jp->nj_startblock = startblockoffs / ncp->svc_blocksize;
+    jp->nj_blockcount = (endblockoffs - startblockoffs) / ncp->svc_blocksize;
 
     /*
-     * Make sure we have a read buffer.
+     * Adjust block count.
      */
-    if (!readbuf) {
-        timetoleave = 3;
-        error       = ENOMEM;
+    if (jp->nj_length)
+        jp->nj_blockcount++;
+}
+
+/*
+ * The number of jobs which can be outstanding at once: one without
+ * workers, and enough to keep them busy with.
+ */
+static inline uint32_t
+nbd_njobs(nbd_context_t *ncp) {
+    return (ncp->svc_nworkers) ? 2 * ncp->svc_nworkers : 1;
+}
+
+/*
+ * Set up the request buffers, enough for every job at once until they get
+ * large.  The largest holds the largest request, including the partial
+ * blocks on either end.
+ */
+static int
+nbd_bufpool_create(nbd_context_t *ncp) {
+    uint64_t minsize = NBD_MIN_BUFFER;
+    int      error;
+
+    if (ncp->svc_blocksize > minsize)
+        minsize = ncp->svc_blocksize;
+    if ((error = sysdep_pool_create(minsize,
+                                    NBD_MAX_REQUEST + (2 * ncp->svc_blocksize),
+                                    nbd_njobs(ncp), &ncp->svc_bufpool)))
+        logmsg(ncp, -1, "%s: cannot set up request buffers: %s\n",
+               ncp->svc_progname, strerror(error));
+
+    return error;
+}
+
+static void
+nbd_bufpool_destroy(nbd_context_t *ncp) {
+    sysdep_pool_destroy(ncp->svc_bufpool);
+    ncp->svc_bufpool = (sysdep_pool_t *)NULL;
+}
+
+/*
+ * Get a buffer large enough for the request, waiting if they're all in
+ * use.
+ */
+static int
+nbd_job_buffer(nbd_context_t *ncp, nbd_job_t *jp) {
+    int      error       = 0;
+    uint64_t req_readbuf = 0;
+
+    switch (jp->nj_type) {
+    case NBD_CMD_READ:
+    case NBD_CMD_WRITE:
+        req_readbuf = jp->nj_blockcount * ncp->svc_blocksize;
+        break;
+    case NBD_CMD_BLOCK_STATUS:
+        req_readbuf = NBD_MAX_EXTENTS * sizeof(struct nbd_block_descriptor);
+        break;
     }
 
-    /*
-     * If we're setting up a mount, then for a child to do the mount and
-     * prepare the signal handler to be notified when the child completes.
-     */
-    if (ncp->svc_mount) {
-        pid_t cpid;
+    if (!jp->nj_edge &&
+        !(jp->nj_edge = (char *)calloc(1, ncp->svc_blocksize)))
+        error = ENOMEM;
+    if (!error && req_readbuf)
+        error = sysdep_pool_get(ncp->svc_bufpool, req_readbuf,
+                                (void **)&jp->nj_buf);
 
-        newsig.sa_sigaction = nbd_reapchild;
-        newsig.sa_flags     = SA_RESETHAND | SA_SIGINFO;
-        diedp               = (int *)&someonedied;
-        toreapp             = (pid_t *)&whodied;
-        sigaction(SIGCHLD, &newsig, &oldsig);
-        switch ((cpid = fork())) {
-        case 0:
-            exit(mount(ncp->nbd_dev, ncp->svc_mount,
-                       (ncp->svc_mtype) ? ncp->svc_mtype : "ext2",
-                       (ncp->svc_rdonly) ? MS_RDONLY : 0, ""));
-            break;
-        case -1:
+    return error;
+}
+
+/*
+ * Give back the job's buffer once the reply is sent.
+ */
+static void
+nbd_job_release(nbd_context_t *ncp, nbd_job_t *jp) {
+    if (jp->nj_buf) {
+        sysdep_pool_put(ncp->svc_bufpool, jp->nj_buf);
+        jp->nj_buf = (char *)NULL;
+    }
+}
+
+/*
+ * Read the data for a write request into place in the job's buffer.
+ */
+static int
+nbd_job_payload(nbd_context_t *ncp, nbd_job_t *jp,
+                volatile int *timetoleavep) {
+    int     error  = 0;
+    char *  rembp  = jp->nj_buf + jp->nj_sboffs;
+    size_t  remlen = jp->nj_length;
+    ssize_t rlength;
+
+    while (!error && remlen) {
+        /*
+         * Retry the read if we're interrupted but not if it's time to leave.
+         */
+        while (((rlength = read(ncp->svc_fh, rembp, remlen)) == -1) &&
+               (errno == EINTR) && (!*timetoleavep))
+            ;
+        if (rlength > 0) {
+            remlen -= rlength;
+            rembp += rlength;
+        } else if (rlength == 0) {
+            logmsg(ncp, 1, "NBD_WRITE fail: short read of data\n");
+            error = EIO;
+        } else {
             error = errno;
-            logmsg(ncp, -1, "%s: cannot fork to mount: %s\n", ncp->svc_progname,
+            logmsg(ncp, 1, "NBD_WRITE fail: read fail %d (%s)\n", error,
                    strerror(error));
-            /*
-             * We ignore this failure.  Someone else can try the mount.
-             */
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Check that a request is one we can carry out.  The kernel only sends
+ * sensible requests, but network clients needn't.
+ */
+static int
+nbd_job_check(nbd_context_t *ncp, nbd_job_t *jp) {
+    uint64_t size = ncp->svc_blockcount * ncp->svc_blocksize;
+
+    switch (jp->nj_type) {
+    case NBD_CMD_WRITE:
+    case NBD_CMD_TRIM:
+    case NBD_CMD_WRITE_ZEROES:
+        if (ncp->svc_rdonly)
+            return EPERM;
+        /* FALLTHROUGH */
+    case NBD_CMD_READ:
+        return ((jp->nj_offset < 0) || ((uint64_t)jp->nj_offset > size) ||
+                (jp->nj_length > (size - jp->nj_offset)))
+                   ? EINVAL
+                   : 0;
+    case NBD_CMD_BLOCK_STATUS:
+        return (!ncp->svc_allocation || !jp->nj_length ||
+                (jp->nj_offset < 0) || ((uint64_t)jp->nj_offset >= size))
+                   ? EINVAL
+                   : 0;
+    case NBD_CMD_FLUSH:
+        return 0;
+    default:
+        return EINVAL;
+    }
+}
+
+/*
+ * Find where the data for a read lives, trimmed to the bytes requested, so
+ * that it can be sent without being copied through the job's buffer.
+ */
+static int
+nbd_job_map(nbd_context_t *ncp, void *pctx, nbd_job_t *jp) {
+    uint32_t nsegs = NBD_MAX_SEGS;
+    int      error;
+
+    if ((error = image_block_map(pctx, jp->nj_startblock, jp->nj_blockcount,
+                                 jp->nj_segs, &nsegs)) == 0) {
+        uint64_t skip = jp->nj_sboffs;
+        uint64_t left = jp->nj_length;
+        uint32_t sidx;
+
+        for (sidx = 0; (sidx < nsegs) && left; sidx++) {
+            image_segment_t *sp = &jp->nj_segs[sidx];
+
+            if (skip >= sp->is_length) {
+                skip -= sp->is_length;
+                continue;
+            }
+            sp->is_offset += skip;
+            sp->is_length -= skip;
+            skip = 0;
+            if (sp->is_length > left)
+                sp->is_length = left;
+            left -= sp->is_length;
+            jp->nj_segs[jp->nj_nsegs++] = *sp;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Describe the allocation of the blocks of a block status request, as
+ * extents in the job's buffer.  Used blocks, including those in the change
+ * file, are allocated.  The rest are holes, and if the image says they
+ * read as zeroes, zero too.  The extents cover as much of the request as
+ * they can, clipped to it and the end of the image.
+ */
+static int
+nbd_job_extents(nbd_context_t *ncp, void *pctx, nbd_job_t *jp) {
+    struct nbd_block_descriptor *bdp =
+        (struct nbd_block_descriptor *)jp->nj_buf;
+    uint32_t maxext =
+        (jp->nj_flags & NBD_CMD_FLAG_REQ_ONE) ? 1 : NBD_MAX_EXTENTS;
+    uint64_t blockno  = jp->nj_startblock;
+    uint64_t endblock = jp->nj_startblock + jp->nj_blockcount;
+    uint64_t start    = jp->nj_offset;
+    uint64_t end      = jp->nj_offset + jp->nj_length;
+    int      error    = 0;
+
+    if (endblock > ncp->svc_blockcount)
+        endblock = ncp->svc_blockcount;
+    if (end > (ncp->svc_blockcount * ncp->svc_blocksize))
+        end = ncp->svc_blockcount * ncp->svc_blocksize;
+    while (!error && (blockno < endblock)) {
+        uint64_t nblocks, eend;
+        uint32_t status = 0;
+        int      used   = image_block_extent(pctx, blockno, endblock - blockno,
+                                             &nblocks);
+
+        if ((used == BLOCK_ERROR) || !nblocks) {
+            error = EIO;
             break;
-        default:
-            ncp->svc_toreap = cpid;
+        }
+        if (!used) {
+            image_segment_t seg;
+            uint32_t        nsegs = 1;
+
+            status = NBD_STATE_HOLE;
+            if (!image_block_map(pctx, blockno, nblocks, &seg, &nsegs) &&
+                (seg.is_type == IMAGE_SEG_ZERO))
+                status |= NBD_STATE_ZERO;
+        }
+        blockno += nblocks;
+        eend = blockno * ncp->svc_blocksize;
+        if (eend > end)
+            eend = end;
+        if (jp->nj_nextents &&
+            (ntohl(bdp[jp->nj_nextents - 1].status) == status)) {
+            bdp[jp->nj_nextents - 1].length =
+                htonl(ntohl(bdp[jp->nj_nextents - 1].length) + (eend - start));
+        } else if (jp->nj_nextents < maxext) {
+            bdp[jp->nj_nextents].length = htonl(eend - start);
+            bdp[jp->nj_nextents].status = htonl(status);
+            jp->nj_nextents++;
+        } else {
             break;
         }
+        start = eend;
     }
 
-    /*
-     * create pid file
-     */
-    create_pid_file(ncp, getpid(), &pidfile);
+    return error;
+}
 
-    if (ncp->svc_mount) {
-        logmsg(ncp, 0, "Mount \"%s\" is ready.\n", ncp->svc_mount);
-        logmsg(ncp, 0,
-               "When finished with the imagemount, run `umount %s` then "
-               "`nbd-client -d %s to cleanup.\n",
-               ncp->svc_mount, ncp->nbd_dev);
-    } else if (ncp->nbd_dev) {
-        logmsg(ncp, 0, "Device \"%s\" is now ready for further operations.\n",
-               ncp->nbd_dev);
-        logmsg(ncp, 0,
-               "When finished with the imagemount, run `nbd-client -d %s` to "
-               "disconnect from the NBD server.\n",
-               ncp->nbd_dev);
+/*
+ * Set once anything has been written.  Until then there's nothing to flush.
+ */
+static int nbd_written = 0;
+
+/*
+ * Split the bytes of a request into ranges for image_writeranges(): the
+ * parts of blocks at either end, and the whole blocks in between.  "buf"
+ * holds the request's blocks, with its bytes from nj_sboffs on.  Returns
+ * the number of ranges.
+ */
+static uint32_t
+nbd_job_ranges(nbd_context_t *ncp, nbd_job_t *jp, char *buf,
+               image_range_t *ranges) {
+    uint64_t first  = jp->nj_startblock;
+    uint64_t last   = jp->nj_startblock + jp->nj_blockcount;
+    uint32_t nrange = 0;
+    int      tail   = 0;
+
+    if (!jp->nj_length)
+        return 0;
+    if (jp->nj_sboffs ||
+        ((jp->nj_blockcount == 1) && (jp->nj_eboffs != ncp->svc_offsetmask))) {
+        ranges[nrange].ir_blockno = first;
+        ranges[nrange].ir_offset  = jp->nj_sboffs;
+        ranges[nrange].ir_length =
+            ((jp->nj_blockcount == 1) ? jp->nj_eboffs + 1
+                                      : ncp->svc_blocksize) -
+            jp->nj_sboffs;
+        ranges[nrange].ir_buf = buf;
+        if (buf)
+            ranges[nrange].ir_buf = buf + jp->nj_sboffs;
+        nrange++;
+        first++;
+    }
+    if ((last > first) && (jp->nj_eboffs != ncp->svc_offsetmask)) {
+        last--;
+        tail = 1;
+    }
+    if (last > first) {
+        ranges[nrange].ir_blockno = first;
+        ranges[nrange].ir_offset  = 0;
+        ranges[nrange].ir_length  = (last - first) * ncp->svc_blocksize;
+        ranges[nrange].ir_buf     = buf;
+        if (buf)
+            ranges[nrange].ir_buf =
+                buf + ((first - jp->nj_startblock) * ncp->svc_blocksize);
+        nrange++;
+    }
+    if (tail) {
+        ranges[nrange].ir_blockno = last;
+        ranges[nrange].ir_offset  = 0;
+        ranges[nrange].ir_length  = jp->nj_eboffs + 1;
+        ranges[nrange].ir_buf     = buf;
+        if (buf)
+            ranges[nrange].ir_buf =
+                buf + ((last - jp->nj_startblock) * ncp->svc_blocksize);
+        nrange++;
     }
-    /*
-     * Do work until we're completely done.
-     */
-    while (timetoleave < 3) {
-        struct nbd_request request;
-        size_t             rlength;
 
-        /*
-         * If signalled that someone died, reap the child to avoid zombies.
-         */
-        if (someonedied) {
-            int   existat;
-            pid_t corpse;
+    return nrange;
+}
 
-            if (whodied) {
-                corpse = waitpid(whodied, &existat, WNOHANG);
-            } else {
-                corpse = wait(&existat);
-            }
-            someonedied = 0;
-            whodied     = 0;
-            logmsg(ncp, 2, "%s: pid %d finished with %d\n", ncp->svc_progname,
-                   corpse, existat);
-            if (ncp->svc_toreap == corpse)
-                ncp->svc_toreap = 0;
+/*
+ * Zero the blocks of a trim or write zeroes request.  Whole blocks are
+ * recorded as zeroes without writing any data.  Parts of blocks at either
+ * end of a write zeroes are written with zeroes; those of a trim are left
+ * alone, as trimming is only advice.
+ */
+static int
+nbd_job_zero(nbd_context_t *ncp, void *pctx, nbd_job_t *jp) {
+    int           error = 0;
+    image_range_t ranges[NBD_MAX_RANGES];
+    image_range_t parts[NBD_MAX_RANGES];
+    uint32_t      nranges = nbd_job_ranges(ncp, jp, (char *)NULL, ranges);
+    uint32_t      nparts  = 0;
+    uint32_t      ridx;
+
+    for (ridx = 0; !error && (ridx < nranges); ridx++) {
+        if (ranges[ridx].ir_length % ncp->svc_blocksize) {
+            parts[nparts]        = ranges[ridx];
+            parts[nparts].ir_buf = jp->nj_edge;
+            nparts++;
+        } else {
+            error = image_zeroblocks(pctx, ranges[ridx].ir_blockno,
+                                     ranges[ridx].ir_length /
+                                         ncp->svc_blocksize);
         }
+    }
+    if (!error && nparts && (jp->nj_type == NBD_CMD_WRITE_ZEROES))
+        error = image_writeranges(pctx, parts, nparts);
+    if (!error && nranges)
+        __atomic_store_n(&nbd_written, 1, __ATOMIC_RELAXED);
+
+    return error;
+}
+
+/*
+ * Perform the image operation for a request.
+ */
+static void
+nbd_job_execute(nbd_context_t *ncp, void *pctx, nbd_job_t *jp) {
+    int           error = 0;
+    image_range_t ranges[NBD_MAX_RANGES];
+    uint32_t      nranges;
 
+    switch (jp->nj_type) {
+    case NBD_CMD_WRITE:
+        logmsg(ncp, 1, "NBD_WRITE0x%x@0x%x\n", jp->nj_length, jp->nj_offset);
         /*
-         * Read a request.
+         * One call for the request, however it falls on blocks.
          */
-        if ((rlength = read(ncp->svc_fh, &request, sizeof(request))) ==
-            sizeof(request)) {
-            struct nbd_reply reply;
-            char *           replyappend = (char *)NULL;
-            /*
-             * Calculate the start/end blocks.
-             */
-            off_t    offset         = NTOHLL(request.from);
-            size_t   length         = ntohl(request.len);
-            uint64_t startblockoffs = offset & ncp->svc_blockmask;
-            uint64_t sboffs         = offset & ncp->svc_offsetmask;
-            uint64_t endblockoffs = (offset + length - 1) & ncp->svc_blockmask;
-            uint64_t eboffs       = (offset + length - 1) & ncp->svc_offsetmask;
-            uint64_t startblock   = startblockoffs / ncp->svc_blocksize;
-            uint64_t blockcount =
-                (endblockoffs - startblockoffs) / ncp->svc_blocksize;
-            uint64_t req_readbuf;
+        nranges = nbd_job_ranges(ncp, jp, jp->nj_buf, ranges);
+        if (!(error = image_writeranges(pctx, ranges, nranges))) {
+            __atomic_store_n(&nbd_written, 1, __ATOMIC_RELAXED);
+            logmsg(ncp, 2, "NBD_WRITE image write success\n");
+        } else {
+            logmsg(ncp, 1, "NBD_WRITE: write fail %d (%s)\n", error,
+                   strerror(error));
+        }
+        break;
+    case NBD_CMD_READ:
+        logmsg(ncp, 1, "NBD_READ 0x%x@0x%x\n", jp->nj_length, jp->nj_offset);
+        if (nbd_job_map(ncp, pctx, jp) == 0) {
+            logmsg(ncp, 2, "NBD_READ image map success\n");
+        } else if (!(error = image_readblocks_at(pctx, jp->nj_startblock,
+                                                 jp->nj_buf,
+                                                 jp->nj_blockcount))) {
+            logmsg(ncp, 2, "NBD_READ image read success\n");
+        } else {
+            logmsg(ncp, 2, "NBD_READ image read fail %d (%s)\n", error,
+                   strerror(error));
+        }
+        break;
+    case NBD_CMD_TRIM:
+    case NBD_CMD_WRITE_ZEROES:
+        logmsg(ncp, 1, "%s 0x%x@0x%x\n",
+               (jp->nj_type == NBD_CMD_TRIM) ? "NBD_TRIM" : "NBD_WRITE_ZEROES",
+               jp->nj_length, jp->nj_offset);
+        if ((error = nbd_job_zero(ncp, pctx, jp))) {
+            logmsg(ncp, 1, "NBD_TRIM/NBD_WRITE_ZEROES: fail %d (%s)\n", error,
+                   strerror(error));
+        }
+        break;
+    case NBD_CMD_BLOCK_STATUS:
+        logmsg(ncp, 1, "NBD_BLOCK_STATUS 0x%x@0x%x\n", jp->nj_length,
+               jp->nj_offset);
+        if ((error = nbd_job_extents(ncp, pctx, jp))) {
+            logmsg(ncp, 1, "NBD_BLOCK_STATUS: extent fail %d (%s)\n", error,
+                   strerror(error));
+        }
+        break;
+    case NBD_CMD_FLUSH:
+        logmsg(ncp, 1, "NBD_FLUSH\n");
+        if (__atomic_load_n(&nbd_written, __ATOMIC_RELAXED) &&
+            (error = image_sync(pctx))) {
+            logmsg(ncp, 1, "NBD_FLUSH: sync fail %d (%s)\n", error,
+                   strerror(error));
+        }
+        break;
+    default:
+        error = EINVAL;
+        break;
+    }
+    jp->nj_error = error;
+}
 
-            /*
-             * Adjust block count.
-             */
-            if (length)
-                blockcount++;
+/*
+ * Zeroes to send unused blocks from.
+ */
+static const char nbd_zeroes[64 * 1024];
 
-            /*
-             * Calculate the required read buffer and adjust if necessary.
-             */
-            if (endblockoffs > startblockoffs) {
-                req_readbuf = blockcount * ncp->svc_blocksize;
-                while (req_readbuf > readbuf_size) {
-                    char *nrbuf = malloc(req_readbuf);
-
-                    if (nrbuf) {
-                        readbuf_size = req_readbuf;
-                        free(readbuf);
-                        readbuf = nrbuf;
-                    } else {
-                        if (req_readbuf < 0x80000000UL) {
-                            logmsg(
-                                ncp, 0,
-                                "[%s] retrying allocation of %d byte buffer\n",
-                                ncp->svc_progname, req_readbuf);
-                            sleep(10);
-                        } else {
-                            logmsg(ncp, 0,
-                                   "[%s] not retrying allocation of %d byte "
-                                   "buffer\n",
-                                   ncp->svc_progname, req_readbuf);
-                            timetoleave = 1;
-                            error       = ENOMEM;
-                            break;
-                        }
-                    }
-                }
+/*
+ * Write out a vector, retrying if we're interrupted but not if it's time
+ * to leave.
+ */
+static int
+nbd_send_iov(nbd_context_t *ncp, struct iovec *iov, int niov,
+             volatile int *timetoleavep) {
+    int     error = 0;
+    ssize_t wlength;
+
+    while (!error && niov) {
+        while (((wlength = writev(ncp->svc_fh, iov, niov)) == -1) &&
+               (errno == EINTR) && (!*timetoleavep))
+            ;
+        if (wlength == -1) {
+            error = errno;
+        } else {
+            while (niov && ((size_t)wlength >= iov->iov_len)) {
+                wlength -= iov->iov_len;
+                iov++;
+                niov--;
             }
+            if (niov) {
+                iov->iov_base = (char *)iov->iov_base + wlength;
+                iov->iov_len -= wlength;
+            }
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Send a segment of the image file.  The data goes straight from the file
+ * to the socket unless it can't, in which case it's copied through the
+ * job's buffer.
+ */
+static int
+nbd_send_file(nbd_context_t *ncp, nbd_job_t *jp, image_segment_t *sp,
+              volatile int *timetoleavep) {
+    int      error  = 0;
+    off_t    offset = sp->is_offset;
+    uint64_t left   = sp->is_length;
+    ssize_t  slength;
+
+    while (!error && left) {
+        while (((slength = sendfile(ncp->svc_fh, sp->is_fd, &offset, left)) ==
+                -1) &&
+               (errno == EINTR) && (!*timetoleavep))
+            ;
+        if (slength > 0) {
+            left -= slength;
+        } else if (slength == 0) {
+            error = EIO;
+        } else if ((errno == EINVAL) || (errno == ENOSYS)) {
+            struct iovec iov;
 
             /*
-             * Verify that the message was correctly formed.
+             * The buffer is at least as long as the request.
+             */
+            if ((slength = pread(sp->is_fd, jp->nj_buf, left, offset)) ==
+                left) {
+                iov.iov_base = jp->nj_buf;
+                iov.iov_len  = left;
+                error        = nbd_send_iov(ncp, &iov, 1, timetoleavep);
+                left         = 0;
+            } else {
+                error = (slength == -1) ? errno : EIO;
+            }
+        } else {
+            error = errno;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Add a piece to a reply, first sending what's been gathered if there's no
+ * room for it.
+ */
+static int
+nbd_iov_add(nbd_context_t *ncp, struct iovec *iov, int *niovp,
+            const void *base, size_t len, volatile int *timetoleavep) {
+    int error = 0;
+
+    if (*niovp == NBD_MAX_IOV) {
+        error  = nbd_send_iov(ncp, iov, *niovp, timetoleavep);
+        *niovp = 0;
+    }
+    iov[*niovp].iov_base = (void *)base;
+    iov[*niovp].iov_len  = len;
+    (*niovp)++;
+
+    return error;
+}
+
+/*
+ * Add zeroes to a reply.
+ */
+static int
+nbd_iov_zeroes(nbd_context_t *ncp, struct iovec *iov, int *niovp,
+               uint64_t len, volatile int *timetoleavep) {
+    int error = 0;
+
+    while (!error && len) {
+        size_t n = (len < sizeof(nbd_zeroes)) ? len : sizeof(nbd_zeroes);
+
+        error = nbd_iov_add(ncp, iov, niovp, nbd_zeroes, n, timetoleavep);
+        len -= n;
+    }
+
+    return error;
+}
+
+/*
+ * Send what's been gathered, then a segment of the image file.
+ */
+static int
+nbd_iov_file(nbd_context_t *ncp, nbd_job_t *jp, struct iovec *iov,
+             int *niovp, image_segment_t *sp, volatile int *timetoleavep) {
+    int error = nbd_send_iov(ncp, iov, *niovp, timetoleavep);
+
+    *niovp = 0;
+    return (error) ? error : nbd_send_file(ncp, jp, sp, timetoleavep);
+}
+
+/*
+ * Translate an error for the wire.
+ */
+static uint32_t
+nbd_errno(int error) {
+    switch (error) {
+    case 0:
+        return 0;
+    case EPERM:
+    case EROFS:
+        return NBD_EPERM;
+    case ENOMEM:
+        return NBD_ENOMEM;
+    case EINVAL:
+        return NBD_EINVAL;
+    case ENOSPC:
+    case EFBIG:
+        return NBD_ENOSPC;
+    case EOVERFLOW:
+        return NBD_EOVERFLOW;
+    case ENOTSUP:
+        return NBD_ENOTSUP;
+    case ESHUTDOWN:
+        return NBD_ESHUTDOWN;
+    default:
+        return NBD_EIO;
+    }
+}
+
+/*
+ * Send a simple reply.  The header and the data go out together where
+ * they can.  Mapped reads are sent straight from the image file, with
+ * unused blocks sent from the zeroes.
+ */
+static int
+nbd_reply_simple(nbd_context_t *ncp, nbd_job_t *jp,
+                 volatile int *timetoleavep) {
+    struct nbd_reply reply;
+    struct iovec     iov[NBD_MAX_IOV];
+    int              niov  = 1;
+    int              error = 0;
+    uint32_t         sidx;
+
+    reply.magic = htonl(NBD_REPLY_MAGIC);
+    reply.error = htonl(nbd_errno(jp->nj_error));
+    memcpy(reply.handle, jp->nj_request.handle, 8);
+    iov[0].iov_base = &reply;
+    iov[0].iov_len  = sizeof(reply);
+
+    /*
+     * Add the reply appendage if it's a read and there was no error.
+     */
+    if ((jp->nj_type == NBD_CMD_READ) && (jp->nj_error == 0)) {
+        if (!jp->nj_nsegs) {
+            iov[1].iov_base = &jp->nj_buf[jp->nj_sboffs];
+            iov[1].iov_len  = jp->nj_length;
+            niov            = 2;
+        }
+        for (sidx = 0; !error && (sidx < jp->nj_nsegs); sidx++) {
+            image_segment_t *sp = &jp->nj_segs[sidx];
+
+            error = (sp->is_type == IMAGE_SEG_ZERO)
+                        ? nbd_iov_zeroes(ncp, iov, &niov, sp->is_length,
+                                         timetoleavep)
+                        : nbd_iov_file(ncp, jp, iov, &niov, sp, timetoleavep);
+        }
+    }
+
+    return (error) ? error : nbd_send_iov(ncp, iov, niov, timetoleavep);
+}
+
+/*
+ * A structured reply chunk header, with room for what follows it for the
+ * chunk types we send.
+ */
+typedef struct nbd_chunk {
+    struct nbd_structured_reply nc_head;
+    union {
+        struct {
+            uint64_t nc_offset; /* Offset, for data and holes */
+            uint32_t nc_length; /* Length, for holes */
+        } __attribute__((packed));
+        struct {
+            uint32_t nc_error;  /* Error, for errors */
+            uint16_t nc_msglen; /* Message length, for errors */
+        } __attribute__((packed));
+        uint32_t nc_context; /* Metadata context, for block status */
+    };
+} __attribute__((packed)) nbd_chunk_t;
+
+/*
+ * Fill in a chunk header, returning the size of it.
+ */
+static size_t
+nbd_chunk_init(nbd_chunk_t *cp, nbd_job_t *jp, int type, int last,
+               uint32_t length) {
+    size_t hsize = sizeof(cp->nc_head);
+
+    cp->nc_head.magic  = htonl(NBD_STRUCTURED_REPLY_MAGIC);
+    cp->nc_head.flags  = htons((last) ? NBD_REPLY_FLAG_DONE : 0);
+    cp->nc_head.type   = htons(type);
+    cp->nc_head.length = htonl(length);
+    memcpy(cp->nc_head.handle, jp->nj_request.handle, 8);
+    switch (type) {
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        hsize += sizeof(cp->nc_length);
+        /* FALLTHROUGH */
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        hsize += sizeof(cp->nc_offset);
+        break;
+    case NBD_REPLY_TYPE_ERROR:
+        hsize += sizeof(cp->nc_error) + sizeof(cp->nc_msglen);
+        break;
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        hsize += sizeof(cp->nc_context);
+        break;
+    }
+
+    return hsize;
+}
+
+/*
+ * Send a structured reply to a read or block status request.  For reads,
+ * unused blocks go out as holes, which carry no data, and everything else
+ * as data chunks.  A read that wasn't mapped goes out as one data chunk.
+ */
+static int
+nbd_reply_chunks(nbd_context_t *ncp, nbd_job_t *jp,
+                 volatile int *timetoleavep) {
+    nbd_chunk_t  chunks[NBD_MAX_SEGS];
+    struct iovec iov[NBD_MAX_IOV];
+    int          niov   = 0;
+    int          error  = 0;
+    uint64_t     offset = jp->nj_offset;
+    nbd_chunk_t *cp     = &chunks[0];
+    uint32_t     sidx;
+
+    if (jp->nj_error) {
+        iov[niov].iov_len = nbd_chunk_init(cp, jp, NBD_REPLY_TYPE_ERROR, 1,
+                                           sizeof(cp->nc_error) +
+                                               sizeof(cp->nc_msglen));
+        iov[niov++].iov_base = cp;
+        cp->nc_error         = htonl(nbd_errno(jp->nj_error));
+        cp->nc_msglen        = 0;
+    } else if (jp->nj_type == NBD_CMD_BLOCK_STATUS) {
+        size_t elen = jp->nj_nextents * sizeof(struct nbd_block_descriptor);
+
+        iov[niov].iov_len    = nbd_chunk_init(cp, jp,
+                                              NBD_REPLY_TYPE_BLOCK_STATUS, 1,
+                                              sizeof(cp->nc_context) + elen);
+        iov[niov++].iov_base = cp;
+        cp->nc_context       = htonl(NBD_META_ID_ALLOCATION);
+        iov[niov].iov_base   = jp->nj_buf;
+        iov[niov++].iov_len  = elen;
+    } else if (!jp->nj_length) {
+        iov[niov].iov_len =
+            nbd_chunk_init(cp, jp, NBD_REPLY_TYPE_NONE, 1, 0);
+        iov[niov++].iov_base = cp;
+    } else if (!jp->nj_nsegs) {
+        iov[niov].iov_len =
+            nbd_chunk_init(cp, jp, NBD_REPLY_TYPE_OFFSET_DATA, 1,
+                           sizeof(cp->nc_offset) + jp->nj_length);
+        iov[niov++].iov_base = cp;
+        cp->nc_offset        = htobe64(offset);
+        iov[niov].iov_base   = &jp->nj_buf[jp->nj_sboffs];
+        iov[niov++].iov_len  = jp->nj_length;
+    }
+    for (sidx = 0; !error && (sidx < jp->nj_nsegs); sidx++) {
+        image_segment_t *sp   = &jp->nj_segs[sidx];
+        int              last = (sidx == (jp->nj_nsegs - 1));
+        size_t           hsize;
+
+        cp = &chunks[sidx];
+        if (sp->is_type == IMAGE_SEG_ZERO) {
+            hsize = nbd_chunk_init(cp, jp, NBD_REPLY_TYPE_OFFSET_HOLE, last,
+                                   sizeof(cp->nc_offset) +
+                                       sizeof(cp->nc_length));
+            cp->nc_length = htonl(sp->is_length);
+        } else {
+            hsize = nbd_chunk_init(cp, jp, NBD_REPLY_TYPE_OFFSET_DATA, last,
+                                   sizeof(cp->nc_offset) + sp->is_length);
+        }
+        cp->nc_offset = htobe64(offset);
+        offset += sp->is_length;
+        if (!(error = nbd_iov_add(ncp, iov, &niov, cp, hsize,
+                                  timetoleavep)) &&
+            (sp->is_type == IMAGE_SEG_FILE)) {
+            error = nbd_iov_file(ncp, jp, iov, &niov, sp, timetoleavep);
+        }
+    }
+
+    return (error) ? error : nbd_send_iov(ncp, iov, niov, timetoleavep);
+}
+
+/*
+ * Send the reply for a request.  Reads get a structured reply if the
+ * client asked for them, and block status requests always do.
+ */
+static int
+nbd_job_reply(nbd_context_t *ncp, nbd_job_t *jp, volatile int *timetoleavep) {
+    uint64_t start = stats_start();
+    int      error;
+
+    error = (ncp->svc_structured && ((jp->nj_type == NBD_CMD_READ) ||
+                                     (jp->nj_type == NBD_CMD_BLOCK_STATUS)))
+                ? nbd_reply_chunks(ncp, jp, timetoleavep)
+                : nbd_reply_simple(ncp, jp, timetoleavep);
+
+    stats_end(STATS_NBD_REPLY, start,
+              ((jp->nj_type == NBD_CMD_READ) && !jp->nj_error) ? jp->nj_length
+                                                               : 0,
+              error);
+    if (error) {
+        logmsg(ncp, 0, "[%s] reply write error: %s\n", ncp->svc_progname,
+               strerror(error));
+    }
+
+    return error;
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * Everybody serving requests shares the one image handle: all the workers
+ * and, when serving over the network, all the connections.  Reads use the
+ * positional read interface and so can proceed concurrently; everything
+ * else keeps the image to itself.
+ */
+static pthread_rwlock_t nbd_image_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif /* HAVE_LIBPTHREAD */
+
+/*
+ * Which counter a request's execution is recorded in.
+ */
+static stats_id_t
+nbd_job_statsid(nbd_job_t *jp) {
+    switch (jp->nj_type) {
+    case NBD_CMD_READ:
+        return STATS_NBD_READ;
+    case NBD_CMD_WRITE:
+        return STATS_NBD_WRITE;
+    case NBD_CMD_FLUSH:
+        return STATS_NBD_FLUSH;
+    case NBD_CMD_BLOCK_STATUS:
+        return STATS_NBD_STATUS;
+    default:
+        return STATS_NBD_TRIM;
+    }
+}
+
+/*
+ * Perform the image operation for a request, under the image lock.
+ */
+static void
+nbd_job_run(nbd_context_t *ncp, void *pctx, nbd_job_t *jp) {
+    uint64_t start = stats_start();
+
+#ifdef HAVE_LIBPTHREAD
+    if ((jp->nj_type == NBD_CMD_READ) || (jp->nj_type == NBD_CMD_BLOCK_STATUS))
+        pthread_rwlock_rdlock(&nbd_image_lock);
+    else
+        pthread_rwlock_wrlock(&nbd_image_lock);
+    stats_end(STATS_NBD_LOCK, start, 1, 0);
+    start = stats_start();
+#endif /* HAVE_LIBPTHREAD */
+    nbd_job_execute(ncp, pctx, jp);
+    stats_end(nbd_job_statsid(jp), start, jp->nj_length, jp->nj_error);
+#ifdef HAVE_LIBPTHREAD
+    pthread_rwlock_unlock(&nbd_image_lock);
+#endif /* HAVE_LIBPTHREAD */
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * Worker pool.
+ *
+ * The service loop reads requests (and write data) from the kernel and
+ * queues them for the workers.  A request is not queued while it overlaps
+ * an outstanding request and either one of them is a write, so writes to
+ * the same region are processed in the order in which they were received.
+ * Replies are sent in completion order under the send lock; the kernel
+ * matches them up by handle.
+ *
+ * All workers share the one image handle.
+ */
+typedef struct nbd_worker {
+    struct nbd_pool *nw_pool;    /* Pool we belong to */
+    pthread_t        nw_thread;  /* Our thread */
+    int              nw_started; /* Thread is running */
+} nbd_worker_t;
+
+typedef struct nbd_pool {
+    nbd_context_t *  np_ncp;         /* Service context */
+    pthread_mutex_t  np_lock;        /* Protects the following */
+    pthread_cond_t   np_work;        /* Signalled when work is queued */
+    pthread_cond_t   np_done;        /* Signalled when work completes */
+    nbd_job_t *      np_queue;       /* Queued jobs */
+    nbd_job_t *      np_queue_tail;  /* Last queued job */
+    nbd_job_t *      np_free;        /* Free jobs */
+    int              np_shutdown;    /* Workers should finish */
+    pthread_mutex_t  np_send_lock;   /* Serializes replies */
+    void *           np_pctx;        /* Image handle */
+    volatile int *   np_timetoleave; /* Termination flag */
+    int              np_nworkers;    /* Number of workers */
+    nbd_worker_t *   np_workers;     /* Workers */
+    int              np_njobs;       /* Number of jobs */
+    nbd_job_t *      np_jobs;        /* Jobs */
+} nbd_pool_t;
+
+/*
+ * Block the termination signals in the calling thread, so that threads it
+ * starts leave them to the service loop.
+ */
+static void
+nbd_block_signals(sigset_t *oldmaskp) {
+    sigset_t newmask;
+
+    sigemptyset(&newmask);
+    sigaddset(&newmask, SIGINT);
+    sigaddset(&newmask, SIGHUP);
+    sigaddset(&newmask, SIGTERM);
+    sigaddset(&newmask, SIGQUIT);
+    sigaddset(&newmask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &newmask, oldmaskp);
+}
+
+/*
+ * Does a job change the image?
+ */
+static inline int
+nbd_job_writes(nbd_job_t *jp) {
+    return (jp->nj_type == NBD_CMD_WRITE) || (jp->nj_type == NBD_CMD_TRIM) ||
+           (jp->nj_type == NBD_CMD_WRITE_ZEROES);
+}
+
+/*
+ * Do two jobs have to be processed in order?
+ */
+static inline int
+nbd_jobs_conflict(nbd_job_t *a, nbd_job_t *b) {
+    return (nbd_job_writes(a) || nbd_job_writes(b)) &&
+           (a->nj_startblock < (b->nj_startblock + b->nj_blockcount)) &&
+           (b->nj_startblock < (a->nj_startblock + a->nj_blockcount));
+}
+
+/*
+ * Worker thread.
+ */
+static void *
+nbd_worker(void *arg) {
+    nbd_worker_t * wp  = (nbd_worker_t *)arg;
+    nbd_pool_t *   npp = wp->nw_pool;
+    nbd_context_t *ncp = npp->np_ncp;
+
+    pthread_mutex_lock(&npp->np_lock);
+    for (;;) {
+        nbd_job_t *jp;
+
+        while (!npp->np_queue && !npp->np_shutdown)
+            pthread_cond_wait(&npp->np_work, &npp->np_lock);
+        if (!(jp = npp->np_queue))
+            break;
+        if (!(npp->np_queue = jp->nj_next))
+            npp->np_queue_tail = (nbd_job_t *)NULL;
+        pthread_mutex_unlock(&npp->np_lock);
+
+        nbd_job_run(ncp, npp->np_pctx, jp);
+        pthread_mutex_lock(&npp->np_send_lock);
+        (void)nbd_job_reply(ncp, jp, npp->np_timetoleave);
+        pthread_mutex_unlock(&npp->np_send_lock);
+        nbd_job_release(ncp, jp);
+
+        pthread_mutex_lock(&npp->np_lock);
+        jp->nj_busy  = 0;
+        jp->nj_next  = npp->np_free;
+        npp->np_free = jp;
+        pthread_cond_broadcast(&npp->np_done);
+    }
+    pthread_mutex_unlock(&npp->np_lock);
+
+    return NULL;
+}
+
+/*
+ * Get a free job, waiting for one if necessary.
+ */
+static nbd_job_t *
+nbd_pool_get(nbd_pool_t *npp) {
+    nbd_job_t *jp;
+
+    pthread_mutex_lock(&npp->np_lock);
+    while (!(jp = npp->np_free))
+        pthread_cond_wait(&npp->np_done, &npp->np_lock);
+    npp->np_free = jp->nj_next;
+    pthread_mutex_unlock(&npp->np_lock);
+
+    return jp;
+}
+
+/*
+ * Return a job that wasn't dispatched.
+ */
+static void
+nbd_pool_put(nbd_pool_t *npp, nbd_job_t *jp) {
+    pthread_mutex_lock(&npp->np_lock);
+    jp->nj_next  = npp->np_free;
+    npp->np_free = jp;
+    pthread_mutex_unlock(&npp->np_lock);
+}
+
+/*
+ * Queue a job, waiting until it doesn't conflict with outstanding jobs.
+ */
+static void
+nbd_pool_dispatch(nbd_pool_t *npp, nbd_job_t *jp) {
+    int jidx;
+
+    pthread_mutex_lock(&npp->np_lock);
+    for (jidx = 0; jidx < npp->np_njobs;) {
+        if (npp->np_jobs[jidx].nj_busy &&
+            nbd_jobs_conflict(&npp->np_jobs[jidx], jp)) {
+            pthread_cond_wait(&npp->np_done, &npp->np_lock);
+            jidx = 0;
+        } else {
+            jidx++;
+        }
+    }
+    jp->nj_busy = 1;
+    jp->nj_next = (nbd_job_t *)NULL;
+    if (npp->np_queue_tail)
+        npp->np_queue_tail->nj_next = jp;
+    else
+        npp->np_queue = jp;
+    npp->np_queue_tail = jp;
+    pthread_cond_signal(&npp->np_work);
+    pthread_mutex_unlock(&npp->np_lock);
+}
+
+/*
+ * Wait for all outstanding jobs to complete.
+ */
+static void
+nbd_pool_drain(nbd_pool_t *npp) {
+    int jidx;
+
+    pthread_mutex_lock(&npp->np_lock);
+    for (jidx = 0; jidx < npp->np_njobs;) {
+        if (npp->np_jobs[jidx].nj_busy) {
+            pthread_cond_wait(&npp->np_done, &npp->np_lock);
+            jidx = 0;
+        } else {
+            jidx++;
+        }
+    }
+    pthread_mutex_unlock(&npp->np_lock);
+}
+
+/*
+ * Stop the workers and release the pool.
+ */
+static void
+nbd_pool_destroy(nbd_pool_t *npp) {
+    int widx;
+
+    pthread_mutex_lock(&npp->np_lock);
+    npp->np_shutdown = 1;
+    pthread_cond_broadcast(&npp->np_work);
+    pthread_mutex_unlock(&npp->np_lock);
+    for (widx = 0; widx < npp->np_nworkers; widx++) {
+        if (npp->np_workers[widx].nw_started)
+            pthread_join(npp->np_workers[widx].nw_thread, (void **)NULL);
+    }
+    for (widx = 0; widx < npp->np_njobs; widx++)
+        free(npp->np_jobs[widx].nj_edge);
+    pthread_cond_destroy(&npp->np_work);
+    pthread_cond_destroy(&npp->np_done);
+    pthread_mutex_destroy(&npp->np_lock);
+    pthread_mutex_destroy(&npp->np_send_lock);
+    free(npp->np_jobs);
+    free(npp->np_workers);
+    free(npp);
+}
+
+/*
+ * Create the worker pool.
+ */
+static int
+nbd_pool_create(nbd_context_t *ncp, void *pctx, volatile int *timetoleavep,
+                nbd_pool_t **nppp) {
+    int         error = ENOMEM;
+    int         widx;
+    nbd_pool_t *npp;
+    sigset_t    oldmask;
+
+    if ((npp = (nbd_pool_t *)malloc(sizeof(*npp)))) {
+        memset(npp, 0, sizeof(*npp));
+        npp->np_ncp         = ncp;
+        npp->np_pctx        = pctx;
+        npp->np_timetoleave = timetoleavep;
+        npp->np_nworkers    = ncp->svc_nworkers;
+        npp->np_njobs       = nbd_njobs(ncp);
+        pthread_mutex_init(&npp->np_lock, (pthread_mutexattr_t *)NULL);
+        pthread_mutex_init(&npp->np_send_lock, (pthread_mutexattr_t *)NULL);
+        pthread_cond_init(&npp->np_work, (pthread_condattr_t *)NULL);
+        pthread_cond_init(&npp->np_done, (pthread_condattr_t *)NULL);
+        if ((npp->np_workers = (nbd_worker_t *)calloc(
+                 npp->np_nworkers, sizeof(nbd_worker_t))) &&
+            (npp->np_jobs =
+                 (nbd_job_t *)calloc(npp->np_njobs, sizeof(nbd_job_t)))) {
+            error = 0;
+            for (widx = 0; widx < npp->np_njobs; widx++) {
+                npp->np_jobs[widx].nj_next = npp->np_free;
+                npp->np_free               = &npp->np_jobs[widx];
+            }
+        }
+
+        nbd_block_signals(&oldmask);
+        for (widx = 0; !error && (widx < npp->np_nworkers); widx++) {
+            nbd_worker_t *wp = &npp->np_workers[widx];
+
+            wp->nw_pool = npp;
+            if (!(error = pthread_create(&wp->nw_thread,
+                                         (pthread_attr_t *)NULL, nbd_worker,
+                                         wp))) {
+                wp->nw_started = 1;
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &oldmask, (sigset_t *)NULL);
+
+        if (error) {
+            logmsg(ncp, -1, "%s: cannot start workers: %s\n",
+                   ncp->svc_progname, strerror(error));
+            nbd_pool_destroy(npp);
+            npp = (nbd_pool_t *)NULL;
+        } else {
+            logmsg(ncp, 1, "%s: started %d workers\n", ncp->svc_progname,
+                   npp->np_nworkers);
+        }
+    }
+    *nppp = npp;
+
+    return error;
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/*
+ * Handle a request.  It's either processed now, or handed off to the
+ * worker pool (if there is one).  Disconnecting drains the pool and sets
+ * the termination flag.
+ */
+static int
+nbd_handle_request(nbd_context_t *ncp, void *pctx, struct nbd_pool *pool,
+                   nbd_job_t *sjob, struct nbd_request *rqp,
+                   volatile int *timetoleavep) {
+    int        error = 0;
+    nbd_job_t *jp    = sjob;
+
+#ifdef HAVE_LIBPTHREAD
+    if (pool)
+        jp = nbd_pool_get(pool);
+#endif /* HAVE_LIBPTHREAD */
+    nbd_job_setup(ncp, jp, rqp);
+    if (jp->nj_type == NBD_CMD_DISC) {
+        logmsg(ncp, 1, "NBD_SHUTDOWN\n");
+#ifdef HAVE_LIBPTHREAD
+        if (pool)
+            nbd_pool_drain(pool);
+#endif /* HAVE_LIBPTHREAD */
+        *timetoleavep = 1;
+    } else if ((jp->nj_length > NBD_MAX_REQUEST) &&
+               ((jp->nj_type == NBD_CMD_READ) ||
+                (jp->nj_type == NBD_CMD_WRITE))) {
+        /*
+         * We can't take it.  If there's data following, we can't even
+         * find the next request.  Other requests carry no data either
+         * way.
+         */
+        logmsg(ncp, 1, "[%s] request too large: %d bytes\n",
+               ncp->svc_progname, jp->nj_length);
+        error = EINVAL;
+        if (jp->nj_type == NBD_CMD_WRITE)
+            *timetoleavep = 1;
+    } else if (!(error = nbd_job_buffer(ncp, jp)) &&
+               (jp->nj_type == NBD_CMD_WRITE)) {
+        uint64_t start = stats_start();
+
+        error = nbd_job_payload(ncp, jp, timetoleavep);
+        stats_end(STATS_NBD_RECV, start, jp->nj_length, error);
+    }
+    if (!error && (jp->nj_type != NBD_CMD_DISC))
+        error = nbd_job_check(ncp, jp);
+    jp->nj_error = error;
+#ifdef HAVE_LIBPTHREAD
+    if (pool && !error && (jp->nj_type != NBD_CMD_DISC)) {
+        nbd_pool_dispatch(pool, jp);
+        return 0;
+    }
+#endif /* HAVE_LIBPTHREAD */
+    if (!error && (jp->nj_type != NBD_CMD_DISC))
+        nbd_job_run(ncp, pctx, jp);
+    /*
+     * Network clients don't get a reply to a disconnect.
+     */
+    if ((jp->nj_type != NBD_CMD_DISC) || !ncp->svc_listen) {
+#ifdef HAVE_LIBPTHREAD
+        if (pool)
+            pthread_mutex_lock(&pool->np_send_lock);
+#endif /* HAVE_LIBPTHREAD */
+        error = nbd_job_reply(ncp, jp, timetoleavep);
+        if (!error)
+            error = jp->nj_error;
+#ifdef HAVE_LIBPTHREAD
+        if (pool)
+            pthread_mutex_unlock(&pool->np_send_lock);
+#endif /* HAVE_LIBPTHREAD */
+    }
+    nbd_job_release(ncp, jp);
+#ifdef HAVE_LIBPTHREAD
+    if (pool)
+        nbd_pool_put(pool, jp);
+#endif /* HAVE_LIBPTHREAD */
+
+    return error;
+}
+
+/*
+ * Handle NBD resquest
+ *
+ * The main work processing loop.  Requests are either processed one at a
+ * time, or handed off to a pool of workers.
+ */
+static int
+nbd_service_requests(nbd_context_t *ncp, void *pctx) {
+    char *           pidfile     = (char *)NULL;
+    int              error       = 0;
+    volatile int     timetoleave = 0;
+    volatile int     someonedied = 0;
+    volatile pid_t   whodied     = 0;
+    struct sigaction newsig, oldsig;
+    nbd_job_t        sjob;
+    struct nbd_pool *pool = (struct nbd_pool *)NULL;
+
+    /*
+     * Prepare termination signal handlers.
+     */
+    finishflag = (int *)&timetoleave;
+    memset(&newsig, 0, sizeof(newsig));
+    newsig.sa_sigaction = nbd_finish;
+    sigaction(SIGINT, &newsig, &oldsig);
+    sigaction(SIGHUP, &newsig, &oldsig);
+    sigaction(SIGTERM, &newsig, &oldsig);
+    sigaction(SIGQUIT, &newsig, &oldsig);
+
+    /*
+     * Set up the request buffers.
+     */
+    memset(&sjob, 0, sizeof(sjob));
+    if ((error = nbd_bufpool_create(ncp))) {
+        timetoleave = 3;
+    }
+
+#ifdef HAVE_LIBPTHREAD
+    /*
+     * Start the workers, if requested.
+     */
+    if (!error && ncp->svc_nworkers &&
+        (error = nbd_pool_create(ncp, pctx, &timetoleave, &pool))) {
+        timetoleave = 3;
+    }
+#endif /* HAVE_LIBPTHREAD */
+
+    /*
+     * If we're setting up a mount, then for a child to do the mount and
+     * prepare the signal handler to be notified when the child completes.
+     */
+    if (ncp->svc_mount) {
+        pid_t cpid;
+
+        newsig.sa_sigaction = nbd_reapchild;
+        newsig.sa_flags     = SA_RESETHAND | SA_SIGINFO;
+        diedp               = (int *)&someonedied;
+        toreapp             = (pid_t *)&whodied;
+        sigaction(SIGCHLD, &newsig, &oldsig);
+        switch ((cpid = fork())) {
+        case 0:
+            exit(mount(ncp->nbd_dev, ncp->svc_mount,
+                       (ncp->svc_mtype) ? ncp->svc_mtype : "ext2",
+                       (ncp->svc_rdonly) ? MS_RDONLY : 0, ""));
+            break;
+        case -1:
+            error = errno;
+            logmsg(ncp, -1, "%s: cannot fork to mount: %s\n", ncp->svc_progname,
+                   strerror(error));
+            /*
+             * We ignore this failure.  Someone else can try the mount.
+             */
+            break;
+        default:
+            ncp->svc_toreap = cpid;
+            break;
+        }
+    }
+
+    /*
+     * create pid file
+     */
+    create_pid_file(ncp, getpid(), &pidfile);
+
+    if (ncp->svc_mount) {
+        logmsg(ncp, 0, "Mount \"%s\" is ready.\n", ncp->svc_mount);
+        logmsg(ncp, 0,
+               "When finished with the imagemount, run `umount %s` then "
+               "`nbd-client -d %s to cleanup.\n",
+               ncp->svc_mount, ncp->nbd_dev);
+    } else if (ncp->nbd_dev) {
+        logmsg(ncp, 0, "Device \"%s\" is now ready for further operations.\n",
+               ncp->nbd_dev);
+        logmsg(ncp, 0,
+               "When finished with the imagemount, run `nbd-client -d %s` to "
+               "disconnect from the NBD server.\n",
+               ncp->nbd_dev);
+    }
+    /*
+     * Do work until we're completely done.
+     */
+    while (timetoleave < 3) {
+        struct nbd_request request;
+        ssize_t            rlength;
+
+        /*
+         * If signalled that someone died, reap the child to avoid zombies.
+         */
+        if (someonedied) {
+            int   existat;
+            pid_t corpse;
+
+            if (whodied) {
+                corpse = waitpid(whodied, &existat, WNOHANG);
+            } else {
+                corpse = wait(&existat);
+            }
+            someonedied = 0;
+            whodied     = 0;
+            logmsg(ncp, 2, "%s: pid %d finished with %d\n", ncp->svc_progname,
+                   corpse, existat);
+            if (ncp->svc_toreap == corpse)
+                ncp->svc_toreap = 0;
+        }
+
+        /*
+         * Read a request.
+         */
+        if ((rlength = read(ncp->svc_fh, &request, sizeof(request))) ==
+            sizeof(request)) {
+            /*
+             * Verify that the message was correctly formed.
              */
             if (request.magic == htonl(NBD_REQUEST_MAGIC)) {
-                switch (ntohl(request.type)) {
-                case NBD_CMD_DISC:
-                    logmsg(ncp, 1, "NBD_SHUTDOWN\n");
-                    timetoleave = 1;
-                    break;
-                case NBD_CMD_WRITE:
-                    logmsg(ncp, 1, "NBD_WRITE0x%x@0x%x\n", length, offset);
-                    if (sboffs) {
-                        /* partial leading block write, ech. */
-                        if (!(error = image_seek(pctx, startblock))) {
-                            error = image_readblocks(pctx, readbuf, 1);
-                        }
-                    } else {
-                        error = 0;
-                    }
-                    if (!error) {
-                        if ((eboffs != ncp->svc_offsetmask) &&
-                            (blockcount != 1)) {
-                            /* partial trailing block write, double ech. */
-                            if (!(error = image_seek(
-                                      pctx, startblock + blockcount - 1))) {
-                                error = image_readblocks(
-                                    pctx,
-                                    readbuf +
-                                        ((blockcount - 1) * ncp->svc_blocksize),
-                                    1);
-                            }
-                        }
-                        if (!error) {
-                            char *   rembp  = readbuf;
-                            uint64_t remlen = length;
-                            for ((rembp = readbuf, remlen = length);
-                                 !error && remlen;) {
-                                /*
-                                 * Retry the read if we're interrupted but not
-                                 * if it's time to leave.
-                                 */
-                                while (((rlength = read(ncp->svc_fh, rembp,
-                                                        remlen)) == -1) &&
-                                       (errno == EINTR) && (!timetoleave))
-                                    ;
-                                if (rlength == remlen) {
-                                    if (!(error =
-                                              image_seek(pctx, startblock)) &&
-                                        !(error = image_writeblocks(
-                                              pctx, readbuf, blockcount))) {
-                                        logmsg(
-                                            ncp, 2,
-                                            "NBD_WRITE image write success\n");
-                                    } else {
-                                        logmsg(
-                                            ncp, 1,
-                                            "NBD_WRITE: write fail %d (%s)\n",
-                                            error, strerror(error));
-                                    }
-                                } else {
-                                    if (rlength >= 0) {
-                                        logmsg(ncp, 1,
-                                               "NBD_WRITE fail: short read of "
-                                               "data\n");
-                                    } else {
-                                        error = errno;
-                                        logmsg(ncp, 1,
-                                               "NBD_WRITE fail: read fail %d "
-                                               "(%s)\n",
-                                               error, strerror(error));
-                                    }
-                                }
-                                remlen -= rlength;
-                                rembp += rlength;
-                            }
-                        } else {
-                            logmsg(ncp, 1,
-                                   "NBD_WRITE: priming read fail %d (%s)\n",
-                                   error, strerror(error));
-                        }
+                error = nbd_handle_request(ncp, pctx, pool, &sjob, &request,
+                                           &timetoleave);
+            } else {
+                logmsg(ncp, 1, "[%s] Bad message from kernel: %08x\n",
+                       ncp->svc_progname, request.magic);
+                /*
+                 * It's unclear what to do here.  We've obviously lost sync
+                 * with the kernel.  Will reading 32-bit quantities until we
+                 * get back in sync work?  I dunno.  Without the following
+                 * snippet, we read nbd_requests until we (hopefully) get
+                 * back in sync.  The question then is if the kernel is
+                 * waiting for a response, then we're completely hosed.
+                 */
+#ifdef POTENTIAL_DISASTER
+                timetoleave = 1;
+                error       = EIO;
+#endif /* POTENTIAL_DISASTER */
+            }
+        } else {
+            if ((rlength == -1) && (errno != EINTR)) {
+                error = errno;
+                logmsg(ncp, 0, "[%s] kernel command read error: %s\n",
+                       ncp->svc_progname, strerror(error));
+            }
+        }
+
+        /*
+         * Check to see if we received a termination signal.
+         */
+        if (timetoleave == 1) {
+            /*
+             * Getting ready to punt.
+             */
+            if (ncp->svc_mount) {
+                pid_t cpid;
+
+                newsig.sa_sigaction = nbd_reapchild;
+                newsig.sa_flags     = SA_RESETHAND | SA_SIGINFO;
+                diedp               = (int *)&timetoleave;
+                toreapp             = (pid_t *)&whodied;
+                sigaction(SIGCHLD, &newsig, &oldsig);
+                timetoleave = 2;
+                switch ((cpid = fork())) {
+                case 0:
+                    /*
+                     * If we had an error, try to force the unmount.
+                     */
+                    if (error) {
+                        exit(umount2(ncp->svc_mount, MNT_FORCE));
                     } else {
-                        logmsg(ncp, 1,
-                               "NBD_WRITE: lead priming read fail %d (%s)\n",
-                               error, strerror(error));
+                        exit(umount(ncp->svc_mount));
                     }
                     break;
-                case NBD_CMD_READ:
-                    logmsg(ncp, 1, "NBD_READ 0x%x@0x%x\n", length, offset);
-                    if (!(error = image_seek(pctx, startblock)) &&
-                        !(error =
-                              image_readblocks(pctx, readbuf, blockcount))) {
-                        logmsg(ncp, 2, "NBD_READ image read success\n");
-                        replyappend = &readbuf[sboffs];
-                    } else {
-                        logmsg(ncp, 2, "NBD_READ image read fail %d (%s)\n",
-                               error, strerror(error));
-                    }
+                case -1:
+                    error = errno;
+                    logmsg(ncp, -1, "%s: cannot fork to unmount: %s\n",
+                           ncp->svc_progname, strerror(error));
+                    timetoleave = 3; /* Just punt. */
                     break;
                 default:
-                    error = EINVAL;
+                    ncp->svc_toreap = cpid;
                     break;
                 }
+            } else {
+                timetoleave = 3;
+            }
+        }
+    }
+#ifdef HAVE_LIBPTHREAD
+    if (pool)
+        nbd_pool_destroy(pool);
+#endif /* HAVE_LIBPTHREAD */
+    nbd_bufpool_destroy(ncp);
+    free(sjob.nj_edge);
+    if (ncp->svc_toreap) {
+        int   existat;
+        pid_t corpse;
+
+        if (whodied) {
+            corpse = waitpid(whodied, &existat, WNOHANG);
+        } else {
+            corpse = wait(&existat);
+        }
+        logmsg(ncp, 2, "%s: pid %d finished with %d\n", ncp->svc_progname,
+               corpse, existat);
+    }
+
+    /*
+     * Remove the pid file.
+     */
+    remove_pid_file(pidfile);
+    return error;
+}
+
+/*
+ * Serving over the network.
+ *
+ * Clients connect to a TCP or Unix domain socket, negotiate with the fixed
+ * newstyle handshake and then send requests just as the kernel does.  The
+ * image is the only export.  With threads, each connection is served by a
+ * thread of its own, all sharing the one image handle; without, they're
+ * served one after the other.
+ */
+
+/*
+ * Read exactly "len" bytes, retrying if we're interrupted but not if it's
+ * time to leave.
+ */
+static int
+nbd_recv(nbd_context_t *ncp, void *buf, size_t len,
+         volatile int *timetoleavep) {
+    int     error = 0;
+    char *  bp    = (char *)buf;
+    ssize_t rlength;
+
+    while (!error && len) {
+        while (((rlength = read(ncp->svc_fh, bp, len)) == -1) &&
+               (errno == EINTR) && (!*timetoleavep))
+            ;
+        if (rlength > 0) {
+            bp += rlength;
+            len -= rlength;
+        } else {
+            error = (rlength == 0) ? ECONNRESET : errno;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Reply to an option.  The reply data is "data" followed by "tail".
+ */
+static int
+nbd_option_reply(nbd_context_t *ncp, uint32_t option, uint32_t type,
+                 const void *data, uint32_t len, const void *tail,
+                 uint32_t tlen, volatile int *timetoleavep) {
+    struct nbd_option_reply reply;
+    struct iovec            iov[3];
+
+    reply.magic     = htobe64(NBD_REP_MAGIC);
+    reply.option    = htonl(option);
+    reply.type      = htonl(type);
+    reply.length    = htonl(len + tlen);
+    iov[0].iov_base = &reply;
+    iov[0].iov_len  = sizeof(reply);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len  = len;
+    iov[2].iov_base = (void *)tail;
+    iov[2].iov_len  = tlen;
+
+    return nbd_send_iov(ncp, iov, 3, timetoleavep);
+}
+
+/*
+ * Reply to an option with no data.
+ */
+static inline int
+nbd_option_status(nbd_context_t *ncp, uint32_t option, uint32_t type,
+                  volatile int *timetoleavep) {
+    return nbd_option_reply(ncp, option, type, NULL, 0, NULL, 0,
+                            timetoleavep);
+}
+
+/*
+ * Is "name" our export?  The empty name, the default export, is too.
+ */
+static int
+nbd_export_match(nbd_context_t *ncp, const unsigned char *name,
+                 uint32_t len) {
+    return !len || ((len == strlen(ncp->svc_export)) &&
+                    !memcmp(name, ncp->svc_export, len));
+}
+
+/*
+ * Answer NBD_OPT_INFO or NBD_OPT_GO: describe our export and anything
+ * else asked about that we know.  "*goodp" is set if the export was
+ * found.
+ */
+static int
+nbd_option_info(nbd_context_t *ncp, uint32_t option,
+                const unsigned char *data, uint32_t len, int *goodp,
+                volatile int *timetoleavep) {
+    int      error = 0;
+    uint32_t namelen;
+    uint16_t ninfo, iidx;
+    struct {
+        uint16_t type;
+        uint64_t size;
+        uint16_t flags;
+    } __attribute__((packed)) export;
+
+    *goodp = 0;
+    if (len < (sizeof(namelen) + sizeof(ninfo)))
+        return nbd_option_status(ncp, option, NBD_REP_ERR_INVALID,
+                                 timetoleavep);
+    memcpy(&namelen, data, sizeof(namelen));
+    namelen = ntohl(namelen);
+    if (namelen > (len - sizeof(namelen) - sizeof(ninfo)))
+        return nbd_option_status(ncp, option, NBD_REP_ERR_INVALID,
+                                 timetoleavep);
+    memcpy(&ninfo, &data[sizeof(namelen) + namelen], sizeof(ninfo));
+    ninfo = ntohs(ninfo);
+    if (len != (sizeof(namelen) + namelen + sizeof(ninfo) +
+                (ninfo * sizeof(uint16_t))))
+        return nbd_option_status(ncp, option, NBD_REP_ERR_INVALID,
+                                 timetoleavep);
+    if (!nbd_export_match(ncp, &data[sizeof(namelen)], namelen))
+        return nbd_option_status(ncp, option, NBD_REP_ERR_UNKNOWN,
+                                 timetoleavep);
+
+    export.type  = htons(NBD_INFO_EXPORT);
+    export.size  = htobe64(ncp->svc_blockcount * ncp->svc_blocksize);
+    export.flags = htons(nbd_export_flags(ncp));
+    error = nbd_option_reply(ncp, option, NBD_REP_INFO, &export,
+                             sizeof(export), NULL, 0, timetoleavep);
+    for (iidx = 0; !error && (iidx < ninfo); iidx++) {
+        const unsigned char *ip =
+            &data[sizeof(namelen) + namelen + sizeof(ninfo)];
+        uint16_t info;
+
+        memcpy(&info, &ip[iidx * sizeof(info)], sizeof(info));
+        switch (ntohs(info)) {
+        case NBD_INFO_NAME:
+            info  = htons(NBD_INFO_NAME);
+            error = nbd_option_reply(ncp, option, NBD_REP_INFO, &info,
+                                     sizeof(info), ncp->svc_export,
+                                     strlen(ncp->svc_export), timetoleavep);
+            break;
+        case NBD_INFO_BLOCK_SIZE: {
+            /*
+             * Any size will do, but whole sub-blocks are best.
+             */
+            struct {
+                uint16_t type;
+                uint32_t minimum;
+                uint32_t preferred;
+                uint32_t maximum;
+            } __attribute__((packed)) bsize;
+
+            bsize.type      = htons(NBD_INFO_BLOCK_SIZE);
+            bsize.minimum   = htonl(1);
+            bsize.preferred = htonl(ncp->svc_nbdblocksize);
+            bsize.maximum   = htonl(NBD_MAX_REQUEST);
+            error = nbd_option_reply(ncp, option, NBD_REP_INFO, &bsize,
+                                     sizeof(bsize), NULL, 0, timetoleavep);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    if (!error) {
+        *goodp = 1;
+        error  = nbd_option_status(ncp, option, NBD_REP_ACK, timetoleavep);
+    }
+
+    return error;
+}
+
+/*
+ * Does a metadata context query select base:allocation?  Listing accepts
+ * the whole "base:" namespace as well.
+ */
+static int
+nbd_meta_match(const unsigned char *query, uint32_t len, int listing) {
+    static const char base[] = "base:";
+
+    return ((len == strlen(NBD_META_BASE_ALLOCATION)) &&
+            !memcmp(query, NBD_META_BASE_ALLOCATION, len)) ||
+           (listing && (len == strlen(base)) && !memcmp(query, base, len));
+}
+
+/*
+ * Answer NBD_OPT_LIST_META_CONTEXT or NBD_OPT_SET_META_CONTEXT.  The only
+ * context we have is base:allocation, and setting it needs structured
+ * replies, which block status replies are.
+ */
+static int
+nbd_option_meta(nbd_context_t *ncp, uint32_t option,
+                const unsigned char *data, uint32_t len,
+                volatile int *timetoleavep) {
+    int                  error   = 0;
+    int                  listing = (option == NBD_OPT_LIST_META_CONTEXT);
+    int                  found   = 0;
+    const unsigned char *qp;
+    uint32_t             namelen, nqueries, qlen, qidx, left;
+
+    if (!listing && !ncp->svc_structured)
+        return nbd_option_status(ncp, option, NBD_REP_ERR_INVALID,
+                                 timetoleavep);
+    if (len < (sizeof(namelen) + sizeof(nqueries)))
+        return nbd_option_status(ncp, option, NBD_REP_ERR_INVALID,
+                                 timetoleavep);
+    memcpy(&namelen, data, sizeof(namelen));
+    namelen = ntohl(namelen);
+    if (namelen > (len - sizeof(namelen) - sizeof(nqueries)))
+        return nbd_option_status(ncp, option, NBD_REP_ERR_INVALID,
+                                 timetoleavep);
+    memcpy(&nqueries, &data[sizeof(namelen) + namelen], sizeof(nqueries));
+    nqueries = ntohl(nqueries);
+
+    /*
+     * Check the queries over before acting on any of them.
+     */
+    qp   = &data[sizeof(namelen) + namelen + sizeof(nqueries)];
+    left = len - (sizeof(namelen) + namelen + sizeof(nqueries));
+    for (qidx = 0; qidx < nqueries; qidx++) {
+        if (left < sizeof(qlen))
+            break;
+        memcpy(&qlen, qp, sizeof(qlen));
+        qlen = ntohl(qlen);
+        if (qlen > (left - sizeof(qlen)))
+            break;
+        if (nbd_meta_match(&qp[sizeof(qlen)], qlen, listing))
+            found = 1;
+        qp += sizeof(qlen) + qlen;
+        left -= sizeof(qlen) + qlen;
+    }
+    if ((qidx < nqueries) || left)
+        return nbd_option_status(ncp, option, NBD_REP_ERR_INVALID,
+                                 timetoleavep);
+    if (!nbd_export_match(ncp, &data[sizeof(namelen)], namelen))
+        return nbd_option_status(ncp, option, NBD_REP_ERR_UNKNOWN,
+                                 timetoleavep);
+
+    /*
+     * Listing with no queries lists everything.
+     */
+    if (listing && !nqueries)
+        found = 1;
+    if (!listing)
+        ncp->svc_allocation = found;
+    if (found) {
+        uint32_t id = htonl(NBD_META_ID_ALLOCATION);
+
+        error = nbd_option_reply(ncp, option, NBD_REP_META_CONTEXT, &id,
+                                 sizeof(id), NBD_META_BASE_ALLOCATION,
+                                 strlen(NBD_META_BASE_ALLOCATION),
+                                 timetoleavep);
+    }
+    if (!error)
+        error = nbd_option_status(ncp, option, NBD_REP_ACK, timetoleavep);
+
+    return error;
+}
+
+/*
+ * Negotiate with a new client, until it's ready to send requests.
+ */
+static int
+nbd_negotiate(nbd_context_t *ncp, volatile int *timetoleavep) {
+    int            error = 0;
+    int            done  = 0;
+    uint32_t       cflags;
+    unsigned char *data;
+    struct {
+        uint64_t magic;
+        uint64_t opts;
+        uint16_t flags;
+    } __attribute__((packed)) hello;
+
+    hello.magic = htobe64(NBD_INIT_MAGIC);
+    hello.opts  = htobe64(NBD_OPTS_MAGIC);
+    hello.flags = htons(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+    {
+        struct iovec iov;
+
+        iov.iov_base = &hello;
+        iov.iov_len  = sizeof(hello);
+        if ((error = nbd_send_iov(ncp, &iov, 1, timetoleavep)) ||
+            (error = nbd_recv(ncp, &cflags, sizeof(cflags), timetoleavep)))
+            return error;
+    }
+    cflags = ntohl(cflags);
+    if (cflags & ~(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES)) {
+        logmsg(ncp, 1, "[%s] unknown client flags %x\n", ncp->svc_progname,
+               cflags);
+        return EINVAL;
+    }
+    if (!(data = (unsigned char *)malloc(NBD_MAX_OPTION)))
+        return ENOMEM;
+
+    while (!error && !done) {
+        struct nbd_option opt;
+        uint32_t          option, len;
+        int               good;
+
+        if ((error = nbd_recv(ncp, &opt, sizeof(opt), timetoleavep)))
+            break;
+        option = ntohl(opt.option);
+        len    = ntohl(opt.length);
+        if ((be64toh(opt.magic) != NBD_OPTS_MAGIC) || (len > NBD_MAX_OPTION)) {
+            logmsg(ncp, 1, "[%s] bad option %d (%d bytes)\n",
+                   ncp->svc_progname, option, len);
+            error = EINVAL;
+            break;
+        }
+        if ((error = nbd_recv(ncp, data, len, timetoleavep)))
+            break;
+        logmsg(ncp, 1, "NBD_OPT %d\n", option);
+        switch (option) {
+        case NBD_OPT_EXPORT_NAME:
+            /*
+             * There's no way to say no, other than to hang up.
+             */
+            if (nbd_export_match(ncp, data, len)) {
+                struct {
+                    uint64_t size;
+                    uint16_t flags;
+                    char     zeroes[124];
+                } __attribute__((packed)) export;
+                struct iovec iov;
+
+                memset(&export, 0, sizeof(export));
+                export.size =
+                    htobe64(ncp->svc_blockcount * ncp->svc_blocksize);
+                export.flags = htons(nbd_export_flags(ncp));
+                iov.iov_base = &export;
+                iov.iov_len  = (cflags & NBD_FLAG_C_NO_ZEROES)
+                                   ? sizeof(export) - sizeof(export.zeroes)
+                                   : sizeof(export);
+                error = nbd_send_iov(ncp, &iov, 1, timetoleavep);
+                done  = 1;
+            } else {
+                error = ENOENT;
+            }
+            break;
+        case NBD_OPT_ABORT:
+            (void)nbd_option_status(ncp, option, NBD_REP_ACK, timetoleavep);
+            error = ECONNRESET;
+            break;
+        case NBD_OPT_LIST:
+            if (len) {
+                error = nbd_option_status(ncp, option, NBD_REP_ERR_INVALID,
+                                          timetoleavep);
+            } else {
+                uint32_t namelen = htonl(strlen(ncp->svc_export));
+
+                if (!(error = nbd_option_reply(
+                          ncp, option, NBD_REP_SERVER, &namelen,
+                          sizeof(namelen), ncp->svc_export,
+                          strlen(ncp->svc_export), timetoleavep)))
+                    error = nbd_option_status(ncp, option, NBD_REP_ACK,
+                                              timetoleavep);
+            }
+            break;
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO:
+            if (!(error = nbd_option_info(ncp, option, data, len, &good,
+                                          timetoleavep)) &&
+                good && (option == NBD_OPT_GO))
+                done = 1;
+            break;
+        case NBD_OPT_LIST_META_CONTEXT:
+        case NBD_OPT_SET_META_CONTEXT:
+            error = nbd_option_meta(ncp, option, data, len, timetoleavep);
+            break;
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (len) {
+                error = nbd_option_status(ncp, option, NBD_REP_ERR_INVALID,
+                                          timetoleavep);
+            } else {
+                ncp->svc_structured = 1;
+                error = nbd_option_status(ncp, option, NBD_REP_ACK,
+                                          timetoleavep);
+            }
+            break;
+        default:
+            error =
+                nbd_option_status(ncp, option, NBD_REP_ERR_UNSUP, timetoleavep);
+            break;
+        }
+    }
+    free(data);
+
+    return error;
+}
 
-                reply.magic = htonl(NBD_REPLY_MAGIC);
-                reply.error = error;
-                memcpy(reply.handle, request.handle, 8);
+/*
+ * Serve a connection, from negotiation until the client disconnects.
+ */
+static int
+nbd_serve_connection(nbd_context_t *ncp, void *pctx,
+                     volatile int *timetoleavep) {
+    int              error;
+    nbd_job_t        sjob;
+    struct nbd_pool *pool = (struct nbd_pool *)NULL;
 
-                /*
-                 * Retry the write if we're interrupted but if it's not time
-                 * to leave.
-                 */
-                while (((rlength = write(ncp->svc_fh, &reply, sizeof(reply))) ==
-                        -1) &&
-                       (errno == EINTR) && (!timetoleave))
-                    ;
-                if (rlength == sizeof(reply)) {
-                    /*
-                     * Write the reply appendage if it's a read and there
-                     * was no error.
-                     */
-                    if ((request.type == htonl(NBD_CMD_READ)) &&
-                        (reply.error == 0)) {
-                        /*
-                         * Write the data reply.
-                         */
-                        while (((rlength = write(ncp->svc_fh, replyappend,
-                                                 length)) == -1) &&
-                               (errno == EINTR) && (!timetoleave))
-                            ;
-                        if (rlength == length) {
-                            error = 0;
-                        } else {
-                            if (rlength == -1) {
-                                error = errno;
-                                logmsg(ncp, 0,
-                                       "[%s] reply addendum write error: %s\n",
-                                       ncp->svc_progname, strerror(error));
-                            }
-                        }
-                    }
+    memset(&sjob, 0, sizeof(sjob));
+    if (!(error = nbd_negotiate(ncp, timetoleavep)) &&
+        !(error = nbd_bufpool_create(ncp))) {
+        logmsg(ncp, 1, "[%s] client ready%s%s\n", ncp->svc_progname,
+               (ncp->svc_structured) ? " (structured replies)" : "",
+               (ncp->svc_allocation) ? " (block status)" : "");
+#ifdef HAVE_LIBPTHREAD
+        if (ncp->svc_nworkers)
+            error = nbd_pool_create(ncp, pctx, timetoleavep, &pool);
+#endif /* HAVE_LIBPTHREAD */
+        while (!error && !*timetoleavep) {
+            struct nbd_request request;
+
+            if (!(error = nbd_recv(ncp, &request, sizeof(request),
+                                   timetoleavep))) {
+                if (request.magic == htonl(NBD_REQUEST_MAGIC)) {
+                    (void)nbd_handle_request(ncp, pctx, pool, &sjob, &request,
+                                             timetoleavep);
                 } else {
-                    if ((rlength == -1) && (errno != EINTR)) {
-                        error = errno;
-                        logmsg(ncp, 0, "[%s] reply write error: %s\n",
-                               ncp->svc_progname, strerror(error));
-                    }
+                    logmsg(ncp, 1, "[%s] Bad message from client: %08x\n",
+                           ncp->svc_progname, request.magic);
+                    error = EINVAL;
                 }
-            } else {
-                logmsg(ncp, 1, "[%s] Bad message from kernel: %08x\n",
-                       ncp->svc_progname, request.magic);
-                /*
-                 * It's unclear what to do here.  We've obviously lost sync
-                 * with the kernel.  Will reading 32-bit quantities until we
-                 * get back in sync work?  I dunno.  Without the following
-                 * snippet, we read nbd_requests until we (hopefully) get
-                 * back in sync.  The question then is if the kernel is
-                 * waiting for a response, then we're completely hosed.
-                 */
-#ifdef POTENTIAL_DISASTER
-                timetoleave = 1;
-                error       = EIO;
-#endif /* POTENTIAL_DISASTER */
             }
+        }
+#ifdef HAVE_LIBPTHREAD
+        if (pool)
+            nbd_pool_destroy(pool);
+#endif /* HAVE_LIBPTHREAD */
+        nbd_bufpool_destroy(ncp);
+    }
+    free(sjob.nj_edge);
+
+    /*
+     * Hanging up is how clients usually leave.
+     */
+    return (error == ECONNRESET) ? 0 : error;
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * A connection, and the thread serving it.
+ */
+typedef struct nbd_conn {
+    nbd_context_t    cn_context;     /* Service context for connection */
+    void *           cn_pctx;        /* Image handle */
+    pthread_t        cn_thread;      /* Our thread */
+    volatile int     cn_timetoleave; /* Termination flag */
+    int              cn_done;        /* Thread has finished */
+    struct nbd_conn *cn_next;        /* List linkage */
+} nbd_conn_t;
+
+/*
+ * Connection thread.  The socket is shut down, so that the client knows
+ * we're through, but it's closed when the thread is reaped.
+ */
+static void *
+nbd_conn_thread(void *arg) {
+    nbd_conn_t *   cnp = (nbd_conn_t *)arg;
+    nbd_context_t *ncp = &cnp->cn_context;
+    int            error;
+
+    if ((error = nbd_serve_connection(ncp, cnp->cn_pctx,
+                                      &cnp->cn_timetoleave))) {
+        logmsg(ncp, 1, "[%s] connection closed: %s\n", ncp->svc_progname,
+               strerror(error));
+    }
+    (void)shutdown(ncp->svc_fh, SHUT_RDWR);
+    __atomic_store_n(&cnp->cn_done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/*
+ * Start a thread to serve a new connection.
+ */
+static int
+nbd_conn_start(nbd_context_t *ncp, void *pctx, int cfd, nbd_conn_t **listp) {
+    int         error = ENOMEM;
+    nbd_conn_t *cnp;
+    sigset_t    oldmask;
+
+    if ((cnp = (nbd_conn_t *)calloc(1, sizeof(*cnp)))) {
+        cnp->cn_context        = *ncp;
+        cnp->cn_context.svc_fh = cfd;
+        cnp->cn_pctx           = pctx;
+        nbd_block_signals(&oldmask);
+        error = pthread_create(&cnp->cn_thread, (pthread_attr_t *)NULL,
+                               nbd_conn_thread, cnp);
+        pthread_sigmask(SIG_SETMASK, &oldmask, (sigset_t *)NULL);
+        if (!error) {
+            cnp->cn_next = *listp;
+            *listp       = cnp;
         } else {
-            if ((rlength == -1) && (errno != EINTR)) {
-                error = errno;
-                logmsg(ncp, 0, "[%s] kernel command read error: %s\n",
-                       ncp->svc_progname, strerror(error));
-            }
+            free(cnp);
         }
+    }
 
-        /*
-         * Check to see if we received a termination signal.
-         */
-        if (timetoleave == 1) {
+    return error;
+}
+
+/*
+ * Reap finished connections, or all of them if it's time to leave.
+ */
+static void
+nbd_conn_reap(nbd_conn_t **listp, int all) {
+    nbd_conn_t **cpp = listp;
+
+    while (*cpp) {
+        nbd_conn_t *cnp = *cpp;
+
+        if (all || __atomic_load_n(&cnp->cn_done, __ATOMIC_ACQUIRE)) {
             /*
-             * Getting ready to punt.
+             * Waking the thread up is enough to get it to finish.
              */
-            if (ncp->svc_mount) {
-                pid_t cpid;
+            cnp->cn_timetoleave = 1;
+            (void)shutdown(cnp->cn_context.svc_fh, SHUT_RDWR);
+            pthread_join(cnp->cn_thread, (void **)NULL);
+            close(cnp->cn_context.svc_fh);
+            *cpp = cnp->cn_next;
+            free(cnp);
+        } else {
+            cpp = &cnp->cn_next;
+        }
+    }
+}
+#endif /* HAVE_LIBPTHREAD */
 
-                newsig.sa_sigaction = nbd_reapchild;
-                newsig.sa_flags     = SA_RESETHAND | SA_SIGINFO;
-                diedp               = (int *)&timetoleave;
-                toreapp             = (pid_t *)&whodied;
-                sigaction(SIGCHLD, &newsig, &oldsig);
-                timetoleave = 2;
-                switch ((cpid = fork())) {
-                case 0:
-                    /*
-                     * If we had an error, try to force the unmount.
-                     */
-                    if (error) {
-                        exit(umount2(ncp->svc_mount, MNT_FORCE));
-                    } else {
-                        exit(umount(ncp->svc_mount));
-                    }
-                    break;
-                case -1:
+/*
+ * Create the listening socket.  An address with a slash in it is the path
+ * of a Unix domain socket; otherwise it's [host][:port].
+ */
+static int
+nbd_listen_socket(nbd_context_t *ncp, int *lfdp) {
+    int error = 0;
+    int lfd   = -1;
+
+    if (strchr(ncp->svc_listen, '/')) {
+        struct sockaddr_un sun;
+        struct stat        sbuf;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(ncp->svc_listen) < sizeof(sun.sun_path)) {
+            strcpy(sun.sun_path, ncp->svc_listen);
+            /*
+             * Clear away what's left from a previous run.
+             */
+            if (!lstat(sun.sun_path, &sbuf) && S_ISSOCK(sbuf.st_mode))
+                (void)unlink(sun.sun_path);
+            if (((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+                bind(lfd, (struct sockaddr *)&sun, sizeof(sun)) ||
+                listen(lfd, SOMAXCONN))
+                error = errno;
+        } else {
+            error = ENAMETOOLONG;
+        }
+    } else {
+        char *          host = strdup(ncp->svc_listen);
+        char *          port = NBD_DEFAULT_PORT;
+        char *          cp;
+        struct addrinfo hints, *ai, *aip;
+        int             gerror;
+
+        if (!host)
+            return ENOMEM;
+        if ((host[0] == '[') && (cp = strchr(host, ']'))) {
+            *cp++ = '\0';
+            memmove(host, &host[1], strlen(&host[1]) + 1);
+            cp -= 1;
+            if (*cp == ':')
+                port = cp + 1;
+            else if (*cp)
+                error = EINVAL;
+        } else if ((cp = strrchr(host, ':'))) {
+            *cp  = '\0';
+            port = cp + 1;
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags    = AI_PASSIVE;
+        if (!error && (gerror = getaddrinfo((*host) ? host : (char *)NULL,
+                                            port, &hints, &ai))) {
+            logmsg(ncp, -1, "%s: %s: %s\n", ncp->svc_progname,
+                   ncp->svc_listen, gai_strerror(gerror));
+            error = EINVAL;
+        } else if (!error) {
+            error = EADDRNOTAVAIL;
+            for (aip = ai; aip && error; aip = aip->ai_next) {
+                int on = 1;
+
+                if ((lfd = socket(aip->ai_family, aip->ai_socktype,
+                                  aip->ai_protocol)) < 0) {
                     error = errno;
-                    logmsg(ncp, -1, "%s: cannot fork to unmount: %s\n",
-                           ncp->svc_progname, strerror(error));
-                    timetoleave = 3; /* Just punt. */
-                    break;
-                default:
-                    ncp->svc_toreap = cpid;
-                    break;
+                    continue;
+                }
+                (void)setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on,
+                                 sizeof(on));
+                if (bind(lfd, aip->ai_addr, aip->ai_addrlen) ||
+                    listen(lfd, SOMAXCONN)) {
+                    error = errno;
+                    close(lfd);
+                    lfd = -1;
+                } else {
+                    error = 0;
                 }
-            } else {
-                timetoleave = 3;
             }
+            freeaddrinfo(ai);
         }
+        free(host);
     }
-    if (ncp->svc_toreap) {
-        int   existat;
-        pid_t corpse;
+    if (error && (lfd >= 0)) {
+        close(lfd);
+        lfd = -1;
+    }
+    *lfdp = lfd;
 
-        if (whodied) {
-            corpse = waitpid(whodied, &existat, WNOHANG);
-        } else {
-            corpse = wait(&existat);
+    return error;
+}
+
+/*
+ * Serve the image over the network, on the socket from nbd_listen_socket(),
+ * until we're told to stop.
+ */
+static int
+nbd_listen_requests(nbd_context_t *ncp, void *pctx, int lfd) {
+    char *           pidfile     = (char *)NULL;
+    int              error       = 0;
+    volatile int     timetoleave = 0;
+    struct sigaction newsig, oldsig;
+#ifdef HAVE_LIBPTHREAD
+    nbd_conn_t *conns = (nbd_conn_t *)NULL;
+#endif /* HAVE_LIBPTHREAD */
+
+    nbd_geometry(ncp, pctx);
+
+    /*
+     * Prepare termination signal handlers.  Clients going away shouldn't
+     * take us with them.
+     */
+    finishflag = (int *)&timetoleave;
+    memset(&newsig, 0, sizeof(newsig));
+    newsig.sa_sigaction = nbd_finish;
+    sigaction(SIGINT, &newsig, &oldsig);
+    sigaction(SIGHUP, &newsig, &oldsig);
+    sigaction(SIGTERM, &newsig, &oldsig);
+    sigaction(SIGQUIT, &newsig, &oldsig);
+    memset(&newsig, 0, sizeof(newsig));
+    newsig.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &newsig, &oldsig);
+
+    create_pid_file(ncp, getpid(), &pidfile);
+    logmsg(ncp, 0, "Serving \"%s\" on %s.\n", ncp->svc_export,
+           ncp->svc_listen);
+
+    while (!timetoleave) {
+        int cfd    = accept(lfd, (struct sockaddr *)NULL, (socklen_t *)NULL);
+        int aerror = (cfd < 0) ? errno : 0;
+        int on     = 1;
+
+#ifdef HAVE_LIBPTHREAD
+        nbd_conn_reap(&conns, 0);
+#endif /* HAVE_LIBPTHREAD */
+        if (cfd < 0) {
+            switch (aerror) {
+            case EINTR:
+            case ECONNABORTED:
+                break;
+            case EMFILE:
+            case ENFILE:
+            case ENOBUFS:
+            case ENOMEM:
+                logmsg(ncp, 0, "[%s] accept: %s\n", ncp->svc_progname,
+                       strerror(aerror));
+                sleep(1);
+                break;
+            default:
+                error = aerror;
+                logmsg(ncp, -1, "%s: accept failed: %s\n", ncp->svc_progname,
+                       strerror(error));
+                timetoleave = 1;
+                break;
+            }
+            continue;
         }
-        logmsg(ncp, 2, "%s: pid %d finished with %d\n", ncp->svc_progname,
-               corpse, existat);
+        (void)setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        logmsg(ncp, 1, "[%s] new connection\n", ncp->svc_progname);
+#ifdef HAVE_LIBPTHREAD
+        if ((error = nbd_conn_start(ncp, pctx, cfd, &conns))) {
+            logmsg(ncp, 0, "[%s] cannot serve connection: %s\n",
+                   ncp->svc_progname, strerror(error));
+            close(cfd);
+            error = 0;
+        }
+#else  /* HAVE_LIBPTHREAD */
+        {
+            nbd_context_t cnc = *ncp;
+
+            cnc.svc_fh = cfd;
+            if ((error = nbd_serve_connection(&cnc, pctx, &timetoleave))) {
+                logmsg(ncp, 1, "[%s] connection closed: %s\n",
+                       ncp->svc_progname, strerror(error));
+                error = 0;
+            }
+            close(cfd);
+        }
+#endif /* HAVE_LIBPTHREAD */
     }
+    close(lfd);
+    if (strchr(ncp->svc_listen, '/'))
+        (void)unlink(ncp->svc_listen);
+#ifdef HAVE_LIBPTHREAD
+    nbd_conn_reap(&conns, 1);
+#endif /* HAVE_LIBPTHREAD */
 
     /*
      * Remove the pid file.
@@ -750,7 +2614,11 @@ nbd_daemon_mode(nbd_context_t *ncp, void *pctx) {
         logmsg(ncp, 0,
                "Daemonizing process. Further log output will be written to the "
                "system log.\n");
-        if (daemon(0, 1) < 0) {
+        /*
+         * A Unix domain socket may have a relative path, which we'll need
+         * again to remove it.
+         */
+        if (daemon((ncp->svc_listen) ? 1 : 0, 1) < 0) {
             error = errno;
             logmsg(ncp, -1, "%s: daemon failed: %s\n", ncp->svc_progname,
                    strerror(error));
@@ -762,6 +2630,140 @@ nbd_daemon_mode(nbd_context_t *ncp, void *pctx) {
     return error;
 }
 
+/*
+ * Start loading the image lazily (if specified).  As for the cache, this
+ * is done once we're in the process which serves requests.
+ */
+static void
+nbd_lazy_start(nbd_context_t *ncp, void *pctx) {
+    if (ncp->svc_lazy)
+        (void)image_lazy_load(pctx, ncp->svc_lazy == SVC_LAZY_STRICT);
+}
+
+/*
+ * Start the cache (if specified).  This is done once we're in the process
+ * which serves requests, so that the prefetch thread is there too.
+ */
+static void
+nbd_cache_start(nbd_context_t *ncp, void *pctx) {
+    int error;
+
+    if (ncp->svc_cachesize &&
+        (error = image_cache_enable(pctx, ncp->svc_cachesize << 20,
+                                    ncp->svc_readahead << 20))) {
+        logmsg(ncp, -1, "%s: cannot cache: %s\n", ncp->svc_progname,
+               strerror(error));
+    }
+}
+
+/*
+ * Report how the cache did.
+ */
+static void
+nbd_cache_report(nbd_context_t *ncp, void *pctx) {
+    image_cache_stats_t stats;
+
+    if (!image_cache_stats(pctx, &stats)) {
+        logmsg(ncp, 0,
+               "%s: cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+               " prefetched (%" PRIu64 " used), %" PRIu64 " invalidated\n",
+               ncp->svc_progname, stats.ics_hits, stats.ics_misses,
+               stats.ics_prefetches, stats.ics_prefetch_hits,
+               stats.ics_invalidations);
+    }
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * The stats refresher, which rewrites the stats file every so often
+ * until told to stop.
+ */
+static pthread_t       nbd_stats_thread;
+static pthread_mutex_t nbd_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  nbd_stats_cond = PTHREAD_COND_INITIALIZER;
+static int             nbd_stats_running;
+static int             nbd_stats_stopping;
+
+static void *
+nbd_stats_refresher(void *arg) {
+    nbd_context_t * ncp = (nbd_context_t *)arg;
+    struct timespec when;
+    int             error;
+
+    pthread_mutex_lock(&nbd_stats_lock);
+    clock_gettime(CLOCK_REALTIME, &when);
+    while (!nbd_stats_stopping) {
+        when.tv_sec += ncp->svc_statsinterval;
+        while (!nbd_stats_stopping &&
+               (pthread_cond_timedwait(&nbd_stats_cond, &nbd_stats_lock,
+                                       &when) != ETIMEDOUT))
+            ;
+        if (!nbd_stats_stopping &&
+            (error = stats_write_file(ncp->svc_statsfile, "imagemount"))) {
+            logmsg(ncp, 1, "%s: cannot write %s: %s\n", ncp->svc_progname,
+                   ncp->svc_statsfile, strerror(error));
+        }
+    }
+    pthread_mutex_unlock(&nbd_stats_lock);
+
+    return (void *)NULL;
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/*
+ * Start counting (if a stats file is specified), and keep the stats file
+ * up to date.  Like the cache, this is done in the process which serves
+ * requests.
+ */
+static void
+nbd_stats_start(nbd_context_t *ncp) {
+    if (ncp->svc_statsfile) {
+        stats_enable();
+#ifdef HAVE_LIBPTHREAD
+        if (ncp->svc_statsinterval > 0) {
+            sigset_t oldmask;
+            int      error;
+
+            nbd_block_signals(&oldmask);
+            if ((error = pthread_create(&nbd_stats_thread,
+                                        (pthread_attr_t *)NULL,
+                                        nbd_stats_refresher, ncp))) {
+                logmsg(ncp, -1, "%s: cannot start stats refresher: %s\n",
+                       ncp->svc_progname, strerror(error));
+            } else {
+                nbd_stats_running = 1;
+            }
+            pthread_sigmask(SIG_SETMASK, &oldmask, (sigset_t *)NULL);
+        }
+#endif /* HAVE_LIBPTHREAD */
+    }
+}
+
+/*
+ * Stop the refresher and write the stats file a last time.
+ */
+static void
+nbd_stats_stop(nbd_context_t *ncp) {
+    int error;
+
+    if (ncp->svc_statsfile) {
+#ifdef HAVE_LIBPTHREAD
+        if (nbd_stats_running) {
+            pthread_mutex_lock(&nbd_stats_lock);
+            nbd_stats_stopping = 1;
+            pthread_cond_signal(&nbd_stats_cond);
+            pthread_mutex_unlock(&nbd_stats_lock);
+            pthread_join(nbd_stats_thread, (void **)NULL);
+            nbd_stats_running = 0;
+        }
+#endif /* HAVE_LIBPTHREAD */
+        if ((error = stats_write_file(ncp->svc_statsfile, "imagemount"))) {
+            logmsg(ncp, 0, "%s: cannot write %s: %s\n", ncp->svc_progname,
+                   ncp->svc_statsfile, strerror(error));
+        }
+    }
+}
+
 /*
  * The main routine.
  */
@@ -769,22 +2771,34 @@ int
 main(int argc, char *argv[]) {
     int           option;
     extern char * optarg;
-    char *        file  = (char *)NULL;
-    char *        cfile = (char *)NULL;
-    int           error = 0;
-    nbd_context_t nc;
+    char *                   file      = (char *)NULL;
+    char *                   cfile     = (char *)NULL;
+    char *                   statspath = (char *)NULL;
+    int                      error     = 0;
+    int                      uring     = 0;
+    const sysdep_dispatch_t *sysdep    = &posix_dispatch;
+    nbd_context_t            nc;
 
     memset(&nc, 0, sizeof(nc));
-    nc.nbd_fh          = -1;
-    nc.nbd_timeout     = -1;
-    nc.svc_fh          = -1;
-    nc.svc_daemon_mode = 1;
+    nc.nbd_fh            = -1;
+    nc.nbd_timeout       = -1;
+    nc.svc_fh            = -1;
+    nc.svc_daemon_mode   = 1;
+    nc.svc_readahead     = 4;
+    nc.svc_statsinterval = 10;
 
     /*
      * Parse options.
      */
-    while ((option = getopt(argc, argv, "c:d:f:v:i:m:t:DrwTR")) != -1) {
+    while ((option = getopt(argc, argv,
+                            "a:b:c:d:f:l:v:i:m:n:s:t:uDrwB:L:S:TRC")) != -1) {
         switch (option) {
+        case 'a':
+            sscanf(optarg, "%" SCNu64, &nc.svc_readahead);
+            break;
+        case 'b':
+            sscanf(optarg, "%" SCNu64, &nc.svc_cachesize);
+            break;
         case 'c':
             cfile = optarg;
             break;
@@ -794,6 +2808,9 @@ main(int argc, char *argv[]) {
         case 'f':
             file = optarg;
             break;
+        case 'l':
+            nc.svc_listen = optarg;
+            break;
         case 'v':
             sscanf(optarg, "%d", &nc.svc_verbose);
             break;
@@ -803,9 +2820,29 @@ main(int argc, char *argv[]) {
         case 'm':
             nc.svc_mount = optarg;
             break;
+        case 'n':
+            sscanf(optarg, "%d", &nc.svc_nworkers);
+            if (nc.svc_nworkers < 0)
+                error = 1;
+#ifndef HAVE_LIBPTHREAD
+            if (nc.svc_nworkers) {
+                fprintf(stderr, "%s: workers not supported\n", argv[0]);
+                error = 1;
+            }
+#endif /* HAVE_LIBPTHREAD */
+            break;
+        case 's':
+            nc.svc_statsfile = optarg;
+            break;
+        case 'S':
+            sscanf(optarg, "%d", &nc.svc_statsinterval);
+            break;
         case 't':
             nc.svc_mtype = optarg;
             break;
+        case 'u':
+            uring = !uring;
+            break;
         case 'D':
             nc.svc_daemon_mode = !nc.svc_daemon_mode;
             break;
@@ -821,6 +2858,24 @@ main(int argc, char *argv[]) {
         case 'R':
             nc.svc_raw_available = !nc.svc_raw_available;
             break;
+        case 'C':
+            nc.svc_verify_reads = !nc.svc_verify_reads;
+            break;
+        case 'B':
+            sscanf(optarg, "%" SCNu64, &nc.svc_nbdblocksize);
+            if ((nc.svc_nbdblocksize < NBD_MIN_BLOCKSIZE) ||
+                (nc.svc_nbdblocksize > NBD_MAX_BLOCKSIZE) ||
+                (nc.svc_nbdblocksize & (nc.svc_nbdblocksize - 1)))
+                error = 1;
+            break;
+        case 'L':
+            if (strcmp(optarg, "fast") == 0)
+                nc.svc_lazy = SVC_LAZY_FAST;
+            else if (strcmp(optarg, "strict") == 0)
+                nc.svc_lazy = SVC_LAZY_STRICT;
+            else
+                error = 1;
+            break;
         default:
             error = 1;
             break;
@@ -831,18 +2886,53 @@ main(int argc, char *argv[]) {
                "the system log.\n");
     }
 
+    /*
+     * We either attach to an nbd device or serve the network, not both.
+     */
+    if ((!nc.nbd_dev == !nc.svc_listen) || (nc.svc_listen && nc.svc_mount))
+        error = 1;
+
+    /*
+     * Daemonizing may change directory, so the stats file needs a full
+     * path.
+     */
+    if (!error && nc.svc_statsfile && (nc.svc_statsfile[0] != '/')) {
+        char  cwd[PATH_MAX];
+        char *path;
+
+        if (getcwd(cwd, sizeof(cwd)) &&
+            (path = (char *)malloc(strlen(cwd) + strlen(nc.svc_statsfile) +
+                                   2))) {
+            sprintf(path, "%s/%s", cwd, nc.svc_statsfile);
+            nc.svc_statsfile = path;
+            statspath        = path;
+        } else {
+            fprintf(stderr, "%s: cannot find the full path: %s\n",
+                    nc.svc_statsfile, strerror(errno));
+            error = 1;
+        }
+    }
+
     /*
      * If successful, then do it!.
      */
-    if (!error && nc.nbd_dev && file) {
+    if (!error && file) {
         void *pctx = (void *)NULL;
+        /*
+         * Use io_uring for image I/O (if specified and available).
+         */
+        if (uring && (error = sysdep_uring_init(&sysdep))) {
+            fprintf(stderr, "%s: io_uring not available: %s\n", argv[0],
+                    strerror(error));
+            error = 0;
+        }
         /*
          * Open the image.
          */
         if (!(error =
                   image_open(file, cfile,
                              (nc.svc_rdonly) ? SYSDEP_OPEN_RO : SYSDEP_OPEN_RW,
-                             &posix_dispatch, nc.svc_raw_available, &pctx))) {
+                             sysdep, nc.svc_raw_available, &pctx))) {
             logmsg(&nc, 0, "Preparing \"%s\"...\n", file);
             /*
              * Set tolerant mode (if specified).
@@ -850,28 +2940,78 @@ main(int argc, char *argv[]) {
             if (nc.svc_tolerant) {
                 image_tolerant_mode(pctx);
             }
+            /*
+             * Check checksums on read (if specified).
+             */
+            if (nc.svc_verify_reads &&
+                (error = image_verify_reads(pctx)) != 0) {
+                fprintf(stderr, "%s: cannot check checksums: %s\n", file,
+                        strerror(error));
+                error = 0;
+            }
+            /*
+             * Load the bitmap lazily (if specified).
+             */
+            if (nc.svc_lazy &&
+                (error = image_lazy_load(pctx,
+                                         nc.svc_lazy == SVC_LAZY_STRICT))) {
+                fprintf(stderr, "%s: cannot load lazily: %s\n", file,
+                        strerror(error));
+                error = 0;
+            }
             /*
              * Verify the image.
              */
             if (!(error = image_verify(pctx))) {
                 nc.svc_progname = argv[0];
+                nc.svc_export   = (char *)my_strrchr(file, '/');
                 /*
                  * Initialize the logger and check capabilities.
                  */
                 loginit(&nc);
-                if (!(error = nbd_check_capabilities(&nc, pctx))) {
+                if (nc.svc_listen) {
+                    int lfd = -1;
+
+                    /*
+                     * Serve the network.  No special capabilities needed,
+                     * and we listen before daemonizing so that problems
+                     * with the address are reported.
+                     */
+                    if ((error = nbd_listen_socket(&nc, &lfd))) {
+                        fprintf(stderr, "%s: cannot listen: %s\n",
+                                nc.svc_listen, strerror(error));
+                    } else if (!(error = nbd_daemon_mode(&nc, pctx))) {
+                        nbd_lazy_start(&nc, pctx);
+                        nbd_cache_start(&nc, pctx);
+                        nbd_stats_start(&nc);
+                        error = nbd_listen_requests(&nc, pctx, lfd);
+                        nbd_stats_stop(&nc);
+                        nbd_cache_report(&nc, pctx);
+                        if (error) {
+                            logmsg(&nc, 0, "%s: complete: %s\n", argv[0],
+                                   strerror(error));
+                        }
+                    } else {
+                        close(lfd);
+                    }
+                } else if (!(error = nbd_check_capabilities(&nc, pctx))) {
                     /*
                      * Enter daemon mode - no more stderr messages if so.
                      */
                     if (!(error = nbd_daemon_mode(&nc, pctx))) {
+                        nbd_lazy_start(&nc, pctx);
                         /*
                          * Connect to the nbd device.
                          */
                         if (!(error = nbd_connect(&nc, pctx))) {
+                            nbd_cache_start(&nc, pctx);
+                            nbd_stats_start(&nc);
                             /*
                              * Process requests.
                              */
                             error = nbd_service_requests(&nc, pctx);
+                            nbd_stats_stop(&nc);
+                            nbd_cache_report(&nc, pctx);
                             if (error) {
                                 if (error != EINTR) {
                                     logmsg(&nc, 0, "%s: complete: %s\n",
@@ -909,12 +3049,17 @@ main(int argc, char *argv[]) {
         } else {
             fprintf(stderr, "%s: cannot open: %s\n", file, strerror(error));
         }
+        if (sysdep != &posix_dispatch)
+            sysdep_uring_finish();
     } else {
         fprintf(stderr,
-                "%s: usage %s -d disk -f file [-c cfile] "
-                "[-m mount [-t type]] [-i timeout] [-v verbose] [-Drw]\n",
+                "%s: usage %s {-d disk | -l address} -f file [-c cfile] "
+                "[-m mount [-t type]] [-i timeout] [-n workers] "
+                "[-b cachemb [-a readaheadmb]] [-s statsfile [-S seconds]] "
+                "[-B blocksize] [-L fast|strict] [-v verbose] [-uDrwTRC]\n",
                 argv[0], argv[0]);
     }
+    free(statspath);
 
     return error;
 }
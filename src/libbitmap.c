@@ -0,0 +1,507 @@
+/*
+ * libbitmap.c - Packed usage bitmap with rank directory.
+ */
+/*
+ * Copyright (c) 2010, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "libbitmap.h"
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_LIBPTHREAD
+#    include <pthread.h>
+#    include <unistd.h>
+#endif /* HAVE_LIBPTHREAD */
+#ifdef __SSE2__
+#    include <emmintrin.h>
+#endif /* __SSE2__ */
+
+/*
+ * Bitmaps at least this big have their rank directory built by several
+ * threads.
+ */
+#define BM_THREAD_MIN_BITS ((uint64_t)1 << 26)
+#define BM_MAX_THREADS     8
+
+/*
+ * Number of words needed to hold "nbits" bits.
+ */
+static inline uint64_t
+bitmap_nwords(uint64_t nbits) {
+    return (nbits + BM_WORD_BITS - 1) >> BM_WORD_SHIFT;
+}
+
+/*
+ * Allocate a cleared bitmap of "nbits" bits.  The rank directory is not
+ * allocated until bitmap_build_rank().
+ */
+int
+bitmap_create(const sysdep_dispatch_t *sysdep, uint64_t nbits,
+              bitmap_t **bmpp) {
+    int       error = EINVAL;
+    bitmap_t *bmp;
+
+    if ((error = (*sysdep->sys_malloc)(&bmp, sizeof(*bmp))) == 0) {
+        memset(bmp, 0, sizeof(*bmp));
+        bmp->bm_nbits  = nbits;
+        bmp->bm_sysdep = sysdep;
+        /*
+         * Always round up to whole groups so that rank queries never have to
+         * worry about running into the end of the words.
+         */
+        if ((error = (*sysdep->sys_malloc)(
+                 &bmp->bm_words, ((nbits >> BM_GROUP_SHIFT) + 1) *
+                                     BM_GROUP_WORDS * sizeof(uint64_t))) == 0) {
+            memset(bmp->bm_words, 0,
+                   ((nbits >> BM_GROUP_SHIFT) + 1) * BM_GROUP_WORDS *
+                       sizeof(uint64_t));
+            *bmpp = bmp;
+        } else {
+            (void)(*sysdep->sys_free)(bmp);
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Lengths in bytes of the words, superblock counts and group counts of a
+ * bitmap of "nbits" bits, with its rank directory.
+ */
+void
+bitmap_sizes(uint64_t nbits, uint64_t *wlenp, uint64_t *slenp,
+             uint64_t *glenp) {
+    uint64_t ngroups = (nbits >> BM_GROUP_SHIFT) + 1;
+
+    *wlenp = ngroups * BM_GROUP_WORDS * sizeof(uint64_t);
+    *slenp = ((nbits >> BM_SUPER_SHIFT) + 1) * sizeof(uint64_t);
+    *glenp = ngroups * sizeof(uint16_t);
+}
+
+/*
+ * Make a bitmap of "nbits" bits, "nset" of them set, from the words and
+ * rank directory of one kept elsewhere, as laid out by bitmap_sizes().
+ * They must stay put, unchanged, until the bitmap is destroyed, and aren't
+ * freed with it.
+ */
+int
+bitmap_attach(const sysdep_dispatch_t *sysdep, uint64_t nbits, uint64_t nset,
+              const void *words, const void *super, const void *group,
+              bitmap_t **bmpp) {
+    int       error;
+    bitmap_t *bmp;
+
+    if ((error = (*sysdep->sys_malloc)(&bmp, sizeof(*bmp))) == 0) {
+        memset(bmp, 0, sizeof(*bmp));
+        bmp->bm_words  = (uint64_t *)words;
+        bmp->bm_super  = (uint64_t *)super;
+        bmp->bm_group  = (uint16_t *)group;
+        bmp->bm_nbits  = nbits;
+        bmp->bm_nset   = nset;
+        bmp->bm_sysdep = sysdep;
+        bmp->bm_flags  = BM_ATTACHED;
+        *bmpp          = bmp;
+    }
+
+    return error;
+}
+
+/*
+ * Free a bitmap and its rank directory.
+ */
+void
+bitmap_destroy(bitmap_t *bmp) {
+    if (bmp && (bmp->bm_flags & BM_ATTACHED)) {
+        (void)(*bmp->bm_sysdep->sys_free)(bmp);
+    } else if (bmp) {
+        const sysdep_dispatch_t *sysdep = bmp->bm_sysdep;
+
+        if (bmp->bm_group)
+            (void)(*sysdep->sys_free)(bmp->bm_group);
+        if (bmp->bm_super)
+            (void)(*sysdep->sys_free)(bmp->bm_super);
+        if (bmp->bm_words)
+            (void)(*sysdep->sys_free)(bmp->bm_words);
+        (void)(*sysdep->sys_free)(bmp);
+    }
+}
+
+/*
+ * Load the bitmap from an on-disk bit map: bit (i & 7) of byte (i >> 3) is
+ * block i.  Bits past the end of the map are ignored.
+ */
+void
+bitmap_load_bits(bitmap_t *bmp, const unsigned char *bits) {
+    bitmap_load_bits_at(bmp, bits, 0, bmp->bm_nbits);
+}
+
+/*
+ * Load "nbits" bits of the bitmap, from bit "start", from that part of an
+ * on-disk bit map.  "start" must be at a word boundary; the rest of the
+ * last word loaded is cleared.
+ */
+void
+bitmap_load_bits_at(bitmap_t *bmp, const unsigned char *bits, uint64_t start,
+                    uint64_t nbits) {
+    uint64_t *wp;
+    uint64_t  nwords;
+    uint64_t  nbytes;
+
+    if (nbits > (bmp->bm_nbits - start))
+        nbits = bmp->bm_nbits - start;
+    wp     = &bmp->bm_words[start >> BM_WORD_SHIFT];
+    nwords = bitmap_nwords(nbits);
+    nbytes = (nbits + 7) >> 3;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    /*
+     * The words are already in the on-disk byte order.
+     */
+    memcpy(wp, bits, nbytes);
+    if (nbytes & 7)
+        memset(&((unsigned char *)wp)[nbytes], 0, 8 - (nbytes & 7));
+#else  /* __BYTE_ORDER__ */
+    uint64_t w;
+
+    for (w = 0; w < nwords; w++) {
+        uint64_t word = 0;
+        uint64_t b;
+
+        for (b = 0; (b < 8) && ((w * 8 + b) < nbytes); b++)
+            word |= (uint64_t)bits[w * 8 + b] << (b * 8);
+        wp[w] = word;
+    }
+#endif /* __BYTE_ORDER__ */
+    if (nbits & (BM_WORD_BITS - 1))
+        wp[nwords - 1] &= ((uint64_t)1 << (nbits & (BM_WORD_BITS - 1))) - 1;
+}
+
+/*
+ * Store the bitmap in the on-disk bit map form used by bitmap_load_bits().
+ */
+void
+bitmap_store_bits(const bitmap_t *bmp, unsigned char *bits) {
+    uint64_t nbytes = (bmp->bm_nbits + 7) >> 3;
+    uint64_t i;
+
+    for (i = 0; i < nbytes; i++)
+        bits[i] = (unsigned char)(bmp->bm_words[i >> 3] >> ((i & 7) * 8));
+}
+
+/*
+ * Load the bitmap with the start of each run of set bits in "src": bit i is
+ * set if bit i of "src" is set and bit i-1 isn't.  Bit 0 is never a start.
+ * The bitmaps must be the same size.
+ */
+void
+bitmap_load_edges(bitmap_t *bmp, const bitmap_t *src) {
+    uint64_t nwords = bitmap_nwords(src->bm_nbits);
+    uint64_t carry  = 1;
+    uint64_t w;
+
+    for (w = 0; w < nwords; w++) {
+        uint64_t word = src->bm_words[w];
+
+        bmp->bm_words[w] = word & ~((word << 1) | carry);
+        carry            = word >> (BM_WORD_BITS - 1);
+    }
+}
+
+/*
+ * Load "nbytes" entries of an on-disk byte map, starting with block
+ * "start".  Any entry that isn't 0 is set: the version 1 format can have
+ * other values than 1 in the byte map, and those blocks have always been
+ * read from the image.
+ *
+ * Returns the number of entries that were neither 0 nor 1.
+ */
+uint64_t
+bitmap_load_bytes(bitmap_t *bmp, const unsigned char *bytes, uint64_t nbytes,
+                  uint64_t start) {
+    uint64_t nstrange = 0;
+    uint64_t i        = 0;
+
+    if (nbytes > (bmp->bm_nbits - start))
+        nbytes = bmp->bm_nbits - start;
+#ifdef __SSE2__
+    /*
+     * Once we're at a word boundary, compare a word's worth of entries at
+     * a time against 0 and 1 and collect the results with movemask.
+     */
+    for (; (i < nbytes) && ((start + i) & (BM_WORD_BITS - 1)); i++) {
+        if (bytes[i])
+            bitmap_set(bmp, start + i);
+        if (bytes[i] > 1)
+            nstrange++;
+    }
+    {
+        __m128i const zero = _mm_setzero_si128();
+        __m128i const one  = _mm_set1_epi8(1);
+
+        for (; (nbytes - i) >= BM_WORD_BITS; i += BM_WORD_BITS) {
+            uint64_t ones    = 0;
+            uint64_t nonzero = 0;
+            int      q;
+
+            for (q = 0; q < (BM_WORD_BITS / 16); q++) {
+                __m128i v =
+                    _mm_loadu_si128((const __m128i *)&bytes[i + q * 16]);
+
+                ones |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                            _mm_cmpeq_epi8(v, one))
+                        << (q * 16);
+                nonzero |= (uint64_t)(uint16_t)~_mm_movemask_epi8(
+                               _mm_cmpeq_epi8(v, zero))
+                           << (q * 16);
+            }
+            bmp->bm_words[(start + i) >> BM_WORD_SHIFT] = nonzero;
+            nstrange += __builtin_popcountll(nonzero & ~ones);
+        }
+    }
+#endif /* __SSE2__ */
+    for (; i < nbytes; i++) {
+        if (bytes[i])
+            bitmap_set(bmp, start + i);
+        if (bytes[i] > 1)
+            nstrange++;
+    }
+
+    return nstrange;
+}
+
+/*
+ * Fill in the group counts for superblocks "first" up to (but not
+ * including) "last", and leave the number of set bits in each superblock in
+ * its superblock entry.
+ */
+static void
+bitmap_count_supers(bitmap_t *bmp, uint64_t first, uint64_t last) {
+    uint64_t const gpers   = BM_SUPER_BITS / BM_GROUP_BITS;
+    uint64_t const ngroups = (bmp->bm_nbits >> BM_GROUP_SHIFT) + 1;
+    uint64_t       sb;
+
+    for (sb = first; sb < last; sb++) {
+        const uint64_t *wp    = &bmp->bm_words[sb * gpers * BM_GROUP_WORDS];
+        uint64_t        sset  = 0;
+        uint64_t        g     = sb * gpers;
+        uint64_t        glast = g + gpers;
+
+        if (glast > ngroups)
+            glast = ngroups;
+        for (; g < glast; g++) {
+            int w;
+
+            bmp->bm_group[g] = (uint16_t)sset;
+            for (w = 0; w < BM_GROUP_WORDS; w++)
+                sset += __builtin_popcountll(*wp++);
+        }
+        bmp->bm_super[sb] = sset;
+    }
+}
+
+#ifdef HAVE_LIBPTHREAD
+typedef struct bitmap_count_work {
+    bitmap_t *bcw_bitmap; /* Bitmap being counted */
+    uint64_t  bcw_first;  /* First superblock */
+    uint64_t  bcw_last;   /* Superblock past the last */
+} bitmap_count_work_t;
+
+static void *
+bitmap_count_thread(void *arg) {
+    bitmap_count_work_t *bcwp = (bitmap_count_work_t *)arg;
+
+    bitmap_count_supers(bcwp->bcw_bitmap, bcwp->bcw_first, bcwp->bcw_last);
+    return (void *)NULL;
+}
+
+/*
+ * Count the superblocks using several threads.  Each superblock's counts
+ * only depend on its own bits.  If threads can't be started, the rest is
+ * simply done here.
+ */
+static void
+bitmap_count_parallel(bitmap_t *bmp, uint64_t nsupers) {
+    pthread_t           threads[BM_MAX_THREADS];
+    bitmap_count_work_t work[BM_MAX_THREADS];
+    long                ncpus   = sysconf(_SC_NPROCESSORS_ONLN);
+    int                 nthread = (ncpus > BM_MAX_THREADS) ? BM_MAX_THREADS
+                                  : (ncpus > 1)            ? (int)ncpus
+                                                           : 1;
+    int                 nstarted;
+    uint64_t            per = (nsupers + nthread - 1) / nthread;
+
+    for (nstarted = 0; nstarted < nthread - 1; nstarted++) {
+        work[nstarted].bcw_bitmap = bmp;
+        work[nstarted].bcw_first  = nstarted * per;
+        work[nstarted].bcw_last   = (nstarted + 1) * per;
+        if (work[nstarted].bcw_last > nsupers)
+            break;
+        if (pthread_create(&threads[nstarted], (pthread_attr_t *)NULL,
+                           bitmap_count_thread, &work[nstarted]))
+            break;
+    }
+    bitmap_count_supers(bmp, nstarted * per, nsupers);
+    while (nstarted--)
+        (void)pthread_join(threads[nstarted], (void **)NULL);
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/*
+ * Allocate the rank directory, if it isn't already.
+ */
+int
+bitmap_alloc_rank(bitmap_t *bmp) {
+    int      error   = 0;
+    uint64_t ngroups = (bmp->bm_nbits >> BM_GROUP_SHIFT) + 1;
+    uint64_t nsupers = (bmp->bm_nbits >> BM_SUPER_SHIFT) + 1;
+
+    if (!bmp->bm_group &&
+        ((error = (*bmp->bm_sysdep->sys_malloc)(
+              &bmp->bm_group, ngroups * sizeof(uint16_t))) == 0) &&
+        ((error = (*bmp->bm_sysdep->sys_malloc)(
+              &bmp->bm_super, nsupers * sizeof(uint64_t))) != 0)) {
+        (void)(*bmp->bm_sysdep->sys_free)(bmp->bm_group);
+        bmp->bm_group = (uint16_t *)NULL;
+    }
+
+    return error;
+}
+
+/*
+ * (Re)build the rank directory from the current contents of the bitmap.
+ *
+ * The group counts are relative to their superblock, so superblocks are
+ * counted independently (in parallel, for big bitmaps) and the superblock
+ * entries are then turned into running totals.
+ */
+int
+bitmap_build_rank(bitmap_t *bmp) {
+    int      error;
+    uint64_t nsupers = (bmp->bm_nbits >> BM_SUPER_SHIFT) + 1;
+
+    if ((error = bitmap_alloc_rank(bmp)) == 0) {
+        uint64_t nset = 0;
+        uint64_t sb;
+
+#ifdef HAVE_LIBPTHREAD
+        if (bmp->bm_nbits >= BM_THREAD_MIN_BITS)
+            bitmap_count_parallel(bmp, nsupers);
+        else
+#endif /* HAVE_LIBPTHREAD */
+            bitmap_count_supers(bmp, 0, nsupers);
+        for (sb = 0; sb < nsupers; sb++) {
+            uint64_t sset = bmp->bm_super[sb];
+
+            bmp->bm_super[sb] = nset;
+            nset += sset;
+        }
+        bmp->bm_nset = nset;
+    }
+
+    return error;
+}
+
+/*
+ * Build the rank directory a piece at a time, for superblocks "first" up
+ * to (but not including) "last", once their bits are loaded.  "nset" is
+ * the number of set bits preceding "first"; the number preceding "last" is
+ * returned.  The directory must have been allocated with
+ * bitmap_alloc_rank(), and the pieces are built in order.
+ */
+uint64_t
+bitmap_rank_supers(bitmap_t *bmp, uint64_t first, uint64_t last,
+                   uint64_t nset) {
+    uint64_t sb;
+
+    bitmap_count_supers(bmp, first, last);
+    for (sb = first; sb < last; sb++) {
+        uint64_t sset = bmp->bm_super[sb];
+
+        bmp->bm_super[sb] = nset;
+        nset += sset;
+    }
+    bmp->bm_nset = nset;
+
+    return nset;
+}
+
+/*
+ * Count the set bits preceding group "group", from the rank directory.
+ */
+static inline uint64_t
+bitmap_group_rank(const bitmap_t *bmp, uint64_t group) {
+    return bmp->bm_super[group >> (BM_SUPER_SHIFT - BM_GROUP_SHIFT)] +
+           bmp->bm_group[group];
+}
+
+/*
+ * Return the length of the run of bits that have the same value as bit
+ * "bitno", up to "maxrun" bits and the end of the bitmap.
+ *
+ * Once the rank directory is built, whole superblocks and groups that are
+ * all set or all clear are stepped over by comparing their counts, without
+ * looking at their words.
+ */
+static inline uint64_t
+bitmap_run_common(const bitmap_t *bmp, uint64_t bitno, uint64_t maxrun,
+                  int use_rank) {
+    uint64_t limit = bmp->bm_nbits - bitno;
+    uint64_t flip  = (bitmap_test(bmp, bitno)) ? ~(uint64_t)0 : 0;
+    uint64_t run   = 0;
+
+    if (maxrun < limit)
+        limit = maxrun;
+    while (run < limit) {
+        uint64_t pos = bitno + run;
+        unsigned off = pos & (BM_WORD_BITS - 1);
+        uint64_t word;
+
+        if (use_rank && !(pos & (BM_GROUP_BITS - 1))) {
+            uint64_t sb = pos >> BM_SUPER_SHIFT;
+            uint64_t g  = pos >> BM_GROUP_SHIFT;
+
+            if (!(pos & (BM_SUPER_BITS - 1)) &&
+                ((limit - run) >= BM_SUPER_BITS) &&
+                ((bmp->bm_super[sb + 1] - bmp->bm_super[sb]) ==
+                 (flip & BM_SUPER_BITS))) {
+                run += BM_SUPER_BITS;
+                continue;
+            }
+            if (((limit - run) >= BM_GROUP_BITS) &&
+                ((bitmap_group_rank(bmp, g + 1) - bitmap_group_rank(bmp, g)) ==
+                 (flip & BM_GROUP_BITS))) {
+                run += BM_GROUP_BITS;
+                continue;
+            }
+        }
+        word = (bmp->bm_words[pos >> BM_WORD_SHIFT] ^ flip) >> off;
+        if (word) {
+            run += __builtin_ctzll(word);
+            break;
+        }
+        run += BM_WORD_BITS - off;
+    }
+
+    return (run < limit) ? run : limit;
+}
+
+uint64_t
+bitmap_run(const bitmap_t *bmp, uint64_t bitno, uint64_t maxrun) {
+    return bitmap_run_common(bmp, bitno, maxrun, bmp->bm_super != NULL);
+}
+
+/*
+ * As bitmap_run(), looking only at the words, for when the rank directory
+ * isn't built (or isn't built yet for the bits concerned).
+ */
+uint64_t
+bitmap_run_bits(const bitmap_t *bmp, uint64_t bitno, uint64_t maxrun) {
+    return bitmap_run_common(bmp, bitno, maxrun, 0);
+}
@@ -0,0 +1,128 @@
+/*
+ * libbitmap.h - Interfaces to the packed usage bitmap.
+ */
+/*
+ * Copyright (c) 2010, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+
+#ifndef _LIBBITMAP_H_
+#define _LIBBITMAP_H_ 1
+
+#include "sysdep_int.h"
+#include <sys/types.h>
+
+/*
+ * The bitmap is kept packed at one bit per block.  Alongside it is a
+ * two-level rank directory: a 64-bit count of the set bits preceding each
+ * superblock of BM_SUPER_BITS, and a 16-bit count of the set bits between
+ * the start of the superblock and each group of BM_GROUP_BITS.  A rank
+ * query touches one superblock entry, one group entry and at most one
+ * group's worth (a cache line) of bitmap words.
+ */
+#define BM_WORD_SHIFT  6
+#define BM_WORD_BITS   (1 << BM_WORD_SHIFT)
+#define BM_GROUP_SHIFT 9
+#define BM_GROUP_BITS  (1 << BM_GROUP_SHIFT)
+#define BM_GROUP_WORDS (BM_GROUP_BITS / BM_WORD_BITS)
+#define BM_SUPER_SHIFT 16
+#define BM_SUPER_BITS  (1 << BM_SUPER_SHIFT)
+
+#define BM_ATTACHED 0x0001 /* Words and rank directory aren't ours */
+
+typedef struct libbitmap {
+    uint64_t *               bm_words;  /* Packed bits */
+    uint64_t *               bm_super;  /* Set bits preceding superblock */
+    uint16_t *               bm_group;  /* Set bits preceding group */
+    uint64_t                 bm_nbits;  /* Number of bits */
+    uint64_t                 bm_nset;   /* Number of set bits */
+    const sysdep_dispatch_t *bm_sysdep; /* System-specific routines */
+    uint32_t                 bm_flags;  /* BM_ATTACHED */
+} bitmap_t;
+
+int      bitmap_create(const sysdep_dispatch_t *sysdep, uint64_t nbits,
+                       bitmap_t **bmpp);
+int      bitmap_attach(const sysdep_dispatch_t *sysdep, uint64_t nbits,
+                       uint64_t nset, const void *words, const void *super,
+                       const void *group, bitmap_t **bmpp);
+void     bitmap_sizes(uint64_t nbits, uint64_t *wlenp, uint64_t *slenp,
+                      uint64_t *glenp);
+void     bitmap_destroy(bitmap_t *bmp);
+void     bitmap_load_bits(bitmap_t *bmp, const unsigned char *bits);
+void     bitmap_load_bits_at(bitmap_t *bmp, const unsigned char *bits,
+                             uint64_t start, uint64_t nbits);
+void     bitmap_store_bits(const bitmap_t *bmp, unsigned char *bits);
+void     bitmap_load_edges(bitmap_t *bmp, const bitmap_t *src);
+uint64_t bitmap_load_bytes(bitmap_t *bmp, const unsigned char *bytes,
+                           uint64_t nbytes, uint64_t start);
+int      bitmap_alloc_rank(bitmap_t *bmp);
+int      bitmap_build_rank(bitmap_t *bmp);
+uint64_t bitmap_rank_supers(bitmap_t *bmp, uint64_t first, uint64_t last,
+                            uint64_t nset);
+uint64_t bitmap_run(const bitmap_t *bmp, uint64_t bitno, uint64_t maxrun);
+uint64_t bitmap_run_bits(const bitmap_t *bmp, uint64_t bitno, uint64_t maxrun);
+
+/*
+ * Is bit "bitno" set?
+ */
+static inline int
+bitmap_test(const bitmap_t *bmp, uint64_t bitno) {
+    return (bmp->bm_words[bitno >> BM_WORD_SHIFT] >>
+            (bitno & (BM_WORD_BITS - 1))) &
+           1;
+}
+
+/*
+ * Set bit "bitno".  The rank directory must be rebuilt afterwards.
+ */
+static inline void
+bitmap_set(bitmap_t *bmp, uint64_t bitno) {
+    bmp->bm_words[bitno >> BM_WORD_SHIFT] |= (uint64_t)1
+                                             << (bitno & (BM_WORD_BITS - 1));
+}
+
+/*
+ * Versions of bitmap_test and bitmap_set which may be used concurrently
+ * with each other on a shared bitmap.
+ */
+static inline int
+bitmap_test_shared(const bitmap_t *bmp, uint64_t bitno) {
+    return (__atomic_load_n(&bmp->bm_words[bitno >> BM_WORD_SHIFT],
+                            __ATOMIC_RELAXED) >>
+            (bitno & (BM_WORD_BITS - 1))) &
+           1;
+}
+
+static inline void
+bitmap_set_shared(bitmap_t *bmp, uint64_t bitno) {
+    (void)__atomic_fetch_or(&bmp->bm_words[bitno >> BM_WORD_SHIFT],
+                            (uint64_t)1 << (bitno & (BM_WORD_BITS - 1)),
+                            __ATOMIC_RELAXED);
+}
+
+/*
+ * Count the set bits preceding bit "bitno".  Requires the rank directory.
+ */
+static inline uint64_t
+bitmap_rank(const bitmap_t *bmp, uint64_t bitno) {
+    uint64_t        rank = bmp->bm_super[bitno >> BM_SUPER_SHIFT] +
+                    bmp->bm_group[bitno >> BM_GROUP_SHIFT];
+    const uint64_t *wp =
+        &bmp->bm_words[(bitno >> BM_GROUP_SHIFT) * BM_GROUP_WORDS];
+    const uint64_t *ep   = &bmp->bm_words[bitno >> BM_WORD_SHIFT];
+    unsigned        tail = bitno & (BM_WORD_BITS - 1);
+
+    while (wp < ep)
+        rank += __builtin_popcountll(*wp++);
+    if (tail)
+        rank += __builtin_popcountll(*ep & (((uint64_t)1 << tail) - 1));
+
+    return rank;
+}
+
+#endif /* _LIBBITMAP_H_ */
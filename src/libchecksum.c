@@ -1,57 +1,317 @@
-/*
- * libchecksum.c - implementation to checksum algorithms
- */
-#include "libchecksum.h"
-
-#define CRC32_SEED      0xFFFFFFFFL
-#define CRC32_TABLE_LEN 256
-
-static uint32_t crc_tab32[CRC32_TABLE_LEN] = {0};
-
-/**
- * Initialise crc32 lookup table if it is not already done and initialise the
- * seed to the default implementation seed value
- */
-crc32_t
-init_crc32() {
-    if (crc_tab32[0] == 0) {
-        crc32_t  init_crc;
-        uint32_t i, j;
-
-        for (i = 0; i < CRC32_TABLE_LEN; ++i) {
-            init_crc = i;
-            for (j = 0; j < 8; j++) {
-                if (init_crc & 0x00000001L)
-                    init_crc = (init_crc >> 1) ^ 0xEDB88320L;
-                else
-                    init_crc = init_crc >> 1;
-            }
-
-            crc_tab32[i] = init_crc;
-        }
-    }
-
-    return CRC32_SEED;
-}
-
-/// the crc32 function, reference from libcrc.
-/// Author is Lammert Bies  1999-2007
-/// Mail: info@lammertbies.nl
-/// http://www.lammertbies.nl/comm/info/nl_crc-calculation.html
-/// generate crc32 code
-crc32_t
-update_crc32(crc32_t seed, void *buffer, uint64_t size) {
-
-    uint8_t const *      buf = (uint8_t *)buffer;
-    uint8_t const *const end = buf + size;
-    crc32_t              crc = seed;
-    int32_t              tmp, long_c;
-
-    while (buf != end) {
-        long_c = *(buf++);
-        tmp    = crc ^ long_c;
-        crc    = (crc >> 8) ^ crc_tab32[tmp & 0xff];
-    };
-
-    return crc;
-}
+/*
+ * libchecksum.c - implementation to checksum algorithms
+ */
+#include "libchecksum.h"
+#include "libstats.h"
+#include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    include <immintrin.h>
+#    define CRC32_HAVE_PCLMUL 1
+#endif /* __GNUC__ && x86 */
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#    include <arm_acle.h>
+#    include <sys/auxv.h>
+#    ifndef HWCAP_CRC32
+#        define HWCAP_CRC32 (1 << 7)
+#    endif /* HWCAP_CRC32 */
+#    define CRC32_HAVE_ARMV8 1
+#endif /* __GNUC__ && __aarch64__ && __linux__ */
+
+#define CRC32_SEED      0xFFFFFFFFL
+#define CRC32_POLY      0xEDB88320L
+#define CRC32_TABLE_LEN 256
+#define CRC32_SLICES    8
+#define CRC32_SIMD_MIN  64 /* Shortest buffer worth the vector path */
+
+/*
+ * crc_tab32[0] is the classic byte-at-a-time table; crc_tab32[n] advances
+ * a byte's contribution past n following zero bytes, so eight bytes can be
+ * folded in with one lookup each (slice-by-8).
+ */
+static uint32_t crc_tab32[CRC32_SLICES][CRC32_TABLE_LEN];
+
+typedef crc32_t (*crc32_engine_t)(crc32_t crc, const uint8_t *buf,
+                                  uint64_t size);
+
+static crc32_t crc32_slice8(crc32_t crc, const uint8_t *buf, uint64_t size);
+static crc32_engine_t crc32_engine = crc32_slice8;
+
+/*
+ * Byte at a time.
+ */
+static inline crc32_t
+crc32_bytes(crc32_t crc, const uint8_t *buf, uint64_t size) {
+    while (size--)
+        crc = (crc >> 8) ^ crc_tab32[0][(crc ^ *buf++) & 0xff];
+    return crc;
+}
+
+/*
+ * Eight bytes at a time.
+ */
+static crc32_t
+crc32_slice8(crc32_t crc, const uint8_t *buf, uint64_t size) {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    while (size >= 8) {
+        uint64_t word;
+
+        memcpy(&word, buf, sizeof(word));
+        word ^= crc;
+        crc = crc_tab32[7][word & 0xff] ^ crc_tab32[6][(word >> 8) & 0xff] ^
+              crc_tab32[5][(word >> 16) & 0xff] ^
+              crc_tab32[4][(word >> 24) & 0xff] ^
+              crc_tab32[3][(word >> 32) & 0xff] ^
+              crc_tab32[2][(word >> 40) & 0xff] ^
+              crc_tab32[1][(word >> 48) & 0xff] ^ crc_tab32[0][word >> 56];
+        buf += 8;
+        size -= 8;
+    }
+#endif /* __ORDER_LITTLE_ENDIAN__ */
+    return crc32_bytes(crc, buf, size);
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+/*
+ * Carry-less multiplication folding, after Intel's "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction".  Folds four 128-bit
+ * lanes 64 bytes at a time, then down to one lane, then Barrett-reduces to
+ * 32 bits.  The constants are for the bit-reflected IEEE polynomial.
+ */
+__attribute__((target("pclmul,sse4.1"))) static crc32_t
+crc32_pclmul(crc32_t crc, const uint8_t *buf, uint64_t size) {
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = {
+        0x0154442bd4, 0x01c6e41596};
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = {
+        0x01751997d0, 0x00ccaa009e};
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = {
+        0x0163cd6124, 0x0000000000};
+    static const uint64_t poly[2] __attribute__((aligned(16))) = {
+        0x01db710641, 0x01f7011641};
+    uint64_t tail = size & 15;
+    __m128i  x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    if (size < CRC32_SIMD_MIN)
+        return crc32_slice8(crc, buf, size);
+    size -= tail;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    size -= 64;
+
+    /*
+     * Fold 64 bytes at a time.
+     */
+    while (size >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+        buf += 64;
+        size -= 64;
+    }
+
+    /*
+     * Fold the four lanes into one.
+     */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /*
+     * Fold any remaining 16 byte blocks.
+     */
+    while (size >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i *)buf));
+        buf += 16;
+        size -= 16;
+    }
+
+    /*
+     * Fold 128 bits to 64, then Barrett-reduce to 32.
+     */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return crc32_slice8((crc32_t)_mm_extract_epi32(x1, 1), buf, tail);
+}
+#endif /* CRC32_HAVE_PCLMUL */
+
+#ifdef CRC32_HAVE_ARMV8
+/*
+ * The ARMv8 CRC32 instructions use the IEEE polynomial.
+ */
+__attribute__((target("+crc"))) static crc32_t
+crc32_armv8(crc32_t crc, const uint8_t *buf, uint64_t size) {
+    while (size >= 8) {
+        uint64_t word;
+
+        memcpy(&word, buf, sizeof(word));
+        crc = __crc32d(crc, word);
+        buf += 8;
+        size -= 8;
+    }
+    while (size--)
+        crc = __crc32b(crc, *buf++);
+    return crc;
+}
+#endif /* CRC32_HAVE_ARMV8 */
+
+/*
+ * Build the tables and pick the fastest engine this processor supports.
+ * This runs before main(), so there are no races with threaded callers.
+ */
+__attribute__((constructor)) static void
+crc32_setup(void) {
+    uint32_t i, j;
+
+    for (i = 0; i < CRC32_TABLE_LEN; ++i) {
+        crc32_t init_crc = i;
+
+        for (j = 0; j < 8; j++)
+            init_crc = (init_crc & 0x00000001L) ? (init_crc >> 1) ^ CRC32_POLY
+                                                : (init_crc >> 1);
+        crc_tab32[0][i] = init_crc;
+    }
+    for (i = 0; i < CRC32_TABLE_LEN; ++i)
+        for (j = 1; j < CRC32_SLICES; j++)
+            crc_tab32[j][i] = (crc_tab32[j - 1][i] >> 8) ^
+                              crc_tab32[0][crc_tab32[j - 1][i] & 0xff];
+
+#ifdef CRC32_HAVE_PCLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+        crc32_engine = crc32_pclmul;
+#endif /* CRC32_HAVE_PCLMUL */
+#ifdef CRC32_HAVE_ARMV8
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        crc32_engine = crc32_armv8;
+#endif /* CRC32_HAVE_ARMV8 */
+}
+
+/**
+ * Return the seed to the default implementation seed value.  The tables
+ * are built at startup.
+ */
+crc32_t
+init_crc32() {
+    return CRC32_SEED;
+}
+
+/*
+ * Update "seed" with the bytes in "buffer".  There is no inversion before
+ * or after; callers that want it supply CRC32_SEED from init_crc32().
+ */
+crc32_t
+update_crc32(crc32_t seed, const void *buffer, uint64_t size) {
+    uint64_t start = stats_start();
+    crc32_t  crc   = (*crc32_engine)(seed, (const uint8_t *)buffer, size);
+
+    stats_end(STATS_CRC, start, size, 0);
+    return crc;
+}
+
+/*
+ * GF(2) helpers for repeat_crc32: a 32x32 matrix is held as 32 columns.
+ */
+static inline uint32_t
+gf2_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1)
+            sum ^= *mat;
+    return sum;
+}
+
+/*
+ * An affine map x -> Mx ^ v over GF(2)^32.
+ */
+typedef struct gf2_affine {
+    uint32_t ga_mat[32];
+    uint32_t ga_vec;
+} gf2_affine_t;
+
+/*
+ * *rp = a applied after b.
+ */
+static void
+gf2_compose(gf2_affine_t *rp, const gf2_affine_t *a, const gf2_affine_t *b) {
+    gf2_affine_t r;
+    int          i;
+
+    for (i = 0; i < 32; i++)
+        r.ga_mat[i] = gf2_times(a->ga_mat, b->ga_mat[i]);
+    r.ga_vec = gf2_times(a->ga_mat, b->ga_vec) ^ a->ga_vec;
+    *rp      = r;
+}
+
+/*
+ * Update "seed" with "count" copies of "byte", in O(log count) time.
+ *
+ * One byte step is crc -> (crc >> 8) ^ T[(crc ^ byte) & 0xff], and as T is
+ * linear that is the affine map crc -> Z(crc) ^ T[byte], where Z is the
+ * step for a zero byte.  Raise that map to the "count"th power by repeated
+ * squaring and apply it to the seed.
+ */
+crc32_t
+repeat_crc32(crc32_t seed, uint8_t byte, uint64_t count) {
+    gf2_affine_t step;
+    gf2_affine_t result;
+    int          i;
+
+    for (i = 0; i < 32; i++) {
+        step.ga_mat[i]   = crc32_bytes((uint32_t)1 << i, (const uint8_t *)"",
+                                       1);
+        result.ga_mat[i] = (uint32_t)1 << i;
+    }
+    step.ga_vec   = crc_tab32[0][byte];
+    result.ga_vec = 0;
+    while (count) {
+        if (count & 1)
+            gf2_compose(&result, &step, &result);
+        count >>= 1;
+        if (count)
+            gf2_compose(&step, &step, &step);
+    }
+
+    return gf2_times(result.ga_mat, seed) ^ result.ga_vec;
+}
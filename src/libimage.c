@@ -10,44 +10,601 @@
  * any later version.
  *
  */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
 #include "libimage.h"
 #include "libntfsclone.h"
 #include "libpartclone.h"
 #include "librawimage.h"
+#include "libstats.h"
+#include "sysdep_split.h"
 #include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_LIBPTHREAD
+#    include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
 
 extern image_dispatch_t partclone_image_type;
 extern image_dispatch_t ntfsclone_image_type;
 extern image_dispatch_t raw_image_type;
+extern image_dispatch_t zpartclone_image_type;
 
 static const image_dispatch_t *known_types[] = {
-    &ntfsclone_image_type, &partclone_image_type,
+    &ntfsclone_image_type, &partclone_image_type, &zpartclone_image_type,
     &raw_image_type, /* must be last */
 };
 
 #undef IMAGE_MAGIC
 #define IMAGE_MAGIC 0xceebee00
 typedef struct image_handle {
-    image_dispatch_t * i_dispatch;
-    sysdep_dispatch_t *i_sysdep;
-    void *             i_type_handle;
-    uint32_t           i_magic;
+    image_dispatch_t *  i_dispatch;
+    sysdep_dispatch_t * i_sysdep;
+    void *              i_type_handle;
+    struct image_cache *i_cache;
+    uint32_t            i_magic;
 } image_handle_t;
 
+/*
+ * Block cache.
+ *
+ * The cache holds "lines" of consecutive blocks, IC_LINE_BYTES worth (or one
+ * block, if blocks are larger than that).  Lines are spread over IC_NSHARDS
+ * shards, each with its own lock, hash table and CLOCK hand, so that
+ * concurrent readers seldom contend.  A line is read from the image, outside
+ * of the shard lock, by whoever misses on it first; while that is in
+ * progress, the line is IC_FILLING and is neither evicted nor used.
+ *
+ * Writes bump the generation number and then drop the lines which they
+ * cover.  A fill which started before a write completes is discarded rather
+ * than entered, since it may hold the old contents.
+ *
+ * With threads, a sequential stream of reads starts the prefetch thread
+ * reading lines ahead of it.  Prefetch reads are excluded from writes.
+ */
+#define IC_LINE_BYTES  (32 * 1024)
+#define IC_NSHARDS     16
+#define IC_SEQ_TRIGGER 2
+#define IC_QUEUE_LEN   256
+
+#define IC_FREE    0
+#define IC_FILLING 1
+#define IC_VALID   2
+
+#define IC_NONE    ((uint32_t)~0)
+
+typedef struct image_cache_entry {
+    uint64_t       ce_line;       /* Line number */
+    unsigned char *ce_data;       /* Line contents */
+    uint32_t       ce_next;       /* Next entry in hash chain */
+    unsigned char  ce_state;      /* IC_FREE, IC_FILLING or IC_VALID */
+    unsigned char  ce_ref;        /* Referenced since last CLOCK pass */
+    unsigned char  ce_prefetched; /* Filled by prefetch, not yet used */
+} image_cache_entry_t;
+
+typedef struct image_cache_shard {
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_t ics_lock; /* Protects the following */
+#endif                        /* HAVE_LIBPTHREAD */
+    image_cache_entry_t *ics_entries;  /* Entries */
+    unsigned char *      ics_data;     /* Contents of all entries */
+    uint32_t *           ics_hash;     /* Hash chain heads */
+    uint32_t             ics_nentries; /* Number of entries */
+    uint32_t             ics_hashmask; /* Hash table size - 1 */
+    uint32_t             ics_hand;     /* CLOCK hand */
+} image_cache_shard_t;
+
+typedef struct image_cache {
+    image_cache_shard_t ic_shards[IC_NSHARDS];
+    image_dispatch_t *  ic_dispatch;    /* Type dispatch */
+    sysdep_dispatch_t * ic_sysdep;      /* System dispatch */
+    void *              ic_type_handle; /* Type handle */
+    uint64_t            ic_lineblocks;  /* Blocks per line */
+    uint64_t            ic_linebytes;   /* Bytes per line */
+    uint64_t            ic_blocksize;   /* Bytes per block */
+    uint64_t            ic_blockcount;  /* Blocks in image */
+    uint64_t            ic_readahead;   /* Lines to prefetch */
+    uint64_t            ic_gen;         /* Bumped by each write */
+    image_cache_stats_t ic_stats;       /* Statistics */
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_t  ic_qlock;               /* Protects the following */
+    pthread_cond_t   ic_qcond;               /* Signalled when queueing */
+    uint64_t         ic_seq_next;            /* Next block if sequential */
+    uint64_t         ic_seq_count;           /* Sequential reads in a row */
+    uint64_t         ic_ra_next;             /* Next line to prefetch */
+    uint64_t         ic_queue[IC_QUEUE_LEN]; /* Lines to prefetch */
+    uint32_t         ic_qhead;               /* Next line to take */
+    uint32_t         ic_qcount;              /* Lines queued */
+    int              ic_stop;                /* Prefetch should finish */
+    int              ic_started;             /* Prefetch is running */
+    pthread_t        ic_thread;              /* Prefetch thread */
+    pthread_rwlock_t ic_iolock;              /* Prefetch vs. writes */
+#endif                                       /* HAVE_LIBPTHREAD */
+} image_cache_t;
+
+#ifdef HAVE_LIBPTHREAD
+#    define IC_LOCK(_sp)   pthread_mutex_lock(&(_sp)->ics_lock)
+#    define IC_UNLOCK(_sp) pthread_mutex_unlock(&(_sp)->ics_lock)
+#else /* HAVE_LIBPTHREAD */
+#    define IC_LOCK(_sp)
+#    define IC_UNLOCK(_sp)
+#endif /* HAVE_LIBPTHREAD */
+#define IC_COUNT(_icp, _field) \
+    __atomic_fetch_add(&(_icp)->ic_stats._field, 1, __ATOMIC_RELAXED)
+
+static inline image_cache_shard_t *
+ic_shard(image_cache_t *icp, uint64_t line) {
+    return &icp->ic_shards[line % IC_NSHARDS];
+}
+
+static inline uint32_t *
+ic_bucket(image_cache_shard_t *sp, uint64_t line) {
+    return &sp->ics_hash[(line / IC_NSHARDS) & sp->ics_hashmask];
+}
+
+/*
+ * Number of blocks in a line - the last one may be short.
+ */
+static inline uint64_t
+ic_line_nblocks(image_cache_t *icp, uint64_t line) {
+    uint64_t first = line * icp->ic_lineblocks;
+
+    return ((icp->ic_blockcount - first) < icp->ic_lineblocks)
+               ? icp->ic_blockcount - first
+               : icp->ic_lineblocks;
+}
+
+/*
+ * Find a line.  Called with the shard locked.
+ */
+static uint32_t
+ic_lookup(image_cache_shard_t *sp, uint64_t line) {
+    uint32_t eidx;
+
+    for (eidx = *ic_bucket(sp, line);
+         (eidx != IC_NONE) && (sp->ics_entries[eidx].ce_line != line);
+         eidx = sp->ics_entries[eidx].ce_next)
+        ;
+    return eidx;
+}
+
+/*
+ * Remove an entry from its hash chain and free it.  Called with the shard
+ * locked.
+ */
+static void
+ic_unhash(image_cache_shard_t *sp, uint32_t eidx) {
+    uint32_t *linkp = ic_bucket(sp, sp->ics_entries[eidx].ce_line);
+
+    while (*linkp != eidx)
+        linkp = &sp->ics_entries[*linkp].ce_next;
+    *linkp                         = sp->ics_entries[eidx].ce_next;
+    sp->ics_entries[eidx].ce_state = IC_FREE;
+}
+
+/*
+ * Choose an entry to fill with "line" and hash it in as IC_FILLING.  Lines
+ * which are being filled are passed over, as are (once) those referenced
+ * since the hand last passed.  Called with the shard locked.
+ */
+static uint32_t
+ic_claim(image_cache_shard_t *sp, uint64_t line) {
+    uint32_t             npass;
+    uint32_t             eidx = IC_NONE;
+    image_cache_entry_t *cep;
+
+    for (npass = 0; npass < 2 * sp->ics_nentries; npass++) {
+        cep          = &sp->ics_entries[sp->ics_hand];
+        sp->ics_hand = (sp->ics_hand + 1) % sp->ics_nentries;
+        if (cep->ce_state == IC_FILLING)
+            continue;
+        if ((cep->ce_state == IC_VALID) && cep->ce_ref) {
+            cep->ce_ref = 0;
+            continue;
+        }
+        eidx = cep - sp->ics_entries;
+        if (cep->ce_state == IC_VALID)
+            ic_unhash(sp, eidx);
+        cep->ce_line         = line;
+        cep->ce_state        = IC_FILLING;
+        cep->ce_ref          = 0;
+        cep->ce_prefetched   = 0;
+        cep->ce_next         = *ic_bucket(sp, line);
+        *ic_bucket(sp, line) = eidx;
+        break;
+    }
+    return eidx;
+}
+
+/*
+ * Obtain part of a line: "nblocks" blocks starting "offset" blocks into it.
+ * If "buffer" is null, this is a prefetch and nothing is copied.  Returns
+ * EEXIST if a prefetch finds the line already present or being filled.
+ */
+static int
+ic_read_line(image_cache_t *icp, uint64_t line, uint64_t offset,
+             uint64_t nblocks, void *buffer) {
+    image_cache_shard_t *sp    = ic_shard(icp, line);
+    image_cache_entry_t *cep   = (image_cache_entry_t *)NULL;
+    int                  error = 0;
+    int                  done  = 0;
+    uint32_t             eidx;
+    uint64_t             gen;
+
+    IC_LOCK(sp);
+    if ((eidx = ic_lookup(sp, line)) != IC_NONE) {
+        cep = &sp->ics_entries[eidx];
+        if (!buffer) {
+            done  = 1;
+            error = EEXIST;
+        } else if (cep->ce_state == IC_VALID) {
+            memcpy(buffer, cep->ce_data + offset * icp->ic_blocksize,
+                   nblocks * icp->ic_blocksize);
+            cep->ce_ref = 1;
+            IC_COUNT(icp, ics_hits);
+            if (cep->ce_prefetched) {
+                cep->ce_prefetched = 0;
+                IC_COUNT(icp, ics_prefetch_hits);
+            }
+            done = 1;
+        }
+        cep = (image_cache_entry_t *)NULL;
+    } else if ((eidx = ic_claim(sp, line)) != IC_NONE) {
+        cep = &sp->ics_entries[eidx];
+    }
+    gen = __atomic_load_n(&icp->ic_gen, __ATOMIC_ACQUIRE);
+    IC_UNLOCK(sp);
+
+    if (!done) {
+        if (cep) {
+            /*
+             * We own the entry: fill it.
+             */
+            int ferror = (*icp->ic_dispatch->readblocks_at)(
+                icp->ic_type_handle, line * icp->ic_lineblocks, cep->ce_data,
+                ic_line_nblocks(icp, line));
+
+            IC_LOCK(sp);
+            if (!ferror &&
+                (gen == __atomic_load_n(&icp->ic_gen, __ATOMIC_ACQUIRE))) {
+                cep->ce_state = IC_VALID;
+                cep->ce_ref   = 1;
+                if (buffer) {
+                    memcpy(buffer, cep->ce_data + offset * icp->ic_blocksize,
+                           nblocks * icp->ic_blocksize);
+                    done = 1;
+                } else {
+                    cep->ce_prefetched = 1;
+                }
+            } else {
+                ic_unhash(sp, eidx);
+            }
+            IC_UNLOCK(sp);
+            if (buffer)
+                IC_COUNT(icp, ics_misses);
+            else if (!ferror)
+                IC_COUNT(icp, ics_prefetches);
+            if (!buffer)
+                error = ferror;
+        } else if (buffer) {
+            IC_COUNT(icp, ics_misses);
+        } else {
+            error = EEXIST;
+        }
+        /*
+         * If we couldn't use the cache, or the line couldn't be filled,
+         * read just what was asked for.
+         */
+        if (buffer && !done) {
+            error = (*icp->ic_dispatch->readblocks_at)(
+                icp->ic_type_handle, line * icp->ic_lineblocks + offset,
+                buffer, nblocks);
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Drop cached lines covering "nblocks" blocks starting at "blockno".
+ */
+static void
+ic_invalidate(image_cache_t *icp, uint64_t blockno, uint64_t nblocks) {
+    uint64_t line;
+    uint64_t lastline;
+
+    if (!nblocks)
+        return;
+    __atomic_fetch_add(&icp->ic_gen, 1, __ATOMIC_ACQ_REL);
+    lastline = (blockno + nblocks - 1) / icp->ic_lineblocks;
+    for (line = blockno / icp->ic_lineblocks; line <= lastline; line++) {
+        image_cache_shard_t *sp = ic_shard(icp, line);
+        uint32_t             eidx;
+
+        IC_LOCK(sp);
+        if (((eidx = ic_lookup(sp, line)) != IC_NONE) &&
+            (sp->ics_entries[eidx].ce_state == IC_VALID)) {
+            ic_unhash(sp, eidx);
+            IC_COUNT(icp, ics_invalidations);
+        }
+        IC_UNLOCK(sp);
+    }
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * Note a read, and if it continues a sequential stream, queue the lines
+ * ahead of it for prefetch.
+ */
+static void
+ic_readahead(image_cache_t *icp, uint64_t blockno, uint64_t nblocks) {
+    uint64_t nlines = (icp->ic_blockcount + icp->ic_lineblocks - 1) /
+                      icp->ic_lineblocks;
+    uint64_t line;
+    uint64_t endline;
+
+    pthread_mutex_lock(&icp->ic_qlock);
+    if (blockno == icp->ic_seq_next) {
+        icp->ic_seq_count++;
+    } else {
+        icp->ic_seq_count = 0;
+        icp->ic_ra_next   = 0;
+    }
+    icp->ic_seq_next = blockno + nblocks;
+    if (icp->ic_seq_count >= IC_SEQ_TRIGGER) {
+        line    = (blockno + nblocks - 1) / icp->ic_lineblocks + 1;
+        endline = line + icp->ic_readahead;
+        if (endline > nlines)
+            endline = nlines;
+        if (line < icp->ic_ra_next)
+            line = icp->ic_ra_next;
+        for (; (line < endline) && (icp->ic_qcount < IC_QUEUE_LEN); line++) {
+            icp->ic_queue[(icp->ic_qhead + icp->ic_qcount) % IC_QUEUE_LEN] =
+                line;
+            icp->ic_qcount++;
+        }
+        if (line > icp->ic_ra_next) {
+            icp->ic_ra_next = line;
+            pthread_cond_signal(&icp->ic_qcond);
+        }
+    }
+    pthread_mutex_unlock(&icp->ic_qlock);
+}
+
+/*
+ * Prefetch thread.
+ */
+static void *
+ic_prefetch(void *arg) {
+    image_cache_t *icp = (image_cache_t *)arg;
+    uint64_t       line;
+
+    pthread_mutex_lock(&icp->ic_qlock);
+    for (;;) {
+        while (!icp->ic_qcount && !icp->ic_stop)
+            pthread_cond_wait(&icp->ic_qcond, &icp->ic_qlock);
+        if (icp->ic_stop)
+            break;
+        line          = icp->ic_queue[icp->ic_qhead];
+        icp->ic_qhead = (icp->ic_qhead + 1) % IC_QUEUE_LEN;
+        icp->ic_qcount--;
+        pthread_mutex_unlock(&icp->ic_qlock);
+
+        pthread_rwlock_rdlock(&icp->ic_iolock);
+        (void)ic_read_line(icp, line, 0, 0, (void *)NULL);
+        pthread_rwlock_unlock(&icp->ic_iolock);
+
+        pthread_mutex_lock(&icp->ic_qlock);
+    }
+    pthread_mutex_unlock(&icp->ic_qlock);
+
+    return NULL;
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/*
+ * Read blocks through the cache.
+ */
+static int
+ic_readblocks(image_cache_t *icp, uint64_t blockno, void *buffer,
+              uint64_t nblocks) {
+    unsigned char *bp    = (unsigned char *)buffer;
+    int            error = 0;
+    uint64_t       line;
+    uint64_t       offset;
+    uint64_t       count;
+
+    if ((blockno >= icp->ic_blockcount) ||
+        (nblocks > (icp->ic_blockcount - blockno))) {
+        /*
+         * Let the type complain about it.
+         */
+        return (*icp->ic_dispatch->readblocks_at)(icp->ic_type_handle, blockno,
+                                                  buffer, nblocks);
+    }
+#ifdef HAVE_LIBPTHREAD
+    if (icp->ic_started)
+        ic_readahead(icp, blockno, nblocks);
+#endif /* HAVE_LIBPTHREAD */
+    while (!error && nblocks) {
+        line   = blockno / icp->ic_lineblocks;
+        offset = blockno % icp->ic_lineblocks;
+        count  = icp->ic_lineblocks - offset;
+        if (count > nblocks)
+            count = nblocks;
+        if (!(error = ic_read_line(icp, line, offset, count, bp))) {
+            blockno += count;
+            nblocks -= count;
+            bp += count * icp->ic_blocksize;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Stop prefetching and release the cache.
+ */
+static void
+ic_destroy(image_cache_t *icp) {
+    int sidx;
+
+#ifdef HAVE_LIBPTHREAD
+    if (icp->ic_started) {
+        pthread_mutex_lock(&icp->ic_qlock);
+        icp->ic_stop = 1;
+        pthread_cond_broadcast(&icp->ic_qcond);
+        pthread_mutex_unlock(&icp->ic_qlock);
+        pthread_join(icp->ic_thread, (void **)NULL);
+    }
+    pthread_cond_destroy(&icp->ic_qcond);
+    pthread_mutex_destroy(&icp->ic_qlock);
+    pthread_rwlock_destroy(&icp->ic_iolock);
+#endif /* HAVE_LIBPTHREAD */
+    for (sidx = 0; sidx < IC_NSHARDS; sidx++) {
+        image_cache_shard_t *sp = &icp->ic_shards[sidx];
+
+#ifdef HAVE_LIBPTHREAD
+        pthread_mutex_destroy(&sp->ics_lock);
+#endif /* HAVE_LIBPTHREAD */
+        if (sp->ics_entries)
+            (void)(*icp->ic_sysdep->sys_free)(sp->ics_entries);
+        if (sp->ics_data)
+            (void)(*icp->ic_sysdep->sys_free)(sp->ics_data);
+        if (sp->ics_hash)
+            (void)(*icp->ic_sysdep->sys_free)(sp->ics_hash);
+    }
+    (void)(*icp->ic_sysdep->sys_free)(icp);
+}
+
+/*
+ * Create the cache.
+ */
+static int
+ic_create(image_handle_t *ihp, uint64_t cachebytes, uint64_t readahead,
+          image_cache_t **icpp) {
+    image_cache_t *icp = (image_cache_t *)NULL;
+    int64_t        blocksize;
+    int64_t        blockcount;
+    uint64_t       nentries;
+    int            error = EINVAL;
+    int            sidx;
+    uint32_t       eidx;
+
+    blocksize  = (*ihp->i_dispatch->blocksize)(ihp->i_type_handle);
+    blockcount = (*ihp->i_dispatch->blockcount)(ihp->i_type_handle);
+    if ((blocksize > 0) && (blockcount > 0) &&
+        !(error = (*ihp->i_sysdep->sys_malloc)(&icp, sizeof(*icp)))) {
+        memset(icp, 0, sizeof(*icp));
+        icp->ic_dispatch    = ihp->i_dispatch;
+        icp->ic_sysdep      = ihp->i_sysdep;
+        icp->ic_type_handle = ihp->i_type_handle;
+        icp->ic_blocksize   = blocksize;
+        icp->ic_blockcount  = blockcount;
+        icp->ic_lineblocks  = (blocksize < IC_LINE_BYTES)
+                                  ? IC_LINE_BYTES / blocksize
+                                  : 1;
+        icp->ic_linebytes   = icp->ic_lineblocks * blocksize;
+        icp->ic_readahead   = (readahead + icp->ic_linebytes - 1) /
+                            icp->ic_linebytes;
+        nentries = cachebytes / icp->ic_linebytes / IC_NSHARDS;
+        if (nentries < 1)
+            nentries = 1;
+        if (nentries > (IC_NONE / 2))
+            nentries = IC_NONE / 2;
+#ifdef HAVE_LIBPTHREAD
+        pthread_mutex_init(&icp->ic_qlock, (pthread_mutexattr_t *)NULL);
+        pthread_cond_init(&icp->ic_qcond, (pthread_condattr_t *)NULL);
+        pthread_rwlock_init(&icp->ic_iolock, (pthread_rwlockattr_t *)NULL);
+        icp->ic_seq_next = ~0;
+#endif /* HAVE_LIBPTHREAD */
+        for (sidx = 0; sidx < IC_NSHARDS; sidx++) {
+            image_cache_shard_t *sp = &icp->ic_shards[sidx];
+
+#ifdef HAVE_LIBPTHREAD
+            pthread_mutex_init(&sp->ics_lock, (pthread_mutexattr_t *)NULL);
+#endif /* HAVE_LIBPTHREAD */
+            if (error)
+                continue;
+            sp->ics_nentries = nentries;
+            for (sp->ics_hashmask = 1; sp->ics_hashmask < nentries;
+                 sp->ics_hashmask <<= 1)
+                ;
+            if (!(error = (*icp->ic_sysdep->sys_malloc)(
+                      &sp->ics_entries,
+                      nentries * sizeof(image_cache_entry_t))) &&
+                !(error = (*icp->ic_sysdep->sys_malloc)(
+                      &sp->ics_data,
+                      nentries * icp->ic_linebytes)) &&
+                !(error = (*icp->ic_sysdep->sys_malloc)(
+                      &sp->ics_hash,
+                      sp->ics_hashmask * sizeof(uint32_t)))) {
+                memset(sp->ics_entries, 0,
+                       nentries * sizeof(image_cache_entry_t));
+                memset(sp->ics_hash, 0xff,
+                       sp->ics_hashmask * sizeof(uint32_t));
+                for (eidx = 0; eidx < nentries; eidx++)
+                    sp->ics_entries[eidx].ce_data =
+                        sp->ics_data + eidx * icp->ic_linebytes;
+                sp->ics_hashmask--;
+            }
+        }
+#ifdef HAVE_LIBPTHREAD
+        if (!error && icp->ic_readahead) {
+            sigset_t newmask, oldmask;
+
+            /*
+             * Signals are for the application, not the prefetch thread.
+             */
+            sigfillset(&newmask);
+            pthread_sigmask(SIG_BLOCK, &newmask, &oldmask);
+            if (!(error = pthread_create(&icp->ic_thread,
+                                         (pthread_attr_t *)NULL, ic_prefetch,
+                                         icp))) {
+                icp->ic_started = 1;
+            }
+            pthread_sigmask(SIG_SETMASK, &oldmask, (sigset_t *)NULL);
+        }
+#endif /* HAVE_LIBPTHREAD */
+        if (error) {
+            ic_destroy(icp);
+            icp = (image_cache_t *)NULL;
+        }
+    }
+    *icpp = icp;
+
+    return error;
+}
+
 int
 image_open(const char *path, const char *cfpath, sysdep_open_mode_t omode,
            const sysdep_dispatch_t *sysdep, int raw_allowed, void **rpp) {
     int               itidx;
     int               error  = ENOENT;
+    int               notsup = 0;
     image_dispatch_t *fentry = (image_dispatch_t *)NULL;
 
+    /*
+     * Images split into pieces are read as one file; the split interface
+     * passes everything else through.
+     */
+    if ((error = sysdep_split_init(sysdep, &sysdep)))
+        return error;
     for (itidx = 0; itidx < (sizeof(known_types) / sizeof(known_types[0]));
          itidx++) {
         if (!(error = (*known_types[itidx]->probe)(path, sysdep))) {
             fentry = (image_dispatch_t *)known_types[itidx];
             break;
         }
+        /*
+         * Remember a type which recognized the image but can't read it
+         * (e.g. compressed without a seek table), to say so if nothing
+         * else takes it.
+         */
+        if (error == ENOTSUP)
+            notsup = 1;
     }
     if (fentry &&
         ((itidx < (sizeof(known_types) / sizeof(known_types[0])) - 1) ||
@@ -57,9 +614,12 @@ image_open(const char *path, const char *cfpath, sysdep_open_mode_t omode,
             ihp->i_magic        = IMAGE_MAGIC;
             ihp->i_sysdep       = (sysdep_dispatch_t *)sysdep;
             ihp->i_dispatch     = (image_dispatch_t *)fentry;
+            ihp->i_cache        = (struct image_cache *)NULL;
             error = (*ihp->i_dispatch->open)(path, cfpath, omode, sysdep,
                                              &ihp->i_type_handle);
         }
+    } else if (fentry) {
+        error = (notsup) ? ENOTSUP : EINVAL;
     }
 
     return error;
@@ -70,6 +630,8 @@ image_close(void *rp) {
     image_handle_t *ihp   = (image_handle_t *)rp;
     int             error = EINVAL;
     if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        if (ihp->i_cache)
+            ic_destroy(ihp->i_cache);
         error        = (*ihp->i_dispatch->close)(ihp->i_type_handle);
         ihp->i_magic = 0;
         (void)(ihp->i_sysdep->sys_free)(ihp);
@@ -88,6 +650,38 @@ image_tolerant_mode(void *rp) {
     }
 }
 
+/*
+ * Check block checksums, where the image has them, as blocks are read.
+ * Mismatches are reported as EIO, unless in tolerant mode.
+ */
+int
+image_verify_reads(void *rp) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        error = (*ihp->i_dispatch->verify_reads)(ihp->i_type_handle);
+    }
+
+    return error;
+}
+
+/*
+ * Load the image's bitmap lazily, where it has one, so that it can be
+ * served as soon as its header is verified.  Called again after verifying
+ * to start the loading.  If "strict", requests wait until the whole bitmap
+ * is loaded and checked.
+ */
+int
+image_lazy_load(void *rp, int strict) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        error = (*ihp->i_dispatch->lazy_load)(ihp->i_type_handle, strict);
+    }
+
+    return error;
+}
+
 int
 image_verify(void *rp) {
     image_handle_t *ihp   = (image_handle_t *)rp;
@@ -99,6 +693,13 @@ image_verify(void *rp) {
     return error;
 }
 
+const char *
+image_type_name(void *rp) {
+    image_handle_t *ihp = (image_handle_t *)rp;
+    return (ihp && (ihp->i_magic == IMAGE_MAGIC)) ? ihp->i_dispatch->type_name
+                                                  : (const char *)NULL;
+}
+
 int64_t
 image_blocksize(void *rp) {
     image_handle_t *ihp = (image_handle_t *)rp;
@@ -120,7 +721,10 @@ image_seek(void *rp, uint64_t blockno) {
     image_handle_t *ihp   = (image_handle_t *)rp;
     int             error = EINVAL;
     if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        uint64_t start = stats_start();
+
         error = (*ihp->i_dispatch->seek)(ihp->i_type_handle, blockno);
+        stats_end(STATS_IMAGE_SEEK, start, 1, error);
     }
 
     return error;
@@ -139,8 +743,42 @@ image_readblocks(void *rp, void *buffer, uint64_t nblocks) {
     image_handle_t *ihp   = (image_handle_t *)rp;
     int             error = EINVAL;
     if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
-        error =
-            (*ihp->i_dispatch->readblocks)(ihp->i_type_handle, buffer, nblocks);
+        uint64_t start = stats_start();
+
+        if (ihp->i_cache) {
+            uint64_t blockno = (*ihp->i_dispatch->tell)(ihp->i_type_handle);
+
+            if (!(error = ic_readblocks(ihp->i_cache, blockno, buffer,
+                                        nblocks)))
+                error = (*ihp->i_dispatch->seek)(ihp->i_type_handle,
+                                                 blockno + nblocks);
+        } else {
+            error = (*ihp->i_dispatch->readblocks)(ihp->i_type_handle, buffer,
+                                                   nblocks);
+        }
+        stats_end(STATS_IMAGE_READ, start, nblocks, error);
+    }
+
+    return error;
+}
+
+/*
+ * Read blocks starting at the specified block.  This does not change the
+ * current position, and may be used concurrently with other readers.
+ */
+int
+image_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                    uint64_t nblocks) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        uint64_t start = stats_start();
+
+        error = (ihp->i_cache)
+                    ? ic_readblocks(ihp->i_cache, blockno, buffer, nblocks)
+                    : (*ihp->i_dispatch->readblocks_at)(
+                          ihp->i_type_handle, blockno, buffer, nblocks);
+        stats_end(STATS_IMAGE_READ, start, nblocks, error);
     }
 
     return error;
@@ -154,13 +792,198 @@ image_block_used(void *rp) {
                : BLOCK_ERROR;
 }
 
+/*
+ * Returns 1 if the block at "blockno" is used and 0 if not, and sets
+ * "*nblocksp" to the number of blocks from there, up to "maxblocks", in the
+ * same state.  Used to walk an image extent by extent.
+ */
+int
+image_block_extent(void *rp, uint64_t blockno, uint64_t maxblocks,
+                   uint64_t *nblocksp) {
+    image_handle_t *ihp = (image_handle_t *)rp;
+    return (ihp && (ihp->i_magic == IMAGE_MAGIC))
+               ? (*ihp->i_dispatch->block_extent)(ihp->i_type_handle, blockno,
+                                                  maxblocks, nblocksp)
+               : BLOCK_ERROR;
+}
+
+/*
+ * Describe where the data for "nblocks" blocks from "blockno" lives, as up
+ * to "*nsegsp" segments, and set "*nsegsp" to the number used.  ENOTSUP
+ * means the range must be read instead: the image type can't map it, or
+ * some of it is in the change file.  Reads go through the block cache
+ * when there is one, so then only ranges that are all zeroes are mapped.
+ */
+int
+image_block_map(void *rp, uint64_t blockno, uint64_t nblocks,
+                image_segment_t *segs, uint32_t *nsegsp) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        uint64_t start = stats_start();
+
+        error = (*ihp->i_dispatch->block_map)(ihp->i_type_handle, blockno,
+                                              nblocks, segs, nsegsp);
+        if (!error && ihp->i_cache) {
+            uint32_t sidx;
+
+            for (sidx = 0; sidx < *nsegsp; sidx++)
+                if (segs[sidx].is_type != IMAGE_SEG_ZERO)
+                    error = ENOTSUP;
+        }
+        stats_end(STATS_IMAGE_MAP, start, nblocks, error);
+    }
+
+    return error;
+}
+
 int
 image_writeblocks(void *rp, void *buffer, uint64_t nblocks) {
     image_handle_t *ihp   = (image_handle_t *)rp;
     int             error = EINVAL;
     if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
-        error = (*ihp->i_dispatch->writeblocks)(ihp->i_type_handle, buffer,
-                                                nblocks);
+        uint64_t start = stats_start();
+
+        if (ihp->i_cache) {
+            image_cache_t *icp     = ihp->i_cache;
+            uint64_t       blockno =
+                (*ihp->i_dispatch->tell)(ihp->i_type_handle);
+
+#ifdef HAVE_LIBPTHREAD
+            pthread_rwlock_wrlock(&icp->ic_iolock);
+#endif /* HAVE_LIBPTHREAD */
+            error = (*ihp->i_dispatch->writeblocks)(ihp->i_type_handle, buffer,
+                                                    nblocks);
+            /*
+             * Even a failed write may have changed some blocks.
+             */
+            ic_invalidate(icp, blockno, nblocks);
+#ifdef HAVE_LIBPTHREAD
+            pthread_rwlock_unlock(&icp->ic_iolock);
+#endif /* HAVE_LIBPTHREAD */
+        } else {
+            error = (*ihp->i_dispatch->writeblocks)(ihp->i_type_handle, buffer,
+                                                    nblocks);
+        }
+        stats_end(STATS_IMAGE_WRITE, start, nblocks, error);
+    }
+
+    return error;
+}
+
+/*
+ * Write one range for image_writeranges().  Where the image type can't
+ * keep part of a block as it is, the rest of the block is read to make it
+ * whole.
+ */
+static int
+image_writerange(image_handle_t *ihp, const image_range_t *irp) {
+    const image_dispatch_t *idp   = ihp->i_dispatch;
+    void *                  th    = ihp->i_type_handle;
+    int64_t                 bsize = (*idp->blocksize)(th);
+    unsigned char *         bp    = (unsigned char *)NULL;
+    int                     error;
+
+    if (bsize <= 0)
+        return EINVAL;
+    if (!irp->ir_offset && !(irp->ir_length % bsize)) {
+        if (!(error = (*idp->seek)(th, irp->ir_blockno)))
+            error = (*idp->writeblocks)(th, irp->ir_buf,
+                                        irp->ir_length / bsize);
+    } else if ((irp->ir_offset >= (uint64_t)bsize) ||
+               (irp->ir_length > (bsize - irp->ir_offset))) {
+        error = EINVAL;
+    } else if (((error = (*idp->writepartial)(th, irp->ir_blockno,
+                                              irp->ir_offset, irp->ir_length,
+                                              irp->ir_buf)) == ENOTSUP) &&
+               !(error = (*ihp->i_sysdep->sys_malloc)(&bp, bsize))) {
+        if (!(error = (*idp->readblocks_at)(th, irp->ir_blockno, bp, 1))) {
+            memcpy(bp + irp->ir_offset, irp->ir_buf, irp->ir_length);
+            if (!(error = (*idp->seek)(th, irp->ir_blockno)))
+                error = (*idp->writeblocks)(th, bp, 1);
+        }
+        (void)(*ihp->i_sysdep->sys_free)(bp);
+    }
+
+    return error;
+}
+
+/*
+ * Write the "nranges" ranges of one request, each of them whole blocks or
+ * part of one block.  Parts of blocks are written as they are where the
+ * image type can keep them so, without reading the rest of the block.
+ * The current position is left after the last range.
+ */
+int
+image_writeranges(void *rp, const image_range_t *ranges, uint32_t nranges) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        image_cache_t *icp     = ihp->i_cache;
+        int64_t        bsize   = (*ihp->i_dispatch->blocksize)(
+            ihp->i_type_handle);
+        uint64_t       nblocks = 0;
+        uint64_t       start   = stats_start();
+        uint32_t       ridx;
+
+#ifdef HAVE_LIBPTHREAD
+        if (icp)
+            pthread_rwlock_wrlock(&icp->ic_iolock);
+#endif /* HAVE_LIBPTHREAD */
+        for (error = 0, ridx = 0; !error && (ridx < nranges); ridx++) {
+            const image_range_t *irp = &ranges[ridx];
+            uint64_t             n   = (bsize > 0)
+                                           ? (irp->ir_offset + irp->ir_length +
+                                              bsize - 1) / bsize
+                                           : 0;
+
+            error = image_writerange(ihp, irp);
+            /*
+             * Even a failed write may have changed some blocks.
+             */
+            if (icp)
+                ic_invalidate(icp, irp->ir_blockno, n);
+            nblocks += n;
+        }
+#ifdef HAVE_LIBPTHREAD
+        if (icp)
+            pthread_rwlock_unlock(&icp->ic_iolock);
+#endif /* HAVE_LIBPTHREAD */
+        stats_end(STATS_IMAGE_WRITE, start, nblocks, error);
+    }
+
+    return error;
+}
+
+/*
+ * Make "nblocks" blocks from "blockno" read as zeroes, as for a trim or a
+ * write of zeroes.  No data is written for them.  This does not change the
+ * current position.
+ */
+int
+image_zeroblocks(void *rp, uint64_t blockno, uint64_t nblocks) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        uint64_t start = stats_start();
+
+        if (ihp->i_cache) {
+            image_cache_t *icp = ihp->i_cache;
+
+#ifdef HAVE_LIBPTHREAD
+            pthread_rwlock_wrlock(&icp->ic_iolock);
+#endif /* HAVE_LIBPTHREAD */
+            error = (*ihp->i_dispatch->zeroblocks)(ihp->i_type_handle, blockno,
+                                                   nblocks);
+            ic_invalidate(icp, blockno, nblocks);
+#ifdef HAVE_LIBPTHREAD
+            pthread_rwlock_unlock(&icp->ic_iolock);
+#endif /* HAVE_LIBPTHREAD */
+        } else {
+            error = (*ihp->i_dispatch->zeroblocks)(ihp->i_type_handle, blockno,
+                                                   nblocks);
+        }
+        stats_end(STATS_IMAGE_ZERO, start, nblocks, error);
     }
 
     return error;
@@ -171,7 +994,58 @@ image_sync(void *rp) {
     image_handle_t *ihp   = (image_handle_t *)rp;
     int             error = EINVAL;
     if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        uint64_t start = stats_start();
+
         error = (*ihp->i_dispatch->sync)(ihp->i_type_handle);
+        stats_end(STATS_IMAGE_SYNC, start, 1, error);
+    }
+
+    return error;
+}
+
+/*
+ * Cache up to "cachebytes" of image contents, and when reads are sequential,
+ * prefetch "readahead" bytes ahead of them.  Call after the image is
+ * verified.
+ */
+int
+image_cache_enable(void *rp, uint64_t cachebytes, uint64_t readahead) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        error = (ihp->i_cache) ? EBUSY
+                               : ic_create(ihp, cachebytes, readahead,
+                                           &ihp->i_cache);
+    }
+
+    return error;
+}
+
+/*
+ * Obtain cache statistics.
+ */
+int
+image_cache_stats(void *rp, image_cache_stats_t *statsp) {
+    image_handle_t *ihp   = (image_handle_t *)rp;
+    int             error = EINVAL;
+    if (ihp && (ihp->i_magic == IMAGE_MAGIC)) {
+        if (ihp->i_cache) {
+            image_cache_stats_t *sp = &ihp->i_cache->ic_stats;
+
+            statsp->ics_hits =
+                __atomic_load_n(&sp->ics_hits, __ATOMIC_RELAXED);
+            statsp->ics_misses =
+                __atomic_load_n(&sp->ics_misses, __ATOMIC_RELAXED);
+            statsp->ics_prefetches =
+                __atomic_load_n(&sp->ics_prefetches, __ATOMIC_RELAXED);
+            statsp->ics_prefetch_hits =
+                __atomic_load_n(&sp->ics_prefetch_hits, __ATOMIC_RELAXED);
+            statsp->ics_invalidations =
+                __atomic_load_n(&sp->ics_invalidations, __ATOMIC_RELAXED);
+            error = 0;
+        } else {
+            error = ENOENT;
+        }
     }
 
     return error;
@@ -15,10 +15,70 @@
 #define _LIBIMAGE_H_ 1
 
 #include "sysdep_int.h"
+#include <errno.h>
 #include <sys/types.h>
 
 #define BLOCK_ERROR -2
 
+/*
+ * Where the data for a range of blocks lives, for callers which can move
+ * it to its destination without copying it through a buffer.
+ */
+#define IMAGE_SEG_FILE 1 /* is_length bytes at is_offset in is_fd */
+#define IMAGE_SEG_ZERO 2 /* is_length bytes of zeroes */
+
+typedef struct image_segment {
+    int      is_type;   /* IMAGE_SEG_* */
+    int      is_fd;     /* Descriptor, for IMAGE_SEG_FILE */
+    uint64_t is_offset; /* Byte offset in is_fd, for IMAGE_SEG_FILE */
+    uint64_t is_length; /* Byte length */
+} image_segment_t;
+
+/*
+ * Append a segment to a map, merging it with the last one if it simply
+ * continues it.
+ *
+ * Returns:
+ * - 0: Success.
+ * - ENOSPC: The map already has "maxsegs" segments.
+ */
+static inline int
+image_segment_add(image_segment_t *segs, uint32_t *nsegsp, uint32_t maxsegs,
+                  int type, int fd, uint64_t offset, uint64_t length) {
+    image_segment_t *sp;
+
+    if (*nsegsp) {
+        sp = &segs[*nsegsp - 1];
+        if ((sp->is_type == type) &&
+            ((type == IMAGE_SEG_ZERO) ||
+             ((sp->is_fd == fd) &&
+              ((sp->is_offset + sp->is_length) == offset)))) {
+            sp->is_length += length;
+            return 0;
+        }
+    }
+    if (*nsegsp >= maxsegs)
+        return ENOSPC;
+    sp            = &segs[(*nsegsp)++];
+    sp->is_type   = type;
+    sp->is_fd     = fd;
+    sp->is_offset = offset;
+    sp->is_length = length;
+
+    return 0;
+}
+
+/*
+ * A range of a write: "ir_length" bytes from "ir_buf", at byte "ir_offset"
+ * of block "ir_blockno".  It's either whole blocks, or part of one block.
+ */
+typedef struct image_range {
+    uint64_t ir_blockno; /* First block */
+    uint64_t ir_offset;  /* Byte offset in it */
+    uint64_t ir_length;  /* Byte length */
+    void *   ir_buf;     /* Data */
+} image_range_t;
+
 /*
  * Per-image type dispatch table.
  */
@@ -29,17 +89,39 @@ typedef struct image_type_dispatch {
                 const sysdep_dispatch_t *sysdep, void **rpp);
     int (*close)(void *rp);
     void (*tolerant_mode)(void *rp);
+    int (*verify_reads)(void *rp);
+    int (*lazy_load)(void *rp, int strict);
     int (*verify)(void *rp);
     int64_t (*blocksize)(void *rp);
     int64_t (*blockcount)(void *rp);
     int (*seek)(void *rp, uint64_t blockno);
     uint64_t (*tell)(void *rp);
     int (*readblocks)(void *rp, void *buffer, uint64_t nblocks);
+    int (*readblocks_at)(void *rp, uint64_t blockno, void *buffer,
+                         uint64_t nblocks);
     int (*block_used)(void *rp);
+    int (*block_extent)(void *rp, uint64_t blockno, uint64_t maxblocks,
+                        uint64_t *nblocksp);
+    int (*block_map)(void *rp, uint64_t blockno, uint64_t nblocks,
+                     image_segment_t *segs, uint32_t *nsegsp);
     int (*writeblocks)(void *rp, void *buffer, uint64_t nblocks);
+    int (*zeroblocks)(void *rp, uint64_t blockno, uint64_t nblocks);
     int (*sync)(void *rp);
+    int (*writepartial)(void *rp, uint64_t blockno, uint64_t offset,
+                        uint64_t length, const void *buffer);
 } image_dispatch_t;
 
+/*
+ * Block cache statistics.
+ */
+typedef struct image_cache_stats {
+    uint64_t ics_hits;          /* Reads satisfied from the cache */
+    uint64_t ics_misses;        /* Reads which went to the image */
+    uint64_t ics_prefetches;    /* Lines read ahead */
+    uint64_t ics_prefetch_hits; /* Lines read ahead which were then used */
+    uint64_t ics_invalidations; /* Lines dropped by writes */
+} image_cache_stats_t;
+
 /*
  * Our interface to everybody else.
  */
@@ -47,14 +129,28 @@ int  image_open(const char *path, const char *cfpath, sysdep_open_mode_t omode,
                 const sysdep_dispatch_t *sysdep, int raw_allowed, void **rpp);
 int  image_close(void *rp);
 void image_tolerant_mode(void *rp);
+int  image_verify_reads(void *rp);
+int  image_lazy_load(void *rp, int strict);
 int  image_verify(void *rp);
+const char *image_type_name(void *rp);
 int64_t  image_blocksize(void *rp);
 int64_t  image_blockcount(void *rp);
 int      image_seek(void *rp, uint64_t blockno);
 uint64_t image_tell(void *rp);
 int      image_readblocks(void *rp, void *buffer, uint64_t nblocks);
+int      image_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                             uint64_t nblocks);
 int      image_block_used(void *rp);
+int      image_block_extent(void *rp, uint64_t blockno, uint64_t maxblocks,
+                            uint64_t *nblocksp);
+int      image_block_map(void *rp, uint64_t blockno, uint64_t nblocks,
+                         image_segment_t *segs, uint32_t *nsegsp);
 int      image_writeblocks(void *rp, void *buffer, uint64_t nblocks);
+int      image_writeranges(void *rp, const image_range_t *ranges,
+                           uint32_t nranges);
+int      image_zeroblocks(void *rp, uint64_t blockno, uint64_t nblocks);
 int      image_sync(void *rp);
+int      image_cache_enable(void *rp, uint64_t cachebytes, uint64_t readahead);
+int      image_cache_stats(void *rp, image_cache_stats_t *statsp);
 
 #endif /* _LIBIMAGE_H_ */
@@ -0,0 +1,233 @@
+/*
+ * libindex.c - Image index files.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+/*
+ * The file starts with a header giving its key, the library's values and
+ * where each section is.  The sections follow, each starting on an
+ * INDEX_ALIGN boundary.  The whole file is mapped read-only, so that every
+ * open of the image shares it; where it can't be mapped (the interface
+ * underneath doesn't do that), it's read instead.
+ *
+ * Index files aren't written in place, as other opens may have them
+ * mapped: a new one is written alongside and renamed over the old.
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "libindex.h"
+#include "libchecksum.h"
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+#define INDEX_ORDER 0x01020304
+#define INDEX_ALIGN 4096
+
+static const char new_trailer[] = ".new";
+
+typedef struct index_head {
+    index_key_t ih_key;                         /* What it's the index of */
+    uint64_t    ih_values[INDEX_MAX_PARAMS];    /* Library's values */
+    uint64_t    ih_offset[INDEX_MAX_SECTIONS];  /* Where each section is */
+    uint64_t    ih_length[INDEX_MAX_SECTIONS];  /* How long each is */
+    uint32_t    ih_nsections;                   /* Number of sections */
+    uint32_t    ih_crc;                         /* CRC of the sections */
+    uint32_t    ih_head_crc;                    /* CRC of the header */
+    uint32_t    ih_pad;
+} index_head_t;
+
+static inline uint64_t
+index_round(uint64_t offset) {
+    return (offset + INDEX_ALIGN - 1) & ~((uint64_t)INDEX_ALIGN - 1);
+}
+
+static inline crc32_t
+index_head_crc(const index_head_t *ihp) {
+    return update_crc32(init_crc32(), ihp, offsetof(index_head_t, ih_head_crc));
+}
+
+/*
+ * Start the key for the index of the image open as "ifd".  The caller
+ * fills in its parameters.
+ */
+int
+index_key_init(const sysdep_dispatch_t *sysdep, void *ifd, const char *magic,
+               uint32_t version, uint32_t head_crc, index_key_t *keyp) {
+    int error;
+
+    memset(keyp, 0, sizeof(*keyp));
+    memcpy(keyp->ik_magic, magic,
+           (strlen(magic) < sizeof(keyp->ik_magic)) ? strlen(magic)
+                                                    : sizeof(keyp->ik_magic));
+    keyp->ik_version  = version;
+    keyp->ik_order    = INDEX_ORDER;
+    keyp->ik_head_crc = head_crc;
+    if ((error = (*sysdep->sys_file_size)(ifd, &keyp->ik_image_size)) == 0)
+        error = (*sysdep->sys_file_mtime)(ifd, &keyp->ik_image_mtime);
+
+    return error;
+}
+
+/*
+ * Make up the path of an index file: the image's, with "trailer".
+ */
+int
+index_path(const sysdep_dispatch_t *sysdep, const char *ipath,
+           const char *trailer, char **pathp) {
+    int error;
+
+    if ((error = (*sysdep->sys_malloc)(
+             pathp, strlen(ipath) + strlen(trailer) + 1)) == 0) {
+        memcpy(*pathp, ipath, strlen(ipath));
+        memcpy(&(*pathp)[strlen(ipath)], trailer, strlen(trailer) + 1);
+    }
+
+    return error;
+}
+
+/*
+ * Load the index file at "path", if it's the index keyed by "keyp".
+ *
+ * Returns:
+ * - 0: Success.
+ * - ESTALE: It's the index of something else.
+ * - EINVAL: It's damaged.
+ * - error: Otherwise.
+ */
+int
+index_load(const sysdep_dispatch_t *sysdep, const char *path,
+           const index_key_t *keyp, image_index_t **ixpp) {
+    int            error;
+    void *         fd;
+    index_head_t   ih;
+    uint64_t       fsize, r_size;
+    image_index_t *ixp = (image_index_t *)NULL;
+    uint32_t       s;
+
+    if ((error = (*sysdep->sys_open)(&fd, path, SYSDEP_OPEN_RO)))
+        return error;
+    if (((error = (*sysdep->sys_pread)(fd, &ih, sizeof(ih), 0, &r_size)) ==
+         0) &&
+        ((error = (*sysdep->sys_file_size)(fd, &fsize)) == 0)) {
+        if (memcmp(&ih.ih_key, keyp, sizeof(*keyp)))
+            error = ESTALE;
+        else if ((ih.ih_head_crc != index_head_crc(&ih)) ||
+                 (ih.ih_nsections > INDEX_MAX_SECTIONS))
+            error = EINVAL;
+        for (s = 0; !error && (s < ih.ih_nsections); s++) {
+            if ((ih.ih_offset[s] > fsize) ||
+                (ih.ih_length[s] > (fsize - ih.ih_offset[s])))
+                error = EINVAL;
+        }
+    }
+    if (!error && ((error = (*sysdep->sys_malloc)(&ixp, sizeof(*ixp))) == 0)) {
+        memset(ixp, 0, sizeof(*ixp));
+        ixp->ix_sysdep = sysdep;
+        ixp->ix_length = fsize;
+        if ((*sysdep->sys_map)(fd, 0, fsize, &ixp->ix_base) == 0) {
+            ixp->ix_mapped = 1;
+        } else if ((error = (*sysdep->sys_malloc)(&ixp->ix_base, fsize)) ==
+                   0) {
+            error = (*sysdep->sys_pread)(fd, ixp->ix_base, fsize, 0, &r_size);
+        }
+        if (!error) {
+            crc32_t crc = init_crc32();
+
+            for (s = 0; s < ih.ih_nsections; s++) {
+                ixp->ix_sections[s].is_base =
+                    (unsigned char *)ixp->ix_base + ih.ih_offset[s];
+                ixp->ix_sections[s].is_length = ih.ih_length[s];
+                crc = update_crc32(crc, ixp->ix_sections[s].is_base,
+                                   ih.ih_length[s]);
+            }
+            ixp->ix_nsections = ih.ih_nsections;
+            memcpy(ixp->ix_values, ih.ih_values, sizeof(ixp->ix_values));
+            if (crc != ih.ih_crc)
+                error = EINVAL;
+        }
+        if (error)
+            index_release(ixp);
+        else
+            *ixpp = ixp;
+    }
+    (void)(*sysdep->sys_close)(fd);
+
+    return error;
+}
+
+/*
+ * Write the index keyed by "keyp" to "path", with the library's "values"
+ * and "nsections" sections.
+ */
+int
+index_save(const sysdep_dispatch_t *sysdep, const char *path,
+           const index_key_t *keyp, const uint64_t *values,
+           const index_section_t *sections, uint32_t nsections) {
+    int          error;
+    index_head_t ih;
+    char *       npath;
+    uint64_t     offset = INDEX_ALIGN;
+    crc32_t      crc    = init_crc32();
+    uint32_t     s;
+
+    if (nsections > INDEX_MAX_SECTIONS)
+        return EINVAL;
+    memset(&ih, 0, sizeof(ih));
+    ih.ih_key = *keyp;
+    memcpy(ih.ih_values, values, sizeof(ih.ih_values));
+    ih.ih_nsections = nsections;
+    for (s = 0; s < nsections; s++) {
+        ih.ih_offset[s] = offset;
+        ih.ih_length[s] = sections[s].is_length;
+        crc    = update_crc32(crc, sections[s].is_base, sections[s].is_length);
+        offset = index_round(offset + sections[s].is_length);
+    }
+    ih.ih_crc      = crc;
+    ih.ih_head_crc = index_head_crc(&ih);
+
+    if ((error = index_path(sysdep, path, new_trailer, &npath)) == 0) {
+        void *   fd;
+        uint64_t w_size;
+
+        if ((error = (*sysdep->sys_open)(&fd, npath, SYSDEP_CREATE)) == 0) {
+            error = (*sysdep->sys_pwrite)(fd, &ih, sizeof(ih), 0, &w_size);
+            for (s = 0; !error && (s < nsections); s++) {
+                if (sections[s].is_length)
+                    error = (*sysdep->sys_pwrite)(
+                        fd, sections[s].is_base, sections[s].is_length,
+                        ih.ih_offset[s], &w_size);
+            }
+            if (!error)
+                error = (*sysdep->sys_sync)(fd);
+            (void)(*sysdep->sys_close)(fd);
+            if (!error)
+                error = (*sysdep->sys_rename)(npath, path);
+        }
+        (void)(*sysdep->sys_free)(npath);
+    }
+
+    return error;
+}
+
+/*
+ * Release a loaded index.  Nothing from it may be used afterwards.
+ */
+void
+index_release(image_index_t *ixp) {
+    if (ixp) {
+        if (ixp->ix_mapped)
+            (void)(*ixp->ix_sysdep->sys_unmap)(ixp->ix_base, ixp->ix_length);
+        else if (ixp->ix_base)
+            (void)(*ixp->ix_sysdep->sys_free)(ixp->ix_base);
+        (void)(*ixp->ix_sysdep->sys_free)(ixp);
+    }
+}
@@ -0,0 +1,76 @@
+/*
+ * libindex.h - Interfaces to image index files.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+
+#ifndef _LIBINDEX_H_
+#define _LIBINDEX_H_ 1
+
+#include "sysdep_int.h"
+#include <sys/types.h>
+
+/*
+ * An index file holds what an image library works out from an image when
+ * it's opened (its bitmap, rank directory, offset tables), laid out as it
+ * is in memory, so that later opens can map it instead.  Every open of the
+ * image then shares the one copy, in the page cache.
+ *
+ * It's only used while its key still matches the image: the library's
+ * magic and format version, the byte order, the image header's CRC, the
+ * image file's size and modification time, and the library's own
+ * parameters.
+ */
+#define INDEX_MAX_PARAMS   6
+#define INDEX_MAX_SECTIONS 8
+
+typedef struct index_key {
+    char     ik_magic[8];                 /* Library's magic */
+    uint32_t ik_version;                  /* Library's format version */
+    uint32_t ik_order;                    /* INDEX_ORDER, as written */
+    uint32_t ik_head_crc;                 /* CRC of the image header */
+    uint32_t ik_pad;
+    uint64_t ik_image_size;               /* Size of the image file */
+    uint64_t ik_image_mtime;              /* Its modification time */
+    uint64_t ik_params[INDEX_MAX_PARAMS]; /* Library's parameters */
+} index_key_t;
+
+/*
+ * A section of the index, and a loaded index.
+ */
+typedef struct index_section {
+    void *   is_base;   /* Contents */
+    uint64_t is_length; /* Length of them */
+} index_section_t;
+
+typedef struct image_index {
+    const sysdep_dispatch_t *ix_sysdep;    /* System-specific routines */
+    void *                   ix_base;      /* The file's contents */
+    uint64_t                 ix_length;    /* Their length */
+    int                      ix_mapped;    /* Mapped, rather than read */
+    uint32_t                 ix_nsections; /* Number of sections */
+    /* Library's values, and the sections */
+    uint64_t                 ix_values[INDEX_MAX_PARAMS];
+    index_section_t          ix_sections[INDEX_MAX_SECTIONS];
+} image_index_t;
+
+int  index_key_init(const sysdep_dispatch_t *sysdep, void *ifd,
+                    const char *magic, uint32_t version, uint32_t head_crc,
+                    index_key_t *keyp);
+int  index_path(const sysdep_dispatch_t *sysdep, const char *ipath,
+                const char *trailer, char **pathp);
+int  index_load(const sysdep_dispatch_t *sysdep, const char *path,
+                const index_key_t *keyp, image_index_t **ixpp);
+int  index_save(const sysdep_dispatch_t *sysdep, const char *path,
+                const index_key_t *keyp, const uint64_t *values,
+                const index_section_t *sections, uint32_t nsections);
+void index_release(image_index_t *ixp);
+
+#endif /* _LIBINDEX_H_ */
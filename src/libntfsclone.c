@@ -14,13 +14,20 @@
 #    include <config.h>
 #endif /* HAVE_CONFIG_H */
 #include "changefile.h"
+#include "libbitmap.h"
+#include "libchecksum.h"
 #include "libimage.h"
+#include "libindex.h"
 #include "libntfsclone.h"
+#include "libstats.h"
+#include "libverify.h"
 #include "ntfsclone.h"
+#include "sysdep_arena.h"
 #include <errno.h>
 #include <string.h>
 
-static const char cf_trailer[] = ".cf";
+static const char cf_trailer[]  = ".cf";
+static const char idx_trailer[] = ".ntfsidx";
 
 /*
  * Handle to access partclone images.  Used internally.
@@ -40,7 +47,7 @@ struct change_file_context;
 #define NC_HAVE_PATH    0x2000  /* Path string allocated */
 #define NC_HAVE_CF_PATH 0x4000  /* Path string allocated */
 #define NC_VALID        0x8000  /* Header is valid */
-#define NC_TOLERANT     0x4000  /* Open in tolerant mode */
+#define NC_TOLERANT     0x40000 /* Open in tolerant mode */
 #define NC_READ_ONLY    0x80000 /* Open read only */
 typedef struct libntfsclone_context {
     void *                         nc_fd;        /* File handle */
@@ -55,6 +62,7 @@ typedef struct libntfsclone_context {
     uint64_t                       nc_curblock; /* Current position */
     uint32_t                       nc_flags;    /* Handle flags */
     sysdep_open_mode_t             nc_omode;    /* Open mode */
+    sysdep_arena_t *               nc_arena;    /* Memory for its lifetime */
 } nc_context_t;
 
 /*
@@ -101,50 +109,81 @@ typedef struct version_dispatch_table {
     int (*version_verify)(nc_context_t *ntcp);
     int (*version_finish)(nc_context_t *ntcp);
     int (*version_seek)(nc_context_t *ntcp, uint64_t block);
-    int (*version_readblock)(nc_context_t *ntcp, void *buffer);
+    int (*version_readblocks)(nc_context_t *ntcp, uint64_t blockno,
+                              void *buffer, uint64_t nblocks);
     int (*version_blockused)(nc_context_t *ntcp);
-    int (*version_writeblock)(nc_context_t *ntcp, void *buffer);
+    int (*version_blockextent)(nc_context_t *ntcp, uint64_t blockno,
+                               uint64_t maxblocks, uint64_t *nblocksp);
+    int (*version_writeblocks)(nc_context_t *ntcp, void *buffer,
+                               uint64_t nblocks);
+    int (*version_zeroblocks)(nc_context_t *ntcp, uint64_t blockno,
+                              uint64_t nblocks);
     int (*version_sync)(nc_context_t *ntcp);
+    int (*version_build_index)(nc_context_t *ntcp);
+    int (*version_verify_data)(nc_context_t *ntcp, verify_job_t *vjp);
+    int (*version_writepartial)(nc_context_t *ntcp, uint64_t blockno,
+                                uint64_t offset, uint64_t length,
+                                const void *buffer);
 } v_dispatch_table_t;
 
 /*
  * ntfsclone version 10 file format handling.
  */
-#define V10_DEFAULT_FACTOR 10 /* 1024 entries/index */
+#define V10_DEFAULT_FACTOR 10            /* 1024 entries/index */
+#define V10_MAXRUN_BYTES   (1024 * 1024) /* Maximum bytes per run read */
+
+/*
+ * Image data given to each thread at a time by a full check, and read at
+ * a time.
+ */
+#define V10_VERIFY_CHUNK_BYTES (32 * 1024 * 1024)
+#define V10_VERIFY_BUFSIZE     (4 * 1024 * 1024)
+
+#define V10_DIRECT  0x0001 /* Every gap is a single empty atom */
+#define V10_INDEXED 0x0002 /* Loaded from the index file */
 
 /*
  * Per-version specific handles.
  */
 typedef struct version_10_context {
-    unsigned char *v10_bitmap;         /* Usage bitmap */
-    uint64_t *     v10_bucket_offset;  /* Precalculated indices */
-    uint64_t       v10_current_bucket; /* Current bucket */
-    uint16_t       v10_bsfcount;       /* Preceding free blocks */
-    uint16_t       v10_bucket_factor;  /* log2(entries)/index */
+    bitmap_t *     v10_bitmap;        /* Usage bitmap */
+    bitmap_t *     v10_gapmap;        /* Used clusters that follow a gap */
+    uint64_t *     v10_bucket_offset; /* Precalculated indices */
+    uint64_t       v10_data_end;      /* Image offset past the last atom */
+    uint32_t       v10_head_crc;      /* CRC of the image header */
+    uint16_t       v10_bucket_factor; /* log2(entries)/index */
+    uint16_t       v10_flags;         /* Layout flags */
+    image_index_t *v10_index;         /* Index file, if loaded from it */
 } v10_context_t;
 
 /*
- * Inline bitmap manipulation routines.
+ * The index file (see libindex.h) saves what v10_verify() would otherwise
+ * have to work out from the image: the bucket offsets, and the usage and
+ * gap bitmaps with their rank directories.  It's keyed by the cluster count
+ * and bucket factor.
  */
-static inline void
-bitmap_set_bit(unsigned char *bitmap, uint64_t bit, uint32_t value) {
-    uint64_t      boffs = bit / 8;
-    uint8_t       bdisp = bit & 7;
-    unsigned char mask  = 1 << bdisp;
-    if (value) {
-        bitmap[boffs] |= mask;
-    } else {
-        bitmap[boffs] &= ~mask;
-    }
-}
+#define NTFSIDX_MAGIC   "NtfsIdx"
+#define NTFSIDX_VERSION 2
 
-static inline uint32_t
-bitmap_bit_value(unsigned char *bitmap, uint64_t bit) {
-    uint64_t      boffs = bit / 8;
-    uint8_t       bdisp = bit & 7;
-    unsigned char mask  = 1 << bdisp;
-    return (bitmap[boffs] & mask) ? 1 : 0;
-}
+#define NTFSIDX_OFFSETS   0 /* Sections: bucket offsets */
+#define NTFSIDX_BITMAP    1 /* Usage bitmap words, supers and groups */
+#define NTFSIDX_GAPMAP    4 /* Gap bitmap words, supers and groups */
+#define NTFSIDX_NSECTIONS 7
+
+#define NTFSIDX_DATA_END    0 /* Values: v10_data_end */
+#define NTFSIDX_FLAGS       1 /* v10_flags & V10_DIRECT */
+#define NTFSIDX_BITMAP_NSET 2 /* Set bits in the usage bitmap */
+#define NTFSIDX_GAPMAP_NSET 3 /* Set bits in the gap bitmap */
+
+/*
+ * Position of a walk through the atoms in the image.  The atom at image
+ * offset nw_offset describes cluster nw_cluster (and the clusters following
+ * it, if it is an empty atom).
+ */
+typedef struct v10_walk {
+    uint64_t nw_cluster; /* Cluster described by the atom */
+    uint64_t nw_offset;  /* Image offset of the atom */
+} v10_walk_t;
 
 /*
  * Initialize version 10 file handling.
@@ -158,8 +197,8 @@ v10_init(nc_context_t *ntcp) {
     v10_context_t *v10p;
 
     if (NTCTX_VALID(ntcp)) {
-        if ((error = (*ntcp->nc_sysdep->sys_malloc)(&v10p, sizeof(*v10p))) ==
-            0) {
+        if ((error = sysdep_arena_alloc(ntcp->nc_arena, &v10p,
+                                        sizeof(*v10p))) == 0) {
             memset(v10p, 0, sizeof(*v10p));
             ntcp->nc_verdep = v10p;
             ntcp->nc_flags |= (NC_HAVE_VERDEP | NC_VERSION_INIT);
@@ -171,8 +210,8 @@ v10_init(nc_context_t *ntcp) {
                                      ntcp->nc_head.nr_clusters +
                                          1, /* for trailing cluster */
                                      &ntcp->nc_cf_handle)) == 0) {
-                    ntcp->nc_flags |= NC_CF_OPEN;
-                } else {
+                    ntcp->nc_flags |= (NC_CF_OPEN | NC_HAVE_CFDEP);
+                } else if (error == ENOENT) {
                     /*
                      * We'll create later...
                      */
@@ -194,10 +233,253 @@ v10_init(nc_context_t *ntcp) {
     return error;
 }
 
+/*
+ * Number of entries in the bucket offset table.
+ */
+static inline uint64_t
+v10_nbuckets(nc_context_t *ntcp) {
+    v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
+
+    return (ntcp->nc_head.nr_clusters >> v10p->v10_bucket_factor) + 1;
+}
+
+/*
+ * Make up the key of the index file.
+ */
+static int
+v10_index_key(nc_context_t *ntcp, index_key_t *keyp) {
+    v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
+    int            error;
+
+    if ((error = index_key_init(ntcp->nc_sysdep, ntcp->nc_fd, NTFSIDX_MAGIC,
+                                NTFSIDX_VERSION, v10p->v10_head_crc,
+                                keyp)) == 0) {
+        keyp->ik_params[0] = ntcp->nc_head.nr_clusters;
+        keyp->ik_params[1] = v10p->v10_bucket_factor;
+    }
+
+    return error;
+}
+
+/*
+ * Describe the three sections holding a bitmap.
+ */
+static void
+v10_index_bitmap(const bitmap_t *bmp, index_section_t *isp) {
+    bitmap_sizes(bmp->bm_nbits, &isp[0].is_length, &isp[1].is_length,
+                 &isp[2].is_length);
+    isp[0].is_base = bmp->bm_words;
+    isp[1].is_base = bmp->bm_super;
+    isp[2].is_base = bmp->bm_group;
+}
+
+/*
+ * Attach a bitmap to its three sections of the index, if they're the right
+ * size for it.
+ */
+static int
+v10_index_attach(nc_context_t *ntcp, const index_section_t *isp,
+                 uint64_t nset, bitmap_t **bmpp) {
+    uint64_t wlen, slen, glen;
+
+    bitmap_sizes(ntcp->nc_head.nr_clusters, &wlen, &slen, &glen);
+    if ((isp[0].is_length != wlen) || (isp[1].is_length != slen) ||
+        (isp[2].is_length != glen) || (nset > ntcp->nc_head.nr_clusters))
+        return EINVAL;
+
+    return bitmap_attach(ntcp->nc_sysdep, ntcp->nc_head.nr_clusters, nset,
+                         isp[0].is_base, isp[1].is_base, isp[2].is_base, bmpp);
+}
+
+/*
+ * Use the bitmaps and bucket offsets in the index file.  The index must
+ * match the image exactly; if it doesn't, nothing is changed.
+ */
+static int
+v10_index_load(nc_context_t *ntcp) {
+    v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
+    index_key_t    key;
+    char *         ipath;
+    image_index_t *ixp;
+    int            error;
+
+    if (((error = v10_index_key(ntcp, &key)) == 0) &&
+        ((error = index_path(ntcp->nc_sysdep, ntcp->nc_path, idx_trailer,
+                             &ipath)) == 0)) {
+        if ((error = index_load(ntcp->nc_sysdep, ipath, &key, &ixp)) == 0) {
+            index_section_t *isp = ixp->ix_sections;
+
+            if ((ixp->ix_nsections != NTFSIDX_NSECTIONS) ||
+                (isp[NTFSIDX_OFFSETS].is_length !=
+                 v10_nbuckets(ntcp) * sizeof(uint64_t))) {
+                error = EINVAL;
+            } else if (((error = v10_index_attach(
+                             ntcp, &isp[NTFSIDX_BITMAP],
+                             ixp->ix_values[NTFSIDX_BITMAP_NSET],
+                             &v10p->v10_bitmap)) == 0) &&
+                       ((error = v10_index_attach(
+                             ntcp, &isp[NTFSIDX_GAPMAP],
+                             ixp->ix_values[NTFSIDX_GAPMAP_NSET],
+                             &v10p->v10_gapmap)) == 0)) {
+                v10p->v10_bucket_offset =
+                    (uint64_t *)isp[NTFSIDX_OFFSETS].is_base;
+                v10p->v10_data_end = ixp->ix_values[NTFSIDX_DATA_END];
+                v10p->v10_flags =
+                    (uint16_t)(ixp->ix_values[NTFSIDX_FLAGS] & V10_DIRECT);
+                v10p->v10_index = ixp;
+            }
+            if (error) {
+                bitmap_destroy(v10p->v10_bitmap);
+                v10p->v10_bitmap = (bitmap_t *)NULL;
+                index_release(ixp);
+            }
+        }
+        (void)(*ntcp->nc_sysdep->sys_free)(ipath);
+    }
+
+    return error;
+}
+
+/*
+ * Write the bitmaps and bucket offsets to the index file.
+ */
+static int
+v10_index_save(nc_context_t *ntcp) {
+    int            error = EINVAL;
+    v10_context_t *v10p  = (v10_context_t *)ntcp->nc_verdep;
+    index_key_t    key;
+    char *         ipath;
+
+    if (NTCTX_HAVE_VERDEP(ntcp) && v10p->v10_bitmap && v10p->v10_gapmap &&
+        ((error = v10_index_key(ntcp, &key)) == 0) &&
+        ((error = index_path(ntcp->nc_sysdep, ntcp->nc_path, idx_trailer,
+                             &ipath)) == 0)) {
+        index_section_t sections[NTFSIDX_NSECTIONS];
+        uint64_t        values[INDEX_MAX_PARAMS];
+
+        memset(values, 0, sizeof(values));
+        values[NTFSIDX_DATA_END]    = v10p->v10_data_end;
+        values[NTFSIDX_FLAGS]       = v10p->v10_flags & V10_DIRECT;
+        values[NTFSIDX_BITMAP_NSET] = v10p->v10_bitmap->bm_nset;
+        values[NTFSIDX_GAPMAP_NSET] = v10p->v10_gapmap->bm_nset;
+        sections[NTFSIDX_OFFSETS].is_base   = v10p->v10_bucket_offset;
+        sections[NTFSIDX_OFFSETS].is_length =
+            v10_nbuckets(ntcp) * sizeof(uint64_t);
+        v10_index_bitmap(v10p->v10_bitmap, &sections[NTFSIDX_BITMAP]);
+        v10_index_bitmap(v10p->v10_gapmap, &sections[NTFSIDX_GAPMAP]);
+        error = index_save(ntcp->nc_sysdep, ipath, &key, values, sections,
+                           NTFSIDX_NSECTIONS);
+        (void)(*ntcp->nc_sysdep->sys_free)(ipath);
+    }
+
+    return error;
+}
+
+/*
+ * Scan the image to build the bitmap and bucket offsets.
+ *
+ * While we're at it, check whether every run of unused clusters is a
+ * single empty atom.  If it is, the offset of any used cluster follows from
+ * the count of used clusters and gaps before it.
+ */
+static int
+v10_scan(nc_context_t *ntcp) {
+    int            error = 0;
+    v10_context_t *v10p  = (v10_context_t *)ntcp->nc_verdep;
+    uint64_t       cclust;
+    int            nconsecsync;
+    int            lastempty;
+
+    /*
+     * Seek to the first offset.
+     */
+    (void)(*ntcp->nc_sysdep->sys_seek)(ntcp->nc_fd,
+                                       ntcp->nc_head.offset_to_image_data,
+                                       SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL);
+
+    cclust      = 0;
+    nconsecsync = 0;
+    lastempty   = 0;
+    v10p->v10_flags |= V10_DIRECT;
+    while (!error && (cclust < ntcp->nc_head.nr_clusters)) {
+        ntfsclone_atom_t ibuf;
+        uint64_t         rsize, cfoffs;
+        uint64_t         xcpos;
+        (void)(*ntcp->nc_sysdep->sys_seek)(ntcp->nc_fd, 0, SYSDEP_SEEK_RELATIVE,
+                                           &xcpos);
+        if ((error = (*ntcp->nc_sysdep->sys_read)(ntcp->nc_fd, &ibuf,
+                                                  sizeof(ibuf), &rsize)) == 0) {
+            switch (ibuf.nca_atype) {
+            case 0: /* empty cluster */
+                nconsecsync = 0;
+                if (lastempty || (ibuf.nca_union.ncau_empty_count == 0))
+                    v10p->v10_flags &= ~V10_DIRECT;
+                lastempty = 1;
+                cclust += ibuf.nca_union.ncau_empty_count;
+                break;
+            case 1: /* used cluster */
+                nconsecsync = 0;
+                lastempty   = 0;
+                if ((error = (*ntcp->nc_sysdep->sys_seek)(
+                         ntcp->nc_fd,
+                         ntcp->nc_head.cluster_size - sizeof(ibuf.nca_union),
+                         SYSDEP_SEEK_RELATIVE, &cfoffs)) == 0) {
+                    bitmap_set(v10p->v10_bitmap, cclust);
+                    if (v10p->v10_bucket_offset[cclust >>
+                                                v10p->v10_bucket_factor] == 0) {
+                        /*
+                         * First used cluster in bucket.  Make note
+                         * of offset to the atom.
+                         */
+                        v10p->v10_bucket_offset[cclust >>
+                                                v10p->v10_bucket_factor] =
+                            cfoffs - ntcp->nc_head.cluster_size -
+                            ATOM_TO_DATA_OFFSET;
+                    }
+                    cclust++;
+                } else {
+                    if (NTCTX_TOLERANT(ntcp)) {
+                        error  = 0;
+                        cclust = ntcp->nc_head.nr_clusters;
+                    }
+                }
+                break;
+            default:
+                v10p->v10_flags &= ~V10_DIRECT;
+                if (NTCTX_TOLERANT(ntcp)) {
+                    error = 0;
+                    if (nconsecsync > 128) {
+                        cclust = ntcp->nc_head.nr_clusters;
+                    } else {
+                        nconsecsync++;
+                    }
+                } else {
+                    error = EDEADLK;
+                }
+                break;
+            }
+        } else {
+            if (NTCTX_TOLERANT(ntcp)) {
+                uint64_t discpos;
+                (void)(*ntcp->nc_sysdep->sys_seek)(
+                    ntcp->nc_fd, sizeof(ibuf), SYSDEP_SEEK_RELATIVE, &discpos);
+                v10p->v10_flags &= ~V10_DIRECT;
+                cclust++;
+                error = 0;
+            }
+        }
+    }
+    if (!error)
+        (void)(*ntcp->nc_sysdep->sys_seek)(ntcp->nc_fd, 0, SYSDEP_SEEK_RELATIVE,
+                                           &v10p->v10_data_end);
+
+    return error;
+}
+
 /*
  * Verify the currently open file.
  *
- * - Load the bitmap
+ * - Load the bitmap, from the index file if it's current.
  * - Precalculate the count of preceding valid blocks.
  */
 static int
@@ -209,119 +491,45 @@ v10_verify(nc_context_t *ntcp) {
          * Verify the header magic.
          */
         if (memcmp(ntcp->nc_head.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE) == 0) {
-            v10_context_t *v10p  = (v10_context_t *)ntcp->nc_verdep;
-            uint64_t       bmlen = ntcp->nc_head.nr_clusters / 8;
+            v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
 
+            v10p->v10_head_crc = update_crc32(init_crc32(), &ntcp->nc_head,
+                                              sizeof(ntcp->nc_head));
             ntcp->nc_flags |= NC_HEAD_VALID;
+
             /*
-             * Allocate and fill the bitmap.
+             * We always handle the last cluster.
              */
-            if (ntcp->nc_head.nr_clusters & 7)
-                bmlen++;
-            if (((error = (*ntcp->nc_sysdep->sys_malloc)(&v10p->v10_bitmap,
-                                                         bmlen)) == 0) &&
-                ((error = (*ntcp->nc_sysdep->sys_malloc)(
-                      &v10p->v10_bucket_offset,
-                      ((ntcp->nc_head.nr_clusters >> v10p->v10_bucket_factor) +
-                       1) *
-                          sizeof(uint64_t))) == 0)) {
-                uint64_t cclust;
-                int      nconsecsync;
-
-                memset(v10p->v10_bitmap, 0, bmlen);
-                memset(v10p->v10_bucket_offset, 0,
-                       ((ntcp->nc_head.nr_clusters >> v10p->v10_bucket_factor) +
-                        1) *
-                           sizeof(uint64_t));
+            ntcp->nc_head.nr_clusters++;
 
-                /*
-                 * Seek to the first offset.
-                 */
-                (void)(*ntcp->nc_sysdep->sys_seek)(
-                    ntcp->nc_fd, ntcp->nc_head.offset_to_image_data,
-                    SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL);
-
-                /*
-                 * We always handle the last cluster.
-                 */
-                ntcp->nc_head.nr_clusters++;
-
-                /*
-                 * Alas, there is no bitmap in the image, so we have to go
-                 * and build it.
-                 */
-                cclust      = 0;
-                nconsecsync = 0;
-                while (!error && (cclust < ntcp->nc_head.nr_clusters)) {
-                    ntfsclone_atom_t ibuf;
-                    uint64_t         rsize, cfoffs;
-                    uint64_t         xcpos;
-                    (void)(*ntcp->nc_sysdep->sys_seek)(
-                        ntcp->nc_fd, 0, SYSDEP_SEEK_RELATIVE, &xcpos);
-                    if ((error = (*ntcp->nc_sysdep->sys_read)(
-                             ntcp->nc_fd, &ibuf, sizeof(ibuf), &rsize)) == 0) {
-                        switch (ibuf.nca_atype) {
-                        case 0: /* empty cluster */
-                            nconsecsync = 0;
-                            cclust += ibuf.nca_union.ncau_empty_count;
-                            break;
-                        case 1: /* used cluster */
-                            nconsecsync = 0;
-                            if ((error = (*ntcp->nc_sysdep->sys_seek)(
-                                     ntcp->nc_fd,
-                                     ntcp->nc_head.cluster_size -
-                                         sizeof(ibuf.nca_union),
-                                     SYSDEP_SEEK_RELATIVE, &cfoffs)) == 0) {
-                                bitmap_set_bit(v10p->v10_bitmap, cclust, 1);
-                                if (v10p->v10_bucket_offset
-                                        [cclust >> v10p->v10_bucket_factor] ==
-                                    0) {
-                                    /*
-                                     * First used cluster in bucket.  Make note
-                                     * of offset to the atom.
-                                     */
-                                    v10p->v10_bucket_offset
-                                        [cclust >> v10p->v10_bucket_factor] =
-                                        cfoffs - ntcp->nc_head.cluster_size -
-                                        ATOM_TO_DATA_OFFSET;
-                                }
-                                cclust++;
-                            } else {
-                                if (NTCTX_TOLERANT(ntcp)) {
-                                    error  = 0;
-                                    cclust = ntcp->nc_head.nr_clusters;
-                                }
-                            }
-                            break;
-                        default:
-                            if (NTCTX_TOLERANT(ntcp)) {
-                                error = 0;
-                                if (nconsecsync > 128) {
-                                    cclust = ntcp->nc_head.nr_clusters;
-                                } else {
-                                    nconsecsync++;
-                                }
-                            } else {
-                                error = EDEADLK;
-                            }
-                            break;
-                        }
-                    } else {
-                        if (NTCTX_TOLERANT(ntcp)) {
-                            uint64_t discpos;
-                            (void)(*ntcp->nc_sysdep->sys_seek)(
-                                ntcp->nc_fd, sizeof(ibuf), SYSDEP_SEEK_RELATIVE,
-                                &discpos);
-                            cclust++;
-                            error = 0;
-                        }
-                    }
+            /*
+             * Alas, there is no bitmap in the image, so unless we have an
+             * index, we have to go and build it.
+             */
+            if (!NTCTX_TOLERANT(ntcp) && (v10_index_load(ntcp) == 0)) {
+                v10p->v10_flags |= V10_INDEXED;
+                error = 0;
+            } else if (((error = bitmap_create(ntcp->nc_sysdep,
+                                               ntcp->nc_head.nr_clusters,
+                                               &v10p->v10_bitmap)) == 0) &&
+                       ((error = bitmap_create(ntcp->nc_sysdep,
+                                               ntcp->nc_head.nr_clusters,
+                                               &v10p->v10_gapmap)) == 0) &&
+                       ((error = sysdep_arena_alloc(
+                             ntcp->nc_arena, &v10p->v10_bucket_offset,
+                             v10_nbuckets(ntcp) * sizeof(uint64_t))) == 0)) {
+                memset(v10p->v10_bucket_offset, 0,
+                       v10_nbuckets(ntcp) * sizeof(uint64_t));
+                if (((error = v10_scan(ntcp)) == 0) &&
+                    ((error = bitmap_build_rank(v10p->v10_bitmap)) == 0)) {
+                    bitmap_load_edges(v10p->v10_gapmap, v10p->v10_bitmap);
+                    error = bitmap_build_rank(v10p->v10_gapmap);
                 }
-                if (!error && ntcp->nc_cf_handle) {
-                    error = cf_verify(ntcp->nc_cf_handle);
-                    if (!error) {
-                        ntcp->nc_flags |= NC_CF_VERIFIED;
-                    }
+            }
+            if (!error && ntcp->nc_cf_handle) {
+                error = cf_verify(ntcp->nc_cf_handle);
+                if (!error) {
+                    ntcp->nc_flags |= NC_CF_VERIFIED;
                 }
             }
         }
@@ -342,11 +550,9 @@ v10_finish(nc_context_t *ntcp) {
     if (NTCTX_HAVE_VERDEP(ntcp)) {
         v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
 
-        if (v10p->v10_bitmap)
-            (void)(*ntcp->nc_sysdep->sys_free)(v10p->v10_bitmap);
-        if (v10p->v10_bucket_offset)
-            (void)(*ntcp->nc_sysdep->sys_free)(v10p->v10_bucket_offset);
-        (void)(*ntcp->nc_sysdep->sys_free)(v10p);
+        bitmap_destroy(v10p->v10_bitmap);
+        bitmap_destroy(v10p->v10_gapmap);
+        index_release(v10p->v10_index);
         ntcp->nc_flags &= ~NC_HAVE_VERDEP;
         error = (ntcp->nc_cf_handle) ? cf_finish(ntcp->nc_cf_handle) : 0;
     }
@@ -357,17 +563,15 @@ v10_finish(nc_context_t *ntcp) {
 /*
  * Version-specific handling for seeking to a particular block.
  *
- * Update the number of preceding valid blocks.
+ * Only the change file keeps a position of its own.
  */
 static int
 v10_seek(nc_context_t *ntcp, uint64_t blockno) {
     int error = EINVAL;
 
     if (NTCTX_HAVE_VERDEP(ntcp)) {
-        v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
-        int            trailing_cluster_in_image =
+        int trailing_cluster_in_image =
             (VDT_MINOR(ntcp->nc_dispatch) >= 1) ? 1 : 0;
-        uint64_t pbn, cbn;
 
         /*
          * The trailing cluster "should" be the same as the first cluster.
@@ -377,22 +581,6 @@ v10_seek(nc_context_t *ntcp, uint64_t blockno) {
             (blockno == ntcp->nc_head.nr_clusters))
             blockno = 0;
 
-        cbn = blockno >> v10p->v10_bucket_factor;
-        if (cbn != v10p->v10_current_bucket) {
-            /*
-             * Starting with the hint that is nearest, start calculating
-             * the preceding free blocks.
-             */
-            v10p->v10_bsfcount = 0;
-            pbn                = cbn << v10p->v10_bucket_factor;
-            for (v10p->v10_bsfcount = 0;
-                 ((bitmap_bit_value(v10p->v10_bitmap,
-                                    pbn + v10p->v10_bsfcount) == 0) &&
-                  ((pbn + v10p->v10_bsfcount) < blockno));
-                 v10p->v10_bsfcount++)
-                ;
-            v10p->v10_current_bucket = cbn;
-        }
         error = (ntcp->nc_cf_handle) ? cf_seek(ntcp->nc_cf_handle, blockno) : 0;
     }
 
@@ -400,115 +588,252 @@ v10_seek(nc_context_t *ntcp, uint64_t blockno) {
 }
 
 /*
- * Seek to the specified cluster in the image.
+ * Advance a walk to the atom for the specified (used) cluster.  If the walk
+ * is not already positioned in the cluster's bucket, start at the first used
+ * cluster in the bucket.
  */
-static inline int
-seek2cluster(nc_context_t *ntcp, uint64_t cnum) {
-    int            error   = EINVAL;
-    v10_context_t *v10p    = (v10_context_t *)ntcp->nc_verdep;
-    uint64_t       cbucket = cnum >> v10p->v10_bucket_factor;
-    uint64_t       imgpos  = v10p->v10_bucket_offset[cbucket];
-    uint64_t       cpos, cfoffs;
-
-    if (bitmap_bit_value(v10p->v10_bitmap, cnum) && imgpos) {
-        if (cbucket == v10p->v10_current_bucket) {
-            cpos = (v10p->v10_current_bucket << v10p->v10_bucket_factor) +
-                   v10p->v10_bsfcount;
-        } else {
+static int
+v10_walk_to(nc_context_t *ntcp, uint64_t cnum, v10_walk_t *wp) {
+    int            error = 0;
+    v10_context_t *v10p  = (v10_context_t *)ntcp->nc_verdep;
+    uint64_t       start = stats_start();
+    uint64_t       from;
+
+    if (!wp->nw_offset || (wp->nw_cluster > cnum) ||
+        ((wp->nw_cluster >> v10p->v10_bucket_factor) !=
+         (cnum >> v10p->v10_bucket_factor))) {
+        uint64_t cbucket = cnum >> v10p->v10_bucket_factor;
+
+        if ((wp->nw_offset = v10p->v10_bucket_offset[cbucket])) {
             /*
              * Advance to the first valid block in the bucket.
              */
-            for (cpos = cnum & ~((1 << v10p->v10_bucket_factor) - 1);
-                 bitmap_bit_value(v10p->v10_bitmap, cpos) == 0; cpos++)
+            for (wp->nw_cluster = cbucket << v10p->v10_bucket_factor;
+                 bitmap_test(v10p->v10_bitmap, wp->nw_cluster) == 0;
+                 wp->nw_cluster++)
                 ;
+        } else {
+            error = EINVAL;
         }
-        /*
-         * Now the tedium...
-         */
-        error = (*ntcp->nc_sysdep->sys_seek)(
-            ntcp->nc_fd, imgpos, SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL);
-        while (!error && (cpos < cnum)) {
-            ntfsclone_atom_t ibuf;
-            uint64_t         rsize;
-            if ((error = (*ntcp->nc_sysdep->sys_read)(
-                     ntcp->nc_fd, &ibuf, sizeof(ibuf), &rsize)) == 0) {
-                switch (ibuf.nca_atype) {
-                case 0: /* empty cluster */
-                    cpos += ibuf.nca_union.ncau_empty_count;
-                    break;
-                case 1: /* used cluster */
-                    if ((error = (*ntcp->nc_sysdep->sys_seek)(
-                             ntcp->nc_fd,
-                             ntcp->nc_head.cluster_size -
-                                 sizeof(ibuf.nca_union),
-                             SYSDEP_SEEK_RELATIVE, &cfoffs)) == 0) {
-                        cpos++;
-                    }
-                    break;
-                default:
-                    error = EDEADLK;
-                    break;
-                }
+    }
+
+    /*
+     * Now the tedium...
+     */
+    from = wp->nw_cluster;
+    while (!error && (wp->nw_cluster < cnum)) {
+        ntfsclone_atom_t ibuf;
+        uint64_t         rsize;
+
+        if ((error = (*ntcp->nc_sysdep->sys_pread)(
+                 ntcp->nc_fd, &ibuf, sizeof(ibuf), wp->nw_offset, &rsize)) ==
+            0) {
+            switch (ibuf.nca_atype) {
+            case 0: /* empty cluster */
+                wp->nw_cluster += ibuf.nca_union.ncau_empty_count;
+                wp->nw_offset += sizeof(ibuf);
+                break;
+            case 1: /* used cluster */
+                wp->nw_cluster++;
+                wp->nw_offset +=
+                    ATOM_TO_DATA_OFFSET + ntcp->nc_head.cluster_size;
+                break;
+            default:
+                error = EDEADLK;
+                break;
             }
         }
-        /*
-         * Now, we are ostensibly at the right place.  Our count had
-         * better match...
-         */
-        if (!error && (cpos == cnum)) {
-            error = (*ntcp->nc_sysdep->sys_seek)(
-                ntcp->nc_fd, ATOM_TO_DATA_OFFSET, SYSDEP_SEEK_RELATIVE,
-                (uint64_t *)NULL);
+    }
+
+    /*
+     * Now, we are ostensibly at the right place.  Our count had better
+     * match...
+     */
+    if (!error && (wp->nw_cluster != cnum))
+        error = EDEADLK;
+    stats_end(STATS_NC_WALK, start, (error) ? 0 : cnum - from, error);
+
+    return error;
+}
+
+/*
+ * Position a walk at the atom for the specified (used) cluster.  If every
+ * gap is a single empty atom, the atom's offset follows from the used
+ * clusters before it and the gaps up to and including the one just before
+ * it; otherwise walk the atoms.
+ */
+static int
+v10_locate(nc_context_t *ntcp, uint64_t cnum, v10_walk_t *wp) {
+    v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
+
+    if (v10p->v10_flags & V10_DIRECT) {
+        wp->nw_cluster = cnum;
+        wp->nw_offset =
+            ntcp->nc_head.offset_to_image_data +
+            bitmap_rank(v10p->v10_bitmap, cnum) *
+                (ATOM_TO_DATA_OFFSET + ntcp->nc_head.cluster_size) +
+            bitmap_rank(v10p->v10_gapmap, cnum + 1) * sizeof(ntfsclone_atom_t);
+        return 0;
+    }
+
+    return v10_walk_to(ntcp, cnum, wp);
+}
+
+/*
+ * Squeeze the atom headers out of "len" bytes read from "roffs" bytes into a
+ * run of used cluster atoms, leaving only cluster data at the front of "bp".
+ *
+ * Returns the number of bytes of cluster data, or -1 if an atom isn't a
+ * used cluster atom.
+ */
+static int64_t
+v10_squeeze(nc_context_t *ntcp, unsigned char *bp, uint64_t roffs,
+            uint64_t len) {
+    uint64_t stride = ATOM_TO_DATA_OFFSET + ntcp->nc_head.cluster_size;
+    uint64_t in     = 0;
+    uint64_t out    = 0;
+
+    while (in < len) {
+        uint64_t aoffs = (roffs + in) % stride;
+        uint64_t n =
+            ((aoffs < ATOM_TO_DATA_OFFSET) ? ATOM_TO_DATA_OFFSET : stride) -
+            aoffs;
+
+        if (n > (len - in))
+            n = len - in;
+        if (aoffs >= ATOM_TO_DATA_OFFSET) {
+            if (out != in)
+                memmove(&bp[out], &bp[in], n);
+            out += n;
+        } else if ((aoffs == 0) && (bp[in] != 1)) {
+            return -1;
         }
+        in += n;
     }
 
+    return out;
+}
+
+/*
+ * Read a run of consecutive used clusters starting at the walk position.
+ * The atoms are contiguous in the image, so read as much of the range as
+ * fits straight into the caller's buffer, squeeze the atom headers out and
+ * read the remainder the same way.
+ */
+static int
+v10_readrun(nc_context_t *ntcp, v10_walk_t *wp, uint64_t nclusters,
+            void *buffer) {
+    int            error  = 0;
+    unsigned char *cbp    = (unsigned char *)buffer;
+    uint64_t       stride = ATOM_TO_DATA_OFFSET + ntcp->nc_head.cluster_size;
+    uint64_t       total  = nclusters * ntcp->nc_head.cluster_size;
+    uint64_t       roffs  = 0;
+    uint64_t       filled = 0;
+    uint64_t       start  = stats_start();
+
+    while (!error && (filled < total)) {
+        uint64_t want = total - filled;
+        uint64_t r_size;
+        int64_t  ndata;
+
+        if (((error = (*ntcp->nc_sysdep->sys_pread)(
+                  ntcp->nc_fd, &cbp[filled], want, wp->nw_offset + roffs,
+                  &r_size)) == 0) &&
+            (r_size == want)) {
+            /*
+             * XXX - endian?
+             */
+            if ((ndata = v10_squeeze(ntcp, &cbp[filled], roffs, want)) >= 0) {
+                filled += ndata;
+                roffs += want;
+            } else {
+                error = EDEADLK;
+            }
+        } else if (!error) {
+            error = EIO;
+        }
+    }
+    if (!error) {
+        wp->nw_cluster += nclusters;
+        wp->nw_offset += nclusters * stride;
+    }
+    stats_end(STATS_NC_READRUN, start, nclusters, error);
+
     return error;
 }
 
 /*
- * Read the block at the current position.
+ * Read blocks starting at a particular block.
+ *
+ * Consecutive used clusters which are not in the change file are read with
+ * one read per run.  No per-handle state is changed, so readers may share
+ * the handle.
  */
 static int
-v10_readblock(nc_context_t *ntcp, void *buffer) {
+v10_readblocks(nc_context_t *ntcp, uint64_t blockno, void *buffer,
+               uint64_t nblocks) {
     int error = EINVAL;
 
-    /*
-     * Check to see if we can get the result from the change file.
-     */
     if (NTCTX_HAVE_VERDEP(ntcp)) {
-        if (ntcp->nc_cf_handle) {
-            cf_seek(ntcp->nc_cf_handle, ntcp->nc_curblock);
-            error = cf_readblock(ntcp->nc_cf_handle, buffer);
-        }
-        if (error) {
-            v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
+        v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
+        int            trailing_cluster_in_image =
+            (VDT_MINOR(ntcp->nc_dispatch) >= 1) ? 1 : 0;
+        uint64_t       csize  = ntcp->nc_head.cluster_size;
+        uint64_t       maxrun = V10_MAXRUN_BYTES / csize;
+        unsigned char *cbp    = (unsigned char *)buffer;
+        uint64_t       bindex = 0;
+        v10_walk_t     walk   = {0, 0};
+
+        if (!maxrun)
+            maxrun = 1;
+        error = 0;
+        while (!error && (bindex < nblocks)) {
+            uint64_t curblock = blockno + bindex;
+            uint64_t cnum     = curblock;
+            uint64_t nrun     = 1;
 
             /*
-             * Determine whether the block is used/valid.
+             * See v10_seek() regarding the trailing cluster.
              */
-            if (bitmap_bit_value(v10p->v10_bitmap, ntcp->nc_curblock)) {
-                /* block is valid */
-                if ((error = seek2cluster(ntcp, ntcp->nc_curblock)) == 0) {
-                    uint64_t r_size = -1;
-
-                    (void)(*ntcp->nc_sysdep->sys_read)(
-                        ntcp->nc_fd, buffer, ntcp->nc_head.cluster_size,
-                        &r_size);
-                    /*
-                     * XXX - endian?
-                     */
-                    if (r_size != ntcp->nc_head.cluster_size) {
-                        error = EIO;
-                    }
-                }
+            if (!trailing_cluster_in_image &&
+                (curblock == ntcp->nc_head.nr_clusters))
+                cnum = 0;
+
+            /*
+             * Check to see if we can get the result from the change file.
+             */
+            if (ntcp->nc_cf_handle &&
+                cf_blockused_at(ntcp->nc_cf_handle, curblock) &&
+                (cf_readblock_at(ntcp->nc_cf_handle, curblock, cbp) == 0)) {
+                /* block came from the change file */
+            } else if (bitmap_test(v10p->v10_bitmap, cnum)) {
+                /*
+                 * Find the extent of the run of valid blocks.
+                 */
+                while (((bindex + nrun) < nblocks) && (nrun < maxrun) &&
+                       (cnum == curblock) &&
+                       ((cnum + nrun) < ntcp->nc_head.nr_clusters) &&
+                       bitmap_test(v10p->v10_bitmap, cnum + nrun) &&
+                       !(ntcp->nc_cf_handle &&
+                         cf_blockused_at(ntcp->nc_cf_handle, curblock + nrun)))
+                    nrun++;
+                if ((error = v10_locate(ntcp, cnum, &walk)) == 0)
+                    error = v10_readrun(ntcp, &walk, nrun, cbp);
             } else {
                 /*
                  * If we're reading an invalid block, use the handy buffer.
                  */
-                memcpy(buffer, ntcp->nc_ivblock, ntcp->nc_head.cluster_size);
-                error = 0; /* This shouldn't be necessary... */
+                memcpy(cbp, ntcp->nc_ivblock, csize);
             }
+            cbp += nrun * csize;
+            bindex += nrun;
         }
+        /*
+         * Partial clusters in the change file go over what was read for
+         * them.
+         */
+        if (!error && ntcp->nc_cf_handle)
+            error = cf_overlay(ntcp->nc_cf_handle, blockno, buffer, nblocks);
     }
 
     return error;
@@ -525,56 +850,117 @@ v10_blockused(nc_context_t *ntcp) {
 
         retval = (ntcp->nc_cf_handle && cf_blockused(ntcp->nc_cf_handle))
                      ? 1
-                     : bitmap_bit_value(v10p->v10_bitmap, ntcp->nc_curblock);
+                     : bitmap_test(v10p->v10_bitmap, ntcp->nc_curblock);
     }
 
     return retval;
 }
 
 /*
- * Write block at current location.
+ * Find the extent of clusters starting at "blockno", up to "maxblocks",
+ * that are all used or all unused.  Clusters in the change file count as
+ * used.
  */
 static int
-v10_writeblock(nc_context_t *ntcp, void *buffer) {
-    int error = EINVAL;
-
-    /*
-     * Make sure we're initialized.
-     */
+v10_blockextent(nc_context_t *ntcp, uint64_t blockno, uint64_t maxblocks,
+                uint64_t *nblocksp) {
+    int retval = BLOCK_ERROR;
     if (NTCTX_HAVE_VERDEP(ntcp)) {
-        if (!NTCTX_WRITEREADY(ntcp)) {
-            if (!NTCTX_HAVE_CF_PATH(ntcp)) {
-                /*
-                 * We have to make up a name.
-                 */
-                if ((error = (*ntcp->nc_sysdep->sys_malloc)(
-                         &ntcp->nc_cf_path, strlen(ntcp->nc_path) +
-                                                strlen(cf_trailer) + 1)) == 0) {
-                    memcpy(ntcp->nc_cf_path, ntcp->nc_path,
-                           strlen(ntcp->nc_path));
-                    memcpy(&ntcp->nc_cf_path[strlen(ntcp->nc_path)], cf_trailer,
-                           strlen(cf_trailer) + 1);
-                    ntcp->nc_flags |= NC_HAVE_CF_PATH;
-                }
-            }
-            error = cf_create(ntcp->nc_cf_path, ntcp->nc_sysdep,
-                              ntcp->nc_head.cluster_size,
-                              ntcp->nc_head.nr_clusters, &ntcp->nc_cf_handle);
-            if (!error) {
-                ntcp->nc_flags |= (NC_HAVE_CFDEP | NC_CF_VERIFIED);
+        v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
+        uint64_t       nrun = bitmap_run(v10p->v10_bitmap, blockno, maxblocks);
+
+        retval = bitmap_test(v10p->v10_bitmap, blockno);
+        if (!retval && ntcp->nc_cf_handle) {
+            /*
+             * Trim the unused run back to the change file's clusters.
+             */
+            retval = cf_blockused_at(ntcp->nc_cf_handle, blockno);
+            nrun   = cf_run(ntcp->nc_cf_handle, blockno, nrun, retval);
+        }
+        *nblocksp = nrun;
+    }
+
+    return retval;
+}
+
+/*
+ * Make sure the change file is ready for changes, creating it if need be.
+ */
+static int
+v10_cf_ready(nc_context_t *ntcp) {
+    int error = 0;
+
+    if (!NTCTX_WRITEREADY(ntcp)) {
+        if (!NTCTX_HAVE_CF_PATH(ntcp)) {
+            /*
+             * We have to make up a name.
+             */
+            if ((error = sysdep_arena_alloc(
+                     ntcp->nc_arena, &ntcp->nc_cf_path,
+                     strlen(ntcp->nc_path) + strlen(cf_trailer) + 1)) == 0) {
+                memcpy(ntcp->nc_cf_path, ntcp->nc_path, strlen(ntcp->nc_path));
+                memcpy(&ntcp->nc_cf_path[strlen(ntcp->nc_path)], cf_trailer,
+                       strlen(cf_trailer) + 1);
+                ntcp->nc_flags |= NC_HAVE_CF_PATH;
             }
-        } else {
-            error = 0;
         }
+        error = cf_create(ntcp->nc_cf_path, ntcp->nc_sysdep,
+                          ntcp->nc_head.cluster_size, ntcp->nc_head.nr_clusters,
+                          &ntcp->nc_cf_handle);
         if (!error) {
-            cf_seek(ntcp->nc_cf_handle, ntcp->nc_curblock);
-            error = cf_writeblock(ntcp->nc_cf_handle, buffer);
+            ntcp->nc_flags |= (NC_HAVE_CFDEP | NC_CF_VERIFIED);
         }
     }
 
     return error;
 }
 
+/*
+ * Write blocks at current location.
+ */
+static int
+v10_writeblocks(nc_context_t *ntcp, void *buffer, uint64_t nblocks) {
+    int error = EINVAL;
+
+    /*
+     * Make sure we're initialized.
+     */
+    if (NTCTX_HAVE_VERDEP(ntcp) && !(error = v10_cf_ready(ntcp)))
+        error = cf_writeblocks(ntcp->nc_cf_handle, ntcp->nc_curblock, buffer,
+                               nblocks);
+
+    return error;
+}
+
+/*
+ * Write part of a cluster, without reading the rest of it.
+ */
+static int
+v10_writepartial(nc_context_t *ntcp, uint64_t blockno, uint64_t offset,
+                 uint64_t length, const void *buffer) {
+    int error = EINVAL;
+
+    if (NTCTX_HAVE_VERDEP(ntcp) && !(error = v10_cf_ready(ntcp)))
+        error = cf_writepartial(ntcp->nc_cf_handle, blockno, offset, length,
+                                buffer);
+
+    return error;
+}
+
+/*
+ * Make clusters read as zeroes.  They're recorded in the change file, so
+ * that nothing is written for them.
+ */
+static int
+v10_zeroblocks(nc_context_t *ntcp, uint64_t blockno, uint64_t nblocks) {
+    int error = EINVAL;
+
+    if (NTCTX_HAVE_VERDEP(ntcp) && !(error = v10_cf_ready(ntcp)))
+        error = cf_zeroblocks(ntcp->nc_cf_handle, blockno, nblocks);
+
+    return error;
+}
+
 /*
  * Flush changes to change file
  */
@@ -588,16 +974,176 @@ v10_sync(nc_context_t *ntcp) {
     return error;
 }
 
+/*
+ * The first used cluster in a bucket that has one.
+ */
+static uint64_t
+v10_bucket_first(nc_context_t *ntcp, uint64_t bucket) {
+    v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
+    uint64_t       cnum = bucket << v10p->v10_bucket_factor;
+
+    return (bitmap_test(v10p->v10_bitmap, cnum))
+               ? cnum
+               : cnum + bitmap_run(v10p->v10_bitmap, cnum,
+                                   ntcp->nc_head.nr_clusters - cnum);
+}
+
+/*
+ * Walk the atoms from image offset "offs", which describes cluster "cnum",
+ * up to "end", where cluster "cend" should be reached.  The atoms are read
+ * "bufsize" bytes at a time into "buf", and must agree with the bitmap.
+ *
+ * Returns EDEADLK if they don't, or the error from a failed read.
+ */
+static int
+v10_check_atoms(nc_context_t *ntcp, uint64_t offs, uint64_t end,
+                uint64_t cnum, uint64_t cend, unsigned char *buf,
+                uint64_t bufsize, uint64_t *nbytesp) {
+    v10_context_t *v10p   = (v10_context_t *)ntcp->nc_verdep;
+    uint64_t       stride = ATOM_TO_DATA_OFFSET + ntcp->nc_head.cluster_size;
+    int            error  = 0;
+
+    while (!error && (offs < end)) {
+        uint64_t len = ((end - offs) < bufsize) ? (end - offs) : bufsize;
+        uint64_t i   = 0;
+
+        if ((error = (*ntcp->nc_sysdep->sys_pread)(ntcp->nc_fd, buf, len, offs,
+                                                   &len)) != 0)
+            break;
+        /*
+         * Take the whole atoms in the buffer; one cut off at the end is
+         * read again at the start of the next.
+         */
+        while (!error && (i < len)) {
+            ntfsclone_atom_t atom;
+
+            if (buf[i] == 0) {
+                if ((len - i) < sizeof(atom))
+                    break;
+                memcpy(&atom, &buf[i], sizeof(atom));
+                if ((atom.nca_union.ncau_empty_count > (cend - cnum)) ||
+                    (bitmap_run(v10p->v10_bitmap, cnum,
+                                atom.nca_union.ncau_empty_count) <
+                     atom.nca_union.ncau_empty_count) ||
+                    (atom.nca_union.ncau_empty_count &&
+                     bitmap_test(v10p->v10_bitmap, cnum)))
+                    error = EDEADLK;
+                cnum += atom.nca_union.ncau_empty_count;
+                i += sizeof(atom);
+            } else if (buf[i] == 1) {
+                if ((len - i) < stride)
+                    break;
+                if ((cnum >= cend) || !bitmap_test(v10p->v10_bitmap, cnum))
+                    error = EDEADLK;
+                cnum++;
+                i += stride;
+            } else {
+                error = EDEADLK;
+            }
+        }
+        if (!error && !i)
+            error = EDEADLK; /* Atom cut off by the end */
+        offs += i;
+        *nbytesp += i;
+    }
+    if (!error && (cnum != cend))
+        error = EDEADLK;
+
+    return error;
+}
+
+/*
+ * Check the atoms of "nbuckets" buckets from "bucket" for a full check of
+ * the image data.  Each bucket with a used cluster starts a walk, which
+ * runs up to the next such bucket (possibly in another chunk) and reports
+ * the bucket bad if the atoms don't agree with the bitmap.  The first
+ * bucket's walk starts at the beginning of the data, to take in any gap
+ * before the first used cluster.
+ */
+static int
+v10_check_data(verify_job_t *vjp, uint64_t bucket, uint64_t nbuckets,
+               unsigned char *buf) {
+    nc_context_t * ntcp   = (nc_context_t *)vjp->vj_arg;
+    v10_context_t *v10p   = (v10_context_t *)ntcp->nc_verdep;
+    uint64_t       nb     = v10_nbuckets(ntcp);
+    uint64_t       last   = bucket + nbuckets;
+    uint64_t       nbytes = 0;
+    uint64_t       b;
+    uint64_t       next;
+
+    for (b = bucket; b < last; b = next) {
+        uint64_t offs, cnum, end, cend;
+        int      error;
+
+        for (next = b + 1; (next < nb) && !v10p->v10_bucket_offset[next];
+             next++)
+            ;
+        if (b == 0) {
+            offs = ntcp->nc_head.offset_to_image_data;
+            cnum = 0;
+        } else if (v10p->v10_bucket_offset[b]) {
+            offs = v10p->v10_bucket_offset[b];
+            cnum = v10_bucket_first(ntcp, b);
+        } else {
+            continue;
+        }
+        if (next < nb) {
+            end  = v10p->v10_bucket_offset[next];
+            cend = v10_bucket_first(ntcp, next);
+        } else {
+            end  = v10p->v10_data_end;
+            cend = ntcp->nc_head.nr_clusters;
+        }
+        if ((error = v10_check_atoms(ntcp, offs, end, cnum, cend, buf,
+                                     vjp->vj_bufsize, &nbytes)) != 0)
+            verify_unit_bad(vjp, b, error);
+    }
+    verify_unit_done(vjp, nbuckets, nbytes);
+
+    return 0;
+}
+
+/*
+ * Set up a full check of the image data.  There are no checksums, so it
+ * is the atoms which are checked, against the bitmap and bucket offsets
+ * (which may have come from the index file rather than the image).
+ */
+static int
+v10_verify_data(nc_context_t *ntcp, verify_job_t *vjp) {
+    v10_context_t *v10p = (v10_context_t *)ntcp->nc_verdep;
+    uint64_t       nb   = v10_nbuckets(ntcp);
+    uint64_t       bytes;
+
+    bytes = v10p->v10_data_end - ntcp->nc_head.offset_to_image_data;
+    vjp->vj_unitname = "bucket";
+    vjp->vj_units    = nb;
+    vjp->vj_bytes    = bytes;
+    vjp->vj_chunk    = (bytes > V10_VERIFY_CHUNK_BYTES)
+                           ? (nb * V10_VERIFY_CHUNK_BYTES) / bytes
+                           : nb;
+    if (!vjp->vj_chunk)
+        vjp->vj_chunk = 1;
+    vjp->vj_bufsize = V10_VERIFY_BUFSIZE;
+    if (vjp->vj_bufsize < (ATOM_TO_DATA_OFFSET + ntcp->nc_head.cluster_size))
+        vjp->vj_bufsize = ATOM_TO_DATA_OFFSET + ntcp->nc_head.cluster_size;
+    vjp->vj_check = v10_check_data;
+    vjp->vj_arg   = ntcp;
+
+    return verify_run(ntcp->nc_sysdep, vjp);
+}
+
 /*
  * Dispatch table for handling various versions.
  */
 static const v_dispatch_table_t version_table[] = {
     {VDT_VERSION_KEY(10, 1), /* version 10.1 */
-     v10_init, v10_verify, v10_finish, v10_seek, v10_readblock, v10_blockused,
-     v10_writeblock, v10_sync},
+     v10_init, v10_verify, v10_finish, v10_seek, v10_readblocks,
+     v10_blockused, v10_blockextent, v10_writeblocks, v10_zeroblocks,
+     v10_sync, v10_index_save, v10_verify_data, v10_writepartial},
     {VDT_VERSION_KEY(10, 0), /* version 10.0 */
-     v10_init, v10_verify, v10_finish, v10_seek, v10_readblock, v10_blockused,
-     v10_writeblock, v10_sync},
+     v10_init, v10_verify, v10_finish, v10_seek, v10_readblocks,
+     v10_blockused, v10_blockextent, v10_writeblocks, v10_zeroblocks,
+     v10_sync, v10_index_save, v10_verify_data, v10_writepartial},
 };
 
 /*
@@ -615,20 +1161,15 @@ ntfsclone_close(void *rp) {
         if (NTCTX_OPEN(ntcp)) {
             (void)(*ntcp->nc_sysdep->sys_close)(ntcp->nc_fd);
         }
-        if (NTCTX_HAVE_PATH(ntcp)) {
-            (void)(*ntcp->nc_sysdep->sys_free)(ntcp->nc_path);
-        }
-        if (NTCTX_HAVE_CF_PATH(ntcp)) {
-            (void)(*ntcp->nc_sysdep->sys_free)(ntcp->nc_cf_path);
-        }
-        if (NTCTX_HAVE_IVBLOCK(ntcp)) {
-            (void)(*ntcp->nc_sysdep->sys_free)(ntcp->nc_ivblock);
-        }
         if (NTCTX_HAVE_VERDEP(ntcp)) {
             if (ntcp->nc_dispatch && ntcp->nc_dispatch->version_finish)
                 error = (*ntcp->nc_dispatch->version_finish)(ntcp);
         }
-        (void)(*ntcp->nc_sysdep->sys_free)(ntcp);
+        /*
+         * The handle, its paths, buffer and version-dependent handle all
+         * go with the arena.
+         */
+        sysdep_arena_destroy(ntcp->nc_arena);
         error = 0;
     }
 
@@ -643,25 +1184,32 @@ ntfsclone_open(const char *path, const char *cfpath, sysdep_open_mode_t omode,
                const sysdep_dispatch_t *sysdep, void **rpp) {
     int error = EINVAL;
     if (sysdep) {
-        nc_context_t *ntcp;
-        error = (*sysdep->sys_malloc)(&ntcp, sizeof(*ntcp));
+        sysdep_arena_t *arena;
+        nc_context_t *  ntcp = (nc_context_t *)NULL;
+
+        if ((error = sysdep_arena_create(sysdep, &arena)) == 0 &&
+            (error = sysdep_arena_alloc(arena, &ntcp, sizeof(*ntcp))) != 0)
+            sysdep_arena_destroy(arena);
 
         if (ntcp) {
             memset(ntcp, 0, sizeof(*ntcp));
             ntcp->nc_flags |= NC_VALID;
             ntcp->nc_sysdep = sysdep;
+            ntcp->nc_arena  = arena;
 
             if ((error = (*ntcp->nc_sysdep->sys_open)(&ntcp->nc_fd, path,
                                                       SYSDEP_OPEN_RO)) == 0) {
                 ntcp->nc_flags |= NC_OPEN;
-                if ((error = (*ntcp->nc_sysdep->sys_malloc)(
-                         &ntcp->nc_path, strlen(path) + 1)) == 0) {
+                if ((error = sysdep_arena_alloc(ntcp->nc_arena, &ntcp->nc_path,
+                                                strlen(path) + 1)) == 0) {
                     ntcp->nc_flags |= NC_HAVE_PATH;
                     ntcp->nc_omode = omode;
                     memcpy(ntcp->nc_path, path, strlen(path) + 1);
                     if (cfpath &&
-                        ((error = (*ntcp->nc_sysdep->sys_malloc)(
-                              &ntcp->nc_cf_path, strlen(cfpath) + 1)) == 0)) {
+                        ((error = sysdep_arena_alloc(ntcp->nc_arena,
+                                                     &ntcp->nc_cf_path,
+                                                     strlen(cfpath) + 1)) ==
+                         0)) {
                         ntcp->nc_flags |= NC_HAVE_CF_PATH;
                         memcpy(ntcp->nc_cf_path, cfpath, strlen(cfpath) + 1);
                     }
@@ -693,6 +1241,22 @@ ntfsclone_tolerant_mode(void *rp) {
     }
 }
 
+/*
+ * Check checksums on read (ntfsclone images have none).
+ */
+int
+ntfsclone_verify_reads(void *rp) {
+    return ENOTSUP;
+}
+
+/*
+ * Load lazily (ntfsclone images have to be scanned to find their blocks).
+ */
+int
+ntfsclone_lazy_load(void *rp, int strict) {
+    return ENOTSUP;
+}
+
 /*
  * Determine the version of the file and verify it.
  */
@@ -749,8 +1313,8 @@ ntfsclone_verify_common(void *rp, int full) {
                         /*
                          * Allocate a buffer.
                          */
-                        if ((error = (*ntcp->nc_sysdep->sys_malloc)(
-                                 &ntcp->nc_ivblock,
+                        if ((error = sysdep_arena_alloc(
+                                 ntcp->nc_arena, &ntcp->nc_ivblock,
                                  ntcp->nc_head.cluster_size)) == 0) {
                             memset(ntcp->nc_ivblock, 69,
                                    ntcp->nc_head.cluster_size);
@@ -840,25 +1404,69 @@ ntfsclone_readblocks(void *rp, void *buffer, uint64_t nblocks) {
     int           error = EINVAL;
     nc_context_t *ntcp  = (nc_context_t *)rp;
     if (NTCTX_READREADY(ntcp)) {
-        uint64_t bindex;
-        void *   cbp = buffer;
-
         /*
-         * Iterate and use the version-specific routine to do the heavy
-         * lifting.
+         * Use the version-specific routine to do the heavy lifting.
          */
-        for (bindex = 0; bindex < nblocks; bindex++) {
-            if ((error = (*ntcp->nc_dispatch->version_readblock)(ntcp, cbp))) {
-                break;
-            }
-            ntcp->nc_curblock++;
-            cbp += ntcp->nc_head.cluster_size;
+        if (!(error = (*ntcp->nc_dispatch->version_readblocks)(
+                  ntcp, ntcp->nc_curblock, buffer, nblocks))) {
+            ntcp->nc_curblock += nblocks;
         }
     }
 
     return error;
 }
 
+/*
+ * Read blocks starting at a particular block.  The current position is
+ * not changed.
+ */
+int
+ntfsclone_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                        uint64_t nblocks) {
+    int           error = EINVAL;
+    nc_context_t *ntcp  = (nc_context_t *)rp;
+
+    if (NTCTX_READREADY(ntcp) && (blockno <= ntcp->nc_head.nr_clusters) &&
+        (nblocks <= (ntcp->nc_head.nr_clusters - blockno))) {
+        error = (*ntcp->nc_dispatch->version_readblocks)(ntcp, blockno, buffer,
+                                                         nblocks);
+    }
+
+    return error;
+}
+
+/*
+ * Write an index file for the image, so that later verifies can load the
+ * bitmap from it instead of scanning the image.
+ */
+int
+ntfsclone_build_index(void *rp) {
+    int           error = EINVAL;
+    nc_context_t *ntcp  = (nc_context_t *)rp;
+
+    if (NTCTX_READREADY(ntcp)) {
+        error = (*ntcp->nc_dispatch->version_build_index)(ntcp);
+    }
+
+    return error;
+}
+
+/*
+ * Check all of the atoms in a verified image, with the threads and
+ * callbacks set in "vjp".
+ */
+int
+ntfsclone_verify_data(void *rp, verify_job_t *vjp) {
+    int           error = EINVAL;
+    nc_context_t *ntcp  = (nc_context_t *)rp;
+
+    if (NTCTX_READREADY(ntcp)) {
+        error = (*ntcp->nc_dispatch->version_verify_data)(ntcp, vjp);
+    }
+
+    return error;
+}
+
 /*
  * Determine if the current block is used.
  */
@@ -870,6 +1478,33 @@ ntfsclone_block_used(void *rp) {
                : BLOCK_ERROR;
 }
 
+/*
+ * Determine whether the clusters starting at "blockno" are used, and how
+ * many of them, up to "maxblocks", share that state.
+ */
+int
+ntfsclone_block_extent(void *rp, uint64_t blockno, uint64_t maxblocks,
+                       uint64_t *nblocksp) {
+    nc_context_t *ntcp = (nc_context_t *)rp;
+    return (NTCTX_READREADY(ntcp) && (blockno < ntcp->nc_head.nr_clusters) &&
+            maxblocks && nblocksp)
+               ? (*ntcp->nc_dispatch->version_blockextent)(ntcp, blockno,
+                                                           maxblocks, nblocksp)
+               : BLOCK_ERROR;
+}
+
+/*
+ * Map a range of clusters.  Every used cluster is stored behind a one byte
+ * marker and invalid clusters don't read as zeroes, so there's nothing to
+ * map: reads of ntfsclone images always go through a buffer.
+ */
+int
+ntfsclone_block_map(void *rp, uint64_t blockno, uint64_t nblocks,
+                    image_segment_t *segs, uint32_t *nsegsp) {
+    nc_context_t *ntcp = (nc_context_t *)rp;
+    return (NTCTX_READREADY(ntcp) && nsegsp) ? ENOTSUP : EINVAL;
+}
+
 /*
  * Write blocks to the current position.
  */
@@ -878,26 +1513,45 @@ ntfsclone_writeblocks(void *rp, void *buffer, uint64_t nblocks) {
     int           error = EINVAL;
     nc_context_t *ntcp  = (nc_context_t *)rp;
 
-    if (NTCTX_WRITEABLE(ntcp)) {
-        uint64_t bindex;
-        void *   cbp = buffer;
-
-        /*
-         * Iterate and use the version-specific routine to do the heavy
-         * lifting.
-         */
-        for (bindex = 0; bindex < nblocks; bindex++) {
-            if ((error = (*ntcp->nc_dispatch->version_writeblock)(ntcp, cbp))) {
-                break;
-            }
-            ntcp->nc_curblock++;
-            cbp += ntcp->nc_head.cluster_size;
-        }
-    }
+    if (NTCTX_WRITEABLE(ntcp) &&
+        !(error = (*ntcp->nc_dispatch->version_writeblocks)(ntcp, buffer,
+                                                            nblocks)))
+        ntcp->nc_curblock += nblocks;
 
     return error;
 }
 
+/*
+ * Make clusters read as zeroes.
+ */
+int
+ntfsclone_zeroblocks(void *rp, uint64_t blockno, uint64_t nblocks) {
+    nc_context_t *ntcp = (nc_context_t *)rp;
+
+    return (NTCTX_WRITEABLE(ntcp) && (blockno <= ntcp->nc_head.nr_clusters) &&
+            (nblocks <= (ntcp->nc_head.nr_clusters - blockno)))
+               ? (*ntcp->nc_dispatch->version_zeroblocks)(ntcp, blockno,
+                                                          nblocks)
+               : EINVAL;
+}
+
+/*
+ * Write "length" bytes at "offset" in cluster "blockno".  ENOTSUP means the
+ * whole cluster has to be written instead.  This does not change the
+ * current position.
+ */
+int
+ntfsclone_writepartial(void *rp, uint64_t blockno, uint64_t offset,
+                       uint64_t length, const void *buffer) {
+    nc_context_t *ntcp = (nc_context_t *)rp;
+
+    return (NTCTX_WRITEABLE(ntcp) && (blockno < ntcp->nc_head.nr_clusters))
+               ? (*ntcp->nc_dispatch->version_writepartial)(ntcp, blockno,
+                                                            offset, length,
+                                                            buffer)
+               : EINVAL;
+}
+
 /*
  * Commit changes to image.
  */
@@ -929,8 +1583,10 @@ ntfsclone_probe(const char *path, const sysdep_dispatch_t *sysdep) {
  * The image type dispatch table.
  */
 const image_dispatch_t ntfsclone_image_type = {
-    "ntfsclone image",     ntfsclone_probe,         ntfsclone_open,
-    ntfsclone_close,       ntfsclone_tolerant_mode, ntfsclone_verify,
-    ntfsclone_blocksize,   ntfsclone_blockcount,    ntfsclone_seek,
-    ntfsclone_tell,        ntfsclone_readblocks,    ntfsclone_block_used,
-    ntfsclone_writeblocks, ntfsclone_sync};
+    "ntfsclone image",       ntfsclone_probe,         ntfsclone_open,
+    ntfsclone_close,         ntfsclone_tolerant_mode, ntfsclone_verify_reads,
+    ntfsclone_lazy_load,     ntfsclone_verify,        ntfsclone_blocksize,
+    ntfsclone_blockcount,    ntfsclone_seek,          ntfsclone_tell,
+    ntfsclone_readblocks,    ntfsclone_readblocks_at, ntfsclone_block_used,
+    ntfsclone_block_extent,  ntfsclone_block_map,     ntfsclone_writeblocks,
+    ntfsclone_zeroblocks,    ntfsclone_sync,          ntfsclone_writepartial};
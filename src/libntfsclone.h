@@ -14,6 +14,8 @@
 #ifndef _LIBNTFSCLONE_H_
 #define _LIBNTFSCLONE_H_ 1
 
+#include "libimage.h"
+#include "libverify.h"
 #include "sysdep_int.h"
 #include <sys/types.h>
 
@@ -21,14 +23,27 @@ int      ntfsclone_open(const char *path, const char *cfpath,
                         sysdep_open_mode_t omode, const sysdep_dispatch_t *sysdep,
                         void **rpp);
 int      ntfsclone_close(void *rp);
+int      ntfsclone_verify_reads(void *rp);
+int      ntfsclone_lazy_load(void *rp, int strict);
 int      ntfsclone_verify(void *rp);
 int64_t  ntfsclone_blocksize(void *rp);
 int64_t  ntfsclone_blockcount(void *rp);
 int      ntfsclone_seek(void *rp, uint64_t blockno);
 uint64_t ntfsclone_tell(void *rp);
 int      ntfsclone_readblocks(void *rp, void *buffer, uint64_t nblocks);
+int      ntfsclone_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                                 uint64_t nblocks);
 int      ntfsclone_block_used(void *rp);
+int      ntfsclone_block_extent(void *rp, uint64_t blockno, uint64_t maxblocks,
+                                uint64_t *nblocksp);
+int      ntfsclone_block_map(void *rp, uint64_t blockno, uint64_t nblocks,
+                             image_segment_t *segs, uint32_t *nsegsp);
 int      ntfsclone_writeblocks(void *rp, void *buffer, uint64_t nblocks);
+int      ntfsclone_zeroblocks(void *rp, uint64_t blockno, uint64_t nblocks);
+int      ntfsclone_writepartial(void *rp, uint64_t blockno, uint64_t offset,
+                                uint64_t length, const void *buffer);
 int      ntfsclone_sync(void *rp);
+int      ntfsclone_build_index(void *rp);
+int      ntfsclone_verify_data(void *rp, verify_job_t *vjp);
 
 #endif /* _LIBNTFSCLONE_H_ */
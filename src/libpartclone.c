@@ -14,14 +14,22 @@
 #    include "config.h"
 #endif /* HAVE_CONFIG_H */
 #include "changefile.h"
+#include "libbitmap.h"
 #include "libchecksum.h"
 #include "libimage.h"
+#include "libindex.h"
 #include "libpartclone.h"
+#include "libstats.h"
+#include "libverify.h"
 #include "partclone.h"
 #include <errno.h>
 #include <string.h>
+#ifdef HAVE_LIBPTHREAD
+#    include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
 
-static const char cf_trailer[] = ".cf";
+static const char cf_trailer[]  = ".cf";
+static const char idx_trailer[] = ".pcidx";
 
 struct version_dispatch_table;
 struct change_file_context;
@@ -31,7 +39,6 @@ struct change_file_context;
 #define PC_VERIFIED     0x0004  /* Image verified */
 #define PC_HAVE_CFDEP   0x0040  /* Image has change file handle */
 #define PC_HAVE_VERDEP  0x0080  /* Image has version-dependent handle */
-#define PC_HAVE_IVBLOCK 0x0100  /* Image has invalid block. */
 #define PC_CF_VERIFIED  0x0200  /* Change file verified. */
 #define PC_CF_INIT      0x0400  /* Change file init done. */
 #define PC_VERSION_INIT 0x0800  /* Version-dependent init done. */
@@ -41,6 +48,9 @@ struct change_file_context;
 #define PC_VALID        0x8000  /* Header is valid */
 #define PC_TOLERANT     0x40000 /* Open in tolerant mode */
 #define PC_READ_ONLY    0x80000 /* Open read only */
+#define PC_CHECK_READS  0x100000 /* Check checksums on read */
+#define PC_LAZY         0x200000 /* Load the bitmap in the background */
+#define PC_STRICT       0x400000 /* Wait for all of it to be checked */
 
 /*
  * Macros to check state flags.
@@ -50,6 +60,7 @@ struct change_file_context;
 #define PCTX_VALID(_p)     PCTX_FLAGS_SET(_p, 0)
 #define PCTX_OPEN(_p)      PCTX_FLAGS_SET(_p, PC_OPEN)
 #define PCTX_TOLERANT(_p)  PCTX_FLAGS_SET(_p, PC_TOLERANT)
+#define PCTX_CHECK_READS(_p) PCTX_FLAGS_SET(_p, PC_CHECK_READS)
 #define PCTX_READ_ONLY(_p) (((_p)->pc_flags & PC_READ_ONLY) == PC_READ_ONLY)
 #define PCTX_CF_OPEN(_p)   PCTX_FLAGS_SET(_p, PC_CF_OPEN)
 #define PCTX_VERIFIED(_p)  PCTX_FLAGS_SET(_p, PC_OPEN | PC_VERIFIED)
@@ -69,8 +80,6 @@ struct change_file_context;
     (PCTX_FLAGS_SET(_p, PC_HAVE_VERDEP) && (_p)->pc_verdep)
 #define PCTX_HAVE_CFDEP(_p) \
     (PCTX_FLAGS_SET(_p, PC_HAVE_CFDEP) && (_p)->pc_cfdep)
-#define PCTX_HAVE_IVBLOCK(_p) \
-    (PCTX_FLAGS_SET(_p, PC_HAVE_IVBLOCK) && (_p)->pc_ivblock)
 
 /*
  * Version dispatch table - to handle different file format versions.
@@ -81,45 +90,65 @@ typedef struct version_dispatch_table {
     int (*version_verify)(pc_context_t *pcp);
     int (*version_finish)(pc_context_t *pcp);
     int (*version_seek)(pc_context_t *pcp, uint64_t block);
-    int (*version_readblock)(pc_context_t *pcp, void *buffer);
+    int (*version_readblocks)(pc_context_t *pcp, uint64_t blockno,
+                              void *buffer, uint64_t nblocks);
     int (*version_blockused)(pc_context_t *pcp);
-    int (*version_writeblock)(pc_context_t *pcp, void *buffer);
+    int (*version_blockextent)(pc_context_t *pcp, uint64_t blockno,
+                               uint64_t maxblocks, uint64_t *nblocksp);
+    int (*version_blockmap)(pc_context_t *pcp, uint64_t blockno,
+                            uint64_t nblocks, image_segment_t *segs,
+                            uint32_t *nsegsp);
+    int (*version_writeblocks)(pc_context_t *pcp, void *buffer,
+                               uint64_t nblocks);
+    int (*version_zeroblocks)(pc_context_t *pcp, uint64_t blockno,
+                              uint64_t nblocks);
     int (*version_sync)(pc_context_t *pcp);
+    int (*version_build_index)(pc_context_t *pcp);
+    int (*version_writepartial)(pc_context_t *pcp, uint64_t blockno,
+                                uint64_t offset, uint64_t length,
+                                const void *buffer);
 } v_dispatch_table_t;
 
+static const char cmagicstr[] = BIT_MAGIC;
+
 /*
- * Common parameters.
+ * partclone version 1 file format handling.
  */
-#define CRC_UNIT_BITS 8
-#define CRC_TABLE_LEN (1 << CRC_UNIT_BITS)
+#define V1_MAXRUN_BYTES (1024 * 1024) /* Maximum bytes per run read */
+#define V1_BYTEMAP_CHUNK (64 * 1024)   /* Byte map bytes per read */
 
 /*
- * This really should be in partclone.h.
+ * Image data read at a time by each thread of a full check.
  */
-static const char cmagicstr[] = "BiTmAgIc";
+#define PC_VERIFY_CHUNK_BYTES (8 * 1024 * 1024)
 
 /*
- * partclone version 1 file format handling.
+ * Checksum group buffers kept for reuse by checked reads.
  */
-#define V1_DEFAULT_FACTOR 10 /* 1024 entries/index */
+#define V1_GBUF_SLOTS 16
+
+typedef struct v1_lazy v1_lazy_t;
 
 /*
  * Per-version specific handles.
  */
 typedef struct version_1_context {
-    unsigned char *v1_bitmap;   /* Usage bitmap */
-    uint64_t *     v1_sumcount; /* Precalculated indices */
-    uint64_t       v1_nvbcount; /* Preceding valid blocks */
-    uint32_t       v1_crc_tab32[CRC_TABLE_LEN];
-    /* Precalculated CRC table */
-    uint16_t v1_bitmap_factor; /* log2(entries)/index */
+    bitmap_t *     v1_bitmap;               /* Usage bitmap and rank index */
+    uint64_t       v1_nstrange;             /* Byte map entries not 0 or 1 */
+    bitmap_t *     v1_checked;              /* Groups verified on read */
+    uint64_t       v1_crc_errors;           /* Tolerated checksum mismatches */
+    void *         v1_gbufs[V1_GBUF_SLOTS]; /* Idle checksum group buffers */
+    uint32_t       v1_head_crc;             /* CRC of the image header */
+    image_index_t *v1_index;                /* Index file, if loaded from it */
+    v1_lazy_t *    v1_lazy;                 /* Background load, if lazy */
 } v1_context_t;
 
+static int v2_check_setup(pc_context_t *pcp);
+
 /*
  * Initialize version 1 file handling.
  *
  * - Allocate and initialize version 1 handle.
- * - Precalculate the CRC table.
  */
 static int
 v1_init(pc_context_t *pcp) {
@@ -127,90 +156,542 @@ v1_init(pc_context_t *pcp) {
     v1_context_t *v1p;
 
     if (PCTX_VALID(pcp)) {
-        if ((error = (*pcp->pc_sysdep->sys_malloc)(&v1p, sizeof(*v1p))) == 0) {
-            int i;
+        if ((error = sysdep_arena_alloc(pcp->pc_arena, &v1p, sizeof(*v1p))) ==
+            0) {
             memset(v1p, 0, sizeof(*v1p));
             pcp->pc_verdep = v1p;
             pcp->pc_flags |= (PC_HAVE_VERDEP | PC_VERSION_INIT);
 
-            if (pcp->pc_cf_path &&
-                ((int)pcp->pc_omode >= (int)SYSDEP_OPEN_RW)) {
-                if ((error = cf_init(pcp->pc_cf_path, pcp->pc_sysdep,
-                                     pcp->pc_head.block_size,
-                                     pcp->pc_head.totalblock,
-                                     &pcp->pc_cf_handle)) == 0) {
-                    pcp->pc_flags |= PC_CF_OPEN;
-                } else {
-                    /*
-                     * We'll create later...
-                     */
-                    error = 0;
+            /*
+             * The change file is opened once the header has been verified
+             * and the geometry is known.
+             */
+            if ((int)pcp->pc_omode < (int)SYSDEP_OPEN_RW)
+                pcp->pc_flags |= PC_READ_ONLY;
+        }
+    }
+
+    return error;
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * Lazy loading.  Verifying only reads the header, and the bitmap is loaded
+ * by a background thread, a chunk of LZ_CHUNK_SUPERS superblocks at a
+ * time and in order, building the rank directory behind it; lz_ranked is
+ * how far that has got.  Once the whole map is loaded, its checksum (or
+ * version 1's trailing magic) is checked.
+ *
+ * A request ahead of the loader loads the superblocks it touches itself.
+ * That's enough for blocks that aren't in the image, which read as zeroes;
+ * blocks that are in it need the rank directory up to them, so requests
+ * for those wait for the loader.  In strict mode (and when checking reads,
+ * which needs the count of blocks in the image), requests wait until the
+ * whole bitmap is loaded and checked.
+ */
+#define LZ_CHUNK_SUPERS 16
+
+#define LZ_LOADING 0
+#define LZ_DONE    1
+#define LZ_FAILED  2
+
+struct v1_lazy {
+    pthread_t       lz_thread;   /* Loader */
+    pthread_mutex_t lz_lock;     /* Serializes loading superblocks */
+    pthread_cond_t  lz_cond;     /* Signalled as the loader progresses */
+    bitmap_t *      lz_loaded;   /* Superblocks loaded */
+    uint64_t        lz_nsupers;  /* Number of superblocks */
+    uint64_t        lz_ranked;   /* Rank directory entries built */
+    uint64_t        lz_mapoffs;  /* Where the on-disk map is */
+    uint64_t        lz_maplen;   /* Its length, without its trailer */
+    uint64_t        lz_region;   /* On-disk map bytes per superblock */
+    unsigned char * lz_buf;      /* One superblock's map, under lz_lock */
+    int             lz_bytemap;  /* Version 1 byte map, rather than bits */
+    int             lz_state;    /* LZ_LOADING, LZ_DONE or LZ_FAILED */
+    int             lz_error;    /* Why it failed */
+    int             lz_started;  /* Loader started */
+    int             lz_joinable; /* Loader is a thread of its own */
+    int             lz_stop;     /* Loader to stop */
+};
+
+/*
+ * Set up to load the bitmap lazily from the on-disk map of "maplen" bytes
+ * at "mapoffs".
+ */
+static int
+v1_lazy_setup(pc_context_t *pcp, uint64_t mapoffs, uint64_t maplen,
+              int bytemap) {
+    int           error;
+    v1_context_t *v1p     = (v1_context_t *)pcp->pc_verdep;
+    uint64_t      nsupers = (pcp->pc_head.totalblock + BM_SUPER_BITS - 1) >>
+                       BM_SUPER_SHIFT;
+    v1_lazy_t *   lzp;
+
+    if ((error = sysdep_arena_alloc(pcp->pc_arena, &lzp, sizeof(*lzp))) ==
+        0) {
+        memset(lzp, 0, sizeof(*lzp));
+        lzp->lz_nsupers = nsupers;
+        lzp->lz_mapoffs = mapoffs;
+        lzp->lz_maplen  = maplen;
+        lzp->lz_region  = (bytemap) ? BM_SUPER_BITS : BM_SUPER_BITS / 8;
+        lzp->lz_bytemap = bytemap;
+        if (((error = bitmap_create(pcp->pc_sysdep, pcp->pc_head.totalblock,
+                                    &v1p->v1_bitmap)) == 0) &&
+            ((error = bitmap_alloc_rank(v1p->v1_bitmap)) == 0) &&
+            ((error = bitmap_create(pcp->pc_sysdep, nsupers,
+                                    &lzp->lz_loaded)) == 0) &&
+            ((error = (*pcp->pc_sysdep->sys_malloc)(&lzp->lz_buf,
+                                                    lzp->lz_region)) == 0)) {
+            pthread_mutex_init(&lzp->lz_lock, (pthread_mutexattr_t *)NULL);
+            pthread_cond_init(&lzp->lz_cond, (pthread_condattr_t *)NULL);
+            v1p->v1_lazy = lzp;
+        } else {
+            bitmap_destroy(lzp->lz_loaded);
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Load superblock "sb" from its part of the on-disk map, with lz_lock
+ * held.
+ */
+static void
+v1_lazy_load_super(pc_context_t *pcp, uint64_t sb, const unsigned char *map) {
+    v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
+    v1_lazy_t *   lzp = v1p->v1_lazy;
+
+    if (lzp->lz_bytemap)
+        (void)__atomic_fetch_add(
+            &v1p->v1_nstrange,
+            bitmap_load_bytes(v1p->v1_bitmap, map, lzp->lz_region,
+                              sb << BM_SUPER_SHIFT),
+            __ATOMIC_RELAXED);
+    else
+        bitmap_load_bits_at(v1p->v1_bitmap, map, sb << BM_SUPER_SHIFT,
+                            BM_SUPER_BITS);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    bitmap_set_shared(lzp->lz_loaded, sb);
+}
+
+/*
+ * Length of superblock "sb"'s part of the on-disk map.
+ */
+static inline uint64_t
+v1_lazy_region(v1_lazy_t *lzp, uint64_t sb, uint64_t nsupers) {
+    uint64_t offs = sb * lzp->lz_region;
+    uint64_t len  = nsupers * lzp->lz_region;
+
+    return (len < (lzp->lz_maplen - offs)) ? len : lzp->lz_maplen - offs;
+}
+
+/*
+ * Load the superblocks from "first" to "last" which aren't loaded yet.
+ */
+static int
+v1_lazy_fault(pc_context_t *pcp, uint64_t first, uint64_t last) {
+    int           error = 0;
+    v1_context_t *v1p   = (v1_context_t *)pcp->pc_verdep;
+    v1_lazy_t *   lzp   = v1p->v1_lazy;
+    uint64_t      sb;
+
+    for (sb = first; !error && (sb <= last) && (sb < lzp->lz_nsupers); sb++) {
+        if (bitmap_test_shared(lzp->lz_loaded, sb))
+            continue;
+        pthread_mutex_lock(&lzp->lz_lock);
+        if (!bitmap_test(lzp->lz_loaded, sb)) {
+            uint64_t want = v1_lazy_region(lzp, sb, 1);
+            uint64_t r_size;
+
+            if (((error = (*pcp->pc_sysdep->sys_pread)(
+                      pcp->pc_fd, lzp->lz_buf, want,
+                      lzp->lz_mapoffs + (sb * lzp->lz_region), &r_size)) ==
+                 0) &&
+                (r_size == want))
+                v1_lazy_load_super(pcp, sb, lzp->lz_buf);
+            else if (!error)
+                error = EIO;
+        }
+        pthread_mutex_unlock(&lzp->lz_lock);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return error;
+}
+
+/*
+ * The loader.
+ */
+static void *
+v1_lazy_loader(void *arg) {
+    pc_context_t * pcp    = (pc_context_t *)arg;
+    v1_context_t * v1p    = (v1_context_t *)pcp->pc_verdep;
+    v1_lazy_t *    lzp    = v1p->v1_lazy;
+    uint64_t       nranks = (v1p->v1_bitmap->bm_nbits >> BM_SUPER_SHIFT) + 1;
+    uint64_t       nset   = 0;
+    uint64_t       sb     = 0;
+    crc32_t        crc    = init_crc32();
+    unsigned char *buf;
+    int            error;
+
+    if ((error = (*pcp->pc_sysdep->sys_malloc)(
+             &buf, LZ_CHUNK_SUPERS * lzp->lz_region)) == 0) {
+        while (!error && (sb < nranks)) {
+            uint64_t last  = sb + LZ_CHUNK_SUPERS;
+            uint64_t rlast = last;
+
+            if (last >= lzp->lz_nsupers) {
+                /*
+                 * The last chunk also ranks the end of the bitmap.
+                 */
+                last  = lzp->lz_nsupers;
+                rlast = nranks;
+            }
+            if (__atomic_load_n(&lzp->lz_stop, __ATOMIC_RELAXED)) {
+                error = ECANCELED;
+            } else if (last > sb) {
+                uint64_t want = v1_lazy_region(lzp, sb, last - sb);
+                uint64_t r_size;
+                uint64_t s;
+
+                if (((error = (*pcp->pc_sysdep->sys_pread)(
+                          pcp->pc_fd, buf, want,
+                          lzp->lz_mapoffs + (sb * lzp->lz_region),
+                          &r_size)) == 0) &&
+                    (r_size == want)) {
+                    if (!lzp->lz_bytemap)
+                        crc = update_crc32(crc, buf, want);
+                    pthread_mutex_lock(&lzp->lz_lock);
+                    for (s = sb; s < last; s++)
+                        if (!bitmap_test(lzp->lz_loaded, s))
+                            v1_lazy_load_super(
+                                pcp, s, &buf[(s - sb) * lzp->lz_region]);
+                    pthread_mutex_unlock(&lzp->lz_lock);
+                } else if (!error) {
+                    error = EIO;
                 }
-            } else {
-                if ((int)pcp->pc_omode < (int)SYSDEP_OPEN_RW)
-                    pcp->pc_flags |= PC_READ_ONLY;
-                else
-                    /*
-                     * Completely discard errors here.
-                     */
-                    error = 0;
             }
+            if (!error) {
+                nset = bitmap_rank_supers(v1p->v1_bitmap, sb, rlast, nset);
+                pthread_mutex_lock(&lzp->lz_lock);
+                __atomic_store_n(&lzp->lz_ranked, rlast, __ATOMIC_RELEASE);
+                pthread_cond_broadcast(&lzp->lz_cond);
+                pthread_mutex_unlock(&lzp->lz_lock);
+                sb = rlast;
+            }
+        }
+        if (!error) {
             /*
-             * Initialize the CRC table.
+             * Finally check the bitmap's checksum, or the magic string.
+             * Requests fail from then on if it's damaged.
              */
-            for (i = 0; i < CRC_TABLE_LEN; i++) {
-                int      j;
-                uint32_t init_crc = (uint32_t)i;
-                for (j = 0; j < CRC_UNIT_BITS; j++) {
-                    init_crc = (init_crc & 0x00000001L)
-                                   ? (init_crc >> 1) ^ 0xEDB88320L
-                                   : (init_crc >> 1);
-                }
-                v1p->v1_crc_tab32[i] = init_crc;
+            uint64_t want = (lzp->lz_bytemap) ? MAGIC_LEN : CRC_SIZE;
+            uint64_t r_size;
+
+            if (((error = (*pcp->pc_sysdep->sys_pread)(
+                      pcp->pc_fd, buf, want,
+                      lzp->lz_mapoffs + lzp->lz_maplen, &r_size)) == 0) &&
+                (r_size == want)) {
+                if ((lzp->lz_bytemap)
+                        ? (memcmp(buf, cmagicstr, MAGIC_LEN) != 0)
+                        : (memcmp(buf, &crc, sizeof(crc)) != 0))
+                    error = EIO;
+            } else if (!error) {
+                error = EIO;
+            }
+        }
+        (void)(*pcp->pc_sysdep->sys_free)(buf);
+    }
+    if (!error && !lzp->lz_bytemap)
+        error = v2_check_setup(pcp);
+    pthread_mutex_lock(&lzp->lz_lock);
+    lzp->lz_error = error;
+    __atomic_store_n(&lzp->lz_state, (error) ? LZ_FAILED : LZ_DONE,
+                     __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&lzp->lz_cond);
+    pthread_mutex_unlock(&lzp->lz_lock);
+
+    return NULL;
+}
+
+/*
+ * Start the loader, if it isn't already.  If it can't have a thread of its
+ * own, load the bitmap now.
+ */
+static void
+v1_lazy_start(pc_context_t *pcp) {
+    v1_lazy_t *lzp = ((v1_context_t *)pcp->pc_verdep)->v1_lazy;
+    int        inline_load = 0;
+
+    pthread_mutex_lock(&lzp->lz_lock);
+    if (!lzp->lz_started) {
+        lzp->lz_started = 1;
+        if (pthread_create(&lzp->lz_thread, (pthread_attr_t *)NULL,
+                           v1_lazy_loader, pcp) == 0)
+            lzp->lz_joinable = 1;
+        else
+            inline_load = 1;
+    }
+    pthread_mutex_unlock(&lzp->lz_lock);
+    if (inline_load)
+        (void)v1_lazy_loader(pcp);
+}
+
+/*
+ * Wait until the bitmap is loaded far enough for the "nblocks" blocks from
+ * "blockno", or (if "all") all of it.  If "rankedp" is null, their rank
+ * directory entries are needed.  Otherwise their bits are enough, and
+ * whether the rank directory covers them yet is returned there.
+ */
+static int
+v1_lazy_wait_common(pc_context_t *pcp, uint64_t blockno, uint64_t nblocks,
+                    int *rankedp, int all) {
+    int           error = 0;
+    v1_context_t *v1p   = (v1_context_t *)pcp->pc_verdep;
+    v1_lazy_t *   lzp   = v1p->v1_lazy;
+    uint64_t      last  = (blockno + nblocks) >> BM_SUPER_SHIFT;
+    int           state;
+
+    if (rankedp)
+        *rankedp = 1;
+    if (!lzp ||
+        ((state = __atomic_load_n(&lzp->lz_state, __ATOMIC_ACQUIRE)) ==
+         LZ_DONE))
+        return 0;
+    if (state == LZ_FAILED)
+        return lzp->lz_error;
+    all |= (pcp->pc_flags & (PC_STRICT | PC_CHECK_READS)) != 0;
+    if (!all && (__atomic_load_n(&lzp->lz_ranked, __ATOMIC_ACQUIRE) > last))
+        return 0;
+    v1_lazy_start(pcp);
+    if (!all && rankedp) {
+        error = v1_lazy_fault(pcp, blockno >> BM_SUPER_SHIFT,
+                              (blockno + nblocks - (nblocks != 0)) >>
+                                  BM_SUPER_SHIFT);
+        *rankedp = (__atomic_load_n(&lzp->lz_ranked, __ATOMIC_ACQUIRE) > last);
+    } else {
+        pthread_mutex_lock(&lzp->lz_lock);
+        while ((lzp->lz_state == LZ_LOADING) &&
+               (all || (lzp->lz_ranked <= last)))
+            pthread_cond_wait(&lzp->lz_cond, &lzp->lz_lock);
+        if (lzp->lz_state == LZ_FAILED)
+            error = lzp->lz_error;
+        pthread_mutex_unlock(&lzp->lz_lock);
+    }
+
+    return error;
+}
+
+/*
+ * Is the bitmap still loading?
+ */
+static inline int
+v1_lazy_loading(v1_context_t *v1p) {
+    return v1p->v1_lazy && (__atomic_load_n(&v1p->v1_lazy->lz_state,
+                                            __ATOMIC_ACQUIRE) != LZ_DONE);
+}
+
+/*
+ * Stop the loader and free what it used.
+ */
+static void
+v1_lazy_finish(pc_context_t *pcp) {
+    v1_lazy_t *lzp = ((v1_context_t *)pcp->pc_verdep)->v1_lazy;
+
+    if (lzp) {
+        __atomic_store_n(&lzp->lz_stop, 1, __ATOMIC_RELAXED);
+        if (lzp->lz_joinable)
+            pthread_join(lzp->lz_thread, (void **)NULL);
+        pthread_cond_destroy(&lzp->lz_cond);
+        pthread_mutex_destroy(&lzp->lz_lock);
+        bitmap_destroy(lzp->lz_loaded);
+        (void)(*pcp->pc_sysdep->sys_free)(lzp->lz_buf);
+    }
+}
+#else  /* HAVE_LIBPTHREAD */
+/*
+ * Without threads, the bitmap is always loaded when verifying.
+ */
+static int
+v1_lazy_setup(pc_context_t *pcp, uint64_t mapoffs, uint64_t maplen,
+              int bytemap) {
+    return ENOTSUP;
+}
+
+static inline int
+v1_lazy_wait_common(pc_context_t *pcp, uint64_t blockno, uint64_t nblocks,
+                    int *rankedp, int all) {
+    if (rankedp)
+        *rankedp = 1;
+
+    return 0;
+}
+
+static inline int
+v1_lazy_loading(v1_context_t *v1p) {
+    return 0;
+}
+
+static inline void
+v1_lazy_finish(pc_context_t *pcp) {}
+#endif /* HAVE_LIBPTHREAD */
+
+static inline int
+v1_lazy_wait(pc_context_t *pcp, uint64_t blockno, uint64_t nblocks,
+             int *rankedp) {
+    return v1_lazy_wait_common(pcp, blockno, nblocks, rankedp, 0);
+}
+
+static inline int
+v1_lazy_wait_all(pc_context_t *pcp) {
+    return v1_lazy_wait_common(pcp, 0, 0, (int *)NULL, 1);
+}
+
+/*
+ * The index file (see libindex.h) saves the usage bitmap and its rank
+ * directory, so that they're mapped rather than read from the image and
+ * rebuilt.  It's keyed by the image header, block count and block size.
+ */
+#define PCIDX_MAGIC     "PcIdx"
+#define PCIDX_VERSION   2 /* 2: byte map entries other than 1 are set */
+#define PCIDX_NSECTIONS 3 /* Bitmap words, supers and groups */
+
+#define PCIDX_NSET     0 /* Values: set bits in the bitmap */
+#define PCIDX_NSTRANGE 1 /* v1_nstrange */
+
+/*
+ * Make up the key of the index file.
+ */
+static int
+v1_index_key(pc_context_t *pcp, index_key_t *keyp) {
+    v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
+    int           error;
+
+    if ((error = index_key_init(pcp->pc_sysdep, pcp->pc_fd, PCIDX_MAGIC,
+                                PCIDX_VERSION, v1p->v1_head_crc, keyp)) == 0) {
+        keyp->ik_params[0] = pcp->pc_head.totalblock;
+        keyp->ik_params[1] = pcp->pc_head.block_size;
+    }
+
+    return error;
+}
+
+/*
+ * Use the bitmap in the index file, if it's the index of this image.
+ */
+static int
+v1_index_load(pc_context_t *pcp) {
+    v1_context_t * v1p = (v1_context_t *)pcp->pc_verdep;
+    index_key_t    key;
+    char *         ipath;
+    image_index_t *ixp;
+    int            error;
+
+    if (((error = v1_index_key(pcp, &key)) == 0) &&
+        ((error = index_path(pcp->pc_sysdep, pcp->pc_path, idx_trailer,
+                             &ipath)) == 0)) {
+        if ((error = index_load(pcp->pc_sysdep, ipath, &key, &ixp)) == 0) {
+            index_section_t *isp = ixp->ix_sections;
+            uint64_t         wlen, slen, glen;
+
+            bitmap_sizes(pcp->pc_head.totalblock, &wlen, &slen, &glen);
+            if ((ixp->ix_nsections != PCIDX_NSECTIONS) ||
+                (isp[0].is_length != wlen) || (isp[1].is_length != slen) ||
+                (isp[2].is_length != glen) ||
+                (ixp->ix_values[PCIDX_NSET] > pcp->pc_head.totalblock)) {
+                error = EINVAL;
+            } else if ((error = bitmap_attach(
+                            pcp->pc_sysdep, pcp->pc_head.totalblock,
+                            ixp->ix_values[PCIDX_NSET], isp[0].is_base,
+                            isp[1].is_base, isp[2].is_base,
+                            &v1p->v1_bitmap)) == 0) {
+                v1p->v1_nstrange = ixp->ix_values[PCIDX_NSTRANGE];
+                v1p->v1_index    = ixp;
             }
-            v1p->v1_bitmap_factor = V1_DEFAULT_FACTOR;
+            if (error)
+                index_release(ixp);
         }
+        (void)(*pcp->pc_sysdep->sys_free)(ipath);
     }
 
     return error;
 }
 
+/*
+ * Write the bitmap to the index file.
+ */
 static int
-precalculate_sumcount(pc_context_t *pcp) {
+v1_index_save(pc_context_t *pcp) {
     int           error = EINVAL;
     v1_context_t *v1p   = (v1_context_t *)pcp->pc_verdep;
+    index_key_t   key;
+    char *        ipath;
+
+    if (PCTX_HAVE_VERDEP(pcp) && v1p->v1_bitmap &&
+        ((error = v1_lazy_wait_all(pcp)) == 0) &&
+        ((error = v1_index_key(pcp, &key)) == 0) &&
+        ((error = index_path(pcp->pc_sysdep, pcp->pc_path, idx_trailer,
+                             &ipath)) == 0)) {
+        index_section_t sections[PCIDX_NSECTIONS];
+        uint64_t        values[INDEX_MAX_PARAMS];
+
+        memset(values, 0, sizeof(values));
+        values[PCIDX_NSET]     = v1p->v1_bitmap->bm_nset;
+        values[PCIDX_NSTRANGE] = v1p->v1_nstrange;
+        bitmap_sizes(v1p->v1_bitmap->bm_nbits, &sections[0].is_length,
+                     &sections[1].is_length, &sections[2].is_length);
+        sections[0].is_base = v1p->v1_bitmap->bm_words;
+        sections[1].is_base = v1p->v1_bitmap->bm_super;
+        sections[2].is_base = v1p->v1_bitmap->bm_group;
+        error = index_save(pcp->pc_sysdep, ipath, &key, values, sections,
+                           PCIDX_NSECTIONS);
+        (void)(*pcp->pc_sysdep->sys_free)(ipath);
+    }
 
-    if ((error = (*pcp->pc_sysdep->sys_malloc)(
-             &v1p->v1_sumcount,
-             ((pcp->pc_head.totalblock >> v1p->v1_bitmap_factor) + 1) *
-                 sizeof(uint64_t))) == 0) {
+    return error;
+}
+
+/*
+ * Build the rank directory for the loaded bitmap, so that the count of
+ * preceding valid blocks can be found directly for any block.
+ */
+static int
+precalculate_rank(pc_context_t *pcp) {
+    int           error;
+    v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
+
+    /*
+     * A bitmap from the index file comes with its rank directory, and a
+     * lazily loaded one has it built as it's loaded.
+     */
+    error = (v1p->v1_index || v1p->v1_lazy)
+                ? 0
+                : bitmap_build_rank(v1p->v1_bitmap);
+    if (!error) {
+        uint64_t dsize;
         /*
-         * Precalculate the count of preceding valid blocks
-         * for every 1k blocks.
+         * Fixup device size...
          */
-        uint64_t i, nset = 0;
-        for (i = 0; i < pcp->pc_head.totalblock; i++) {
-            if ((i & ((1 << v1p->v1_bitmap_factor) - 1)) == 0) {
-                v1p->v1_sumcount[i >> v1p->v1_bitmap_factor] = nset;
+        dsize = pcp->pc_head.totalblock * pcp->pc_head.block_size;
+        if (pcp->pc_head.device_size != dsize)
+            pcp->pc_head.device_size = dsize;
+        if (pcp->pc_cf_path && !pcp->pc_cf_handle && !PCTX_READ_ONLY(pcp)) {
+            if ((error = cf_init(pcp->pc_cf_path, pcp->pc_sysdep,
+                                 pcp->pc_head.block_size,
+                                 pcp->pc_head.totalblock,
+                                 &pcp->pc_cf_handle)) == 0) {
+                /*
+                 * An existing change file.
+                 */
+                pcp->pc_flags |= (PC_CF_OPEN | PC_HAVE_CFDEP);
+            } else if (error == ENOENT) {
+                /*
+                 * We'll create later...
+                 */
+                error = 0;
             }
-            /* [2011-08]
-             * ...sigh... the *bitmap* can have more than
-             * two values.  It can be 1, in which case it's
-             * definitely in the file.  It can be zero
-             * in which case, it's definitely not in the
-             * file.  And it can be anything else that fits
-             * into a byte?  What does it mean?  I don't
-             * know.  But it's not set.
-             */
-            if (v1p->v1_bitmap[i] == 1)
-                nset++;
         }
-        /*
-         * Fixup device size...
-         */
-        i = pcp->pc_head.totalblock * pcp->pc_head.block_size;
-        if (pcp->pc_head.device_size != i)
-            pcp->pc_head.device_size = i;
         if (!error && pcp->pc_cf_handle) {
             /*
              * Verify the change file, if present.
@@ -250,33 +731,74 @@ v1_verify(pc_context_t *pcp) {
                 sizeof(pcp->pc_head_v1) + pcp->pc_head.totalblock + MAGIC_LEN;
 
             pcp->pc_flags |= PC_HEAD_VALID;
+            v1p->v1_head_crc = update_crc32(
+                init_crc32(), &pcp->pc_head_v1, sizeof(pcp->pc_head_v1));
             /*
-             * Allocate and fill the bitmap.
+             * Use the index file if it's current.  Otherwise, allocate the
+             * bitmap and fill it from the byte map a chunk at a time (or
+             * leave that to the loader, if lazy).
              */
-            if ((error = (*pcp->pc_sysdep->sys_malloc)(
-                     &v1p->v1_bitmap, pcp->pc_head.totalblock)) == 0) {
-                uint64_t r_size;
+            if (!PCTX_TOLERANT(pcp) && (v1_index_load(pcp) == 0)) {
+                error = precalculate_rank(pcp);
+            } else if (pcp->pc_flags & PC_LAZY) {
+                if ((error = v1_lazy_setup(pcp, sizeof(pcp->pc_head_v1),
+                                           pcp->pc_head.totalblock, 1)) == 0)
+                    error = precalculate_rank(pcp);
+            } else if ((error = bitmap_create(pcp->pc_sysdep,
+                                              pcp->pc_head.totalblock,
+                                              &v1p->v1_bitmap)) == 0) {
+                unsigned char *chunk;
 
-                (void)(*pcp->pc_sysdep->sys_seek)(
-                    pcp->pc_fd, sizeof(pcp->pc_head_v1), SYSDEP_SEEK_ABSOLUTE,
-                    (uint64_t *)NULL);
-                if (((error = (*pcp->pc_sysdep->sys_read)(
-                          pcp->pc_fd, v1p->v1_bitmap, pcp->pc_head.totalblock,
-                          &r_size)) == 0) &&
-                    (r_size == pcp->pc_head.totalblock)) {
-                    char magicstr[MAGIC_LEN];
-                    /*
-                     * Finally look for the magic string.
-                     */
-                    if (((error = (*pcp->pc_sysdep->sys_read)(
-                              pcp->pc_fd, magicstr, sizeof(magicstr),
-                              &r_size)) == 0) &&
-                        (r_size == sizeof(magicstr)) &&
-                        (memcmp(magicstr, cmagicstr, sizeof(magicstr)) == 0)) {
-                        error = precalculate_sumcount(pcp);
-                    } else {
-                        if (error == 0)
-                            error = EINVAL;
+                if ((error = (*pcp->pc_sysdep->sys_malloc)(
+                         &chunk, V1_BYTEMAP_CHUNK)) == 0) {
+                    uint64_t bmi = 0;
+                    uint64_t r_size;
+
+                    (void)(*pcp->pc_sysdep->sys_seek)(
+                        pcp->pc_fd, sizeof(pcp->pc_head_v1),
+                        SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL);
+                    while (!error && (bmi < pcp->pc_head.totalblock)) {
+                        uint64_t want = pcp->pc_head.totalblock - bmi;
+
+                        if (want > V1_BYTEMAP_CHUNK)
+                            want = V1_BYTEMAP_CHUNK;
+                        if (((error = (*pcp->pc_sysdep->sys_read)(
+                                  pcp->pc_fd, chunk, want, &r_size)) == 0) &&
+                            (r_size == want)) {
+                            /* [2011-08]
+                             * ...sigh... the *bitmap* can have more than
+                             * two values.  It can be 1, in which case it's
+                             * definitely in the file.  It can be zero
+                             * in which case, it's definitely not in the
+                             * file.  And it can be anything else that fits
+                             * into a byte?  What does it mean?  I don't
+                             * know.  It's counted as strange, but still
+                             * read from the image, as it always was.
+                             */
+                            v1p->v1_nstrange += bitmap_load_bytes(
+                                v1p->v1_bitmap, chunk, want, bmi);
+                            bmi += want;
+                        } else if (!error) {
+                            error = EIO;
+                        }
+                    }
+                    (void)(*pcp->pc_sysdep->sys_free)(chunk);
+                    if (!error) {
+                        char magicstr[MAGIC_LEN];
+                        /*
+                         * Finally look for the magic string.
+                         */
+                        if (((error = (*pcp->pc_sysdep->sys_read)(
+                                  pcp->pc_fd, magicstr, sizeof(magicstr),
+                                  &r_size)) == 0) &&
+                            (r_size == sizeof(magicstr)) &&
+                            (memcmp(magicstr, cmagicstr, sizeof(magicstr)) ==
+                             0)) {
+                            error = precalculate_rank(pcp);
+                        } else {
+                            if (error == 0)
+                                error = EINVAL;
+                        }
                     }
                 }
             }
@@ -297,12 +819,16 @@ v1_finish(pc_context_t *pcp) {
 
     if (PCTX_HAVE_VERDEP(pcp)) {
         v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
-
-        if (v1p->v1_bitmap)
-            (void)(*pcp->pc_sysdep->sys_free)(v1p->v1_bitmap);
-        if (v1p->v1_sumcount)
-            (void)(*pcp->pc_sysdep->sys_free)(v1p->v1_sumcount);
-        (void)(*pcp->pc_sysdep->sys_free)(v1p);
+        uint32_t      i;
+
+        v1_lazy_finish(pcp);
+        bitmap_destroy(v1p->v1_bitmap);
+        bitmap_destroy(v1p->v1_checked);
+        index_release(v1p->v1_index);
+        for (i = 0; i < V1_GBUF_SLOTS; i++) {
+            if (v1p->v1_gbufs[i])
+                (void)(*pcp->pc_sysdep->sys_free)(v1p->v1_gbufs[i]);
+        }
         pcp->pc_flags &= ~PC_HAVE_VERDEP;
         error = (pcp->pc_cf_handle) ? cf_finish(pcp->pc_cf_handle) : 0;
     }
@@ -313,27 +839,13 @@ v1_finish(pc_context_t *pcp) {
 /*
  * Version-specific handling for seeking to a particular block.
  *
- * Update the number of preceding valid blocks.
+ * Only the change file keeps a position of its own.
  */
 static int
 v1_seek(pc_context_t *pcp, uint64_t blockno) {
     int error = EINVAL;
 
     if (PCTX_HAVE_VERDEP(pcp)) {
-        v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
-        uint64_t      pbn;
-
-        /*
-         * Starting with the hint that is nearest, start calculating
-         * the preceding valid blocks.
-         */
-        v1p->v1_nvbcount = v1p->v1_sumcount[blockno >> v1p->v1_bitmap_factor];
-        for (pbn = blockno & ~((1 << v1p->v1_bitmap_factor) - 1); pbn < blockno;
-             pbn++) {
-            if (v1p->v1_bitmap[pbn]) {
-                v1p->v1_nvbcount++;
-            }
-        }
         error = (pcp->pc_cf_handle) ? cf_seek(pcp->pc_cf_handle, blockno) : 0;
     }
 
@@ -355,74 +867,354 @@ rblock2offset(pc_context_t *pcp, uint64_t rbnum) {
 /*
  * This routine is so wrong.  This isn't actually a CRC over the buffer,
  * it's a CRC of the first byte, iterated "size" number of times.  This is
- * to mimic the behavior of partclone (ech).
+ * to mimic the behavior of partclone (ech).  Since only the first byte
+ * matters, it's computed in closed form rather than by looping.
  *
  * Remark: it is defined here instead of checksum.c because it is absolutly
  * specific to partclone.
  */
 static inline uint32_t
-v1_crc32(v1_context_t *v1p, uint32_t crc, char *buf, size_t size) {
-    size_t   s;
-    uint32_t tmp;
+v1_crc32(uint32_t crc, const char *buf, size_t size) {
+    return (size) ? repeat_crc32(crc, (uint8_t)buf[0], size) : crc;
+}
 
-    for (s = 0; s < size; s++) {
-        /*
-         * The copied logic advanced s without using it to offset into buf.
-         * The correct thing to do here would be to move buf[s], but we
-         * want this to be able to successfully read the files generated
-         * by partclone.
-         */
-        char c = buf[0];
-        tmp    = crc ^ (((uint32_t)c) & 0x000000ffL);
-        crc    = (crc >> 8) ^ v1p->v1_crc_tab32[tmp & 0xff];
+/*
+ * Maximum number of blocks to read with a single run read.
+ */
+static inline uint64_t
+v1_maxrun(pc_context_t *pcp) {
+    uint64_t maxrun = V1_MAXRUN_BYTES / pcp->pc_head.block_size;
+
+    return (maxrun) ? maxrun : 1;
+}
+
+/*
+ * Squeeze the checksums out of "len" bytes read from image file offset
+ * "foffs" into "bp", leaving only block data at the front of "bp".
+ *
+ * Returns the number of bytes of block data.
+ */
+static uint64_t
+v1_squeeze(pc_context_t *pcp, unsigned char *bp, uint64_t foffs,
+           uint64_t len) {
+    uint64_t gsize =
+        pcp->pc_head.blocks_per_checksum * pcp->pc_head.block_size;
+    uint64_t stride = gsize + pcp->pc_head.checksum_size;
+    uint64_t in     = 0;
+    uint64_t out    = 0;
+
+    while (in < len) {
+        uint64_t goffs = (foffs + in - pcp->pc_head.head_size) % stride;
+        uint64_t n     = ((goffs < gsize) ? gsize : stride) - goffs;
+
+        if (n > (len - in))
+            n = len - in;
+        if (goffs < gsize) {
+            if (out != in)
+                memmove(&bp[out], &bp[in], n);
+            out += n;
+        }
+        in += n;
+    }
+
+    return out;
+}
+
+/*
+ * Read a run of consecutive valid blocks, starting with the "rbnum"th valid
+ * block in the image.  The run is one contiguous range in the image file,
+ * but it may have checksums interleaved in it.  If so, read as much of the
+ * range as fits straight into the caller's buffer, squeeze the checksums
+ * out and read the remainder the same way.
+ */
+static int
+v1_readrun(pc_context_t *pcp, uint64_t rbnum, uint64_t nblocks, void *buffer) {
+    int            error  = 0;
+    unsigned char *cbp    = (unsigned char *)buffer;
+    uint64_t       total  = nblocks * pcp->pc_head.block_size;
+    uint64_t       foffs  = rblock2offset(pcp, rbnum);
+    uint64_t       filled = 0;
+    uint64_t       start  = stats_start();
+
+    while (!error && (filled < total)) {
+        uint64_t want = total - filled;
+        uint64_t r_size;
+
+        if (((error = (*pcp->pc_sysdep->sys_pread)(
+                  pcp->pc_fd, &cbp[filled], want, foffs, &r_size)) == 0) &&
+            (r_size == want)) {
+            filled += (pcp->pc_head.blocks_per_checksum)
+                          ? v1_squeeze(pcp, &cbp[filled], foffs, want)
+                          : want;
+            foffs += want;
+        } else if (!error) {
+            error = EIO;
+        }
+    }
+    stats_end(STATS_PC_READRUN, start, nblocks, error);
+
+    return error;
+}
+
+/*
+ * Get a buffer for a checksum group and its checksums, reusing an idle one
+ * when there is one.  Checked reads run concurrently, so the idle ones are
+ * taken and put back atomically.
+ */
+static int
+v2_gbuf_get(pc_context_t *pcp, unsigned char **gbufp) {
+    v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
+    uint32_t      i;
+
+    for (i = 0; i < V1_GBUF_SLOTS; i++) {
+        if (__atomic_load_n(&v1p->v1_gbufs[i], __ATOMIC_RELAXED) &&
+            (*gbufp = __atomic_exchange_n(&v1p->v1_gbufs[i], NULL,
+                                          __ATOMIC_ACQUIRE)))
+            return 0;
+    }
+
+    return (*pcp->pc_sysdep->sys_malloc)(
+        gbufp, (pcp->pc_head.blocks_per_checksum * pcp->pc_head.block_size) +
+                   (2 * pcp->pc_head.checksum_size));
+}
+
+static void
+v2_gbuf_put(pc_context_t *pcp, unsigned char *gbuf) {
+    v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
+    uint32_t      i;
+
+    for (i = 0; i < V1_GBUF_SLOTS; i++) {
+        void *idle = NULL;
+
+        if (__atomic_compare_exchange_n(&v1p->v1_gbufs[i], &idle, gbuf, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+    }
+    (void)(*pcp->pc_sysdep->sys_free)(gbuf);
+}
+
+/*
+ * Check the checksum of version 2 checksum group "group", the "group"th
+ * run of blocks_per_checksum valid blocks.  It's read whole along with
+ * its checksum, and with the preceding group's checksum when that is the
+ * seed.  A group that checks out is recorded so it isn't checked again.
+ * In tolerant mode a mismatch is counted and otherwise ignored.
+ */
+static int
+v2_check_group(pc_context_t *pcp, uint64_t group) {
+    int            error = 0;
+    v1_context_t * v1p   = (v1_context_t *)pcp->pc_verdep;
+    uint64_t       bpc   = pcp->pc_head.blocks_per_checksum;
+    uint64_t       bsize = pcp->pc_head.block_size;
+    uint64_t       csize = pcp->pc_head.checksum_size;
+    uint64_t       nblocks = v1p->v1_bitmap->bm_nset - (group * bpc);
+    uint64_t       foffs =
+        pcp->pc_head.head_size + (group * ((bpc * bsize) + csize));
+    uint64_t       prefix =
+        (!pcp->pc_head_v2.reseed_checksum && group) ? csize : 0;
+    uint64_t       start = stats_start();
+    uint64_t       len;
+    unsigned char *gbuf;
+
+    if (nblocks > bpc)
+        nblocks = bpc;
+    len = prefix + (nblocks * bsize) + csize;
+    if ((error = v2_gbuf_get(pcp, &gbuf)) == 0) {
+        uint64_t r_size;
+
+        if (((error = (*pcp->pc_sysdep->sys_pread)(
+                  pcp->pc_fd, gbuf, len, foffs - prefix, &r_size)) == 0) &&
+            (r_size == len)) {
+            crc32_t seed = init_crc32();
+            crc32_t stored;
+
+            if (prefix)
+                memcpy(&seed, gbuf, sizeof(seed));
+            memcpy(&stored, &gbuf[len - csize], sizeof(stored));
+            if (update_crc32(seed, &gbuf[prefix], nblocks * bsize) == stored) {
+                bitmap_set_shared(v1p->v1_checked, group);
+            } else if (PCTX_TOLERANT(pcp)) {
+                (void)__atomic_fetch_add(&v1p->v1_crc_errors, 1,
+                                         __ATOMIC_RELAXED);
+                bitmap_set_shared(v1p->v1_checked, group);
+            } else {
+                error = EIO;
+            }
+        } else if (!error) {
+            error = EIO;
+        }
+        v2_gbuf_put(pcp, gbuf);
+    }
+    stats_end(STATS_PC_CHECK, start, 1, error);
+
+    return error;
+}
+
+/*
+ * Check the checksum groups covering "nblocks" valid blocks from the
+ * "rbnum"th, if checking reads.
+ */
+static int
+v2_check_run(pc_context_t *pcp, uint64_t rbnum, uint64_t nblocks) {
+    int           error = 0;
+    v1_context_t *v1p   = (v1_context_t *)pcp->pc_verdep;
+
+    if (v1p->v1_checked) {
+        uint64_t bpc   = pcp->pc_head.blocks_per_checksum;
+        uint64_t group = rbnum / bpc;
+        uint64_t last  = (rbnum + nblocks - 1) / bpc;
+
+        for (; !error && (group <= last); group++)
+            if (!bitmap_test_shared(v1p->v1_checked, group))
+                error = v2_check_group(pcp, group);
     }
 
-    return crc;
+    return error;
 }
 
 /*
- * Read the block at the current position.
+ * Check "ngroups" version 2 checksum groups from the "group"th for a full
+ * check of the image data.  They're read with a single read, along with
+ * the preceding group's checksum when that is the seed.  A read error or a
+ * short read makes the groups it covers bad.
  */
 static int
-v1_readblock(pc_context_t *pcp, void *buffer) {
+v2_check_data(verify_job_t *vjp, uint64_t group, uint64_t ngroups,
+              unsigned char *buf) {
+    pc_context_t *pcp     = (pc_context_t *)vjp->vj_arg;
+    v1_context_t *v1p     = (v1_context_t *)pcp->pc_verdep;
+    uint64_t      bpc     = pcp->pc_head.blocks_per_checksum;
+    uint64_t      bsize   = pcp->pc_head.block_size;
+    uint64_t      csize   = pcp->pc_head.checksum_size;
+    uint64_t      gbytes  = (bpc * bsize) + csize;
+    uint64_t      nblocks = v1p->v1_bitmap->bm_nset - (group * bpc);
+    uint64_t      prefix =
+        (!pcp->pc_head_v2.reseed_checksum && group) ? csize : 0;
+    uint64_t      r_size = 0;
+    uint64_t      g;
+    int           error;
+
+    if (nblocks > (ngroups * bpc))
+        nblocks = ngroups * bpc;
+    error = (*pcp->pc_sysdep->sys_pread)(
+        pcp->pc_fd, buf, prefix + (nblocks * bsize) + (ngroups * csize),
+        pcp->pc_head.head_size + (group * gbytes) - prefix, &r_size);
+    for (g = 0; g < ngroups; g++) {
+        unsigned char *gp = &buf[prefix + (g * gbytes)];
+        uint64_t       gblocks = nblocks - (g * bpc);
+        crc32_t        seed    = init_crc32();
+        crc32_t        stored;
+
+        if (gblocks > bpc)
+            gblocks = bpc;
+        if (error ||
+            (r_size < (prefix + (g * gbytes) + (gblocks * bsize) + csize))) {
+            verify_unit_bad(vjp, group + g, (error) ? error : EIO);
+            continue;
+        }
+        if (!pcp->pc_head_v2.reseed_checksum && (group + g))
+            memcpy(&seed, gp - csize, sizeof(seed));
+        memcpy(&stored, &gp[gblocks * bsize], sizeof(stored));
+        if (update_crc32(seed, gp, gblocks * bsize) != stored)
+            verify_unit_bad(vjp, group + g, EIO);
+    }
+    verify_unit_done(vjp, ngroups, r_size);
+
+    return 0;
+}
+
+/*
+ * Read blocks starting at a particular block.
+ *
+ * Consecutive valid blocks which are not in the change file are read with
+ * one read per run.  Runs of invalid blocks are zeroed, and blocks from the
+ * change file are read one at a time.  No per-handle state
+ * is changed, so readers may share the handle.
+ */
+static int
+v1_readblocks(pc_context_t *pcp, uint64_t blockno, void *buffer,
+              uint64_t nblocks) {
     int error = EINVAL;
 
-    /*
-     * Check to see if we can get the result from the change file.
-     */
     if (PCTX_HAVE_VERDEP(pcp)) {
-        if (pcp->pc_cf_handle) {
-            cf_seek(pcp->pc_cf_handle, pcp->pc_curblock);
-            error = cf_readblock(pcp->pc_cf_handle, buffer);
+        v1_context_t * v1p      = (v1_context_t *)pcp->pc_verdep;
+        uint64_t       bsize    = pcp->pc_head.block_size;
+        uint64_t       maxrun   = v1_maxrun(pcp);
+        unsigned char *cbp      = (unsigned char *)buffer;
+        uint64_t       bindex   = 0;
+        uint64_t       nvbcount = 0;
+        int            ranked;
+
+        /*
+         * Ahead of a lazy load's rank directory, blocks that aren't in the
+         * image can still be read; blocks that are have to wait for it.
+         */
+        error = v1_lazy_wait(pcp, blockno, nblocks, &ranked);
+        if (!error && !ranked &&
+            (bitmap_test(v1p->v1_bitmap, blockno) ||
+             (bitmap_run_bits(v1p->v1_bitmap, blockno, nblocks) < nblocks))) {
+            error  = v1_lazy_wait(pcp, blockno, nblocks, (int *)NULL);
+            ranked = 1;
         }
-        if (error) {
-            v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
+        if (!error && ranked)
+            nvbcount = bitmap_rank(v1p->v1_bitmap, blockno);
+        while (!error && (bindex < nblocks)) {
+            uint64_t curblock = blockno + bindex;
+            uint64_t nrun     = 1;
 
             /*
-             * Determine whether the block is used/valid.
+             * Check to see if we can get the result from the change file.
              */
-            if (v1p->v1_bitmap[pcp->pc_curblock]) {
-                /* block is valid */
-                int64_t boffs = rblock2offset(pcp, v1p->v1_nvbcount);
-                if ((error = (*pcp->pc_sysdep->sys_seek)(
-                         pcp->pc_fd, boffs, SYSDEP_SEEK_ABSOLUTE,
-                         (uint64_t *)NULL)) == 0) {
-                    uint64_t r_size;
-                    (void)(*pcp->pc_sysdep->sys_read)(
-                        pcp->pc_fd, buffer, pcp->pc_head.block_size, &r_size);
-                    if (r_size != pcp->pc_head.block_size) {
-                        error = EIO;
+            if (pcp->pc_cf_handle &&
+                cf_blockused_at(pcp->pc_cf_handle, curblock) &&
+                (cf_readblock_at(pcp->pc_cf_handle, curblock, cbp) == 0)) {
+                /*
+                 * Block came from the change file.  Still account for it
+                 * if it's in the image.
+                 */
+                if (bitmap_test(v1p->v1_bitmap, curblock))
+                    nvbcount++;
+            } else if (bitmap_test(v1p->v1_bitmap, curblock)) {
+                /*
+                 * Find the extent of the run of valid blocks, then trim it
+                 * back to the first block that's in the change file.
+                 */
+                uint64_t limit = nblocks - bindex;
+                uint64_t i;
+
+                nrun = bitmap_run(v1p->v1_bitmap, curblock,
+                                  (limit < maxrun) ? limit : maxrun);
+                for (i = 1; pcp->pc_cf_handle && (i < nrun); i++) {
+                    if (cf_blockused_at(pcp->pc_cf_handle, curblock + i)) {
+                        nrun = i;
+                        break;
                     }
-                    v1p->v1_nvbcount++;
+                }
+                if (((error = v2_check_run(pcp, nvbcount, nrun)) == 0) &&
+                    ((error = v1_readrun(pcp, nvbcount, nrun, cbp)) == 0)) {
+                    nvbcount += nrun;
                 }
             } else {
                 /*
-                 * If we're reading an invalid block, use the handy buffer.
+                 * Invalid blocks read as zeroes.  Zero the whole run, up to
+                 * the next block that's in the change file.
                  */
-                memcpy(buffer, pcp->pc_ivblock, pcp->pc_head.block_size);
-                error = 0; /* This shouldn't be necessary... */
+                nrun = (ranked) ? bitmap_run(v1p->v1_bitmap, curblock,
+                                             nblocks - bindex)
+                                : nblocks - bindex;
+                if (pcp->pc_cf_handle && (nrun > 1))
+                    nrun = 1 + cf_run(pcp->pc_cf_handle, curblock + 1,
+                                      nrun - 1, 0);
+                memset(cbp, 0, nrun * bsize);
             }
+            cbp += nrun * bsize;
+            bindex += nrun;
         }
+        /*
+         * Partial blocks in the change file go over what was read for them.
+         */
+        if (!error && pcp->pc_cf_handle)
+            error = cf_overlay(pcp->pc_cf_handle, blockno, buffer, nblocks);
     }
 
     return error;
@@ -434,60 +1226,195 @@ v1_readblock(pc_context_t *pcp, void *buffer) {
 static int
 v1_blockused(pc_context_t *pcp) {
     int retval = BLOCK_ERROR;
-    if (PCTX_HAVE_VERDEP(pcp)) {
+    int ranked;
+
+    if (PCTX_HAVE_VERDEP(pcp) &&
+        (v1_lazy_wait(pcp, pcp->pc_curblock, 1, &ranked) == 0)) {
         v1_context_t *v1p = (v1_context_t *)pcp->pc_verdep;
 
         retval = (pcp->pc_cf_handle && cf_blockused(pcp->pc_cf_handle))
                      ? 1
-                     : v1p->v1_bitmap[pcp->pc_curblock];
+                     : bitmap_test(v1p->v1_bitmap, pcp->pc_curblock);
     }
 
     return retval;
 }
 
 /*
- * Write block at current location.
+ * Find the extent of blocks starting at "blockno", up to "maxblocks", that
+ * are all used or all unused.  Blocks in the change file count as used.
  */
 static int
-v1_writeblock(pc_context_t *pcp, void *buffer) {
-    int error = EINVAL;
+v1_blockextent(pc_context_t *pcp, uint64_t blockno, uint64_t maxblocks,
+               uint64_t *nblocksp) {
+    int           retval = BLOCK_ERROR;
+    v1_context_t *v1p    = (v1_context_t *)pcp->pc_verdep;
+    int           ranked;
 
     /*
-     * Make sure we're initialized.
+     * While lazily loading, stop at the end of the superblock, so as not to
+     * load all of the rest of the bitmap to answer.
      */
+    if (PCTX_HAVE_VERDEP(pcp) && v1_lazy_loading(v1p) &&
+        (maxblocks > (BM_SUPER_BITS - (blockno & (BM_SUPER_BITS - 1)))))
+        maxblocks = BM_SUPER_BITS - (blockno & (BM_SUPER_BITS - 1));
+    if (PCTX_HAVE_VERDEP(pcp) &&
+        (v1_lazy_wait(pcp, blockno, maxblocks, &ranked) == 0)) {
+        uint64_t nrun =
+            (ranked) ? bitmap_run(v1p->v1_bitmap, blockno, maxblocks)
+                     : bitmap_run_bits(v1p->v1_bitmap, blockno, maxblocks);
+
+        retval = bitmap_test(v1p->v1_bitmap, blockno);
+        if (!retval && pcp->pc_cf_handle) {
+            /*
+             * Trim the unused run back to the change file's blocks.
+             */
+            retval = cf_blockused_at(pcp->pc_cf_handle, blockno);
+            nrun   = cf_run(pcp->pc_cf_handle, blockno, nrun, retval);
+        }
+        *nblocksp = nrun;
+    }
+
+    return retval;
+}
+
+/*
+ * Map a range of blocks.  Runs of valid blocks map to the image file,
+ * split at the checksums interleaved in it, and runs of invalid blocks
+ * map to zeroes.  A range with blocks in the change file isn't mapped.
+ * When checking reads, the checksums are checked as for a read.
+ */
+static int
+v1_blockmap(pc_context_t *pcp, uint64_t blockno, uint64_t nblocks,
+            image_segment_t *segs, uint32_t *nsegsp) {
+    int error = EINVAL;
+
     if (PCTX_HAVE_VERDEP(pcp)) {
-        if (!PCTX_WRITEREADY(pcp)) {
-            if (!PCTX_HAVE_CF_PATH(pcp)) {
-                /*
-                 * We have to make up a name.
-                 */
-                if ((error = (*pcp->pc_sysdep->sys_malloc)(
-                         &pcp->pc_cf_path,
-                         strlen(pcp->pc_path) + strlen(cf_trailer) + 1)) == 0) {
-                    memcpy(pcp->pc_cf_path, pcp->pc_path, strlen(pcp->pc_path));
-                    memcpy(&pcp->pc_cf_path[strlen(pcp->pc_path)], cf_trailer,
-                           strlen(cf_trailer) + 1);
-                    pcp->pc_flags |= PC_HAVE_CF_PATH;
+        v1_context_t *v1p      = (v1_context_t *)pcp->pc_verdep;
+        uint64_t      bsize    = pcp->pc_head.block_size;
+        uint64_t      bpc      = pcp->pc_head.blocks_per_checksum;
+        uint32_t      maxsegs  = *nsegsp;
+        int           fd       = (*pcp->pc_sysdep->sys_fileno)(pcp->pc_fd);
+        uint64_t      bindex   = 0;
+        uint64_t      nvbcount = 0;
+
+        *nsegsp = 0;
+        error   = ((fd < 0) || (pcp->pc_cf_handle &&
+                                (cf_run(pcp->pc_cf_handle, blockno, nblocks,
+                                        0) < nblocks)))
+                      ? ENOTSUP
+                      : v1_lazy_wait(pcp, blockno, nblocks, (int *)NULL);
+        if (!error)
+            nvbcount = bitmap_rank(v1p->v1_bitmap, blockno);
+        while (!error && (bindex < nblocks)) {
+            uint64_t curblock = blockno + bindex;
+            uint64_t nrun =
+                bitmap_run(v1p->v1_bitmap, curblock, nblocks - bindex);
+
+            if (!bitmap_test(v1p->v1_bitmap, curblock)) {
+                error = image_segment_add(segs, nsegsp, maxsegs,
+                                          IMAGE_SEG_ZERO, -1, 0, nrun * bsize);
+            } else if ((error = v2_check_run(pcp, nvbcount, nrun)) == 0) {
+                uint64_t i, n;
+
+                for (i = 0; !error && (i < nrun); i += n) {
+                    /*
+                     * Up to the end of this block's checksum group.
+                     */
+                    n = (bpc) ? bpc - ((nvbcount + i) % bpc) : nrun - i;
+                    if (n > (nrun - i))
+                        n = nrun - i;
+                    error = image_segment_add(
+                        segs, nsegsp, maxsegs, IMAGE_SEG_FILE, fd,
+                        rblock2offset(pcp, nvbcount + i), n * bsize);
                 }
+                nvbcount += nrun;
             }
-            error = cf_create(pcp->pc_cf_path, pcp->pc_sysdep,
-                              pcp->pc_head.block_size, pcp->pc_head.totalblock,
-                              &pcp->pc_cf_handle);
-            if (!error) {
-                pcp->pc_flags |= (PC_HAVE_CFDEP | PC_CF_VERIFIED);
+            bindex += nrun;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Make sure the change file is ready for changes, creating it if need be.
+ */
+static int
+v1_cf_ready(pc_context_t *pcp) {
+    int error = 0;
+
+    if (!PCTX_WRITEREADY(pcp)) {
+        if (!PCTX_HAVE_CF_PATH(pcp)) {
+            /*
+             * We have to make up a name.
+             */
+            if ((error = sysdep_arena_alloc(
+                     pcp->pc_arena, &pcp->pc_cf_path,
+                     strlen(pcp->pc_path) + strlen(cf_trailer) + 1)) == 0) {
+                memcpy(pcp->pc_cf_path, pcp->pc_path, strlen(pcp->pc_path));
+                memcpy(&pcp->pc_cf_path[strlen(pcp->pc_path)], cf_trailer,
+                       strlen(cf_trailer) + 1);
+                pcp->pc_flags |= PC_HAVE_CF_PATH;
             }
-        } else {
-            error = 0;
         }
+        error = cf_create(pcp->pc_cf_path, pcp->pc_sysdep,
+                          pcp->pc_head.block_size, pcp->pc_head.totalblock,
+                          &pcp->pc_cf_handle);
         if (!error) {
-            cf_seek(pcp->pc_cf_handle, pcp->pc_curblock);
-            error = cf_writeblock(pcp->pc_cf_handle, buffer);
+            pcp->pc_flags |= (PC_HAVE_CFDEP | PC_CF_VERIFIED);
         }
     }
 
     return error;
 }
 
+/*
+ * Write blocks at current location.
+ */
+static int
+v1_writeblocks(pc_context_t *pcp, void *buffer, uint64_t nblocks) {
+    int error = EINVAL;
+
+    /*
+     * Make sure we're initialized.
+     */
+    if (PCTX_HAVE_VERDEP(pcp) && !(error = v1_cf_ready(pcp)))
+        error = cf_writeblocks(pcp->pc_cf_handle, pcp->pc_curblock, buffer,
+                               nblocks);
+
+    return error;
+}
+
+/*
+ * Make blocks read as zeroes.  They're recorded in the change file, so
+ * that nothing is written for them.
+ */
+static int
+v1_zeroblocks(pc_context_t *pcp, uint64_t blockno, uint64_t nblocks) {
+    int error = EINVAL;
+
+    if (PCTX_HAVE_VERDEP(pcp) && !(error = v1_cf_ready(pcp)))
+        error = cf_zeroblocks(pcp->pc_cf_handle, blockno, nblocks);
+
+    return error;
+}
+
+/*
+ * Write part of a block, without reading the rest of it.
+ */
+static int
+v1_writepartial(pc_context_t *pcp, uint64_t blockno, uint64_t offset,
+                uint64_t length, const void *buffer) {
+    int error = EINVAL;
+
+    if (PCTX_HAVE_VERDEP(pcp) && !(error = v1_cf_ready(pcp)))
+        error = cf_writepartial(pcp->pc_cf_handle, blockno, offset, length,
+                                buffer);
+
+    return error;
+}
+
 /*
  * Flush changes to change file
  */
@@ -501,11 +1428,33 @@ v1_sync(pc_context_t *pcp) {
     return error;
 }
 
+/*
+ * Set up checking reads against the version 2 checksums, if the image has
+ * CRC32 checksums.
+ */
+static int
+v2_check_setup(pc_context_t *pcp) {
+    int           error = 0;
+    v1_context_t *v1p   = (v1_context_t *)pcp->pc_verdep;
+
+    if (PCTX_CHECK_READS(pcp) && !v1p->v1_checked &&
+        (pcp->pc_head_v2.checksum_mode == V2_CSM_CRC32) &&
+        (pcp->pc_head.checksum_size == sizeof(crc32_t)) &&
+        pcp->pc_head.blocks_per_checksum) {
+        uint64_t bpc = pcp->pc_head.blocks_per_checksum;
+
+        error = bitmap_create(pcp->pc_sysdep,
+                              (v1p->v1_bitmap->bm_nset + bpc - 1) / bpc,
+                              &v1p->v1_checked);
+    }
+
+    return error;
+}
+
 static int
 v2_verify(pc_context_t *pcp) {
     int            error = EINVAL;
     unsigned char *bitmap;
-    int            i;
     int            bitmap_size;
 
     if (PCTX_OPEN(pcp)) {
@@ -531,11 +1480,22 @@ v2_verify(pc_context_t *pcp) {
                 sizeof(pcp->pc_head_v2) + bitmap_size + CRC_SIZE;
 
             pcp->pc_flags |= PC_HEAD_VALID;
+            v1p->v1_head_crc = update_crc32(
+                init_crc32(), &pcp->pc_head_v2, sizeof(pcp->pc_head_v2));
             /*
-             * Allocate and fill the bitmap.
+             * Use the index file if it's current.  Otherwise, allocate and
+             * fill the bitmap (or leave that to the loader, if lazy).
              */
-            if ((error = (*pcp->pc_sysdep->sys_malloc)(
-                     &v1p->v1_bitmap, pcp->pc_head.totalblock)) == 0) {
+            if (!PCTX_TOLERANT(pcp) && (v1_index_load(pcp) == 0)) {
+                if ((error = precalculate_rank(pcp)) == 0)
+                    error = v2_check_setup(pcp);
+            } else if (pcp->pc_flags & PC_LAZY) {
+                if ((error = v1_lazy_setup(pcp, sizeof(pcp->pc_head_v2),
+                                           bitmap_size, 0)) == 0)
+                    error = precalculate_rank(pcp);
+            } else if ((error = bitmap_create(pcp->pc_sysdep,
+                                              pcp->pc_head.totalblock,
+                                              &v1p->v1_bitmap)) == 0) {
                 uint64_t r_size;
 
                 (void)(*pcp->pc_sysdep->sys_seek)(
@@ -556,19 +1516,17 @@ v2_verify(pc_context_t *pcp) {
                             error = EINVAL;
                         } else {
                             /*
-                             * Convert the "bit" map into a "byte" map
+                             * The on-disk bit map is already in our form.
                              */
-                            for (i = 0; i < pcp->pc_head.totalblock; i++)
-                                v1p->v1_bitmap[i] =
-                                    (bitmap[i >> 3] & (1 << (i & 7))) ? 1 : 0;
-
-                            (void)(*pcp->pc_sysdep->sys_free)(bitmap);
+                            bitmap_load_bits(v1p->v1_bitmap, bitmap);
 
-                            error = precalculate_sumcount(pcp);
+                            if ((error = precalculate_rank(pcp)) == 0)
+                                error = v2_check_setup(pcp);
                         }
                     } else if (error == 0) {
                         error = EINVAL;
                     }
+                    (void)(*pcp->pc_sysdep->sys_free)(bitmap);
                 }
             }
         }
@@ -581,10 +1539,12 @@ v2_verify(pc_context_t *pcp) {
  * Dispatch table for handling various versions.
  */
 static const v_dispatch_table_t version_table[] = {
-    {"0001", v1_init, v1_verify, v1_finish, v1_seek, v1_readblock, v1_blockused,
-     v1_writeblock, v1_sync},
-    {"0002", v1_init, v2_verify, v1_finish, v1_seek, v1_readblock, v1_blockused,
-     v1_writeblock, v1_sync},
+    {"0001", v1_init, v1_verify, v1_finish, v1_seek, v1_readblocks,
+     v1_blockused, v1_blockextent, v1_blockmap, v1_writeblocks, v1_zeroblocks,
+     v1_sync, v1_index_save, v1_writepartial},
+    {"0002", v1_init, v2_verify, v1_finish, v1_seek, v1_readblocks,
+     v1_blockused, v1_blockextent, v1_blockmap, v1_writeblocks, v1_zeroblocks,
+     v1_sync, v1_index_save, v1_writepartial},
 };
 
 /*
@@ -599,23 +1559,21 @@ partclone_close(void *rp) {
         if (PCTX_CF_OPEN(pcp)) {
             (void)(*pcp->pc_dispatch->version_sync)(pcp);
         }
-        if (PCTX_OPEN(pcp)) {
-            (void)(*pcp->pc_sysdep->sys_close)(pcp->pc_fd);
-        }
-        if (PCTX_HAVE_PATH(pcp)) {
-            (void)(*pcp->pc_sysdep->sys_free)(pcp->pc_path);
-        }
-        if (PCTX_HAVE_CF_PATH(pcp)) {
-            (void)(*pcp->pc_sysdep->sys_free)(pcp->pc_cf_path);
-        }
-        if (PCTX_HAVE_IVBLOCK(pcp)) {
-            (void)(*pcp->pc_sysdep->sys_free)(pcp->pc_ivblock);
-        }
+        /*
+         * Finish first, as a lazy load may still be reading the image.
+         */
         if (PCTX_HAVE_VERDEP(pcp)) {
             if (pcp->pc_dispatch && pcp->pc_dispatch->version_finish)
                 error = (*pcp->pc_dispatch->version_finish)(pcp);
         }
-        (void)(*pcp->pc_sysdep->sys_free)(pcp);
+        if (PCTX_OPEN(pcp)) {
+            (void)(*pcp->pc_sysdep->sys_close)(pcp->pc_fd);
+        }
+        /*
+         * The handle, its paths and its version-dependent handle all go
+         * with the arena.
+         */
+        sysdep_arena_destroy(pcp->pc_arena);
         error = 0;
     }
 
@@ -630,25 +1588,32 @@ partclone_open(const char *path, const char *cfpath, sysdep_open_mode_t omode,
                const sysdep_dispatch_t *sysdep, void **rpp) {
     int error = EINVAL;
     if (sysdep) {
-        pc_context_t *pcp;
-        error = (*sysdep->sys_malloc)(&pcp, sizeof(*pcp));
+        sysdep_arena_t *arena;
+        pc_context_t *  pcp = (pc_context_t *)NULL;
+
+        if ((error = sysdep_arena_create(sysdep, &arena)) == 0 &&
+            (error = sysdep_arena_alloc(arena, &pcp, sizeof(*pcp))) != 0)
+            sysdep_arena_destroy(arena);
 
         if (pcp) {
             memset(pcp, 0, sizeof(*pcp));
             pcp->pc_flags |= PC_VALID;
             pcp->pc_sysdep = sysdep;
+            pcp->pc_arena  = arena;
 
             if ((error = (*pcp->pc_sysdep->sys_open)(&pcp->pc_fd, path,
                                                      SYSDEP_OPEN_RO)) == 0) {
                 pcp->pc_flags |= PC_OPEN;
-                if ((error = (*pcp->pc_sysdep->sys_malloc)(
-                         &pcp->pc_path, strlen(path) + 1)) == 0) {
+                if ((error = sysdep_arena_alloc(pcp->pc_arena, &pcp->pc_path,
+                                                strlen(path) + 1)) == 0) {
                     pcp->pc_flags |= PC_HAVE_PATH;
                     pcp->pc_omode = omode;
                     memcpy(pcp->pc_path, path, strlen(path) + 1);
                     if (cfpath &&
-                        ((error = (*pcp->pc_sysdep->sys_malloc)(
-                              &pcp->pc_cf_path, strlen(cfpath) + 1)) == 0)) {
+                        ((error = sysdep_arena_alloc(pcp->pc_arena,
+                                                     &pcp->pc_cf_path,
+                                                     strlen(cfpath) + 1)) ==
+                         0)) {
                         pcp->pc_flags |= PC_HAVE_CF_PATH;
                         memcpy(pcp->pc_cf_path, cfpath, strlen(cfpath) + 1);
                     }
@@ -681,10 +1646,111 @@ partclone_tolerant_mode(void *rp) {
 }
 
 /*
- * Determine the version of the file and verify it.
+ * Check the checksums of blocks as they are read.  Only version 2 images
+ * with CRC32 checksums can be checked.
  */
 int
-partclone_verify(void *rp) {
+partclone_verify_reads(void *rp) {
+    int           error = ENOTSUP;
+    pc_context_t *pcp   = (pc_context_t *)rp;
+
+    if (PCTX_OPEN(pcp)) {
+        if (PCTX_READREADY(pcp)) {
+            /*
+             * Checking needs the whole bitmap.
+             */
+            if ((pcp->pc_dispatch->version_verify == v2_verify) &&
+                ((error = v1_lazy_wait_all(pcp)) == 0)) {
+                pcp->pc_flags |= PC_CHECK_READS;
+                if ((error = v2_check_setup(pcp)) != 0)
+                    pcp->pc_flags &= ~PC_CHECK_READS;
+            }
+        } else {
+            /*
+             * Not verified yet; set up when it is.
+             */
+            pcp->pc_flags |= PC_CHECK_READS;
+            error = 0;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Load the bitmap lazily, in the background, rather than all of it when
+ * the image is verified.  Called before verifying, to ask for that, and
+ * again afterwards to start loading; the loader is a thread, so that is
+ * best left until after any fork.  Otherwise, loading starts with the
+ * first request that needs it.  If "strict", requests wait until the whole
+ * bitmap is loaded and checked.
+ */
+int
+partclone_lazy_load(void *rp, int strict) {
+    int           error = ENOTSUP;
+#ifdef HAVE_LIBPTHREAD
+    pc_context_t *pcp = (pc_context_t *)rp;
+
+    error = EINVAL;
+    if (PCTX_OPEN(pcp)) {
+        error = 0;
+        if (!PCTX_READREADY(pcp)) {
+            pcp->pc_flags |= PC_LAZY;
+            if (strict)
+                pcp->pc_flags |= PC_STRICT;
+        } else if (((v1_context_t *)pcp->pc_verdep)->v1_lazy) {
+            v1_lazy_start(pcp);
+        }
+    }
+#endif /* HAVE_LIBPTHREAD */
+
+    return error;
+}
+
+/*
+ * Check all of the data in a verified image against its checksums, with
+ * the threads and callbacks set in "vjp".  Only version 2 images with
+ * CRC32 checksums can be checked.
+ */
+int
+partclone_verify_data(void *rp, verify_job_t *vjp) {
+    int           error = ENOTSUP;
+    pc_context_t *pcp   = (pc_context_t *)rp;
+
+    if (!PCTX_READREADY(pcp))
+        return EINVAL;
+    if ((pcp->pc_dispatch->version_verify == v2_verify) &&
+        (pcp->pc_head_v2.checksum_mode == V2_CSM_CRC32) &&
+        (pcp->pc_head.checksum_size == sizeof(crc32_t)) &&
+        pcp->pc_head.blocks_per_checksum &&
+        ((error = v1_lazy_wait_all(pcp)) == 0)) {
+        v1_context_t *v1p    = (v1_context_t *)pcp->pc_verdep;
+        uint64_t      bpc    = pcp->pc_head.blocks_per_checksum;
+        uint64_t      gbytes = (bpc * pcp->pc_head.block_size) +
+                               pcp->pc_head.checksum_size;
+
+        vjp->vj_unitname = "checksum group";
+        vjp->vj_units    = (v1p->v1_bitmap->bm_nset + bpc - 1) / bpc;
+        vjp->vj_chunk    = PC_VERIFY_CHUNK_BYTES / gbytes;
+        if (!vjp->vj_chunk)
+            vjp->vj_chunk = 1;
+        vjp->vj_bufsize = (vjp->vj_chunk * gbytes) + pcp->pc_head.checksum_size;
+        vjp->vj_bytes   = (v1p->v1_bitmap->bm_nset * pcp->pc_head.block_size) +
+                        (vjp->vj_units * pcp->pc_head.checksum_size);
+        vjp->vj_check   = v2_check_data;
+        vjp->vj_arg     = pcp;
+        error           = verify_run(pcp->pc_sysdep, vjp);
+    }
+
+    return error;
+}
+
+/*
+ * Determine the version of the file and verify it.  If not "full", only
+ * check the magic and version in the header.
+ */
+static int
+partclone_verify_common(void *rp, int full) {
     int           error = EINVAL;
     pc_context_t *pcp   = (pc_context_t *)rp;
 
@@ -722,21 +1788,22 @@ partclone_verify(void *rp) {
             if (found >= 0) {
                 pcp->pc_dispatch = (v_dispatch_table_t *)&version_table[found];
                 /*
-                 * Initialize the per-version handle.
+                 * For a header-only check, just look at the magic, which is
+                 * in the same place in all versions.  Otherwise, initialize
+                 * the per-version handle.
                  */
-                if (!(error = (*pcp->pc_dispatch->version_init)(pcp))) {
+                if (!full) {
+                    error = (memcmp(pcp->pc_head_v1.magic, IMAGE_MAGIC,
+                                    IMAGE_MAGIC_SIZE) == 0)
+                                ? 0
+                                : EINVAL;
+                } else if (!(error = (*pcp->pc_dispatch->version_init)(pcp))) {
                     /*
                      * Verify the version header.
                      */
                     if (!(error = (*pcp->pc_dispatch->version_verify)(pcp))) {
                         pcp->pc_flags |= PC_VERIFIED;
                         pcp->pc_curblock = 0;
-                        if ((error = (*pcp->pc_sysdep->sys_malloc)(
-                                 &pcp->pc_ivblock, pcp->pc_head.block_size)) ==
-                            0) {
-                            memset(pcp->pc_ivblock, 0, pcp->pc_head.block_size);
-                            pcp->pc_flags |= PC_HAVE_IVBLOCK;
-                        }
                     }
                 }
             } else {
@@ -755,6 +1822,16 @@ partclone_verify(void *rp) {
     return error;
 }
 
+static int
+partclone_verify_header_only(void *rp) {
+    return partclone_verify_common(rp, 0);
+}
+
+int
+partclone_verify(void *rp) {
+    return partclone_verify_common(rp, 1);
+}
+
 /*
  * Return the blocksize.
  */
@@ -811,25 +1888,37 @@ partclone_readblocks(void *rp, void *buffer, uint64_t nblocks) {
     int           error = EINVAL;
     pc_context_t *pcp   = (pc_context_t *)rp;
     if (PCTX_READREADY(pcp)) {
-        uint64_t bindex;
-        void *   cbp = buffer;
-
         /*
-         * Iterate and use the version-specific routine to do the heavy
-         * lifting.
+         * Use the version-specific routine to do the heavy lifting.
          */
-        for (bindex = 0; bindex < nblocks; bindex++) {
-            if ((error = (*pcp->pc_dispatch->version_readblock)(pcp, cbp))) {
-                break;
-            }
-            pcp->pc_curblock++;
-            cbp += pcp->pc_head.block_size;
+        if (!(error = (*pcp->pc_dispatch->version_readblocks)(
+                  pcp, pcp->pc_curblock, buffer, nblocks))) {
+            pcp->pc_curblock += nblocks;
         }
     }
 
     return error;
 }
 
+/*
+ * Read blocks starting at a particular block.  The current position is
+ * not changed.
+ */
+int
+partclone_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                        uint64_t nblocks) {
+    int           error = EINVAL;
+    pc_context_t *pcp   = (pc_context_t *)rp;
+
+    if (PCTX_READREADY(pcp) && (blockno <= pcp->pc_head.totalblock) &&
+        (nblocks <= (pcp->pc_head.totalblock - blockno))) {
+        error = (*pcp->pc_dispatch->version_readblocks)(pcp, blockno, buffer,
+                                                        nblocks);
+    }
+
+    return error;
+}
+
 /*
  * Determine if the current block is used.
  */
@@ -840,6 +1929,35 @@ partclone_block_used(void *rp) {
                                  : BLOCK_ERROR;
 }
 
+/*
+ * Determine whether the blocks starting at "blockno" are used, and how many
+ * of them, up to "maxblocks", share that state.
+ */
+int
+partclone_block_extent(void *rp, uint64_t blockno, uint64_t maxblocks,
+                       uint64_t *nblocksp) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+    return (PCTX_READREADY(pcp) && (blockno < pcp->pc_head.totalblock) &&
+            maxblocks && nblocksp)
+               ? (*pcp->pc_dispatch->version_blockextent)(pcp, blockno,
+                                                          maxblocks, nblocksp)
+               : BLOCK_ERROR;
+}
+
+/*
+ * Map a range of blocks.
+ */
+int
+partclone_block_map(void *rp, uint64_t blockno, uint64_t nblocks,
+                    image_segment_t *segs, uint32_t *nsegsp) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+    return (PCTX_READREADY(pcp) && nsegsp &&
+            (blockno + nblocks <= pcp->pc_head.totalblock))
+               ? (*pcp->pc_dispatch->version_blockmap)(pcp, blockno, nblocks,
+                                                       segs, nsegsp)
+               : EINVAL;
+}
+
 /*
  * Write blocks to the current position.
  */
@@ -848,26 +1966,43 @@ partclone_writeblocks(void *rp, void *buffer, uint64_t nblocks) {
     int           error = EINVAL;
     pc_context_t *pcp   = (pc_context_t *)rp;
 
-    if (PCTX_WRITEABLE(pcp)) {
-        uint64_t bindex;
-        void *   cbp = buffer;
-
-        /*
-         * Iterate and use the version-specific routine to do the heavy
-         * lifting.
-         */
-        for (bindex = 0; bindex < nblocks; bindex++) {
-            if ((error = (*pcp->pc_dispatch->version_writeblock)(pcp, cbp))) {
-                break;
-            }
-            pcp->pc_curblock++;
-            cbp += pcp->pc_head.block_size;
-        }
-    }
+    if (PCTX_WRITEABLE(pcp) &&
+        !(error = (*pcp->pc_dispatch->version_writeblocks)(pcp, buffer,
+                                                           nblocks)))
+        pcp->pc_curblock += nblocks;
 
     return error;
 }
 
+/*
+ * Make blocks read as zeroes.
+ */
+int
+partclone_zeroblocks(void *rp, uint64_t blockno, uint64_t nblocks) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+
+    return (PCTX_WRITEABLE(pcp) && (blockno <= pcp->pc_head.totalblock) &&
+            (nblocks <= (pcp->pc_head.totalblock - blockno)))
+               ? (*pcp->pc_dispatch->version_zeroblocks)(pcp, blockno, nblocks)
+               : EINVAL;
+}
+
+/*
+ * Write "length" bytes at "offset" in block "blockno".  ENOTSUP means the
+ * whole block has to be written instead.  This does not change the current
+ * position.
+ */
+int
+partclone_writepartial(void *rp, uint64_t blockno, uint64_t offset,
+                       uint64_t length, const void *buffer) {
+    pc_context_t *pcp = (pc_context_t *)rp;
+
+    return (PCTX_WRITEABLE(pcp) && (blockno < pcp->pc_head.totalblock))
+               ? (*pcp->pc_dispatch->version_writepartial)(pcp, blockno, offset,
+                                                          length, buffer)
+               : EINVAL;
+}
+
 /*
  * Commit changes to image.
  */
@@ -879,6 +2014,22 @@ partclone_sync(void *rp) {
                                   : EINVAL;
 }
 
+/*
+ * Write an index file for the image, so that later verifies can map the
+ * bitmap from it instead of reading it from the image.
+ */
+int
+partclone_build_index(void *rp) {
+    int           error = EINVAL;
+    pc_context_t *pcp   = (pc_context_t *)rp;
+
+    if (PCTX_READREADY(pcp)) {
+        error = (*pcp->pc_dispatch->version_build_index)(pcp);
+    }
+
+    return error;
+}
+
 /*
  * Is this a partclone image?
  */
@@ -888,7 +2039,7 @@ partclone_probe(const char *path, const sysdep_dispatch_t *sysdep) {
     int   error =
         partclone_open(path, (char *)NULL, SYSDEP_OPEN_RO, sysdep, &testh);
     if (!error) {
-        error = partclone_verify(testh);
+        error = partclone_verify_header_only(testh);
         partclone_close(testh);
     }
 
@@ -899,8 +2050,10 @@ partclone_probe(const char *path, const sysdep_dispatch_t *sysdep) {
  * The image type dispatch table.
  */
 const image_dispatch_t partclone_image_type = {
-    "partclone image",     partclone_probe,         partclone_open,
-    partclone_close,       partclone_tolerant_mode, partclone_verify,
-    partclone_blocksize,   partclone_blockcount,    partclone_seek,
-    partclone_tell,        partclone_readblocks,    partclone_block_used,
-    partclone_writeblocks, partclone_sync};
+    "partclone image",       partclone_probe,         partclone_open,
+    partclone_close,         partclone_tolerant_mode, partclone_verify_reads,
+    partclone_lazy_load,     partclone_verify,        partclone_blocksize,
+    partclone_blockcount,    partclone_seek,          partclone_tell,
+    partclone_readblocks,    partclone_readblocks_at, partclone_block_used,
+    partclone_block_extent,  partclone_block_map,     partclone_writeblocks,
+    partclone_zeroblocks,    partclone_sync,          partclone_writepartial};
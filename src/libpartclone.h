@@ -14,7 +14,10 @@
 #ifndef _LIBPARTCLONE_H_
 #define _LIBPARTCLONE_H_ 1
 
+#include "libimage.h"
+#include "libverify.h"
 #include "partclone.h"
+#include "sysdep_arena.h"
 #include "sysdep_int.h"
 #include <sys/types.h>
 
@@ -24,22 +27,35 @@ int      partclone_open(const char *path, const char *cfpath,
                         sysdep_open_mode_t omode, const sysdep_dispatch_t *sysdep,
                         void **rpp);
 int      partclone_close(void *rp);
+void     partclone_tolerant_mode(void *rp);
+int      partclone_verify_reads(void *rp);
+int      partclone_lazy_load(void *rp, int strict);
 int      partclone_verify(void *rp);
+int      partclone_verify_data(void *rp, verify_job_t *vjp);
 int64_t  partclone_blocksize(void *rp);
 int64_t  partclone_blockcount(void *rp);
 int      partclone_seek(void *rp, uint64_t blockno);
 uint64_t partclone_tell(void *rp);
 int      partclone_readblocks(void *rp, void *buffer, uint64_t nblocks);
+int      partclone_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                                 uint64_t nblocks);
 int      partclone_block_used(void *rp);
+int      partclone_block_extent(void *rp, uint64_t blockno, uint64_t maxblocks,
+                                uint64_t *nblocksp);
+int      partclone_block_map(void *rp, uint64_t blockno, uint64_t nblocks,
+                             image_segment_t *segs, uint32_t *nsegsp);
 int      partclone_writeblocks(void *rp, void *buffer, uint64_t nblocks);
+int      partclone_zeroblocks(void *rp, uint64_t blockno, uint64_t nblocks);
+int      partclone_writepartial(void *rp, uint64_t blockno, uint64_t offset,
+                                uint64_t length, const void *buffer);
 int      partclone_sync(void *rp);
+int      partclone_build_index(void *rp);
 
 typedef struct libpc_context {
     void *                         pc_fd;        /* File handle */
     char *                         pc_path;      /* Path to image */
     char *                         pc_cf_path;   /* Path to change file */
     void *                         pc_cf_handle; /* Change file handle */
-    unsigned char *                pc_ivblock;   /* Convenient invalid block */
     void *                         pc_verdep;    /* Version-dependent handle */
     struct version_dispatch_table *pc_dispatch; /* Version-dependent dispatch */
     const sysdep_dispatch_t *      pc_sysdep;   /* System-specific routines */
@@ -58,6 +74,7 @@ typedef struct libpc_context {
     uint64_t           pc_curblock; /* Current position */
     uint32_t           pc_flags;    /* Handle flags */
     sysdep_open_mode_t pc_omode;    /* Open mode */
+    sysdep_arena_t *   pc_arena;    /* Memory for the handle's lifetime */
 } pc_context_t;
 
 #endif /* _LIBPARTCLONE_H_ */
@@ -13,22 +13,1185 @@
 #ifdef HAVE_CONFIG_H
 #    include "config.h"
 #endif /* HAVE_CONFIG_H */
+#include "changefileint.h"
+#include "libchecksum.h"
 #include "libpartclone.h"
 #include "sysdep_posix.h"
+#include "sysdep_split.h"
+#include "sysdep_zstream.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#if defined(HAVE_LIBZSTD) && defined(HAVE_ZSTD_H)
+#    include <zstd.h>
+#    define TEST_HAVE_ZSTD 1
+#endif /* HAVE_LIBZSTD && HAVE_ZSTD_H */
+#if defined(HAVE_LIBLZ4) && defined(HAVE_LZ4_H) && defined(HAVE_LZ4FRAME_H)
+#    include <lz4frame.h>
+#    define TEST_HAVE_LZ4 1
+#endif /* HAVE_LIBLZ4 && HAVE_LZ4_H && HAVE_LZ4FRAME_H */
+
+/*
+ * Run without arguments, this runs its own tests: each builds the images
+ * it needs in a scratch directory, and checks what the library reads from
+ * them against what was put in them.
+ */
+#define TEST_BLOCKSIZE 4096 /* Block size of the test images */
+
+static char        test_dir[] = "/tmp/libpctestXXXXXX";
+static const char *test_bindir; /* Where the tools are */
+
+/*
+ * Make up the path of "name" in the scratch directory.  The last four
+ * paths made stay valid.
+ */
+static const char *
+test_path(const char *name) {
+    static char path[4][sizeof(test_dir) + 64];
+    static int  which;
+
+    which = (which + 1) % 4;
+    snprintf(path[which], sizeof(path[which]), "%s/%s", test_dir, name);
+    return path[which];
+}
+
+/*
+ * The contents of used block "blockno" of a test image.  Runs of blocks
+ * compress, and the runs between them don't.
+ */
+static void
+test_fill(unsigned char *buf, uint64_t blockno, uint32_t bsize) {
+    uint32_t x = (uint32_t)(blockno * 2654435761u) | 1;
+    uint32_t i;
+
+    for (i = 0; i < bsize; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf[i] = ((blockno & 32) || !(i & 64)) ? (unsigned char)x
+                                                : (unsigned char)blockno;
+    }
+}
+
+/*
+ * Write a partclone image of "nblocks" blocks to "path": version 1 with a
+ * byte map of "map", or version 2 with a bitmap of the blocks "map" has
+ * set and a checksum every "bpc" blocks.  What it reads as is left in
+ * "ref".
+ */
+static int
+test_image(const char *path, int version, uint32_t bsize, uint64_t nblocks,
+           const unsigned char *map, uint32_t bpc, unsigned char *ref) {
+    FILE *         fp;
+    unsigned char *block = (unsigned char *)malloc(bsize);
+    uint64_t       used  = 0, b;
+    int            error = 0;
+
+    for (b = 0; b < nblocks; b++)
+        used += (map[b] != 0);
+    memset(ref, 0, nblocks * bsize);
+    if (!block || !(fp = fopen(path, "w"))) {
+        free(block);
+        return errno;
+    }
+    if (version == 1) {
+        image_head_v1 head;
+        crc32_t       nocrc = 0;
+
+        memset(&head, 0, sizeof(head));
+        memcpy(head.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
+        memcpy(head.fs, extfs_MAGIC, strlen(extfs_MAGIC));
+        memcpy(head.version, IMAGE_VERSION, VERSION_SIZE);
+        head.block_size  = bsize;
+        head.device_size = nblocks * bsize;
+        head.totalblock  = nblocks;
+        head.usedblocks  = used;
+        fwrite(&head, sizeof(head), 1, fp);
+        fwrite(map, nblocks, 1, fp);
+        fwrite(BIT_MAGIC, BIT_MAGIC_SIZE, 1, fp);
+        for (b = 0; b < nblocks; b++) {
+            if (map[b]) {
+                test_fill(&ref[b * bsize], b, bsize);
+                fwrite(&ref[b * bsize], bsize, 1, fp);
+                fwrite(&nocrc, sizeof(nocrc), 1, fp);
+            }
+        }
+    } else {
+        image_head_v2  head;
+        uint64_t       bmsize = (nblocks + 7) / 8;
+        unsigned char *bitmap = (unsigned char *)calloc(1, bmsize);
+        crc32_t        crc    = init_crc32();
+        uint64_t       ingroup = 0;
+
+        memset(&head, 0, sizeof(head));
+        memcpy(head.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
+        memcpy(head.version, IMAGE_VERSION_2, VERSION_SIZE);
+        memcpy(head.fs, extfs_MAGIC, strlen(extfs_MAGIC));
+        head.endianess           = ENDIAN_MAGIC;
+        head.device_size         = nblocks * bsize;
+        head.totalblock          = nblocks;
+        head.usedblocks          = used;
+        head.used_bitmap         = used;
+        head.block_size          = bsize;
+        head.feature_size        = offsetof(image_head_v2, crc) -
+                                   offsetof(image_head_v2, feature_size);
+        head.image_version       = 2;
+        head.cpu_bits            = sizeof(unsigned long) * 8;
+        head.checksum_mode       = V2_CSM_CRC32;
+        head.checksum_size       = CRC_SIZE;
+        head.blocks_per_checksum = bpc;
+        head.reseed_checksum     = 1;
+        head.bitmap_mode         = V2_BM_BIT;
+        head.crc = update_crc32(init_crc32(), &head, sizeof(head) - CRC_SIZE);
+        for (b = 0; bitmap && (b < nblocks); b++)
+            if (map[b])
+                bitmap[b >> 3] |= 1 << (b & 7);
+        fwrite(&head, sizeof(head), 1, fp);
+        if (bitmap) {
+            crc32_t bmcrc = update_crc32(init_crc32(), bitmap, bmsize);
+
+            fwrite(bitmap, bmsize, 1, fp);
+            fwrite(&bmcrc, sizeof(bmcrc), 1, fp);
+        }
+        free(bitmap);
+        for (b = 0; b < nblocks; b++) {
+            if (map[b]) {
+                test_fill(&ref[b * bsize], b, bsize);
+                fwrite(&ref[b * bsize], bsize, 1, fp);
+                crc = update_crc32(crc, &ref[b * bsize], bsize);
+                if (++ingroup == bpc) {
+                    fwrite(&crc, sizeof(crc), 1, fp);
+                    crc     = init_crc32();
+                    ingroup = 0;
+                }
+            }
+        }
+        if (ingroup)
+            fwrite(&crc, sizeof(crc), 1, fp);
+    }
+    if (ferror(fp))
+        error = EIO;
+    if (fclose(fp) && !error)
+        error = errno;
+    free(block);
+
+    return error;
+}
+
+/*
+ * Open "path" (with change file "cfpath", if any) as an image.
+ */
+static int
+test_open(const char *path, const char *cfpath, void **hp) {
+    int error;
+
+    if ((error = image_open(path, cfpath,
+                            (cfpath) ? SYSDEP_OPEN_RW : SYSDEP_OPEN_RO,
+                            &posix_dispatch, 0, hp)) == 0) {
+        if ((error = image_verify(*hp)))
+            image_close(*hp);
+    }
+
+    return error;
+}
+
+/*
+ * Check that blocks "first" up to "end" of the image open as "h" read as
+ * "ref", in runs of varying length.
+ */
+static int
+test_compare_range(void *h, const unsigned char *ref, uint64_t first,
+                   uint64_t end) {
+    int            error = 0;
+    uint32_t       bsize = (uint32_t)image_blocksize(h);
+    unsigned char *buf   = (unsigned char *)malloc(64 * (size_t)bsize);
+    uint64_t       b, n, run = 1;
+
+    if (!buf)
+        return ENOMEM;
+    for (b = first; !error && (b < end); b += n) {
+        n   = (run < (end - b)) ? run : end - b;
+        run = (run % 61) + 3;
+        if ((error = image_readblocks_at(h, b, buf, n)) == 0) {
+            if (memcmp(buf, &ref[b * bsize], n * bsize)) {
+                printf("  blocks %" PRIu64 "-%" PRIu64 " differ\n", b,
+                       b + n - 1);
+                error = EIO;
+            }
+        }
+    }
+    free(buf);
+
+    return error;
+}
+
+/*
+ * Check that the image open as "h" is "nblocks" long, and reads as "ref".
+ */
+static int
+test_compare(void *h, const unsigned char *ref, uint64_t nblocks) {
+    if ((uint64_t)image_blockcount(h) != nblocks)
+        return EINVAL;
+    return test_compare_range(h, ref, 0, nblocks);
+}
+
+/*
+ * Version 1 byte maps can have entries other than 0 and 1.  The blocks
+ * they're for are in the image, and are read from it.
+ */
+static int
+test_v1_bytemap(void) {
+    int            error;
+    uint64_t const nblocks = 200;
+    unsigned char  map[200];
+    unsigned char *ref = (unsigned char *)malloc(nblocks * TEST_BLOCKSIZE);
+    void *         h;
+    uint64_t       b;
+
+    if (!ref)
+        return ENOMEM;
+    for (b = 0; b < nblocks; b++)
+        map[b] = (b % 3) ? 1 : 0;
+    map[7]   = 2;
+    map[100] = 0xff;
+    if (((error = test_image(test_path("v1.img"), 1, TEST_BLOCKSIZE, nblocks,
+                             map, 1, ref)) == 0) &&
+        ((error = test_open(test_path("v1.img"), (char *)NULL, &h)) == 0)) {
+        error = test_compare(h, ref, nblocks);
+        if (!error && (image_seek(h, 7) || (image_block_used(h) != 1)))
+            error = EINVAL;
+        image_close(h);
+    }
+    free(ref);
+
+    return error;
+}
+
+/*
+ * Version 2, with a checksum every few blocks.
+ */
+static int
+test_v2_read(void) {
+    int            error;
+    uint64_t const nblocks = 1000;
+    unsigned char  map[1000];
+    unsigned char *ref = (unsigned char *)malloc(nblocks * TEST_BLOCKSIZE);
+    void *         h;
+    uint64_t       b;
+
+    if (!ref)
+        return ENOMEM;
+    for (b = 0; b < nblocks; b++)
+        map[b] = ((b / 50) % 3) != 1;
+    if (((error = test_image(test_path("v2.img"), 2, TEST_BLOCKSIZE, nblocks,
+                             map, 16, ref)) == 0) &&
+        ((error = test_open(test_path("v2.img"), (char *)NULL, &h)) == 0)) {
+        error = test_compare(h, ref, nblocks);
+        image_close(h);
+    }
+    free(ref);
+
+    return error;
+}
+
+/*
+ * Write "nblocks" blocks from "blockno" on through the image open as "h",
+ * with contents made up from "seed", and update "ref" to match.
+ */
+static int
+test_write(void *h, unsigned char *ref, uint64_t blockno, uint64_t nblocks,
+           uint64_t seed) {
+    int      error;
+    uint32_t bsize = (uint32_t)image_blocksize(h);
+    uint64_t b;
+
+    for (b = 0; b < nblocks; b++)
+        test_fill(&ref[(blockno + b) * bsize], seed + blockno + b, bsize);
+    if ((error = image_seek(h, blockno)) == 0)
+        error = image_writeblocks(h, &ref[blockno * bsize], nblocks);
+
+    return error;
+}
+
+/*
+ * Blocks written far apart, reopened: most of the change file's block map
+ * is holes, which aren't read when it's loaded.
+ */
+static int
+test_cf_sparse(void) {
+    int            error;
+    uint64_t const nblocks = 100000; /* 196 map pages */
+    uint32_t const bsize   = 512;
+    unsigned char *map     = (unsigned char *)malloc(nblocks);
+    unsigned char *ref     = (unsigned char *)malloc(nblocks * bsize);
+    void *         h;
+    uint64_t       b;
+
+    if (!map || !ref) {
+        free(map);
+        free(ref);
+        return ENOMEM;
+    }
+    for (b = 0; b < nblocks; b++)
+        map[b] = (b & 1);
+    if (((error = test_image(test_path("sparse.img"), 2, bsize, nblocks, map,
+                             64, ref)) == 0) &&
+        ((error = test_open(test_path("sparse.img"), test_path("sparse.cf"),
+                            &h)) == 0)) {
+        if (((error = test_write(h, ref, 3, 1, 0)) == 0) &&
+            ((error = test_write(h, ref, 40000, 1100, 0)) == 0) &&
+            ((error = test_write(h, ref, nblocks - 1, 1, 0)) == 0))
+            error = image_sync(h);
+        image_close(h);
+    }
+    if (!error &&
+        ((error = test_open(test_path("sparse.img"), test_path("sparse.cf"),
+                            &h)) == 0)) {
+        error = test_compare(h, ref, nblocks);
+        image_close(h);
+    }
+    free(map);
+    free(ref);
+
+    return error;
+}
+
+/*
+ * Run the tool "tool", built alongside this program, with "args".
+ */
+static int
+test_tool(const char *tool, const char *args) {
+    char cmd[1024];
+
+    snprintf(cmd, sizeof(cmd), "%s/%s %s >/dev/null", test_bindir, tool,
+             args);
+    return (system(cmd) == 0) ? 0 : EIO;
+}
+
+/*
+ * Make a change file with blocks replaced, added and zeroed.  Compacted,
+ * it reads the same over the image, and committed, the new image reads
+ * the same on its own.
+ */
+static int
+test_tools(void) {
+    int            error;
+    uint64_t const nblocks = 2000;
+    unsigned char  map[2000];
+    unsigned char *ref = (unsigned char *)malloc(nblocks * TEST_BLOCKSIZE);
+    void *         h;
+    uint64_t       b;
+    char           args[512];
+
+    if (!ref)
+        return ENOMEM;
+    for (b = 0; b < nblocks; b++)
+        map[b] = ((b / 7) % 4) != 0;
+    if (((error = test_image(test_path("tools.img"), 2, TEST_BLOCKSIZE,
+                             nblocks, map, 32, ref)) == 0) &&
+        ((error = test_open(test_path("tools.img"), test_path("tools.cf"),
+                            &h)) == 0)) {
+        if (((error = test_write(h, ref, 900, 400, 11)) == 0) &&
+            ((error = test_write(h, ref, 0, 30, 13)) == 0) &&
+            ((error = test_write(h, ref, 1990, 10, 17)) == 0) &&
+            ((error = image_zeroblocks(h, 1500, 50)) == 0)) {
+            memset(&ref[1500 * TEST_BLOCKSIZE], 0, 50 * TEST_BLOCKSIZE);
+            error = image_sync(h);
+        }
+        image_close(h);
+    }
+    if (!error) {
+        snprintf(args, sizeof(args), "%s %s", test_path("tools.cf"),
+                 test_path("compact.cf"));
+        if (((error = test_tool("cfcompact", args)) == 0) &&
+            ((error = test_open(test_path("tools.img"),
+                                test_path("compact.cf"), &h)) == 0)) {
+            error = test_compare(h, ref, nblocks);
+            image_close(h);
+        }
+    }
+    if (!error) {
+        snprintf(args, sizeof(args), "-c %s %s %s", test_path("tools.cf"),
+                 test_path("tools.img"), test_path("commit.img"));
+        if (((error = test_tool("imagecommit", args)) == 0) &&
+            ((error = test_open(test_path("commit.img"), (char *)NULL,
+                                &h)) == 0)) {
+            error = test_compare(h, ref, nblocks);
+            image_close(h);
+        }
+    }
+    free(ref);
+
+    return error;
+}
+
+/*
+ * Read all of the file "path" into a new buffer.
+ */
+static int
+test_slurp(const char *path, unsigned char **bufp, size_t *lenp) {
+    FILE *fp;
+    long  len   = 0;
+    int   error = 0;
+
+    *bufp = (unsigned char *)NULL;
+    if (!(fp = fopen(path, "r")))
+        return errno;
+    if ((fseek(fp, 0, SEEK_END) < 0) || ((len = ftell(fp)) < 0) ||
+        (fseek(fp, 0, SEEK_SET) < 0))
+        error = errno;
+    else if (!(*bufp = (unsigned char *)malloc(len + 1)))
+        error = ENOMEM;
+    else if (fread(*bufp, 1, len, fp) != (size_t)len)
+        error = EIO;
+    fclose(fp);
+    if (error) {
+        free(*bufp);
+        *bufp = (unsigned char *)NULL;
+    } else {
+        *lenp = len;
+    }
+
+    return error;
+}
+
+/*
+ * Write "len" bytes of "buf" to the file "path".
+ */
+static int
+test_spew(const char *path, const unsigned char *buf, size_t len) {
+    FILE *fp;
+    int   error = 0;
+
+    if (!(fp = fopen(path, "w")))
+        return errno;
+    if (fwrite(buf, 1, len, fp) != len)
+        error = EIO;
+    if (fclose(fp) && !error)
+        error = errno;
+
+    return error;
+}
+
+/*
+ * Runs of blocks longer than the change file's log are written straight
+ * to the file after it, more than CF_WRITEV_BLOCKS at a time, around
+ * blocks still in the log.  They must read the same after a sync and
+ * reopen, and when written over again.
+ */
+static int
+test_cf_long(void) {
+    int            error;
+    uint64_t const nblocks = 2000;
+    uint64_t const nrun    = (2 * CF_LOG_SIZE) / TEST_BLOCKSIZE;
+    unsigned char  map[2000];
+    unsigned char *ref = (unsigned char *)malloc(nblocks * TEST_BLOCKSIZE);
+    void *         h;
+    uint64_t       b;
+
+    if (!ref)
+        return ENOMEM;
+    for (b = 0; b < nblocks; b++)
+        map[b] = (b % 3) != 0;
+    if (((error = test_image(test_path("long.img"), 2, TEST_BLOCKSIZE,
+                             nblocks, map, 16, ref)) == 0) &&
+        ((error = test_open(test_path("long.img"), test_path("long.cf"),
+                            &h)) == 0)) {
+        if (((error = test_write(h, ref, 100, 5, 31)) == 0) &&
+            ((error = test_write(h, ref, 50, nrun, 32)) == 0) &&
+            ((error = test_write(h, ref, 40 + nrun, 20, 33)) == 0) &&
+            ((error = test_compare(h, ref, nblocks)) == 0))
+            error = image_sync(h);
+        image_close(h);
+    }
+    if (!error &&
+        ((error = test_open(test_path("long.img"), test_path("long.cf"),
+                            &h)) == 0)) {
+        if (((error = test_compare(h, ref, nblocks)) == 0) &&
+            ((error = test_write(h, ref, 10, nrun + 300, 34)) == 0))
+            error = image_sync(h);
+        image_close(h);
+    }
+    if (!error &&
+        ((error = test_open(test_path("long.img"), test_path("long.cf"),
+                            &h)) == 0)) {
+        error = test_compare(h, ref, nblocks);
+        image_close(h);
+    }
+    free(ref);
+
+    return error;
+}
+
+/*
+ * Fill in "irp" to write "length" bytes at "offset" in block "blockno",
+ * and put them in "ref".
+ */
+static void
+test_range(image_range_t *irp, unsigned char *ref, uint32_t bsize,
+           uint64_t blockno, uint64_t offset, uint64_t length, uint64_t seed) {
+    unsigned char *bp = &ref[(blockno * bsize) + offset];
+    uint64_t       i;
+
+    for (i = 0; i < length; i++)
+        bp[i] = (unsigned char)((seed * 31) + (i * 7));
+    irp->ir_blockno = blockno;
+    irp->ir_offset  = offset;
+    irp->ir_length  = length;
+    irp->ir_buf     = bp;
+}
+
+/*
+ * Get the format version of the change file "path".
+ */
+static int
+test_cf_version(const char *path, uint16_t *versionp) {
+    unsigned char *cf;
+    size_t         len;
+    cf_header_t    cfh;
+    int            error;
+
+    if ((error = test_slurp(path, &cf, &len)) == 0) {
+        if (len < sizeof(cfh)) {
+            error = EINVAL;
+        } else {
+            memcpy(&cfh, cf, sizeof(cfh));
+            if ((cfh.cf_magic != CF_MAGIC_1) || (cfh.cf_magic2 != CF_MAGIC_2))
+                error = EINVAL;
+            else
+                *versionp = cfh.cf_version;
+        }
+        free(cf);
+    }
+
+    return error;
+}
+
+/*
+ * Parts of blocks written as an NBD client with 512-byte blocks would over
+ * an image with bigger ones: partial blocks over used and unused image
+ * blocks, merged with whole blocks in the change file, and completed by
+ * later parts.  They must read the same after a sync and reopen, compacted
+ * and committed, and a damaged one mustn't be read as good.
+ */
+static int
+test_cf_partial(void) {
+    int            error;
+    uint64_t const nblocks = 64;
+    unsigned char  map[64];
+    unsigned char *ref = (unsigned char *)malloc(nblocks * TEST_BLOCKSIZE);
+    unsigned char  buf[TEST_BLOCKSIZE];
+    image_range_t  ranges[4];
+    void *         h;
+    uint64_t       b;
+    uint16_t       version = 0;
+    char           args[512];
+
+    if (!ref)
+        return ENOMEM;
+    for (b = 0; b < nblocks; b++)
+        map[b] = (b % 5) != 0;
+    if (((error = test_image(test_path("part.img"), 2, TEST_BLOCKSIZE,
+                             nblocks, map, 8, ref)) == 0) &&
+        ((error = test_open(test_path("part.img"), test_path("part.cf"),
+                            &h)) == 0)) {
+        /*
+         * One request from byte 1024 of block 10 to byte 1024 of block 13.
+         */
+        test_range(&ranges[0], ref, TEST_BLOCKSIZE, 10, 1024,
+                   TEST_BLOCKSIZE - 1024, 1);
+        test_range(&ranges[1], ref, TEST_BLOCKSIZE, 11, 0, 2 * TEST_BLOCKSIZE,
+                   2);
+        test_range(&ranges[2], ref, TEST_BLOCKSIZE, 13, 0, 1024, 3);
+        if (((error = image_writeranges(h, ranges, 3)) == 0) &&
+            /*
+             * Parts of a used and an unused block.
+             */
+            ((test_range(&ranges[0], ref, TEST_BLOCKSIZE, 20, 512, 512, 4),
+              test_range(&ranges[1], ref, TEST_BLOCKSIZE, 25, 0, 512, 5),
+              (error = image_writeranges(h, ranges, 2))) == 0) &&
+            /*
+             * A block made whole by its parts, and a whole block in the
+             * change file written in part.
+             */
+            ((test_range(&ranges[0], ref, TEST_BLOCKSIZE, 30, 0, 2048, 6),
+              test_range(&ranges[1], ref, TEST_BLOCKSIZE, 30, 2048, 2048, 7),
+              test_range(&ranges[2], ref, TEST_BLOCKSIZE, 11, 512, 1024, 8),
+              (error = image_writeranges(h, ranges, 3))) == 0) &&
+            /*
+             * A partial block written again in the log, and bytes which
+             * aren't whole sub-blocks.
+             */
+            ((test_range(&ranges[0], ref, TEST_BLOCKSIZE, 40, 0, 512, 9),
+              test_range(&ranges[1], ref, TEST_BLOCKSIZE, 40, 3584, 512, 10),
+              test_range(&ranges[2], ref, TEST_BLOCKSIZE, 40, 1024, 512, 11),
+              test_range(&ranges[3], ref, TEST_BLOCKSIZE, 45, 100, 10, 12),
+              (error = image_writeranges(h, ranges, 4))) == 0) &&
+            ((error = test_compare(h, ref, nblocks)) == 0))
+            error = image_sync(h);
+        image_close(h);
+    }
+    if (!error &&
+        ((error = test_cf_version(test_path("part.cf"), &version)) == 0) &&
+        (version != CF_VERSION_3)) {
+        printf("  change file version %u\n", version);
+        error = EINVAL;
+    }
+    if (!error &&
+        ((error = test_open(test_path("part.img"), test_path("part.cf"),
+                            &h)) == 0)) {
+        /*
+         * Partial blocks out of the log and in the file are merged too.
+         */
+        if (((error = test_compare(h, ref, nblocks)) == 0) &&
+            ((test_range(&ranges[0], ref, TEST_BLOCKSIZE, 20, 2048, 512, 13),
+              (error = image_writeranges(h, ranges, 1))) == 0) &&
+            ((error = test_compare(h, ref, nblocks)) == 0))
+            error = image_sync(h);
+        image_close(h);
+    }
+    if (!error) {
+        snprintf(args, sizeof(args), "%s %s", test_path("part.cf"),
+                 test_path("partc.cf"));
+        if (((error = test_tool("cfcompact", args)) == 0) &&
+            ((error = test_open(test_path("part.img"), test_path("partc.cf"),
+                                &h)) == 0)) {
+            error = test_compare(h, ref, nblocks);
+            image_close(h);
+        }
+    }
+    if (!error) {
+        snprintf(args, sizeof(args), "-c %s %s %s", test_path("part.cf"),
+                 test_path("part.img"), test_path("partm.img"));
+        if (((error = test_tool("imagecommit", args)) == 0) &&
+            ((error = test_open(test_path("partm.img"), (char *)NULL, &h)) ==
+             0)) {
+            error = test_compare(h, ref, nblocks);
+            image_close(h);
+        }
+    }
+    if (!error) {
+        unsigned char *    cf;
+        size_t             len;
+        uint64_t const     msize = cf_mask_size(TEST_BLOCKSIZE);
+        cf_block_trailer_t btrail;
+        uint64_t           entry, slot = 0;
+
+        /*
+         * Damage the data of partial block 25, found through its block map
+         * entry.
+         */
+        if ((error = test_slurp(test_path("part.cf"), &cf, &len)) == 0) {
+            memcpy(&entry, &cf[sizeof(cf_header_t) + (25 * sizeof(entry))],
+                   sizeof(entry));
+            slot = CF_ENTRY_OFFSET(entry);
+            if ((entry & CF_MAP_PARTIAL) &&
+                ((slot + TEST_BLOCKSIZE + msize + sizeof(btrail)) <= len))
+                memcpy(&btrail, &cf[slot + TEST_BLOCKSIZE + msize],
+                       sizeof(btrail));
+            else
+                memset(&btrail, 0, sizeof(btrail));
+            if ((btrail.cfb_curblock != 25) ||
+                (btrail.cfb_magic != CF_MAGIC_4)) {
+                printf("  block 25 isn't a partial block\n");
+                error = EINVAL;
+            } else {
+                cf[slot]++;
+                error = test_spew(test_path("part.cf"), cf, len);
+            }
+            free(cf);
+        }
+        if (!error &&
+            ((error = test_open(test_path("part.img"), test_path("part.cf"),
+                                &h)) == 0)) {
+            if (!image_readblocks_at(h, 25, buf, 1)) {
+                printf("  damaged partial block read\n");
+                error = EIO;
+            } else {
+                error = test_compare_range(h, ref, 26, nblocks);
+            }
+            image_close(h);
+        }
+    }
+    free(ref);
+
+    return error;
+}
+
+/*
+ * A version 2 change file, with zeroed blocks, becomes version 3 when a
+ * part of a block is written to it.
+ */
+static int
+test_cf_upgrade(void) {
+    int            error;
+    uint64_t const nblocks = 64;
+    unsigned char  map[64];
+    unsigned char *ref = (unsigned char *)malloc(nblocks * TEST_BLOCKSIZE);
+    image_range_t  range;
+    void *         h;
+    uint64_t       b;
+    uint16_t       version = 0;
+
+    if (!ref)
+        return ENOMEM;
+    for (b = 0; b < nblocks; b++)
+        map[b] = 1;
+    if (((error = test_image(test_path("up.img"), 2, TEST_BLOCKSIZE,
+                             nblocks, map, 8, ref)) == 0) &&
+        ((error = test_open(test_path("up.img"), test_path("up.cf"), &h)) ==
+         0)) {
+        if (((error = test_write(h, ref, 5, 4, 21)) == 0) &&
+            ((error = image_zeroblocks(h, 30, 2)) == 0)) {
+            memset(&ref[30 * TEST_BLOCKSIZE], 0, 2 * TEST_BLOCKSIZE);
+            error = image_sync(h);
+        }
+        image_close(h);
+    }
+    if (!error &&
+        ((error = test_cf_version(test_path("up.cf"), &version)) == 0) &&
+        (version != CF_VERSION_2)) {
+        printf("  change file version %u before\n", version);
+        error = EINVAL;
+    }
+    if (!error &&
+        ((error = test_open(test_path("up.img"), test_path("up.cf"), &h)) ==
+         0)) {
+        if (((error = test_compare(h, ref, nblocks)) == 0) &&
+            ((test_range(&range, ref, TEST_BLOCKSIZE, 40, 1536, 512, 22),
+              (error = image_writeranges(h, &range, 1))) == 0))
+            error = image_sync(h);
+        image_close(h);
+    }
+    if (!error &&
+        ((error = test_cf_version(test_path("up.cf"), &version)) == 0) &&
+        (version != CF_VERSION_3)) {
+        printf("  change file version %u after\n", version);
+        error = EINVAL;
+    }
+    if (!error &&
+        ((error = test_open(test_path("up.img"), test_path("up.cf"), &h)) ==
+         0)) {
+        error = test_compare(h, ref, nblocks);
+        image_close(h);
+    }
+    free(ref);
+
+    return error;
+}
+
+#if defined(TEST_HAVE_ZSTD) || defined(TEST_HAVE_LZ4)
+static void
+test_le32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+#endif /* TEST_HAVE_ZSTD || TEST_HAVE_LZ4 */
+
+#ifdef TEST_HAVE_ZSTD
+/*
+ * Compress the file "from" to "to" in the seekable zstd format, "fsize"
+ * bytes to a frame.
+ */
+static int
+test_zstd(const char *from, const char *to, size_t fsize) {
+    unsigned char *in;
+    unsigned char *out;
+    size_t         len, nframes, f, olen = 0;
+    size_t         bound = ZSTD_compressBound(fsize);
+    int            error;
+
+    if ((error = test_slurp(from, &in, &len)))
+        return error;
+    nframes = (len + fsize - 1) / fsize;
+    if (!(out = (unsigned char *)malloc((bound + 8) * nframes + 17))) {
+        free(in);
+        return ENOMEM;
+    }
+    /*
+     * The frames, then the seek table in a skippable frame.  The table's
+     * entries are gathered after the frames, and moved up once they're
+     * all there.
+     */
+    for (f = 0; !error && (f < nframes); f++) {
+        size_t dsize = ((len - (f * fsize)) < fsize) ? len - (f * fsize)
+                                                     : fsize;
+        size_t csize = ZSTD_compress(out + olen, bound, in + (f * fsize),
+                                     dsize, 3);
+
+        if (ZSTD_isError(csize)) {
+            error = EIO;
+        } else {
+            olen += csize;
+            test_le32(&out[(bound * nframes) + (f * 8)], (uint32_t)csize);
+            test_le32(&out[(bound * nframes) + (f * 8) + 4], (uint32_t)dsize);
+        }
+    }
+    if (!error) {
+        test_le32(&out[olen], 0x184d2a5e);
+        test_le32(&out[olen + 4], (uint32_t)((nframes * 8) + 9));
+        memmove(&out[olen + 8], &out[bound * nframes], nframes * 8);
+        olen += 8 + (nframes * 8);
+        test_le32(&out[olen], (uint32_t)nframes);
+        out[olen + 4] = 0;
+        test_le32(&out[olen + 5], 0x8f92eab1);
+        olen += 9;
+        error = test_spew(to, out, olen);
+    }
+    free(out);
+    free(in);
+
+    return error;
+}
+#endif /* TEST_HAVE_ZSTD */
+
+#ifdef TEST_HAVE_LZ4
+/*
+ * Compress the file "from" to "to" as lz4, with 64K blocks: a frame of
+ * independent blocks with its content size, a skippable frame, a frame of
+ * independent blocks with block checksums and no content size, and a
+ * frame of linked blocks.  Every block but the last of each frame is
+ * full, as the index of a frame of independent blocks assumes.
+ */
+static int
+test_lz4(const char *from, const char *to) {
+    static const struct {
+        LZ4F_blockMode_t mode;
+        int              csize;
+        int              bsum;
+    } frames[3] = {{LZ4F_blockIndependent, 1, 0},
+                   {LZ4F_blockIndependent, 0, 1},
+                   {LZ4F_blockLinked, 1, 0}};
+    unsigned char *      in;
+    unsigned char *      out;
+    size_t               len, olen = 0, cap, off, f;
+    LZ4F_preferences_t   prefs;
+    int                  error;
+
+    if ((error = test_slurp(from, &in, &len)))
+        return error;
+    cap = (2 * len) + 1024;
+    if (!(out = (unsigned char *)malloc(cap))) {
+        free(in);
+        return ENOMEM;
+    }
+    for (f = 0, off = 0; !error && (f < 3); f++) {
+        size_t end = (f == 2) ? len : ((f + 1) * len / 3) + 1234;
+        size_t n;
+
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+        prefs.frameInfo.blockMode   = frames[f].mode;
+        prefs.frameInfo.contentSize = (frames[f].csize) ? end - off : 0;
+        prefs.frameInfo.blockChecksumFlag =
+            (frames[f].bsum) ? LZ4F_blockChecksumEnabled : LZ4F_noBlockChecksum;
+        n = LZ4F_compressFrame(out + olen, cap - olen, in + off, end - off,
+                               &prefs);
+        if (LZ4F_isError(n)) {
+            error = EIO;
+        } else {
+            olen += n;
+            off = end;
+        }
+        if (f == 0) {
+            test_le32(&out[olen], 0x184d2a53);
+            test_le32(&out[olen + 4], 4);
+            memset(&out[olen + 8], 0, 4);
+            olen += 12;
+        }
+    }
+    if (!error)
+        error = test_spew(to, out, olen);
+    free(out);
+    free(in);
+
+    return error;
+}
+
+/*
+ * Write an lz4 frame of independent blocks to "to" where a block before
+ * the last is short.  Its content size shows the index is wrong.
+ */
+static int
+test_lz4_short(const char *to) {
+    size_t const       sizes[3] = {65536, 1000, 500};
+    size_t const       len      = 65536 + 1000 + 500;
+    unsigned char *    in       = (unsigned char *)malloc(len);
+    unsigned char *    out      = (unsigned char *)malloc(2 * len + 1024);
+    size_t             cap      = 2 * len + 1024;
+    size_t             olen, off, i, n;
+    LZ4F_cctx *        cctx;
+    LZ4F_preferences_t prefs;
+    int                error = 0;
+
+    if (!in || !out ||
+        LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION))) {
+        free(in);
+        free(out);
+        return ENOMEM;
+    }
+    for (off = 0; off < len; off += 500)
+        test_fill(in + off, off, (len - off) < 500 ? len - off : 500);
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+    prefs.frameInfo.blockMode   = LZ4F_blockIndependent;
+    prefs.frameInfo.contentSize = len;
+    n = LZ4F_compressBegin(cctx, out, cap, &prefs);
+    error = LZ4F_isError(n) ? EIO : 0;
+    for (i = 0, off = 0, olen = n; !error && (i < 3); off += sizes[i++]) {
+        n = LZ4F_compressUpdate(cctx, out + olen, cap - olen, in + off,
+                                sizes[i], (const LZ4F_compressOptions_t *)NULL);
+        if (!LZ4F_isError(n) && (i == 1)) {
+            olen += n;
+            n = LZ4F_flush(cctx, out + olen, cap - olen,
+                           (const LZ4F_compressOptions_t *)NULL);
+        }
+        if (LZ4F_isError(n))
+            error = EIO;
+        else
+            olen += n;
+    }
+    if (!error) {
+        n = LZ4F_compressEnd(cctx, out + olen, cap - olen,
+                             (const LZ4F_compressOptions_t *)NULL);
+        if (LZ4F_isError(n))
+            error = EIO;
+        else
+            error = test_spew(to, out, olen + n);
+    }
+    (void)LZ4F_freeCompressionContext(cctx);
+    free(out);
+    free(in);
+
+    return error;
+}
+#endif /* TEST_HAVE_LZ4 */
+
+#if defined(TEST_HAVE_ZSTD) || defined(TEST_HAVE_LZ4)
+/*
+ * Compressed copies of an image read the same as the image.  An lz4 frame
+ * which breaks the assumption that only the last of its blocks is short
+ * isn't opened.
+ */
+static int
+test_compressed(void) {
+    int            error;
+    uint64_t const nblocks = 1500;
+    unsigned char  map[1500];
+    unsigned char *ref = (unsigned char *)malloc(nblocks * TEST_BLOCKSIZE);
+    void *         h;
+    uint64_t       b;
+
+    if (!ref)
+        return ENOMEM;
+    for (b = 0; b < nblocks; b++)
+        map[b] = ((b / 40) % 5) != 3;
+    error = test_image(test_path("z.img"), 2, TEST_BLOCKSIZE, nblocks, map,
+                       16, ref);
+#    ifdef TEST_HAVE_ZSTD
+    if (!error &&
+        ((error = test_zstd(test_path("z.img"), test_path("z.img.zst"),
+                            32768)) == 0) &&
+        ((error = test_open(test_path("z.img.zst"), (char *)NULL, &h)) ==
+         0)) {
+        error = test_compare(h, ref, nblocks);
+        image_close(h);
+    }
+#    endif /* TEST_HAVE_ZSTD */
+#    ifdef TEST_HAVE_LZ4
+    if (!error &&
+        ((error = test_lz4(test_path("z.img"), test_path("z.img.lz4"))) ==
+         0) &&
+        ((error = test_open(test_path("z.img.lz4"), (char *)NULL, &h)) ==
+         0)) {
+        error = test_compare(h, ref, nblocks);
+        image_close(h);
+    }
+    if (!error && ((error = test_lz4_short(test_path("short.lz4"))) == 0)) {
+        const sysdep_dispatch_t *zsysdep;
+        void *                   fh;
+
+        /*
+         * Images are read through the split interface, and the compressed
+         * stream interface only goes over the one.
+         */
+        if (((error = sysdep_split_init(&posix_dispatch, &zsysdep)) == 0) &&
+            ((error = sysdep_zstream_init(zsysdep, &zsysdep)) == 0) &&
+            ((*zsysdep->sys_open)(&fh, test_path("short.lz4"),
+                                  SYSDEP_OPEN_RO) == 0)) {
+            (void)(*zsysdep->sys_close)(fh);
+            printf("  short lz4 block not found\n");
+            error = EINVAL;
+        }
+    }
+#    endif /* TEST_HAVE_LZ4 */
+    free(ref);
+
+    return error;
+}
+
+#    ifdef TEST_HAVE_ZSTD
+/*
+ * Decoding threads started before a fork() aren't in the child, and a frame
+ * one was decoding when the child was made mustn't be waited for there.
+ * fork() after a widening delay, to catch the thread part way through.
+ */
+static int
+test_zstream_fork(void) {
+    uint64_t const           nblocks = 1500;
+    size_t const             fsize   = 256 * TEST_BLOCKSIZE;
+    unsigned char            map[1500];
+    unsigned char *          ref = (unsigned char *)malloc(nblocks * TEST_BLOCKSIZE);
+    unsigned char *          raw = (unsigned char *)NULL;
+    unsigned char *          buf = (unsigned char *)malloc(fsize);
+    size_t                   len;
+    const sysdep_dispatch_t *zsysdep;
+    uint64_t                 b, nr;
+    int                      t, error;
+
+    if (!ref || !buf) {
+        free(ref);
+        free(buf);
+        return ENOMEM;
+    }
+    for (b = 0; b < nblocks; b++)
+        map[b] = 1;
+    if (((error = test_image(test_path("f.img"), 2, TEST_BLOCKSIZE, nblocks,
+                             map, 1, ref)) == 0) &&
+        ((error = test_slurp(test_path("f.img"), &raw, &len)) == 0) &&
+        ((error = test_zstd(test_path("f.img"), test_path("f.img.zst"),
+                            fsize)) == 0) &&
+        ((error = sysdep_split_init(&posix_dispatch, &zsysdep)) == 0) &&
+        ((error = sysdep_zstream_init(zsysdep, &zsysdep)) == 0)) {
+        for (t = 0; !error && (t < 50); t++) {
+            void *fh;
+            pid_t child;
+            int   status;
+
+            if ((error = (*zsysdep->sys_open)(&fh, test_path("f.img.zst"),
+                                              SYSDEP_OPEN_RO)))
+                break;
+            /*
+             * Reading the first frame queues the second.
+             */
+            if (!(error = (*zsysdep->sys_pread)(fh, buf, TEST_BLOCKSIZE, 0,
+                                                &nr)) &&
+                ((nr != TEST_BLOCKSIZE) || memcmp(buf, raw, TEST_BLOCKSIZE)))
+                error = EIO;
+            if (!error) {
+                usleep(t * 50);
+                fflush(stdout);
+                if ((child = fork()) < 0) {
+                    error = errno;
+                } else if (child == 0) {
+                    alarm(10);
+                    if (!(error = (*zsysdep->sys_pread)(fh, buf, fsize, fsize,
+                                                        &nr)) &&
+                        ((nr != fsize) || memcmp(buf, raw + fsize, fsize)))
+                        error = EIO;
+                    _exit((error) ? 1 : 0);
+                } else if (waitpid(child, &status, 0) < 0) {
+                    error = errno;
+                } else if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+                    printf("  child %s\n",
+                           WIFSIGNALED(status) ? "timed out" : "failed");
+                    error = EIO;
+                }
+            }
+            (void)(*zsysdep->sys_close)(fh);
+        }
+    }
+    free(raw);
+    free(buf);
+    free(ref);
+
+    return error;
+}
+#    endif /* TEST_HAVE_ZSTD */
+#endif /* TEST_HAVE_ZSTD || TEST_HAVE_LZ4 */
+
+typedef struct test_case {
+    const char *tc_name;
+    int (*tc_run)(void);
+} test_case_t;
+
+static const test_case_t test_cases[] = {
+    {"v1 byte map", test_v1_bytemap},
+    {"v2 read", test_v2_read},
+    {"sparse change file", test_cf_sparse},
+    {"cfcompact and imagecommit", test_tools},
+    {"partial block writes", test_cf_partial},
+    {"change file upgrade", test_cf_upgrade},
+    {"long runs of writes", test_cf_long},
+#if defined(TEST_HAVE_ZSTD) || defined(TEST_HAVE_LZ4)
+    {"compressed images", test_compressed},
+#    ifdef TEST_HAVE_ZSTD
+    {"compressed image after fork", test_zstream_fork},
+#    endif /* TEST_HAVE_ZSTD */
+#endif /* TEST_HAVE_ZSTD || TEST_HAVE_LZ4 */
+};
+
+/*
+ * Run each test, and remove the scratch directory if they all pass.
+ */
+static int
+test_run(void) {
+    size_t t;
+    int    nfailed = 0;
+
+    if (!mkdtemp(test_dir)) {
+        perror(test_dir);
+        return 1;
+    }
+    for (t = 0; t < (sizeof(test_cases) / sizeof(test_cases[0])); t++) {
+        int error = (*test_cases[t].tc_run)();
+
+        if (error) {
+            printf("%s: FAILED (%s)\n", test_cases[t].tc_name,
+                   strerror(error));
+            nfailed++;
+        } else {
+            printf("%s: OK\n", test_cases[t].tc_name);
+        }
+    }
+    if (!nfailed) {
+        char cmd[sizeof(test_dir) + 16];
+
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", test_dir);
+        if (system(cmd))
+            printf("%s: not removed\n", test_dir);
+    } else {
+        printf("%s: left for inspection\n", test_dir);
+    }
+
+    return (nfailed) ? 1 : 0;
+}
 
 int
 main(int argc, char *argv[]) {
     int i;
 
+    if (argc == 1) {
+        char *slash = strrchr(argv[0], '/');
+
+        test_bindir = ".";
+        if (slash) {
+            *slash      = '\0';
+            test_bindir = argv[0];
+        }
+        return test_run();
+    }
     for (i = 1; i < argc; i++) {
         int   error;
         void *pctx;
@@ -16,6 +16,8 @@
 #include "changefile.h"
 #include "libimage.h"
 #include "librawimage.h"
+#include "libstats.h"
+#include "sysdep_arena.h"
 #include <errno.h>
 #include <string.h>
 
@@ -35,6 +37,11 @@ struct change_file_context;
 #define RAW_TOLERANT     0x40000 /* Open in tolerant mode */
 #define RAW_READ_ONLY    0x80000 /* Open read only */
 
+/*
+ * Most reads submitted at once by rawimage_readrun().
+ */
+#define RAW_BATCH 32
+
 /*
  * Handle to access rawimage images.  Used internally.
  */
@@ -49,6 +56,7 @@ typedef struct libraw_context {
     uint64_t                 raw_curblock;    /* Current position */
     uint32_t                 raw_flags;       /* Handle flags */
     sysdep_open_mode_t       raw_omode;       /* Open mode */
+    sysdep_arena_t *         raw_arena;       /* Memory for its lifetime */
 } raw_context_t;
 
 /*
@@ -98,17 +106,14 @@ rawimage_close(void *rp) {
         if (RAWCTX_OPEN(rcp)) {
             (void)(*rcp->raw_sysdep->sys_close)(rcp->raw_fd);
         }
-        if (RAWCTX_HAVE_PATH(rcp)) {
-            (void)(*rcp->raw_sysdep->sys_free)(rcp->raw_path);
-        }
-        if (RAWCTX_HAVE_CF_PATH(rcp)) {
-            (void)(*rcp->raw_sysdep->sys_free)(rcp->raw_cf_path);
-        }
         if (RAWCTX_CF_OPEN(rcp)) {
             (void)cf_sync(rcp->raw_cf_handle);
             (void)cf_finish(rcp->raw_cf_handle);
         }
-        (void)(*rcp->raw_sysdep->sys_free)(rcp);
+        /*
+         * The handle and its paths go with the arena.
+         */
+        sysdep_arena_destroy(rcp->raw_arena);
         error = 0;
     }
 
@@ -123,14 +128,19 @@ rawimage_open(const char *path, const char *cfpath, sysdep_open_mode_t omode,
               const sysdep_dispatch_t *sysdep, void **rpp) {
     int error = EINVAL;
     if (sysdep) {
-        raw_context_t *rcp;
-        error = (*sysdep->sys_malloc)(&rcp, sizeof(*rcp));
+        sysdep_arena_t *arena;
+        raw_context_t * rcp = (raw_context_t *)NULL;
+
+        if ((error = sysdep_arena_create(sysdep, &arena)) == 0 &&
+            (error = sysdep_arena_alloc(arena, &rcp, sizeof(*rcp))) != 0)
+            sysdep_arena_destroy(arena);
 
         if (rcp) {
             memset(rcp, 0, sizeof(*rcp));
             rcp->raw_blocksize = RAW_BLOCKSIZE;
             rcp->raw_flags |= RAW_VALID;
             rcp->raw_sysdep = sysdep;
+            rcp->raw_arena  = arena;
 
             if ((error = (*rcp->raw_sysdep->sys_open)(&rcp->raw_fd, path,
                                                       SYSDEP_OPEN_RO)) == 0) {
@@ -142,12 +152,14 @@ rawimage_open(const char *path, const char *cfpath, sysdep_open_mode_t omode,
                     }
                     rcp->raw_totalblocks = filesize / rcp->raw_blocksize;
                     rcp->raw_flags |= RAW_OPEN;
-                    if ((error = (*rcp->raw_sysdep->sys_malloc)(
-                             &rcp->raw_path, strlen(path) + 1)) == 0) {
+                    if ((error = sysdep_arena_alloc(rcp->raw_arena,
+                                                    &rcp->raw_path,
+                                                    strlen(path) + 1)) == 0) {
                         rcp->raw_flags |= RAW_HAVE_PATH;
                         rcp->raw_omode = omode;
-                        if (cfpath && ((error = (*rcp->raw_sysdep->sys_malloc)(
-                                            &rcp->raw_cf_path,
+                        memcpy(rcp->raw_path, path, strlen(path) + 1);
+                        if (cfpath && ((error = sysdep_arena_alloc(
+                                            rcp->raw_arena, &rcp->raw_cf_path,
                                             strlen(cfpath) + 1)) == 0)) {
                             rcp->raw_flags |= RAW_HAVE_CF_PATH;
                             memcpy(rcp->raw_cf_path, cfpath,
@@ -182,6 +194,22 @@ rawimage_tolerant_mode(void *rp) {
     }
 }
 
+/*
+ * Check checksums on read (raw images have none).
+ */
+int
+rawimage_verify_reads(void *rp) {
+    return ENOTSUP;
+}
+
+/*
+ * Load lazily (raw images have no bitmap to load).
+ */
+int
+rawimage_lazy_load(void *rp, int strict) {
+    return ENOTSUP;
+}
+
 /*
  * Verify the image.
  */
@@ -196,11 +224,11 @@ rawimage_verify(void *rp) {
             if ((error = cf_init(rcp->raw_cf_path, rcp->raw_sysdep,
                                  rcp->raw_blocksize, rcp->raw_totalblocks,
                                  &rcp->raw_cf_handle)) == 0) {
-                rcp->raw_flags |= RAW_CF_OPEN;
+                rcp->raw_flags |= (RAW_CF_OPEN | RAW_HAVE_CFDEP);
                 if ((error = cf_verify(rcp->raw_cf_handle)) == 0) {
                     rcp->raw_flags |= RAW_CF_VERIFIED;
                 }
-            } else {
+            } else if (error == ENOENT) {
                 /*
                  * We'll create this later.
                  */
@@ -262,6 +290,92 @@ rawimage_tell(void *rp) {
     return (RAWCTX_READREADY(rcp)) ? rcp->raw_curblock : ~0;
 }
 
+/*
+ * Read a range of blocks.
+ *
+ * Runs of blocks which are not in the change file are read with one read
+ * per run.  The reads of runs and of change file blocks are gathered up and
+ * submitted as one batch.  No per-handle state is changed, so readers may
+ * share the handle.
+ */
+static int
+rawimage_readrun(raw_context_t *rcp, uint64_t blockno, void *buffer,
+                 uint64_t nblocks) {
+    int            error  = 0;
+    unsigned char *cbp    = (unsigned char *)buffer;
+    uint64_t       bindex = 0;
+    sysdep_io_t    iov[RAW_BATCH];
+    unsigned char  trailers[RAW_BATCH / 2][CF_TRAILER_SIZE];
+    uint64_t       cfblocks[RAW_BATCH / 2];
+    unsigned char *cfbufs[RAW_BATCH / 2];
+
+    while (!error && (bindex < nblocks)) {
+        uint32_t nio = 0;
+        uint32_t ncf = 0;
+        uint32_t cidx;
+
+        /*
+         * Gather reads until we're done or the batch is full.  A change
+         * file block takes two: the block and its trailer.
+         */
+        while (!error && (bindex < nblocks) && ((nio + 2) <= RAW_BATCH)) {
+            uint64_t curblock = blockno + bindex;
+            uint64_t nrun     = 1;
+            int      cferror  = ENXIO;
+
+            if (rcp->raw_cf_handle &&
+                cf_blockused_at(rcp->raw_cf_handle, curblock))
+                cferror = cf_readblock_io(rcp->raw_cf_handle, curblock, cbp,
+                                          trailers[ncf], &iov[nio]);
+            if (cferror == ENODATA) {
+                /*
+                 * Zeroed, or not written out yet: nothing to batch.  Partial
+                 * blocks are read from the image, as below.
+                 */
+                error = cf_readblock_at(rcp->raw_cf_handle, curblock, cbp);
+            } else if (!cferror) {
+                cfblocks[ncf] = curblock;
+                cfbufs[ncf]   = cbp;
+                ncf++;
+                nio += 2;
+            } else {
+                /*
+                 * Find the extent of the run not in the change file.
+                 */
+                while (((bindex + nrun) < nblocks) &&
+                       !(rcp->raw_cf_handle &&
+                         cf_blockused_at(rcp->raw_cf_handle, curblock + nrun)))
+                    nrun++;
+                iov[nio].io_rh     = rcp->raw_fd;
+                iov[nio].io_buf    = cbp;
+                iov[nio].io_len    = nrun * rcp->raw_blocksize;
+                iov[nio].io_offset = rblock2offset(rcp, curblock);
+                nio++;
+            }
+            cbp += nrun * rcp->raw_blocksize;
+            bindex += nrun;
+        }
+        if (!error) {
+            uint64_t start = stats_start();
+
+            error = (*rcp->raw_sysdep->sys_pread_batch)(iov, nio);
+            stats_end(STATS_RAW_READRUN, start, nio, error);
+        }
+        if (!error) {
+            for (cidx = 0; !error && (cidx < ncf); cidx++)
+                error = cf_readblock_check(rcp->raw_cf_handle, cfblocks[cidx],
+                                           cfbufs[cidx], trailers[cidx]);
+        }
+    }
+    /*
+     * Partial blocks in the change file go over what was read for them.
+     */
+    if (!error && rcp->raw_cf_handle)
+        error = cf_overlay(rcp->raw_cf_handle, blockno, buffer, nblocks);
+
+    return error;
+}
+
 /*
  * Read blocks from the current position.
  */
@@ -270,41 +384,33 @@ rawimage_readblocks(void *rp, void *buffer, uint64_t nblocks) {
     int            error = EINVAL;
     raw_context_t *rcp   = (raw_context_t *)rp;
     if (RAWCTX_READREADY(rcp)) {
-        uint64_t nread;
-        if (rcp->raw_cf_handle) {
-            uint64_t bindex;
-            void *   cbp = buffer;
-
-            for (bindex = 0; bindex < nblocks; bindex++) {
-                cf_seek(rcp->raw_cf_handle, rcp->raw_curblock);
-                if ((error = cf_readblock(rcp->raw_cf_handle, cbp))) {
-                    if ((error == ENXIO) &&
-                        (error = (*rcp->raw_sysdep->sys_seek)(
-                             rcp->raw_fd, rblock2offset(rcp, rcp->raw_curblock),
-                             SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) {
-                        error = (*rcp->raw_sysdep->sys_read)(
-                            rcp->raw_fd, cbp, rcp->raw_blocksize, &nread);
-                    }
-                    if (error) {
-                        break;
-                    }
-                }
-                rcp->raw_curblock++;
-                cbp += rcp->raw_blocksize;
-            }
-        } else {
-            if ((error = (*rcp->raw_sysdep->sys_seek)(
-                     rcp->raw_fd, rblock2offset(rcp, rcp->raw_curblock),
-                     SYSDEP_SEEK_ABSOLUTE, (uint64_t *)NULL)) == 0) {
-                error = (*rcp->raw_sysdep->sys_read)(
-                    rcp->raw_fd, buffer, nblocks * rcp->raw_blocksize, &nread);
-            }
+        if (!(error = rawimage_readrun(rcp, rcp->raw_curblock, buffer,
+                                       nblocks))) {
+            rcp->raw_curblock += nblocks;
         }
     }
 
     return error;
 }
 
+/*
+ * Read blocks starting at a particular block.  The current position is
+ * not changed.
+ */
+int
+rawimage_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                       uint64_t nblocks) {
+    int            error = EINVAL;
+    raw_context_t *rcp   = (raw_context_t *)rp;
+
+    if (RAWCTX_READREADY(rcp) && (blockno <= rcp->raw_totalblocks) &&
+        (nblocks <= (rcp->raw_totalblocks - blockno))) {
+        error = rawimage_readrun(rcp, blockno, buffer, nblocks);
+    }
+
+    return error;
+}
+
 /*
  * Determine if the current block is used.
  */
@@ -317,60 +423,136 @@ rawimage_block_used(void *rp) {
 }
 
 /*
- * Write blocks to the current position.
+ * Every block of a raw image is used.
  */
 int
-rawimage_writeblocks(void *rp, void *buffer, uint64_t nblocks) {
+rawimage_block_extent(void *rp, uint64_t blockno, uint64_t maxblocks,
+                      uint64_t *nblocksp) {
+    raw_context_t *rcp = (raw_context_t *)rp;
+
+    if (RAWCTX_READREADY(rcp) && (blockno < rcp->raw_totalblocks) &&
+        maxblocks && nblocksp) {
+        *nblocksp = rcp->raw_totalblocks - blockno;
+        if (*nblocksp > maxblocks)
+            *nblocksp = maxblocks;
+        return 1;
+    }
+    return BLOCK_ERROR;
+}
+
+/*
+ * Map a range of blocks.  A raw image is its own map: the blocks are one
+ * contiguous range in the image file, unless some are in the change file.
+ */
+int
+rawimage_block_map(void *rp, uint64_t blockno, uint64_t nblocks,
+                   image_segment_t *segs, uint32_t *nsegsp) {
     int            error = EINVAL;
     raw_context_t *rcp   = (raw_context_t *)rp;
 
-    if (RAWCTX_WRITEABLE(rcp)) {
-        /*
-         * Make sure we're initialized.
-         */
-        if (!RAWCTX_WRITEREADY(rcp)) {
-            if (!RAWCTX_HAVE_CF_PATH(rcp)) {
-                /*
-                 * We have to make up a name.
-                 */
-                if ((error = (*rcp->raw_sysdep->sys_malloc)(
-                         &rcp->raw_cf_path, strlen(rcp->raw_path) +
-                                                strlen(cf_trailer) + 1)) == 0) {
-                    memcpy(rcp->raw_cf_path, rcp->raw_path,
-                           strlen(rcp->raw_path));
-                    memcpy(&rcp->raw_cf_path[strlen(rcp->raw_path)], cf_trailer,
-                           strlen(cf_trailer) + 1);
-                    rcp->raw_flags |= RAW_HAVE_CF_PATH;
-                }
-            }
-            error =
-                cf_create(rcp->raw_cf_path, rcp->raw_sysdep, rcp->raw_blocksize,
-                          rcp->raw_totalblocks, &rcp->raw_cf_handle);
-            if (!error) {
-                rcp->raw_flags |=
-                    (RAW_HAVE_CFDEP | RAW_CF_VERIFIED | RAW_CF_OPEN);
-            }
+    if (RAWCTX_READREADY(rcp) && nsegsp &&
+        (blockno + nblocks <= rcp->raw_totalblocks)) {
+        uint32_t maxsegs = *nsegsp;
+        int      fd      = (*rcp->raw_sysdep->sys_fileno)(rcp->raw_fd);
+
+        *nsegsp = 0;
+        if ((fd < 0) ||
+            (rcp->raw_cf_handle &&
+             (cf_run(rcp->raw_cf_handle, blockno, nblocks, 0) < nblocks))) {
+            error = ENOTSUP;
         } else {
-            error = 0;
+            error = image_segment_add(segs, nsegsp, maxsegs, IMAGE_SEG_FILE, fd,
+                                      rblock2offset(rcp, blockno),
+                                      nblocks * rcp->raw_blocksize);
         }
-        if (!error) {
-            void *   cbp = buffer;
-            uint64_t bindex;
+    }
 
-            for (bindex = 0; bindex < nblocks; bindex++) {
-                cf_seek(rcp->raw_cf_handle, rcp->raw_curblock);
-                if ((error = cf_writeblock(rcp->raw_cf_handle, cbp))) {
-                    break;
-                }
-                rcp->raw_curblock++;
-                cbp += rcp->raw_blocksize;
+    return error;
+}
+
+/*
+ * Make sure the change file is ready for changes, creating it if need be.
+ */
+static int
+rawimage_cf_ready(raw_context_t *rcp) {
+    int error = 0;
+
+    if (!RAWCTX_WRITEREADY(rcp)) {
+        if (!RAWCTX_HAVE_CF_PATH(rcp)) {
+            /*
+             * We have to make up a name.
+             */
+            if ((error = sysdep_arena_alloc(
+                     rcp->raw_arena, &rcp->raw_cf_path,
+                     strlen(rcp->raw_path) + strlen(cf_trailer) + 1)) == 0) {
+                memcpy(rcp->raw_cf_path, rcp->raw_path, strlen(rcp->raw_path));
+                memcpy(&rcp->raw_cf_path[strlen(rcp->raw_path)], cf_trailer,
+                       strlen(cf_trailer) + 1);
+                rcp->raw_flags |= RAW_HAVE_CF_PATH;
             }
         }
+        error = cf_create(rcp->raw_cf_path, rcp->raw_sysdep, rcp->raw_blocksize,
+                          rcp->raw_totalblocks, &rcp->raw_cf_handle);
+        if (!error) {
+            rcp->raw_flags |= (RAW_HAVE_CFDEP | RAW_CF_VERIFIED | RAW_CF_OPEN);
+        }
     }
 
     return error;
 }
 
+/*
+ * Write blocks to the current position.
+ */
+int
+rawimage_writeblocks(void *rp, void *buffer, uint64_t nblocks) {
+    int            error = EINVAL;
+    raw_context_t *rcp   = (raw_context_t *)rp;
+
+    if (RAWCTX_WRITEABLE(rcp) && !(error = rawimage_cf_ready(rcp)) &&
+        !(error = cf_writeblocks(rcp->raw_cf_handle, rcp->raw_curblock, buffer,
+                                 nblocks)))
+        rcp->raw_curblock += nblocks;
+
+    return error;
+}
+
+/*
+ * Write "length" bytes at "offset" in block "blockno".  ENOTSUP means the
+ * whole block has to be written instead.  This does not change the current
+ * position.
+ */
+int
+rawimage_writepartial(void *rp, uint64_t blockno, uint64_t offset,
+                      uint64_t length, const void *buffer) {
+    int            error = EINVAL;
+    raw_context_t *rcp   = (raw_context_t *)rp;
+
+    if (RAWCTX_WRITEABLE(rcp) && (blockno < rcp->raw_totalblocks) &&
+        !(error = rawimage_cf_ready(rcp)))
+        error = cf_writepartial(rcp->raw_cf_handle, blockno, offset, length,
+                                buffer);
+
+    return error;
+}
+
+/*
+ * Make blocks read as zeroes.  They're recorded in the change file, so
+ * that nothing is written for them.
+ */
+int
+rawimage_zeroblocks(void *rp, uint64_t blockno, uint64_t nblocks) {
+    int            error = EINVAL;
+    raw_context_t *rcp   = (raw_context_t *)rp;
+
+    if (RAWCTX_WRITEABLE(rcp) && (blockno <= rcp->raw_totalblocks) &&
+        (nblocks <= (rcp->raw_totalblocks - blockno)) &&
+        !(error = rawimage_cf_ready(rcp)))
+        error = cf_zeroblocks(rcp->raw_cf_handle, blockno, nblocks);
+
+    return error;
+}
+
 /*
  * Commit changes to image.
  */
@@ -401,8 +583,10 @@ rawimage_probe(const char *path, const sysdep_dispatch_t *sysdep) {
  * The image type dispatch table.
  */
 const image_dispatch_t raw_image_type = {
-    "raw image",          rawimage_probe,         rawimage_open,
-    rawimage_close,       rawimage_tolerant_mode, rawimage_verify,
-    rawimage_blocksize,   rawimage_blockcount,    rawimage_seek,
-    rawimage_tell,        rawimage_readblocks,    rawimage_block_used,
-    rawimage_writeblocks, rawimage_sync};
+    "raw image",            rawimage_probe,         rawimage_open,
+    rawimage_close,         rawimage_tolerant_mode, rawimage_verify_reads,
+    rawimage_lazy_load,     rawimage_verify,        rawimage_blocksize,
+    rawimage_blockcount,    rawimage_seek,          rawimage_tell,
+    rawimage_readblocks,    rawimage_readblocks_at, rawimage_block_used,
+    rawimage_block_extent,  rawimage_block_map,     rawimage_writeblocks,
+    rawimage_zeroblocks,    rawimage_sync,          rawimage_writepartial};
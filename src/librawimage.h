@@ -14,6 +14,7 @@
 #ifndef _LIBRAWIMAGE_H_
 #define _LIBRAWIMAGE_H_ 1
 
+#include "libimage.h"
 #include "sysdep_int.h"
 #include <sys/types.h>
 
@@ -21,14 +22,25 @@ int      rawimage_open(const char *path, const char *cfpath,
                        sysdep_open_mode_t omode, const sysdep_dispatch_t *sysdep,
                        void **rpp);
 int      rawimage_close(void *rp);
+int      rawimage_verify_reads(void *rp);
+int      rawimage_lazy_load(void *rp, int strict);
 int      rawimage_verify(void *rp);
 int64_t  rawimage_blocksize(void *rp);
 int64_t  rawimage_blockcount(void *rp);
 int      rawimage_seek(void *rp, uint64_t blockno);
 uint64_t rawimage_tell(void *rp);
 int      rawimage_readblocks(void *rp, void *buffer, uint64_t nblocks);
+int      rawimage_readblocks_at(void *rp, uint64_t blockno, void *buffer,
+                                uint64_t nblocks);
 int      rawimage_block_used(void *rp);
+int      rawimage_block_extent(void *rp, uint64_t blockno, uint64_t maxblocks,
+                               uint64_t *nblocksp);
+int      rawimage_block_map(void *rp, uint64_t blockno, uint64_t nblocks,
+                            image_segment_t *segs, uint32_t *nsegsp);
 int      rawimage_writeblocks(void *rp, void *buffer, uint64_t nblocks);
+int      rawimage_zeroblocks(void *rp, uint64_t blockno, uint64_t nblocks);
+int      rawimage_writepartial(void *rp, uint64_t blockno, uint64_t offset,
+                               uint64_t length, const void *buffer);
 int      rawimage_sync(void *rp);
 
 #endif /* _LIBRAWIMAGE_H_ */
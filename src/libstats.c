@@ -0,0 +1,226 @@
+/*
+ * libstats.c - Operation counters and latency histograms.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "libstats.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Each thread counts in a slot of its own, a whole number of cache lines
+ * so that threads never share a line, and updates it without atomic
+ * read-modify-writes.  Threads past the last slot all share slot 0 and
+ * update it atomically.  A thread's counts stay in its slot after it
+ * exits.  Readers sum the slots.
+ */
+#define STATS_MAX_SLOTS 64
+#define STATS_LINE      64
+
+typedef struct stats_slot {
+    stats_counter_t ss_counters[STATS_NIDS];
+} __attribute__((aligned(STATS_LINE))) stats_slot_t;
+
+static stats_slot_t     stats_slots[STATS_MAX_SLOTS];
+static uint32_t         stats_nslots = 1;
+static __thread int32_t stats_myslot = -1;
+
+int stats_enabled = 0;
+
+/*
+ * What each operation is called, and what its amount counts.
+ */
+static const struct stats_name {
+    const char *sn_name;
+    const char *sn_unit;
+} stats_names[STATS_NIDS] = {
+    {"image_read", "blocks"},   {"image_seek", "blocks"},
+    {"image_write", "blocks"},  {"image_zero", "blocks"},
+    {"image_map", "blocks"},    {"image_sync", "syncs"},
+    {"pc_readrun", "blocks"},   {"pc_check", "groups"},
+    {"nc_walk", "clusters"},    {"nc_readrun", "clusters"},
+    {"raw_readrun", "reads"},   {"cf_lookup", "blocks"},
+    {"cf_read", "blocks"},      {"cf_write", "blocks"},
+    {"zs_decode", "frames"},    {"split_open", "files"},
+    {"crc", "bytes"},           {"alloc", "bytes"},
+    {"pool_wait", "buffers"},   {"nbd_lock", "requests"},
+    {"nbd_read", "bytes"},      {"nbd_write", "bytes"},
+    {"nbd_trim", "bytes"},      {"nbd_flush", "requests"},
+    {"nbd_status", "bytes"},    {"nbd_recv", "bytes"},
+    {"nbd_reply", "bytes"},
+};
+
+void
+stats_enable(void) {
+    __atomic_store_n(&stats_enabled, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Add "v" to a counter in this thread's slot.
+ */
+static inline void
+stats_add(uint64_t *cp, uint64_t v, int shared) {
+    if (shared)
+        (void)__atomic_fetch_add(cp, v, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n(cp, __atomic_load_n(cp, __ATOMIC_RELAXED) + v,
+                         __ATOMIC_RELAXED);
+}
+
+/*
+ * Record an operation which took "ns" nanoseconds, if "timed".
+ */
+void
+stats_record(stats_id_t id, uint64_t ns, uint64_t amount, int error,
+             int timed) {
+    stats_counter_t *scp;
+    int              shared;
+
+    if (stats_myslot < 0) {
+        uint32_t slot = __atomic_fetch_add(&stats_nslots, 1, __ATOMIC_RELAXED);
+
+        stats_myslot = (slot < STATS_MAX_SLOTS) ? slot : 0;
+    }
+    shared = (stats_myslot == 0);
+    scp    = &stats_slots[stats_myslot].ss_counters[id];
+    stats_add(&scp->sc_ops, 1, shared);
+    stats_add(&scp->sc_amount, amount, shared);
+    if (error)
+        stats_add(&scp->sc_errors, 1, shared);
+    if (timed) {
+        uint64_t us = ns / 1000;
+        int      b  = (us) ? 64 - __builtin_clzll(us) : 0;
+
+        stats_add(&scp->sc_ns, ns, shared);
+        stats_add(&scp->sc_hist[(b < STATS_BUCKETS) ? b : STATS_BUCKETS - 1],
+                  1, shared);
+    }
+}
+
+/*
+ * Sum the slots into "totals", which has room for STATS_NIDS counters.
+ */
+void
+stats_snapshot(stats_counter_t *totals) {
+    uint32_t nslots = __atomic_load_n(&stats_nslots, __ATOMIC_RELAXED);
+    uint32_t slot;
+    int      id;
+    int      b;
+
+    memset(totals, 0, STATS_NIDS * sizeof(*totals));
+    if (nslots > STATS_MAX_SLOTS)
+        nslots = STATS_MAX_SLOTS;
+    for (slot = 0; slot < nslots; slot++) {
+        for (id = 0; id < STATS_NIDS; id++) {
+            stats_counter_t *scp = &stats_slots[slot].ss_counters[id];
+
+            totals[id].sc_ops +=
+                __atomic_load_n(&scp->sc_ops, __ATOMIC_RELAXED);
+            totals[id].sc_errors +=
+                __atomic_load_n(&scp->sc_errors, __ATOMIC_RELAXED);
+            totals[id].sc_amount +=
+                __atomic_load_n(&scp->sc_amount, __ATOMIC_RELAXED);
+            totals[id].sc_ns += __atomic_load_n(&scp->sc_ns, __ATOMIC_RELAXED);
+            for (b = 0; b < STATS_BUCKETS; b++)
+                totals[id].sc_hist[b] +=
+                    __atomic_load_n(&scp->sc_hist[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Write the counters in the Prometheus text format, with metric names
+ * starting with "prefix".
+ */
+int
+stats_write(FILE *fp, const char *prefix) {
+    stats_counter_t totals[STATS_NIDS];
+    int             id;
+    int             b;
+
+    stats_snapshot(totals);
+    fprintf(fp, "# TYPE %s_ops_total counter\n", prefix);
+    for (id = 0; id < STATS_NIDS; id++)
+        fprintf(fp, "%s_ops_total{op=\"%s\"} %" PRIu64 "\n", prefix,
+                stats_names[id].sn_name, totals[id].sc_ops);
+    fprintf(fp, "# TYPE %s_errors_total counter\n", prefix);
+    for (id = 0; id < STATS_NIDS; id++)
+        fprintf(fp, "%s_errors_total{op=\"%s\"} %" PRIu64 "\n", prefix,
+                stats_names[id].sn_name, totals[id].sc_errors);
+    fprintf(fp, "# TYPE %s_amount_total counter\n", prefix);
+    for (id = 0; id < STATS_NIDS; id++)
+        fprintf(fp, "%s_amount_total{op=\"%s\",unit=\"%s\"} %" PRIu64 "\n",
+                prefix, stats_names[id].sn_name, stats_names[id].sn_unit,
+                totals[id].sc_amount);
+    fprintf(fp, "# TYPE %s_latency_seconds histogram\n", prefix);
+    for (id = 0; id < STATS_NIDS; id++) {
+        uint64_t count = 0;
+
+        for (b = 0; b < STATS_BUCKETS; b++)
+            count += totals[id].sc_hist[b];
+        if (!count)
+            continue;
+        count = 0;
+        for (b = 0; b < STATS_BUCKETS - 1; b++) {
+            count += totals[id].sc_hist[b];
+            fprintf(fp,
+                    "%s_latency_seconds_bucket{op=\"%s\",le=\"%g\"} %" PRIu64
+                    "\n",
+                    prefix, stats_names[id].sn_name, (1ULL << b) / 1e6, count);
+        }
+        count += totals[id].sc_hist[b];
+        fprintf(fp,
+                "%s_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %" PRIu64
+                "\n",
+                prefix, stats_names[id].sn_name, count);
+        fprintf(fp, "%s_latency_seconds_sum{op=\"%s\"} %.9f\n", prefix,
+                stats_names[id].sn_name, totals[id].sc_ns / 1e9);
+        fprintf(fp, "%s_latency_seconds_count{op=\"%s\"} %" PRIu64 "\n",
+                prefix, stats_names[id].sn_name, count);
+    }
+
+    return ferror(fp) ? EIO : 0;
+}
+
+/*
+ * Replace the file "path" with the counters.  The new contents are
+ * written alongside and renamed into place, so readers never see a
+ * partial file.
+ */
+int
+stats_write_file(const char *path, const char *prefix) {
+    int   error = 0;
+    char *tpath;
+    FILE *fp;
+
+    if ((tpath = (char *)malloc(strlen(path) + sizeof(".tmp"))) == NULL)
+        return ENOMEM;
+    sprintf(tpath, "%s.tmp", path);
+    if ((fp = fopen(tpath, "w")) == NULL) {
+        error = errno;
+    } else {
+        error = stats_write(fp, prefix);
+        if ((fclose(fp) == EOF) && !error)
+            error = errno;
+        if (!error && (rename(tpath, path) < 0))
+            error = errno;
+        if (error)
+            (void)unlink(tpath);
+    }
+    free(tpath);
+
+    return error;
+}
@@ -0,0 +1,120 @@
+/*
+ * libstats.h - Interfaces to the operation counters.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+
+#ifndef _LIBSTATS_H_
+#define _LIBSTATS_H_ 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Operations counted.  Timed operations also get their total time and a
+ * latency histogram; the rest are only counted.  Each has an amount as
+ * well, in the units given in the table in libstats.c.
+ */
+typedef enum stats_id {
+    STATS_IMAGE_READ = 0, /* image_readblocks(), image_readblocks_at() */
+    STATS_IMAGE_SEEK,     /* image_seek() */
+    STATS_IMAGE_WRITE,    /* image_writeblocks(), image_writeranges() */
+    STATS_IMAGE_ZERO,     /* image_zeroblocks() */
+    STATS_IMAGE_MAP,      /* image_block_map() */
+    STATS_IMAGE_SYNC,     /* image_sync() */
+    STATS_PC_READRUN,     /* partclone: read a run of blocks */
+    STATS_PC_CHECK,       /* partclone: read and check a checksum group */
+    STATS_NC_WALK,        /* ntfsclone: walk the atoms to a cluster */
+    STATS_NC_READRUN,     /* ntfsclone: read a run of clusters */
+    STATS_RAW_READRUN,    /* raw: read a batch of runs */
+    STATS_CF_LOOKUP,      /* change file: block map lookups (counted) */
+    STATS_CF_READ,        /* change file: read a block */
+    STATS_CF_WRITE,       /* change file: write blocks */
+    STATS_ZS_DECODE,      /* compressed images: decode a frame */
+    STATS_SPLIT_OPEN,     /* split images: open a piece (counted) */
+    STATS_CRC,            /* CRC32 calculations */
+    STATS_ALLOC,          /* Allocations (counted) */
+    STATS_POOL_WAIT,      /* Wait for a request buffer */
+    STATS_NBD_LOCK,       /* NBD: wait for the image lock */
+    STATS_NBD_READ,       /* NBD: carry out a read */
+    STATS_NBD_WRITE,      /* NBD: carry out a write */
+    STATS_NBD_TRIM,       /* NBD: carry out a trim or write of zeroes */
+    STATS_NBD_FLUSH,      /* NBD: carry out a flush */
+    STATS_NBD_STATUS,     /* NBD: carry out a block status query */
+    STATS_NBD_RECV,       /* NBD: receive write data */
+    STATS_NBD_REPLY,      /* NBD: send a reply */
+    STATS_NIDS
+} stats_id_t;
+
+/*
+ * Latency buckets: bucket "b" counts operations taking under 2^b
+ * microseconds (and at least half that); the last takes everything
+ * longer.
+ */
+#define STATS_BUCKETS 24
+
+typedef struct stats_counter {
+    uint64_t sc_ops;                 /* Operations */
+    uint64_t sc_errors;              /* Operations which failed */
+    uint64_t sc_amount;              /* Blocks, bytes, ... */
+    uint64_t sc_ns;                  /* Total nanoseconds */
+    uint64_t sc_hist[STATS_BUCKETS]; /* Latency histogram */
+} stats_counter_t;
+
+/*
+ * Nothing is counted until stats_enable() is called, and the calls below
+ * cost next to nothing until then.
+ */
+extern int stats_enabled;
+
+void stats_enable(void);
+void stats_record(stats_id_t id, uint64_t ns, uint64_t amount, int error,
+                  int timed);
+void stats_snapshot(stats_counter_t *totals);
+int  stats_write(FILE *fp, const char *prefix);
+int  stats_write_file(const char *path, const char *prefix);
+
+static inline uint64_t
+stats_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec + 1;
+}
+
+/*
+ * Timing an operation:
+ *
+ *     uint64_t start = stats_start();
+ *     ...
+ *     stats_end(STATS_..., start, amount, error);
+ */
+static inline uint64_t
+stats_start(void) {
+    return (stats_enabled) ? stats_now() : 0;
+}
+
+static inline void
+stats_end(stats_id_t id, uint64_t start, uint64_t amount, int error) {
+    if (start)
+        stats_record(id, stats_now() - start, amount, error, 1);
+}
+
+/*
+ * Counting an operation which isn't worth timing.
+ */
+static inline void
+stats_count(stats_id_t id, uint64_t amount) {
+    if (stats_enabled)
+        stats_record(id, 0, amount, 0, 0);
+}
+
+#endif /* _LIBSTATS_H_ */
@@ -0,0 +1,246 @@
+/*
+ * libverify.c - Check all of an image's data, in parallel.
+ */
+/*
+ * Copyright (c) 2013, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "libverify.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_LIBPTHREAD
+#    include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
+
+#define VERIFY_MAX_THREADS 64
+#define VERIFY_INTERVAL    1.0 /* Seconds between progress reports */
+
+/*
+ * The verifier's side of a job.  Chunks are handed out in order from
+ * vs_nextchunk; the first error stops all the threads.
+ */
+typedef struct verify_state {
+    const sysdep_dispatch_t *vs_sysdep;     /* System-specific routines */
+    struct timespec          vs_start;      /* When the job started */
+    double                   vs_lastreport; /* When progress was reported */
+    uint64_t                 vs_nextchunk;  /* Next chunk to check */
+    int                      vs_error;      /* First error */
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_t vs_mutex; /* Serializes the caller's callbacks */
+#endif                        /* HAVE_LIBPTHREAD */
+} verify_state_t;
+
+#ifdef HAVE_LIBPTHREAD
+#    define VS_LOCK(_s)    pthread_mutex_lock(&(_s)->vs_mutex)
+#    define VS_TRYLOCK(_s) pthread_mutex_trylock(&(_s)->vs_mutex)
+#    define VS_UNLOCK(_s)  pthread_mutex_unlock(&(_s)->vs_mutex)
+#else /* HAVE_LIBPTHREAD */
+#    define VS_LOCK(_s)
+#    define VS_TRYLOCK(_s) 0
+#    define VS_UNLOCK(_s)
+#endif /* HAVE_LIBPTHREAD */
+
+/*
+ * Seconds since the job started.
+ */
+static double
+verify_elapsed(verify_state_t *vsp) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - vsp->vs_start.tv_sec) +
+           (now.tv_nsec - vsp->vs_start.tv_nsec) / 1e9;
+}
+
+/*
+ * Report progress if it's been long enough.  Threads busy reporting are
+ * left to it rather than waited for.
+ */
+static void
+verify_progress(verify_job_t *vjp) {
+    verify_state_t *vsp = (verify_state_t *)vjp->vj_state;
+    double          now = verify_elapsed(vsp);
+
+    if (vjp->vj_progress && (now - vsp->vs_lastreport >= VERIFY_INTERVAL) &&
+        (VS_TRYLOCK(vsp) == 0)) {
+        if (now - vsp->vs_lastreport >= VERIFY_INTERVAL) {
+            verify_job_t snap = *vjp;
+
+            snap.vj_done    = __atomic_load_n(&vjp->vj_done, __ATOMIC_RELAXED);
+            snap.vj_checked = __atomic_load_n(&vjp->vj_checked,
+                                              __ATOMIC_RELAXED);
+            snap.vj_nbad    = __atomic_load_n(&vjp->vj_nbad, __ATOMIC_RELAXED);
+            snap.vj_elapsed = now;
+            vsp->vs_lastreport = now;
+            (*vjp->vj_progress)(vjp->vj_uarg, &snap);
+        }
+        VS_UNLOCK(vsp);
+    }
+}
+
+/*
+ * Check chunks until there are none left or something has failed.
+ */
+static void *
+verify_worker(void *arg) {
+    verify_job_t *  vjp = (verify_job_t *)arg;
+    verify_state_t *vsp = (verify_state_t *)vjp->vj_state;
+    unsigned char * buf;
+    int             error;
+    int             noerror = 0;
+
+    if ((error = (*vsp->vs_sysdep->sys_malloc)(&buf, vjp->vj_bufsize)) == 0) {
+        for (;;) {
+            uint64_t unit = __atomic_fetch_add(&vsp->vs_nextchunk, 1,
+                                               __ATOMIC_RELAXED) *
+                            vjp->vj_chunk;
+            uint64_t nunits;
+
+            if ((unit >= vjp->vj_units) ||
+                __atomic_load_n(&vsp->vs_error, __ATOMIC_RELAXED))
+                break;
+            nunits = vjp->vj_units - unit;
+            if (nunits > vjp->vj_chunk)
+                nunits = vjp->vj_chunk;
+            if ((error = (*vjp->vj_check)(vjp, unit, nunits, buf)) != 0)
+                break;
+            verify_progress(vjp);
+        }
+        (void)(*vsp->vs_sysdep->sys_free)(buf);
+    }
+    if (error)
+        (void)__atomic_compare_exchange_n(&vsp->vs_error, &noerror, error, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+    return (void *)NULL;
+}
+
+/*
+ * Record that "nunits" units and "nbytes" image bytes have been checked.
+ */
+void
+verify_unit_done(verify_job_t *vjp, uint64_t nunits, uint64_t nbytes) {
+    (void)__atomic_fetch_add(&vjp->vj_done, nunits, __ATOMIC_RELAXED);
+    (void)__atomic_fetch_add(&vjp->vj_checked, nbytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Record that unit "unit" is bad, for reason "error".
+ */
+void
+verify_unit_bad(verify_job_t *vjp, uint64_t unit, int error) {
+    verify_state_t *vsp = (verify_state_t *)vjp->vj_state;
+
+    (void)__atomic_fetch_add(&vjp->vj_nbad, 1, __ATOMIC_RELAXED);
+    if (vjp->vj_bad) {
+        VS_LOCK(vsp);
+        (*vjp->vj_bad)(vjp->vj_uarg, vjp, unit, error);
+        VS_UNLOCK(vsp);
+    }
+}
+
+/*
+ * Run a job set up by the image library.  Bad units don't stop the job;
+ * the error returned is the first which prevented units from being checked
+ * at all.
+ */
+int
+verify_run(const sysdep_dispatch_t *sysdep, verify_job_t *vjp) {
+    verify_state_t vs;
+#ifdef HAVE_LIBPTHREAD
+    pthread_t threads[VERIFY_MAX_THREADS];
+    int       nstarted;
+#endif /* HAVE_LIBPTHREAD */
+
+    if (!vjp->vj_check || !vjp->vj_chunk || !vjp->vj_bufsize)
+        return EINVAL;
+    memset(&vs, 0, sizeof(vs));
+    vs.vs_sysdep    = sysdep;
+    vjp->vj_state   = &vs;
+    vjp->vj_done    = 0;
+    vjp->vj_checked = 0;
+    vjp->vj_nbad    = 0;
+    clock_gettime(CLOCK_MONOTONIC, &vs.vs_start);
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_init(&vs.vs_mutex, (pthread_mutexattr_t *)NULL);
+    /*
+     * This thread is one of the workers.  If threads can't be started, the
+     * rest is simply done here.
+     */
+    for (nstarted = 0; (nstarted < (vjp->vj_nthreads - 1)) &&
+                       (nstarted < VERIFY_MAX_THREADS) &&
+                       !pthread_create(&threads[nstarted],
+                                       (pthread_attr_t *)NULL, verify_worker,
+                                       vjp);
+         nstarted++)
+        ;
+    (void)verify_worker(vjp);
+    while (nstarted--)
+        (void)pthread_join(threads[nstarted], (void **)NULL);
+    pthread_mutex_destroy(&vs.vs_mutex);
+#else  /* HAVE_LIBPTHREAD */
+    (void)verify_worker(vjp);
+#endif /* HAVE_LIBPTHREAD */
+    vjp->vj_elapsed = verify_elapsed(&vs);
+    vjp->vj_state   = (void *)NULL;
+
+    return vs.vs_error;
+}
+
+/*
+ * Describe the progress of a job, or its result if "final".
+ */
+void
+verify_report(FILE *fp, const char *name, const verify_job_t *vjp,
+              int final) {
+    double gbchecked = vjp->vj_checked / 1e9;
+    double rate      = (vjp->vj_elapsed > 0) ? gbchecked / vjp->vj_elapsed : 0;
+
+    if (final) {
+        fprintf(fp,
+                "%s: %" PRIu64 " %ss, %.2f GB checked in %.3f seconds "
+                "(%.2f GB/s), %" PRIu64 " bad\n",
+                name, vjp->vj_done, vjp->vj_unitname, gbchecked,
+                vjp->vj_elapsed, rate, vjp->vj_nbad);
+    } else {
+        uint64_t eta = (rate > 0) ? ((vjp->vj_bytes - vjp->vj_checked) / 1e9) /
+                                        rate
+                                  : 0;
+
+        fprintf(fp,
+                "\r%s: %5.1f%%, %.2f of %.2f GB, %.2f GB/s, %" PRIu64
+                " bad, ETA %" PRIu64 ":%02" PRIu64 ":%02" PRIu64 " ",
+                name,
+                (vjp->vj_bytes) ? (100.0 * vjp->vj_checked) / vjp->vj_bytes
+                                : 100.0,
+                gbchecked, vjp->vj_bytes / 1e9, rate, vjp->vj_nbad,
+                eta / 3600, (eta / 60) % 60, eta % 60);
+        fflush(fp);
+    }
+}
+
+/*
+ * Callbacks for programs, printing to stderr.  "arg" is the image name.
+ */
+void
+verify_print_bad(void *arg, const verify_job_t *vjp, uint64_t unit,
+                 int error) {
+    fprintf(stderr, "%s%s: %s %" PRIu64 " is bad: %s\n",
+            (vjp->vj_progress) ? "\n" : "", (const char *)arg,
+            vjp->vj_unitname, unit, strerror(error));
+}
+
+void
+verify_print_progress(void *arg, const verify_job_t *vjp) {
+    verify_report(stderr, (const char *)arg, vjp, 0);
+}
@@ -0,0 +1,68 @@
+/*
+ * libverify.h - Interfaces to the parallel image data verifier.
+ */
+/*
+ * Copyright (c) 2013, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+
+#ifndef _LIBVERIFY_H_
+#define _LIBVERIFY_H_ 1
+
+#include "sysdep_int.h"
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * A check of all of an image's data.  The image library splits the data
+ * into units (checksum groups, buckets of clusters) which can be checked
+ * independently, and checks them a chunk of units at a time, with each
+ * thread reading its chunks into its own buffer.  The caller picks the
+ * number of threads and hears about bad units and progress.
+ */
+typedef struct verify_job verify_job_t;
+struct verify_job {
+    /*
+     * Set by the caller.
+     */
+    int   vj_nthreads; /* Threads checking chunks */
+    void (*vj_bad)(void *arg, const verify_job_t *vjp, uint64_t unit,
+                   int error);                               /* Unit is bad */
+    void (*vj_progress)(void *arg, const verify_job_t *vjp); /* Every second */
+    void *vj_uarg; /* Argument for vj_bad and vj_progress */
+    /*
+     * Set by the image library.
+     */
+    const char *vj_unitname; /* What a unit is */
+    uint64_t    vj_units;    /* Units to check */
+    uint64_t    vj_chunk;    /* Units checked at a time */
+    uint64_t    vj_bufsize;  /* Buffer needed to check a chunk */
+    uint64_t    vj_bytes;    /* Image bytes to check */
+    int (*vj_check)(verify_job_t *vjp, uint64_t unit, uint64_t nunits,
+                    unsigned char *buf);
+    void *vj_arg; /* Argument for vj_check */
+    /*
+     * Progress.
+     */
+    uint64_t vj_done;    /* Units checked */
+    uint64_t vj_checked; /* Image bytes checked */
+    uint64_t vj_nbad;    /* Bad units */
+    double   vj_elapsed; /* Seconds checking */
+    void *   vj_state;   /* Private to the verifier */
+};
+
+int  verify_run(const sysdep_dispatch_t *sysdep, verify_job_t *vjp);
+void verify_unit_done(verify_job_t *vjp, uint64_t nunits, uint64_t nbytes);
+void verify_unit_bad(verify_job_t *vjp, uint64_t unit, int error);
+void verify_report(FILE *fp, const char *name, const verify_job_t *vjp,
+                   int final);
+void verify_print_bad(void *arg, const verify_job_t *vjp, uint64_t unit,
+                      int error);
+void verify_print_progress(void *arg, const verify_job_t *vjp);
+
+#endif /* _LIBVERIFY_H_ */
@@ -0,0 +1,64 @@
+/*
+ * libzpartclone.c - Compressed partclone image library.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+/*
+ * Partclone images compressed with zstd (in the seekable format) or lz4.
+ * The partclone engine does the work, reading the image through the
+ * compressed stream interface, which decompresses it as it goes.
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "libpartclone.h"
+#include "sysdep_zstream.h"
+
+extern image_dispatch_t partclone_image_type;
+
+static int
+zpartclone_probe(const char *path, const sysdep_dispatch_t *sysdep) {
+    const sysdep_dispatch_t *zsysdep;
+    int                      error;
+
+    if (!(error = sysdep_zstream_probe(path, sysdep)) &&
+        !(error = sysdep_zstream_init(sysdep, &zsysdep)))
+        error = (*partclone_image_type.probe)(path, zsysdep);
+
+    return error;
+}
+
+static int
+zpartclone_open(const char *path, const char *cfpath, sysdep_open_mode_t omode,
+                const sysdep_dispatch_t *sysdep, void **rpp) {
+    const sysdep_dispatch_t *zsysdep;
+    int                      error;
+
+    if (!(error = sysdep_zstream_init(sysdep, &zsysdep)))
+        error = partclone_open(path, cfpath, omode, zsysdep, rpp);
+
+    return error;
+}
+
+/*
+ * The image type dispatch table.  Past opening, it's a partclone image.
+ */
+const image_dispatch_t zpartclone_image_type = {
+    "compressed partclone image", zpartclone_probe,
+    zpartclone_open,              partclone_close,
+    partclone_tolerant_mode,      partclone_verify_reads,
+    partclone_lazy_load,          partclone_verify,
+    partclone_blocksize,          partclone_blockcount,
+    partclone_seek,               partclone_tell,
+    partclone_readblocks,         partclone_readblocks_at,
+    partclone_block_used,         partclone_block_extent,
+    partclone_block_map,          partclone_writeblocks,
+    partclone_zeroblocks,         partclone_sync,
+    partclone_writepartial};
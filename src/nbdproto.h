@@ -0,0 +1,139 @@
+/*
+ * nbdproto.h - NBD protocol definitions not in <linux/nbd.h>.
+ */
+/*
+ * Copyright (c) 2010, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifndef _NBDPROTO_H_
+#define _NBDPROTO_H_ 1
+
+#include <linux/nbd.h>
+#include <stdint.h>
+
+/*
+ * The newstyle handshake.  All values are in network byte order.
+ */
+#define NBD_INIT_MAGIC 0x4e42444d41474943ULL /* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC 0x49484156454f5054ULL /* "IHAVEOPT" */
+#define NBD_REP_MAGIC  0x0003e889045565a9ULL /* Option reply */
+
+/* Handshake flags, from the server. */
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES      (1 << 1)
+
+/* Client flags. */
+#define NBD_FLAG_C_FIXED_NEWSTYLE NBD_FLAG_FIXED_NEWSTYLE
+#define NBD_FLAG_C_NO_ZEROES      NBD_FLAG_NO_ZEROES
+
+/* Options. */
+#define NBD_OPT_EXPORT_NAME       1
+#define NBD_OPT_ABORT             2
+#define NBD_OPT_LIST              3
+#define NBD_OPT_STARTTLS          5
+#define NBD_OPT_INFO              6
+#define NBD_OPT_GO                7
+#define NBD_OPT_STRUCTURED_REPLY  8
+#define NBD_OPT_LIST_META_CONTEXT 9
+#define NBD_OPT_SET_META_CONTEXT  10
+
+/* Option replies. */
+#define NBD_REP_ACK             1
+#define NBD_REP_SERVER          2
+#define NBD_REP_INFO            3
+#define NBD_REP_META_CONTEXT    4
+#define NBD_REP_FLAG_ERROR      (1U << 31)
+#define NBD_REP_ERR_UNSUP       (1 | NBD_REP_FLAG_ERROR)
+#define NBD_REP_ERR_POLICY      (2 | NBD_REP_FLAG_ERROR)
+#define NBD_REP_ERR_INVALID     (3 | NBD_REP_FLAG_ERROR)
+#define NBD_REP_ERR_UNKNOWN     (6 | NBD_REP_FLAG_ERROR)
+
+/* NBD_REP_INFO types. */
+#define NBD_INFO_EXPORT     0
+#define NBD_INFO_NAME       1
+#define NBD_INFO_BLOCK_SIZE 3
+
+/*
+ * Commands and command flags beyond those the kernel sends.
+ */
+#define NBD_CMD_WRITE_ZEROES 6
+#define NBD_CMD_BLOCK_STATUS 7
+
+#define NBD_CMD_FLAG_NO_HOLE (1 << 1)
+#define NBD_CMD_FLAG_REQ_ONE (1 << 3)
+
+/* Transmission flags. */
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+
+/*
+ * The base:allocation metadata context, and its block status flags.
+ */
+#define NBD_META_BASE_ALLOCATION "base:allocation"
+#define NBD_STATE_HOLE           (1 << 0)
+#define NBD_STATE_ZERO           (1 << 1)
+
+/*
+ * Option request and reply headers.
+ */
+struct nbd_option {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t length;
+} __attribute__((packed));
+
+struct nbd_option_reply {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t type;
+    uint32_t length;
+} __attribute__((packed));
+
+/*
+ * Structured replies.
+ */
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+#define NBD_REPLY_FLAG_DONE (1 << 0)
+
+#define NBD_REPLY_TYPE_NONE         0
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR        ((1 << 15) + 1)
+
+struct nbd_structured_reply {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    char     handle[8];
+    uint32_t length;
+} __attribute__((packed));
+
+struct nbd_block_descriptor {
+    uint32_t length;
+    uint32_t status;
+} __attribute__((packed));
+
+/*
+ * Errors, as sent on the wire.
+ */
+#define NBD_EPERM     1
+#define NBD_EIO       5
+#define NBD_ENOMEM    12
+#define NBD_EINVAL    22
+#define NBD_ENOSPC    28
+#define NBD_EOVERFLOW 75
+#define NBD_ENOTSUP   95
+#define NBD_ESHUTDOWN 108
+
+/*
+ * Default port.
+ */
+#define NBD_DEFAULT_PORT "10809"
+
+#endif /* _NBDPROTO_H_ */
@@ -13,8 +13,12 @@
 #ifdef HAVE_CONFIG_H
 #    include "config.h"
 #endif /* HAVE_CONFIG_H */
+#include "libbitmap.h"
+#include "libindex.h"
 #include "libntfsclone.h"
+#include "libverify.h"
 #include "ntfsclone.h"
+#include "sysdep_arena.h"
 #include "sysdep_posix.h"
 #include <errno.h>
 #include <fcntl.h>
@@ -23,6 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -39,42 +44,29 @@ typedef struct libntfsclone_context {
     uint64_t                       nc_curblock; /* Current position */
     uint32_t                       nc_flags;    /* Handle flags */
     sysdep_open_mode_t             nc_omode;    /* Open mode */
+    sysdep_arena_t *               nc_arena;    /* Memory for its lifetime */
 } nc_context_t;
 
 typedef struct version_10_context {
-    unsigned char *v10_bitmap;         /* Usage bitmap */
-    off_t *        v10_bucket_offset;  /* Precalculated indices */
-    uint64_t       v10_current_bucket; /* Current bucket */
-    uint16_t       v10_bsfcount;       /* Preceding free blocks */
-    uint16_t       v10_bucket_factor;  /* log2(entries)/index */
+    bitmap_t *     v10_bitmap;        /* Usage bitmap */
+    bitmap_t *     v10_gapmap;        /* Used clusters that follow a gap */
+    uint64_t *     v10_bucket_offset; /* Precalculated indices */
+    uint64_t       v10_data_end;      /* Image offset past the last atom */
+    uint32_t       v10_head_crc;      /* CRC of the image header */
+    uint16_t       v10_bucket_factor; /* log2(entries)/index */
+    uint16_t       v10_flags;         /* Layout flags */
+    image_index_t *v10_index;         /* Index file, if loaded from it */
 } v10_context_t;
 
-/*
- * Inline bitmap manipulation routines.
- */
-static inline void
-bitmap_set_bit(unsigned char *bitmap, uint64_t bit, uint32_t value) {
-    uint64_t      boffs = bit / 8;
-    uint8_t       bdisp = bit & 7;
-    unsigned char mask  = 1 << bdisp;
-    if (value) {
-        bitmap[boffs] |= mask;
-    } else {
-        bitmap[boffs] &= ~mask;
-    }
-}
-
-static inline uint32_t
-bitmap_bit_value(unsigned char *bitmap, uint64_t bit) {
-    uint64_t      boffs = bit / 8;
-    uint8_t       bdisp = bit & 7;
-    unsigned char mask  = 1 << bdisp;
-    return (bitmap[boffs] & mask) ? 1 : 0;
-}
+#define V10_INDEXED 0x0002 /* Loaded from the index file */
 
 int
 main(int argc, char *argv[]) {
     int i;
+    int build_index = 0;
+    int verify_data = 0;
+    int nthreads    = sysconf(_SC_NPROCESSORS_ONLN);
+    int nimages     = 0;
 
     for (i = 1; i < argc; i++) {
         int   error;
@@ -82,15 +74,35 @@ main(int argc, char *argv[]) {
         int   dontcare  = 0;
         int   anomalies = 0;
 
-        if (i > 1) {
+        if (strcmp(argv[i], "--build-index") == 0) {
+            build_index = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--verify-data") == 0) {
+            verify_data = 1;
+            continue;
+        }
+        if (strncmp(argv[i], "--threads=", 10) == 0) {
+            nthreads = atoi(&argv[i][10]);
+            continue;
+        }
+        if (nimages++) {
             fprintf(stdout, "\n");
         }
 
         if ((error = ntfsclone_open(argv[i], (char *)NULL, SYSDEP_OPEN_RO,
                                     &posix_dispatch, &ntctx)) == 0) {
-            uint64_t bmscanned = 0, unset = 0, set = 0, strange = 0;
-            uint64_t lastset = 0;
-            if (((error = ntfsclone_verify(ntctx)) == 0) || dontcare) {
+            uint64_t        bmscanned = 0, unset = 0, set = 0, strange = 0;
+            uint64_t        lastset = 0;
+            struct timespec vstart, vend;
+
+            clock_gettime(CLOCK_MONOTONIC, &vstart);
+            error = ntfsclone_verify(ntctx);
+            clock_gettime(CLOCK_MONOTONIC, &vend);
+            fprintf(stdout, "%s: verified in %.3f seconds\n", argv[i],
+                    (double)(vend.tv_sec - vstart.tv_sec) +
+                        (double)(vend.tv_nsec - vstart.tv_nsec) / 1e9);
+            if ((error == 0) || dontcare) {
                 nc_context_t * p = (nc_context_t *)ntctx;
                 v10_context_t *v = (v10_context_t *)p->nc_verdep;
                 uint64_t       bmi;
@@ -98,18 +110,15 @@ main(int argc, char *argv[]) {
 
                 if (dontcare && error)
                     p->nc_flags |= 4;
+                if (v->v10_flags & V10_INDEXED)
+                    fprintf(stdout, "%s: bitmap loaded from index\n",
+                            argv[i]);
                 for (bmi = 0; bmi < p->nc_head.nr_clusters; bmi++) {
-                    switch (bitmap_bit_value(v->v10_bitmap, bmi)) {
-                    case 0:
-                        unset++;
-                        break;
-                    case 1:
+                    if (bitmap_test(v->v10_bitmap, bmi)) {
                         set++;
                         lastset = bmi;
-                        break;
-                    default:
-                        anomalies++;
-                        break;
+                    } else {
+                        unset++;
                     }
                     bmscanned++;
                 }
@@ -141,7 +150,7 @@ main(int argc, char *argv[]) {
                      */
                     for (lastset = p->nc_head.nr_clusters - 1;
                          lastset > 0 &&
-                         (bitmap_bit_value(v->v10_bitmap, lastset) == 0);
+                         (bitmap_test(v->v10_bitmap, lastset) == 0);
                          lastset--)
                         ;
                     if ((error = ntfsclone_seek(ntctx, lastset)) == 0) {
@@ -149,7 +158,11 @@ main(int argc, char *argv[]) {
                             0) {
                             off_t cpos, eofpos;
 
-                            cpos   = lseek(*fd, 0, SEEK_CUR);
+                            /*
+                             * Blocks are read positionally, so use the end
+                             * of the atoms found when the bitmap was built.
+                             */
+                            cpos   = v->v10_data_end;
                             eofpos = lseek(*fd, 0, SEEK_END);
                             if (cpos == eofpos) {
                                 fprintf(stdout,
@@ -178,11 +191,49 @@ main(int argc, char *argv[]) {
                         anomalies++;
                     }
                     free(iob);
+                    if (build_index) {
+                        if ((error = ntfsclone_build_index(ntctx)) == 0) {
+                            fprintf(stdout, "%s: wrote index %s.ntfsidx\n",
+                                    argv[i], argv[i]);
+                        } else {
+                            fprintf(stderr,
+                                    "%s: cannot write index (error(%d) = "
+                                    "%s)\n",
+                                    argv[i], error, strerror(error));
+                            anomalies++;
+                        }
+                    }
                 } else {
                     fprintf(stderr, "%s: cannot malloc %" PRId64 " bytes\n",
                             argv[i], ntfsclone_blocksize(ntctx));
                     anomalies++;
                 }
+                if (verify_data) {
+                    verify_job_t vj;
+
+                    memset(&vj, 0, sizeof(vj));
+                    vj.vj_nthreads = nthreads;
+                    vj.vj_bad      = verify_print_bad;
+                    vj.vj_progress = (isatty(STDERR_FILENO))
+                                         ? verify_print_progress
+                                         : NULL;
+                    vj.vj_uarg     = argv[i];
+                    error          = ntfsclone_verify_data(ntctx, &vj);
+                    if (vj.vj_progress && (vj.vj_elapsed >= 1.0))
+                        fputc('\n', stderr);
+                    if (error == ENOTSUP) {
+                        fprintf(stdout, "%s: no checksums to check data\n",
+                                argv[i]);
+                    } else if (error) {
+                        fprintf(stderr,
+                                "%s: cannot check data (error(%d) = %s)\n",
+                                argv[i], error, strerror(error));
+                        anomalies++;
+                    } else {
+                        verify_report(stdout, argv[i], &vj, 1);
+                        anomalies += vj.vj_nbad;
+                    }
+                }
             } else {
                 fprintf(stderr, "%s: cannot verify image (error(%d) = %s)\n",
                         argv[i], error, strerror(error));
@@ -38,6 +38,14 @@
 #define CRC_SIZE               4
 #define PARTCLONE_VERSION_SIZE (FS_MAGIC_SIZE - 1)
 
+#define BIT_MAGIC      "BiTmAgIc"
+#define BIT_MAGIC_SIZE 8
+
+#define IMAGE_VERSION_2 "0002"
+#define ENDIAN_MAGIC    0xC0DE
+#define V2_CSM_CRC32    0x20 /* Version 2 CRC32 checksum mode */
+#define V2_BM_BIT       1    /* Version 2 bitmap, one bit per block */
+
 struct image_head_v1 {
     char               magic[IMAGE_MAGIC_SIZE];
     char               fs[FS_MAGIC_SIZE];
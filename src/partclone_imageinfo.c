@@ -13,7 +13,9 @@
 #ifdef HAVE_CONFIG_H
 #    include "config.h"
 #endif /* HAVE_CONFIG_H */
+#include "libbitmap.h"
 #include "libpartclone.h"
+#include "libverify.h"
 #include "partclone.h"
 #include "sysdep_posix.h"
 #include <errno.h>
@@ -23,18 +25,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
-#define CRC_UNIT_BITS 8
-#define CRC_TABLE_LEN (1 << CRC_UNIT_BITS)
-#define CRC_SIZE      4
+#define CRC_SIZE 4
 
 typedef struct version_1_context {
-    unsigned char *v1_bitmap;                   /* Usage bitmap */
-    uint64_t *     v1_sumcount;                 /* Precalculated indices */
-    uint64_t       v1_nvbcount;                 /* Preceding valid blocks */
-    unsigned long  v1_crc_tab32[CRC_TABLE_LEN]; /* Precalculated CRC table */
-    uint16_t       v1_bitmap_factor;            /* log2(entries)/index */
+    bitmap_t *v1_bitmap;   /* Usage bitmap */
+    uint64_t  v1_nstrange; /* Byte map entries not 0 or 1 */
 } v1_context_t;
 
 off_t
@@ -64,6 +62,10 @@ get_written_block_count(pc_context_t *pctx, off_t const data_size,
 int
 main(int argc, char *argv[]) {
     int i;
+    int build_index = 0;
+    int verify_data = 0;
+    int nthreads    = sysconf(_SC_NPROCESSORS_ONLN);
+    int nimages     = 0;
 
     for (i = 1; i < argc; i++) {
         int   error;
@@ -71,43 +73,79 @@ main(int argc, char *argv[]) {
         int   dontcare  = 0;
         int   anomalies = 0;
 
-        if (i > 1) {
+        if (strcmp(argv[i], "--build-index") == 0) {
+            build_index = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--verify-data") == 0) {
+            verify_data = 1;
+            continue;
+        }
+        if (strncmp(argv[i], "--threads=", 10) == 0) {
+            nthreads = atoi(&argv[i][10]);
+            continue;
+        }
+        if (nimages++) {
             fprintf(stdout, "\n");
         }
 
         if ((error = partclone_open(argv[i], (char *)NULL, SYSDEP_OPEN_RO,
                                     &posix_dispatch, &pctx)) == 0) {
-            uint64_t bmscanned = 0, unset = 0, set = 0, strange = 0;
-            uint64_t lastset = 0;
-            if (((error = partclone_verify(pctx)) == 0) || dontcare) {
+            uint64_t        bmscanned = 0, unset = 0, set = 0, strange = 0;
+            uint64_t        lastset = 0;
+            struct timespec vstart, vend;
+
+            clock_gettime(CLOCK_MONOTONIC, &vstart);
+            error = partclone_verify(pctx);
+            clock_gettime(CLOCK_MONOTONIC, &vend);
+            fprintf(stdout, "%s: verified in %.3f seconds\n", argv[i],
+                    (double)(vend.tv_sec - vstart.tv_sec) +
+                        (double)(vend.tv_nsec - vstart.tv_nsec) / 1e9);
+            if ((error == 0) || dontcare) {
                 pc_context_t * p = (pc_context_t *)pctx;
                 v1_context_t * v = (v1_context_t *)p->pc_verdep;
                 uint64_t       bmi;
                 unsigned char *iob;
+                unsigned char *bytemap = (unsigned char *)NULL;
 
                 if (dontcare && error)
                     p->pc_flags |= 4;
+                /*
+                 * The library only keeps whether each block is set.  If the
+                 * version 1 byte map had other values in it, go back to the
+                 * file to find out what they were.
+                 */
+                if (v->v1_nstrange &&
+                    (bytemap =
+                         (unsigned char *)malloc(p->pc_head.totalblock)) &&
+                    (pread(*(int *)p->pc_fd, bytemap, p->pc_head.totalblock,
+                           sizeof(p->pc_head_v1)) !=
+                     (ssize_t)p->pc_head.totalblock)) {
+                    free(bytemap);
+                    bytemap = (unsigned char *)NULL;
+                }
                 for (bmi = 0; bmi < p->pc_head.totalblock; bmi++) {
-                    switch (v->v1_bitmap[bmi]) {
-                    case 0:
+                    if (!bitmap_test(v->v1_bitmap, bmi)) {
                         unset++;
-                        break;
-                    case 1:
-                        set++;
-                        lastset = bmi;
-                        break;
-                    default:
+                    } else if (bytemap && (bytemap[bmi] != 1)) {
                         strange++;
                         fprintf(
                             stderr,
                             "%s: block %lu (0x%016lx) bitmap %d (0x%02x)?\n",
-                            argv[i], bmi, bmi, v->v1_bitmap[bmi],
-                            v->v1_bitmap[bmi]);
+                            argv[i], bmi, bmi, bytemap[bmi], bytemap[bmi]);
                         anomalies++;
-                        break;
+                    } else {
+                        set++;
+                        lastset = bmi;
                     }
                     bmscanned++;
                 }
+                if (v->v1_nstrange && !bytemap) {
+                    strange = v->v1_nstrange;
+                    set -= strange;
+                    anomalies += strange;
+                }
+                free(bytemap);
                 fprintf(stdout,
                         "%s: %llu blocks, %" PRIu64 " blocks scanned, %" PRIu64
                         " unset, %" PRIu64 " set, %" PRIu64 " strange\n",
@@ -123,8 +161,11 @@ main(int argc, char *argv[]) {
                     struct stat sbuf;
                     error   = partclone_seek(pctx, 0);
                     error   = partclone_readblocks(pctx, iob, 1);
-                    sblkpos = lseek(*fd, 0, SEEK_CUR);
-                    sblkpos -= partclone_blocksize(pctx);
+                    /*
+                     * Blocks are read positionally, so work out where they
+                     * are rather than asking the file.
+                     */
+                    sblkpos = p->pc_head.head_size;
                     fstat(*fd, &sbuf);
                     fprintf(stdout,
                             "%s: size is %lld bytes, blocks (%lld bytes) start "
@@ -149,9 +190,14 @@ main(int argc, char *argv[]) {
                     }
                     if ((error = partclone_seek(pctx, lastset)) == 0) {
                         if ((error = partclone_readblocks(pctx, iob, 1)) == 0) {
-                            off_t cpos, eofpos;
+                            off_t const bpc = p->pc_head.blocks_per_checksum;
+                            off_t const nvb = (set) ? set - 1 : 0;
+                            off_t       cpos, eofpos;
 
-                            cpos   = lseek(*fd, 0, SEEK_CUR);
+                            cpos = sblkpos +
+                                   (nvb + 1) * partclone_blocksize(pctx);
+                            if (bpc)
+                                cpos += (nvb / bpc) * crc_size;
                             eofpos = lseek(*fd, 0, SEEK_END);
                             if (cpos == (eofpos - crc_size)) {
                                 fprintf(stdout,
@@ -180,11 +226,49 @@ main(int argc, char *argv[]) {
                         anomalies++;
                     }
                     free(iob);
+                    if (build_index) {
+                        if ((error = partclone_build_index(pctx)) == 0) {
+                            fprintf(stdout, "%s: wrote index %s.pcidx\n",
+                                    argv[i], argv[i]);
+                        } else {
+                            fprintf(stderr,
+                                    "%s: cannot write index (error(%d) = "
+                                    "%s)\n",
+                                    argv[i], error, strerror(error));
+                            anomalies++;
+                        }
+                    }
                 } else {
                     fprintf(stderr, "%s: cannot malloc %" PRId64 " bytes\n",
                             argv[i], partclone_blocksize(pctx));
                     anomalies++;
                 }
+                if (verify_data) {
+                    verify_job_t vj;
+
+                    memset(&vj, 0, sizeof(vj));
+                    vj.vj_nthreads = nthreads;
+                    vj.vj_bad      = verify_print_bad;
+                    vj.vj_progress = (isatty(STDERR_FILENO))
+                                         ? verify_print_progress
+                                         : NULL;
+                    vj.vj_uarg     = argv[i];
+                    error          = partclone_verify_data(pctx, &vj);
+                    if (vj.vj_progress && (vj.vj_elapsed >= 1.0))
+                        fputc('\n', stderr);
+                    if (error == ENOTSUP) {
+                        fprintf(stdout, "%s: no checksums to check data\n",
+                                argv[i]);
+                    } else if (error) {
+                        fprintf(stderr,
+                                "%s: cannot check data (error(%d) = %s)\n",
+                                argv[i], error, strerror(error));
+                        anomalies++;
+                    } else {
+                        verify_report(stdout, argv[i], &vj, 1);
+                        anomalies += vj.vj_nbad;
+                    }
+                }
             } else {
                 fprintf(stderr, "%s: cannot verify image (error(%d) = %s)\n",
                         argv[i], error, strerror(error));
@@ -0,0 +1,150 @@
+/*
+ * sysdep_arena.c - Allocation arenas.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+/*
+ * An arena holds the things which live as long as an image handle: the
+ * context, its paths and its version-dependent state.  They're carved out
+ * of a few large chunks, got with the system-dependent allocator, and
+ * freed all at once when the arena is destroyed.  Allocations too large to
+ * share a chunk get a chunk of their own.
+ *
+ * Arenas aren't locked; they're used while a handle is set up, and by
+ * writers already serialized by the image lock.
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "sysdep_arena.h"
+#include <errno.h>
+#include <stddef.h>
+
+#define ARENA_CHUNK 16384 /* Size of a shared chunk */
+#define ARENA_ALIGN 16    /* Alignment of allocations */
+
+typedef struct arena_chunk {
+    struct arena_chunk *ac_next; /* Next chunk */
+    uint64_t            ac_size; /* Bytes in the chunk */
+    uint64_t            ac_used; /* Bytes handed out */
+} __attribute__((aligned(ARENA_ALIGN))) arena_chunk_t;
+
+struct sysdep_arena {
+    const sysdep_dispatch_t *sa_sysdep; /* Allocator underneath */
+    arena_chunk_t *          sa_chunks; /* Chunks, newest first */
+};
+
+static inline uint64_t
+arena_round(uint64_t nbytes) {
+    return (nbytes + ARENA_ALIGN - 1) & ~((uint64_t)ARENA_ALIGN - 1);
+}
+
+/*
+ * Add a chunk with room for "nbytes".
+ */
+static int
+arena_chunk_add(sysdep_arena_t *arena, uint64_t nbytes,
+                arena_chunk_t **chunkp) {
+    uint64_t       size = sizeof(arena_chunk_t) + nbytes;
+    arena_chunk_t *acp;
+    int            error;
+
+    if (size < ARENA_CHUNK)
+        size = ARENA_CHUNK;
+    if (!(error = (*arena->sa_sysdep->sys_malloc)(&acp, size))) {
+        acp->ac_size     = size;
+        acp->ac_used     = sizeof(arena_chunk_t);
+        acp->ac_next     = arena->sa_chunks;
+        arena->sa_chunks = acp;
+        *chunkp          = acp;
+    }
+
+    return error;
+}
+
+/*
+ * Create an arena, allocating from "sysdep".
+ */
+int
+sysdep_arena_create(const sysdep_dispatch_t *sysdep, sysdep_arena_t **arenap) {
+    sysdep_arena_t  arena;
+    arena_chunk_t * acp;
+    sysdep_arena_t *ap;
+    int             error;
+
+    /*
+     * The arena lives in its first chunk.
+     */
+    arena.sa_sysdep = sysdep;
+    arena.sa_chunks = (arena_chunk_t *)NULL;
+    if (!(error = arena_chunk_add(&arena, arena_round(sizeof(arena)), &acp))) {
+        ap  = (sysdep_arena_t *)((unsigned char *)acp + acp->ac_used);
+        *ap = arena;
+        acp->ac_used += arena_round(sizeof(arena));
+        *arenap = ap;
+    }
+
+    return error;
+}
+
+/*
+ * Allocate "nbytes" from the arena.  Like sys_malloc, without a free.
+ */
+int
+sysdep_arena_alloc(sysdep_arena_t *arena, void *nmpp, uint64_t nbytes) {
+    void **        xnmp   = (void **)nmpp;
+    uint64_t       rbytes = arena_round(nbytes);
+    arena_chunk_t *acp;
+    int            error = 0;
+
+    if (!arena || !xnmp)
+        return EINVAL;
+    /*
+     * Large allocations get their own chunk, behind the current one, so
+     * that the rest of that can still be used.
+     */
+    acp = arena->sa_chunks;
+    if ((acp->ac_size - acp->ac_used) < rbytes) {
+        if ((rbytes > (ARENA_CHUNK / 4)) &&
+            !(error = arena_chunk_add(arena, rbytes, &acp))) {
+            arena->sa_chunks = acp->ac_next;
+            acp->ac_next     = arena->sa_chunks->ac_next;
+            arena->sa_chunks->ac_next = acp;
+        } else if (!error) {
+            error = arena_chunk_add(arena, rbytes, &acp);
+        }
+    }
+    if (!error) {
+        *xnmp = (unsigned char *)acp + acp->ac_used;
+        acp->ac_used += rbytes;
+    } else {
+        *xnmp = (void *)NULL;
+    }
+
+    return error;
+}
+
+/*
+ * Free everything allocated from the arena, and the arena.
+ */
+void
+sysdep_arena_destroy(sysdep_arena_t *arena) {
+    if (arena) {
+        const sysdep_dispatch_t *sysdep = arena->sa_sysdep;
+        arena_chunk_t *          acp    = arena->sa_chunks;
+
+        while (acp) {
+            arena_chunk_t *next = acp->ac_next;
+
+            (void)(*sysdep->sys_free)(acp);
+            acp = next;
+        }
+    }
+}
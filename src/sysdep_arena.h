@@ -0,0 +1,25 @@
+/*
+ * sysdep_arena.h - Allocation arena interface.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifndef _SYSDEP_ARENA_H_
+#define _SYSDEP_ARENA_H_ 1
+
+#include "sysdep_int.h"
+
+typedef struct sysdep_arena sysdep_arena_t;
+
+int  sysdep_arena_create(const sysdep_dispatch_t *sysdep,
+                         sysdep_arena_t **         arenap);
+int  sysdep_arena_alloc(sysdep_arena_t *arena, void *nmpp, uint64_t nbytes);
+void sysdep_arena_destroy(sysdep_arena_t *arena);
+
+#endif /* _SYSDEP_ARENA_H_ */
@@ -26,9 +26,30 @@ typedef enum sysdep_open_mode {
 typedef enum sysdep_whence {
     SYSDEP_SEEK_ABSOLUTE = 0,
     SYSDEP_SEEK_RELATIVE = 1,
-    SYSDEP_SEEK_END      = 2
+    SYSDEP_SEEK_END      = 2,
+    SYSDEP_SEEK_DATA     = 3
 } sysdep_whence_t;
 
+/*
+ * One positional read in a batch.
+ */
+typedef struct sysdep_io {
+    void *   io_rh;     /* File handle */
+    void *   io_buf;    /* Buffer to read into */
+    uint64_t io_len;    /* Length to read */
+    uint64_t io_offset; /* Offset to read from */
+    uint64_t io_nbytes; /* How many bytes read (written on completion) */
+    int      io_error;  /* Error (written on completion) */
+} sysdep_io_t;
+
+/*
+ * One piece of a gathered write.
+ */
+typedef struct sysdep_iovec {
+    void *   iv_base; /* What to write */
+    uint64_t iv_len;  /* Length of it */
+} sysdep_iovec_t;
+
 typedef struct sysdep_dispatch {
     /*
      * Open a file handle and return a pointer to it.
@@ -64,12 +85,14 @@ typedef struct sysdep_dispatch {
      * rh      - File handle.
      * offset  - Offset to seek to.
      * whence  - One of SYSDEP_SEEK_ABSOLUTE, SYSDEP_SEEK_RELATIVE or
-     *     SYSDEP_SEEK_END.
+     *     SYSDEP_SEEK_END, or SYSDEP_SEEK_DATA for the first offset at or
+     *     after "offset" which isn't in a hole.
      * resoffp - Pointer to resultant location (can be null).
      *
      * Returns:
      * - 0: Success.
-     * - EINVAL: Invalid file handle.
+     * - EINVAL: Invalid file handle, or "whence" isn't supported.
+     * - ENXIO: SYSDEP_SEEK_DATA found no data after "offset".
      * - error: Otherwise.
      */
     int (*sys_seek)(void *rh, int64_t offset, sysdep_whence_t whence,
@@ -136,6 +159,149 @@ typedef struct sysdep_dispatch {
      *  nbytes - File size.
      */
     int (*sys_file_size)(void *rh, uint64_t *nbytes);
+    /*
+     * Read data from an offset without changing the current offset.
+     *
+     * Parameters:
+     * rh     - File handle.
+     * buf    - Buffer to read into.
+     * len    - Length to read.
+     * offset - Offset to read from.
+     * nr     - How many bytes read (written on success).
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid file handle.
+     * - error: Otherwise.
+     */
+    int (*sys_pread)(void *rh, void *buf, uint64_t len, uint64_t offset,
+                     uint64_t *nr);
+    /*
+     * Write data at an offset without changing the current offset.
+     *
+     * Parameters:
+     * rh     - File handle.
+     * buf    - Buffer to write from.
+     * len    - Length to write.
+     * offset - Offset to write at.
+     * nw     - How many bytes written (written on success).
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid file handle.
+     * - error: Otherwise.
+     */
+    int (*sys_pwrite)(void *rh, void *buf, uint64_t len, uint64_t offset,
+                      uint64_t *nw);
+    /*
+     * Determine a file's modification time.
+     *
+     * Parameters:
+     * rh    - Open file handle.
+     * mtime - Modification time in nanoseconds since the epoch.
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid file handle.
+     * - error: Otherwise.
+     */
+    int (*sys_file_mtime)(void *rh, uint64_t *mtime);
+    /*
+     * Perform a batch of positional reads, possibly concurrently, and wait
+     * for them all to complete.
+     *
+     * Parameters:
+     * iop - Reads to perform.  io_nbytes and io_error are written for each.
+     * nio - Number of reads.
+     *
+     * Returns:
+     * - 0: Success.
+     * - error: First error in the batch, as per sys_pread.
+     */
+    int (*sys_pread_batch)(sysdep_io_t *iop, uint32_t nio);
+    /*
+     * Find the descriptor underlying a file handle, for callers which move
+     * data between descriptors without copying it (e.g. with sendfile).
+     *
+     * Parameters:
+     * rh - Open file handle.
+     *
+     * Returns:
+     * - >= 0: The descriptor.
+     * - -1: Invalid file handle, or the handle isn't backed by one.
+     */
+    int (*sys_fileno)(void *rh);
+    /*
+     * Make the data written to a file durable.
+     *
+     * Parameters:
+     * rh - Open file handle.
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid file handle.
+     * - error: Otherwise.
+     */
+    int (*sys_sync)(void *rh);
+    /*
+     * Map part of a file read-only, shared with other mappings of it.
+     *
+     * Parameters:
+     * rh     - Open file handle.
+     * offset - Offset to map from, a multiple of the page size.
+     * len    - Length to map.
+     * addrp  - Where the mapping is (written on success).
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid file handle.
+     * - ENOTSUP: The handle can't be mapped.
+     * - error: Otherwise.
+     */
+    int (*sys_map)(void *rh, uint64_t offset, uint64_t len, void **addrp);
+    /*
+     * Undo a mapping made with sys_map.
+     *
+     * Parameters:
+     * addr - Where the mapping is.
+     * len  - Length mapped.
+     *
+     * Returns:
+     * - 0: Success.
+     * - error: Otherwise.
+     */
+    int (*sys_unmap)(void *addr, uint64_t len);
+    /*
+     * Rename a file, replacing any file with the new name.  Anyone with the
+     * old file open or mapped keeps it.
+     *
+     * Parameters:
+     * from - Path to rename.
+     * to   - New path.
+     *
+     * Returns:
+     * - 0: Success.
+     * - error: Otherwise.
+     */
+    int (*sys_rename)(const char *from, const char *to);
+    /*
+     * Write the pieces "iov" one after another to a file at a particular
+     * offset, as one write where the system can.
+     *
+     * Parameters:
+     * rh     - Open file handle.
+     * iov    - Pieces to write.
+     * niov   - Number of pieces.
+     * offset - Offset to write the first at.
+     * nw     - How many bytes written (written on success).
+     *
+     * Returns:
+     * - 0: Success.
+     * - EINVAL: Invalid file handle.
+     * - error: Otherwise.
+     */
+    int (*sys_pwritev)(void *rh, const sysdep_iovec_t *iov, uint32_t niov,
+                       uint64_t offset, uint64_t *nw);
 } sysdep_dispatch_t;
 
 #endif /* _SYSDEP_INT_H_ */
@@ -0,0 +1,273 @@
+/*
+ * sysdep_pool.c - Request buffer pool.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+/*
+ * A pool of buffers for carrying out requests, set up once so that serving
+ * them allocates nothing.  Buffers come in size classes, doubling from the
+ * smallest up to the largest request, with enough of each for every user
+ * at once until a class gets large: then its share of the pool is bounded
+ * by POOL_CLASS_BYTES, so a burst of large requests waits for buffers
+ * rather than growing memory use.
+ *
+ * The buffers are in one mapping, backed by huge pages when the system
+ * has them to spare, and by transparent huge pages otherwise.  Pages are
+ * only touched once a buffer is used, so the pool costs little more than
+ * the largest buffers in use at once.
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "sysdep_pool.h"
+#include "libstats.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#ifdef HAVE_LIBPTHREAD
+#    include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
+
+#define POOL_MAX_CLASSES 32
+#define POOL_CLASS_BYTES (16ULL * 1024 * 1024) /* Bound on a large class */
+#define POOL_PAGE        4096ULL
+#define POOL_HUGE_PAGE   (2ULL * 1024 * 1024)
+
+typedef struct pool_class {
+    uint64_t       pc_size;  /* Size of the buffers */
+    unsigned char *pc_base;  /* First buffer */
+    void **        pc_free;  /* Free buffers */
+    uint32_t       pc_count; /* Number of buffers */
+    uint32_t       pc_nfree; /* Number free */
+} pool_class_t;
+
+struct sysdep_pool {
+    void *       sp_map;                       /* The buffers */
+    uint64_t     sp_maplen;                    /* Length of the mapping */
+    uint32_t     sp_nclasses;                  /* Number of classes */
+    pool_class_t sp_classes[POOL_MAX_CLASSES]; /* Smallest first */
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_t sp_lock;  /* Protects the free lists */
+    pthread_cond_t  sp_freed; /* A buffer has been put back */
+#endif                        /* HAVE_LIBPTHREAD */
+};
+
+static inline uint64_t
+pool_round(uint64_t n, uint64_t to) {
+    return (n + to - 1) & ~(to - 1);
+}
+
+/*
+ * Map "len" bytes for the buffers, aligned to a huge page.
+ */
+static int
+pool_map(sysdep_pool_t *pool, uint64_t len, unsigned char **basep) {
+    void *   map;
+    uint64_t maplen;
+
+#ifdef MAP_HUGETLB
+    /*
+     * Huge pages are reserved up front, so that there's no running out of
+     * them later.
+     */
+    maplen = pool_round(len, POOL_HUGE_PAGE);
+    map    = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (map != MAP_FAILED) {
+        pool->sp_map    = map;
+        pool->sp_maplen = maplen;
+        *basep          = (unsigned char *)map;
+        return 0;
+    }
+#endif /* MAP_HUGETLB */
+    maplen = pool_round(len, POOL_PAGE) + POOL_HUGE_PAGE;
+    map    = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+        return errno;
+    pool->sp_map    = map;
+    pool->sp_maplen = maplen;
+    *basep = (unsigned char *)pool_round((uintptr_t)map, POOL_HUGE_PAGE);
+#ifdef MADV_HUGEPAGE
+    (void)madvise(*basep, pool_round(len, POOL_PAGE), MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+
+    return 0;
+}
+
+/*
+ * Create a pool of buffers from "minsize" up to "maxsize" bytes, for
+ * "nusers" users at once.
+ */
+int
+sysdep_pool_create(uint64_t minsize, uint64_t maxsize, uint32_t nusers,
+                   sysdep_pool_t **poolp) {
+    sysdep_pool_t *pool;
+    void **        frees;
+    uint64_t       size;
+    unsigned char *base   = (unsigned char *)NULL;
+    uint64_t       len    = 0;
+    uint64_t       nfrees = 0;
+    uint32_t       c;
+    uint32_t       i;
+    int            error;
+
+    if (!minsize || (minsize > maxsize) || !nusers)
+        return EINVAL;
+    if (!(pool = (sysdep_pool_t *)calloc(1, sizeof(*pool))))
+        return ENOMEM;
+
+    /*
+     * Size the classes.  Large ones start on a huge page.
+     */
+    minsize = pool_round(minsize, POOL_PAGE);
+    maxsize = pool_round(maxsize, POOL_PAGE);
+    for (size = minsize; pool->sp_nclasses < POOL_MAX_CLASSES;
+         size = (size < maxsize / 2) ? size * 2 : maxsize) {
+        pool_class_t *pcp = &pool->sp_classes[pool->sp_nclasses++];
+
+        pcp->pc_size  = size;
+        pcp->pc_count = ((size * nusers) <= POOL_CLASS_BYTES)
+                            ? nusers
+                            : (uint32_t)(POOL_CLASS_BYTES / size);
+        if (!pcp->pc_count)
+            pcp->pc_count = 1;
+        if (size >= POOL_HUGE_PAGE)
+            len = pool_round(len, POOL_HUGE_PAGE);
+        pcp->pc_base = (unsigned char *)(uintptr_t)len;
+        len += size * pcp->pc_count;
+        nfrees += pcp->pc_count;
+        if (size == maxsize)
+            break;
+    }
+
+    if (!(frees = (void **)malloc(nfrees * sizeof(*frees)))) {
+        free(pool);
+        return ENOMEM;
+    }
+    if ((error = pool_map(pool, len, &base))) {
+        free(frees);
+        free(pool);
+        return error;
+    }
+    for (c = 0; c < pool->sp_nclasses; c++) {
+        pool_class_t *pcp = &pool->sp_classes[c];
+
+        pcp->pc_base  = base + (uintptr_t)pcp->pc_base;
+        pcp->pc_free  = frees;
+        pcp->pc_nfree = pcp->pc_count;
+        frees += pcp->pc_count;
+        /*
+         * Hand out the lowest buffers first, so that fewer pages are
+         * touched.
+         */
+        for (i = 0; i < pcp->pc_count; i++)
+            pcp->pc_free[i] =
+                pcp->pc_base + (pcp->pc_count - 1 - i) * pcp->pc_size;
+    }
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_init(&pool->sp_lock, NULL);
+    pthread_cond_init(&pool->sp_freed, NULL);
+#endif /* HAVE_LIBPTHREAD */
+    *poolp = pool;
+
+    return 0;
+}
+
+/*
+ * Take a free buffer of the smallest class holding "size" bytes, or of a
+ * larger class when those are all in use.  Take an unused one, rather than
+ * waiting, when there is one.
+ */
+static void *
+pool_take(sysdep_pool_t *pool, uint64_t size) {
+    uint32_t c;
+
+    for (c = 0; c < pool->sp_nclasses; c++) {
+        pool_class_t *pcp = &pool->sp_classes[c];
+
+        if ((pcp->pc_size >= size) && pcp->pc_nfree)
+            return pcp->pc_free[--pcp->pc_nfree];
+    }
+
+    return (void *)NULL;
+}
+
+/*
+ * Get a buffer of at least "size" bytes, waiting for one if need be.
+ */
+int
+sysdep_pool_get(sysdep_pool_t *pool, uint64_t size, void **bufp) {
+    void *buf;
+
+    if (!pool || (size > pool->sp_classes[pool->sp_nclasses - 1].pc_size))
+        return EINVAL;
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_lock(&pool->sp_lock);
+    if (!(buf = pool_take(pool, size))) {
+        uint64_t start = stats_start();
+
+        while (!(buf = pool_take(pool, size)))
+            pthread_cond_wait(&pool->sp_freed, &pool->sp_lock);
+        stats_end(STATS_POOL_WAIT, start, 1, 0);
+    }
+    pthread_mutex_unlock(&pool->sp_lock);
+#else  /* HAVE_LIBPTHREAD */
+    if (!(buf = pool_take(pool, size)))
+        return ENOBUFS;
+#endif /* HAVE_LIBPTHREAD */
+    *bufp = buf;
+
+    return 0;
+}
+
+/*
+ * Put back a buffer got from the pool.
+ */
+void
+sysdep_pool_put(sysdep_pool_t *pool, void *buf) {
+    unsigned char *bp = (unsigned char *)buf;
+    uint32_t       c;
+
+    if (!pool || !buf)
+        return;
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_lock(&pool->sp_lock);
+#endif /* HAVE_LIBPTHREAD */
+    for (c = 0; c < pool->sp_nclasses; c++) {
+        pool_class_t *pcp = &pool->sp_classes[c];
+
+        if ((bp >= pcp->pc_base) &&
+            (bp < pcp->pc_base + pcp->pc_size * pcp->pc_count)) {
+            pcp->pc_free[pcp->pc_nfree++] = buf;
+            break;
+        }
+    }
+#ifdef HAVE_LIBPTHREAD
+    pthread_cond_broadcast(&pool->sp_freed);
+    pthread_mutex_unlock(&pool->sp_lock);
+#endif /* HAVE_LIBPTHREAD */
+}
+
+/*
+ * Destroy a pool, once none of its buffers are in use.
+ */
+void
+sysdep_pool_destroy(sysdep_pool_t *pool) {
+    if (pool) {
+#ifdef HAVE_LIBPTHREAD
+        pthread_cond_destroy(&pool->sp_freed);
+        pthread_mutex_destroy(&pool->sp_lock);
+#endif /* HAVE_LIBPTHREAD */
+        (void)munmap(pool->sp_map, pool->sp_maplen);
+        free(pool->sp_classes[0].pc_free);
+        free(pool);
+    }
+}
@@ -0,0 +1,26 @@
+/*
+ * sysdep_pool.h - Request buffer pool interface.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifndef _SYSDEP_POOL_H_
+#define _SYSDEP_POOL_H_ 1
+
+#include <stdint.h>
+
+typedef struct sysdep_pool sysdep_pool_t;
+
+int  sysdep_pool_create(uint64_t minsize, uint64_t maxsize, uint32_t nusers,
+                        sysdep_pool_t **poolp);
+int  sysdep_pool_get(sysdep_pool_t *pool, uint64_t size, void **bufp);
+void sysdep_pool_put(sysdep_pool_t *pool, void *buf);
+void sysdep_pool_destroy(sysdep_pool_t *pool);
+
+#endif /* _SYSDEP_POOL_H_ */
@@ -10,17 +10,32 @@
  * any later version.
  *
  */
+#define _GNU_SOURCE 1 /* For SEEK_DATA */
 #ifdef HAVE_CONFIG_H
 #    include "config.h"
 #endif /* HAVE_CONFIG_H */
+#ifdef POSIX_NO_PWRITEV
+/*
+ * Use the pwrite() loop even where there's pwritev(), to test it.
+ */
+#    undef HAVE_PWRITEV
+#endif /* POSIX_NO_PWRITEV */
+#include "libstats.h"
 #include "sysdep_posix.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifdef HAVE_PWRITEV
+#    include <sys/uio.h>
+#endif /* HAVE_PWRITEV */
 #include <unistd.h>
 
+#define POSIX_IOV_MAX 512 /* Pieces passed to the system at once */
+
 static const int omode2flags[] = {0, O_RDONLY | O_LARGEFILE,
                                   O_RDWR | O_LARGEFILE, O_WRONLY | O_LARGEFILE,
                                   O_RDWR | O_CREAT | O_LARGEFILE};
@@ -89,20 +104,41 @@ posix_closex(void *rh) {
  * Parameters:
  * rh      - File handle.
  * offset  - Offset to seek to.
- * whence  - One of SYSDEP_SEEK_ABSOLUTE, SYSDEP_SEEK_RELATIVE or
- * SYSDEP_SEEK_END.
+ * whence  - One of SYSDEP_SEEK_ABSOLUTE, SYSDEP_SEEK_RELATIVE,
+ * SYSDEP_SEEK_END or SYSDEP_SEEK_DATA.
  * resoffp - Pointer to resultant location (can be null).
  *
  * Returns:
  * - 0: Success.
- * - EINVAL: Invalid file handle.
+ * - EINVAL: Invalid file handle or unsupported "whence".
  */
 static int
 posix_seek(void *rh, int64_t offset, sysdep_whence_t whence,
            uint64_t *resoffp) {
     int *fhp = (int *)rh;
     if (fhp) {
-        off_t poffs = lseek(*fhp, offset, (int)whence);
+        int   pwhence;
+        off_t poffs;
+
+        switch (whence) {
+        case SYSDEP_SEEK_ABSOLUTE:
+            pwhence = SEEK_SET;
+            break;
+        case SYSDEP_SEEK_RELATIVE:
+            pwhence = SEEK_CUR;
+            break;
+        case SYSDEP_SEEK_END:
+            pwhence = SEEK_END;
+            break;
+#ifdef SEEK_DATA
+        case SYSDEP_SEEK_DATA:
+            pwhence = SEEK_DATA;
+            break;
+#endif /* SEEK_DATA */
+        default:
+            return EINVAL;
+        }
+        poffs = lseek(*fhp, offset, pwhence);
         if (resoffp)
             *resoffp = (uint64_t)poffs;
         return (poffs >= 0) ? 0 : errno;
@@ -176,6 +212,8 @@ posix_write(void *rh, void *buf, uint64_t len, uint64_t *nw) {
 static int
 posix_malloc(void *nmpp, uint64_t nbytes) {
     void **xnmp = (void **)nmpp;
+
+    stats_count(STATS_ALLOC, nbytes);
     return (xnmp) ? (((*xnmp = malloc(nbytes))) ? 0 : ENOMEM) : EINVAL;
 }
 
@@ -228,6 +266,275 @@ posix_file_size(void *rh, uint64_t *nbytes) {
     return error;
 }
 
+/*
+ * Read data from an offset without changing the current offset.
+ *
+ * Parameters:
+ * rh     - File handle.
+ * buf    - Buffer to read into.
+ * len    - Length to read.
+ * offset - Offset to read from.
+ * nr     - How many bytes read (written on success).
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid file handle.
+ * - EIO: Short read.
+ * - error: Otherwise.
+ */
+static int
+posix_pread(void *rh, void *buf, uint64_t len, uint64_t offset, uint64_t *nr) {
+    int *fhp = (int *)rh;
+    if (fhp) {
+        ssize_t nread = pread(*fhp, buf, len, (off_t)offset);
+        *nr           = nread;
+        return (*nr == len) ? 0 : ((nread < 0) ? errno : EIO);
+    } else {
+        return EINVAL;
+    }
+}
+
+/*
+ * Write data at an offset without changing the current offset.
+ *
+ * Parameters:
+ * rh     - File handle.
+ * buf    - Buffer to write from.
+ * len    - Length to write.
+ * offset - Offset to write at.
+ * nw     - How many bytes written (written on success).
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid file handle.
+ * - EIO: Short write.
+ * - error: Otherwise.
+ */
+static int
+posix_pwrite(void *rh, void *buf, uint64_t len, uint64_t offset,
+             uint64_t *nw) {
+    int *fhp = (int *)rh;
+    if (fhp) {
+        ssize_t nwritten = pwrite(*fhp, buf, len, (off_t)offset);
+        *nw              = nwritten;
+        return (*nw == len) ? 0 : ((nwritten < 0) ? errno : EIO);
+    } else {
+        return EINVAL;
+    }
+}
+
+/*
+ * Determine a file's modification time.
+ *
+ * Parameters:
+ * rh    - Open file handle.
+ * mtime - Modification time in nanoseconds since the epoch.
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid file handle.
+ * - error: Otherwise.
+ */
+static int
+posix_file_mtime(void *rh, uint64_t *mtime) {
+    int  error = EINVAL;
+    int *fhp   = (int *)rh;
+    if (fhp) {
+        struct stat sbuf;
+        if ((error = (fstat(*fhp, &sbuf) == 0) ? 0 : errno) == 0) {
+            *mtime = ((uint64_t)sbuf.st_mtim.tv_sec * 1000000000) +
+                     sbuf.st_mtim.tv_nsec;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Perform a batch of positional reads, one at a time.
+ *
+ * Parameters:
+ * iop - Reads to perform.
+ * nio - Number of reads.
+ *
+ * Returns:
+ * - 0: Success.
+ * - error: First error in the batch.
+ */
+static int
+posix_pread_batch(sysdep_io_t *iop, uint32_t nio) {
+    int      error = 0;
+    uint32_t iidx;
+
+    for (iidx = 0; iidx < nio; iidx++) {
+        iop[iidx].io_error =
+            posix_pread(iop[iidx].io_rh, iop[iidx].io_buf, iop[iidx].io_len,
+                        iop[iidx].io_offset, &iop[iidx].io_nbytes);
+        if (!error)
+            error = iop[iidx].io_error;
+    }
+
+    return error;
+}
+
+/*
+ * Find the descriptor underlying a file handle.
+ *
+ * Parameters:
+ * rh - File handle.
+ *
+ * Returns:
+ * - >= 0: The descriptor.
+ * - -1: Invalid file handle.
+ */
+static int
+posix_fileno(void *rh) {
+    int *fhp = (int *)rh;
+
+    return (fhp) ? *fhp : -1;
+}
+
+/*
+ * Make the data written to a file durable.
+ *
+ * Parameters:
+ * rh - File handle.
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid file handle.
+ * - error: Otherwise.
+ */
+static int
+posix_sync(void *rh) {
+    int *fhp = (int *)rh;
+
+    return (fhp) ? ((fdatasync(*fhp) == 0) ? 0 : errno) : EINVAL;
+}
+
+/*
+ * Map part of a file read-only, shared with other mappings of it.
+ *
+ * Parameters:
+ * rh     - File handle.
+ * offset - Offset to map from, a multiple of the page size.
+ * len    - Length to map.
+ * addrp  - Where the mapping is (written on success).
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid file handle.
+ * - error: Otherwise.
+ */
+static int
+posix_map(void *rh, uint64_t offset, uint64_t len, void **addrp) {
+    int * fhp = (int *)rh;
+    void *addr;
+
+    if (!fhp || !len)
+        return EINVAL;
+    if ((addr = mmap(NULL, len, PROT_READ, MAP_SHARED, *fhp, (off_t)offset)) ==
+        MAP_FAILED)
+        return errno;
+    *addrp = addr;
+
+    return 0;
+}
+
+/*
+ * Undo a mapping made with posix_map().
+ *
+ * Parameters:
+ * addr - Where the mapping is.
+ * len  - Length mapped.
+ *
+ * Returns:
+ * - 0: Success.
+ * - error: Otherwise.
+ */
+static int
+posix_unmap(void *addr, uint64_t len) {
+    return (munmap(addr, len) == 0) ? 0 : errno;
+}
+
+/*
+ * Rename a file, replacing any file with the new name.
+ *
+ * Parameters:
+ * from - Path to rename.
+ * to   - New path.
+ *
+ * Returns:
+ * - 0: Success.
+ * - error: Otherwise.
+ */
+static int
+posix_rename(const char *from, const char *to) {
+    return (rename(from, to) == 0) ? 0 : errno;
+}
+
+/*
+ * Write pieces one after another at a particular offset.
+ *
+ * Parameters:
+ * rh     - Open file handle.
+ * iov    - Pieces to write.
+ * niov   - Number of pieces.
+ * offset - Offset to write the first at.
+ * nw     - How many bytes written (written on success).
+ *
+ * Returns:
+ * - 0: Success.
+ * - EINVAL: Invalid file handle.
+ * - error: Otherwise.
+ */
+static int
+posix_pwritev(void *rh, const sysdep_iovec_t *iov, uint32_t niov,
+              uint64_t offset, uint64_t *nw) {
+    int *    fhp   = (int *)rh;
+    int      error = 0;
+    uint64_t total = 0;
+
+    if (!fhp)
+        return EINVAL;
+#ifdef HAVE_PWRITEV
+    while (!error && niov) {
+        struct iovec siov[POSIX_IOV_MAX];
+        uint32_t     n   = (niov > POSIX_IOV_MAX) ? POSIX_IOV_MAX : niov;
+        uint64_t     len = 0;
+        uint32_t     i;
+        ssize_t      nwritten;
+
+        for (i = 0; i < n; i++) {
+            siov[i].iov_base = iov[i].iv_base;
+            siov[i].iov_len  = iov[i].iv_len;
+            len += iov[i].iv_len;
+        }
+        nwritten = pwritev(*fhp, siov, (int)n, (off_t)(offset + total));
+        if (nwritten > 0)
+            total += nwritten;
+        if ((uint64_t)nwritten != len)
+            error = (nwritten < 0) ? errno : EIO;
+        iov += n;
+        niov -= n;
+    }
+#else  /* HAVE_PWRITEV */
+    for (; !error && niov; iov++, niov--) {
+        uint64_t nwritten = 0;
+
+        error = posix_pwrite(rh, iov->iv_base, iov->iv_len, offset + total,
+                             &nwritten);
+        total += nwritten;
+    }
+#endif /* HAVE_PWRITEV */
+    *nw = total;
+
+    return error;
+}
+
 const sysdep_dispatch_t posix_dispatch = {
-    posix_open,  posix_closex, posix_seek, posix_read,
-    posix_write, posix_malloc, posix_free, posix_file_size};
+    posix_open,   posix_closex, posix_seek,       posix_read,
+    posix_write,  posix_malloc, posix_free,       posix_file_size,
+    posix_pread,  posix_pwrite, posix_file_mtime, posix_pread_batch,
+    posix_fileno, posix_sync,   posix_map,        posix_unmap,
+    posix_rename, posix_pwritev};
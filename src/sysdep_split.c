@@ -0,0 +1,793 @@
+/*
+ * sysdep_split.c - System-dependent interface for split files.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+/*
+ * Images are often cut into pieces by split(1) ("image.aa", "image.ab",
+ * ...) to fit on media or file systems with a small largest file.  Opening
+ * the first piece read-only, or the name the pieces were split from when it
+ * doesn't exist itself, presents the pieces as one read-only file.
+ * Everything else is passed through to the interface underneath.
+ *
+ * Suffixes are two or more letters or digits, in split's order, including
+ * its widening of them when it runs short ("yz" is followed by "zaaa", and
+ * "89" by "9000").
+ *
+ * split(1) makes every piece but the last the same size, so the piece
+ * holding an offset is found by dividing by it; pieces of other sizes are
+ * found by binary search.  Pieces are opened when they are first read, and
+ * their handles go in a cache shared by all split files.  Once more than
+ * SPLIT_MAX_OPEN are open, the least recently used idle ones are closed.
+ * A read running from one piece into the next becomes a read of each,
+ * issued together as a batch to the interface underneath, which may carry
+ * them out concurrently.
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "sysdep_split.h"
+#include "libstats.h"
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_LIBPTHREAD
+#    include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
+
+#define SPLIT_MAX_OPEN 32 /* Piece handles to keep open */
+#define SPLIT_NIOS     16 /* Reads in a batch before it's allocated */
+
+/*
+ * A piece.  Its handle is neither closed nor changed while it has
+ * references; without them, it's on the idle list.
+ */
+typedef struct split_piece {
+    struct split_piece *sp_prev;   /* Previous idle piece */
+    struct split_piece *sp_next;   /* Next idle piece */
+    char *              sp_path;   /* Path */
+    uint64_t            sp_offset; /* Offset in the whole */
+    uint64_t            sp_size;   /* Size */
+    void *              sp_fd;     /* Handle, while open */
+    int                 sp_refs;   /* Reads using the handle */
+} split_piece_t;
+
+/*
+ * File handle.  With sf_fd, operations are passed through to it.
+ */
+typedef struct split_file {
+    void *         sf_fd;        /* Handle of a file which isn't split */
+    split_piece_t *sf_pieces;    /* Pieces, in order */
+    uint32_t       sf_npieces;   /* Number of pieces */
+    uint32_t       sf_maxpieces; /* Room for this many */
+    uint64_t       sf_psize;     /* Size of all but the last piece, or 0 */
+    uint64_t       sf_size;      /* Total size */
+    uint64_t       sf_mtime;     /* Newest modification time */
+    uint64_t       sf_offset;    /* Current offset */
+} split_file_t;
+
+/*
+ * Where a piece's part of a read goes.
+ */
+typedef struct split_part {
+    split_piece_t *pt_piece; /* Piece read, or null when passed through */
+    uint32_t       pt_owner; /* Read it's part of */
+} split_part_t;
+
+/*
+ * The interface underneath.  A program uses the one, so it's set once.
+ */
+static const sysdep_dispatch_t *split_lower = (const sysdep_dispatch_t *)NULL;
+
+/*
+ * The cache of piece handles: how many are open, and the idle ones, least
+ * recently used first.
+ */
+static uint32_t       split_nopen     = 0;
+static split_piece_t *split_idle_head = (split_piece_t *)NULL;
+static split_piece_t *split_idle_tail = (split_piece_t *)NULL;
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t split_lock = PTHREAD_MUTEX_INITIALIZER;
+#    define SPLIT_LOCK()   pthread_mutex_lock(&split_lock)
+#    define SPLIT_UNLOCK() pthread_mutex_unlock(&split_lock)
+#else /* HAVE_LIBPTHREAD */
+#    define SPLIT_LOCK()
+#    define SPLIT_UNLOCK()
+#endif /* HAVE_LIBPTHREAD */
+
+static void
+split_idle_remove(split_piece_t *spp) {
+    if (spp->sp_prev)
+        spp->sp_prev->sp_next = spp->sp_next;
+    else
+        split_idle_head = spp->sp_next;
+    if (spp->sp_next)
+        spp->sp_next->sp_prev = spp->sp_prev;
+    else
+        split_idle_tail = spp->sp_prev;
+    spp->sp_prev = spp->sp_next = (split_piece_t *)NULL;
+}
+
+static void
+split_idle_append(split_piece_t *spp) {
+    spp->sp_prev = split_idle_tail;
+    spp->sp_next = (split_piece_t *)NULL;
+    if (split_idle_tail)
+        split_idle_tail->sp_next = spp;
+    else
+        split_idle_head = spp;
+    split_idle_tail = spp;
+}
+
+/*
+ * Get a reference to a piece's handle, opening it if need be.  Opening is
+ * rare enough to do under the lock.
+ */
+static int
+split_piece_hold(split_piece_t *spp) {
+    int error = 0;
+
+    SPLIT_LOCK();
+    if (spp->sp_fd) {
+        if (!spp->sp_refs++)
+            split_idle_remove(spp);
+    } else {
+        /*
+         * Handles in use can't be closed, so with enough reads at once
+         * there may briefly be more than SPLIT_MAX_OPEN.
+         */
+        while ((split_nopen >= SPLIT_MAX_OPEN) && split_idle_head) {
+            split_piece_t *vpp = split_idle_head;
+
+            split_idle_remove(vpp);
+            (void)(*split_lower->sys_close)(vpp->sp_fd);
+            vpp->sp_fd = (void *)NULL;
+            split_nopen--;
+        }
+        if (!(error = (*split_lower->sys_open)(&spp->sp_fd, spp->sp_path,
+                                               SYSDEP_OPEN_RO))) {
+            spp->sp_refs = 1;
+            split_nopen++;
+            stats_count(STATS_SPLIT_OPEN, 1);
+        }
+    }
+    SPLIT_UNLOCK();
+
+    return error;
+}
+
+static void
+split_piece_release(split_piece_t *spp) {
+    SPLIT_LOCK();
+    if (!--spp->sp_refs)
+        split_idle_append(spp);
+    SPLIT_UNLOCK();
+}
+
+/*
+ * Add a piece to the file.
+ */
+static int
+split_add_piece(split_file_t *sfp, const char *path, uint64_t size,
+                uint64_t mtime) {
+    int            error;
+    split_piece_t *spp;
+
+    if (sfp->sf_npieces == sfp->sf_maxpieces) {
+        uint32_t       nmax = (sfp->sf_maxpieces) ? 2 * sfp->sf_maxpieces : 64;
+        split_piece_t *npieces;
+
+        if ((error = (*split_lower->sys_malloc)(
+                 &npieces, nmax * sizeof(split_piece_t))))
+            return error;
+        if (sfp->sf_pieces) {
+            memcpy(npieces, sfp->sf_pieces,
+                   sfp->sf_npieces * sizeof(split_piece_t));
+            (void)(*split_lower->sys_free)(sfp->sf_pieces);
+        }
+        sfp->sf_pieces    = npieces;
+        sfp->sf_maxpieces = nmax;
+    }
+    spp = &sfp->sf_pieces[sfp->sf_npieces];
+    memset(spp, 0, sizeof(*spp));
+    if ((error = (*split_lower->sys_malloc)(&spp->sp_path, strlen(path) + 1)))
+        return error;
+    memcpy(spp->sp_path, path, strlen(path) + 1);
+    spp->sp_offset = sfp->sf_size;
+    spp->sp_size   = size;
+    sfp->sf_npieces++;
+    sfp->sf_size += size;
+    if (mtime > sfp->sf_mtime)
+        sfp->sf_mtime = mtime;
+
+    return 0;
+}
+
+/*
+ * Where the suffix starts in "path" if it names a first piece ("aa",
+ * "000", ...), or 0 if it doesn't.
+ */
+static size_t
+split_suffix(const char *path) {
+    const char *dot = strrchr(path, '.');
+    const char *cp;
+
+    if (!dot || (strlen(dot + 1) < 2) || ((dot[1] != 'a') && (dot[1] != '0')))
+        return 0;
+    for (cp = dot + 1; *cp; cp++)
+        if (*cp != dot[1])
+            return 0;
+
+    return (dot + 1) - path;
+}
+
+static size_t
+split_leading(const char *suffix, char c) {
+    size_t n = 0;
+
+    while (suffix[n] == c)
+        n++;
+
+    return n;
+}
+
+/*
+ * Make the name of the piece after "path", whose suffix starts at "soff",
+ * with room to widen it.  "widenp" says whether split(1) would have: when
+ * the suffix gains a leading "z" (or "9").
+ *
+ * Returns:
+ * - 0: Success.
+ * - ENOSPC: There's no suffix after this one.
+ * - error: Otherwise.
+ */
+static int
+split_next_name(const char *path, size_t soff, char **nextp, int *widenp) {
+    size_t len = strlen(path);
+    char   lo  = (path[soff] >= 'a') ? 'a' : '0';
+    char   hi  = (lo == 'a') ? 'z' : '9';
+    char * next;
+    char * cp;
+    int    error;
+
+    if ((error = (*split_lower->sys_malloc)(&next, len + 3)))
+        return error;
+    memcpy(next, path, len + 1);
+    for (cp = next + len - 1; *cp == hi; cp--) {
+        if (cp == (next + soff)) {
+            (void)(*split_lower->sys_free)(next);
+            return ENOSPC;
+        }
+        *cp = lo;
+    }
+    (*cp)++;
+    *widenp = (split_leading(next + soff, hi) > split_leading(path + soff, hi));
+    *nextp  = next;
+
+    return 0;
+}
+
+/*
+ * Find the pieces starting with "path", whose suffix starts at "soff".
+ * The first is left open in "firstp".
+ */
+static int
+split_index(split_file_t *sfp, const char *path, size_t soff, void **firstp) {
+    char *name = (char *)NULL;
+    void *fd;
+    int   error;
+    int   done = 0;
+
+    if ((error = (*split_lower->sys_open)(&fd, path, SYSDEP_OPEN_RO)))
+        return error;
+    *firstp = fd;
+    if (!(error = (*split_lower->sys_malloc)(&name, strlen(path) + 1)))
+        memcpy(name, path, strlen(path) + 1);
+    while (!error && !done) {
+        uint64_t size;
+        uint64_t mtime;
+        char *   next;
+        int      widen;
+
+        if (!(error = (*split_lower->sys_file_size)(fd, &size)) &&
+            !(error = (*split_lower->sys_file_mtime)(fd, &mtime)))
+            error = split_add_piece(sfp, name, size, mtime);
+        if (fd != *firstp)
+            (void)(*split_lower->sys_close)(fd);
+        if (error)
+            break;
+        if ((error = split_next_name(name, soff, &next, &widen))) {
+            done  = (error == ENOSPC);
+            error = (done) ? 0 : error;
+            break;
+        }
+        (void)(*split_lower->sys_free)(name);
+        name  = next;
+        error = (*split_lower->sys_open)(&fd, name, SYSDEP_OPEN_RO);
+        if ((error == ENOENT) && widen) {
+            /*
+             * split(1) widens "za" to "zaaa", "90" to "9000", and so on.
+             */
+            size_t len = strlen(name);
+            char   lo  = (name[soff] >= 'a') ? 'a' : '0';
+
+            name[len]     = lo;
+            name[len + 1] = lo;
+            name[len + 2] = '\0';
+            error = (*split_lower->sys_open)(&fd, name, SYSDEP_OPEN_RO);
+        }
+        if (error == ENOENT) {
+            error = 0;
+            done  = 1;
+        }
+    }
+    if (name)
+        (void)(*split_lower->sys_free)(name);
+    if (error) {
+        (void)(*split_lower->sys_close)(*firstp);
+        *firstp = (void *)NULL;
+    }
+
+    return error;
+}
+
+static uint32_t
+split_piece_of(split_file_t *sfp, uint64_t offset) {
+    uint32_t lo = 0;
+    uint32_t hi = sfp->sf_npieces;
+
+    if (sfp->sf_psize) {
+        uint64_t pidx = offset / sfp->sf_psize;
+
+        return (pidx < hi) ? pidx : hi - 1;
+    }
+    while ((hi - lo) > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (sfp->sf_pieces[mid].sp_offset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/*
+ * Divide a read into reads of the pieces it covers, if "lios" is given,
+ * and say how many there are.  Reads past the end are cut short.
+ */
+static uint32_t
+split_parts(split_file_t *sfp, sysdep_io_t *iop, uint32_t owner,
+            sysdep_io_t *lios, split_part_t *parts) {
+    unsigned char *bp     = (unsigned char *)iop->io_buf;
+    uint64_t       offset = iop->io_offset;
+    uint64_t       end    = offset;
+    uint32_t       n      = 0;
+    uint32_t       pidx;
+
+    if (sfp->sf_fd) {
+        if (lios) {
+            lios[0]           = *iop;
+            lios[0].io_rh     = sfp->sf_fd;
+            parts[0].pt_piece = (split_piece_t *)NULL;
+            parts[0].pt_owner = owner;
+        }
+        return 1;
+    }
+    if (offset < sfp->sf_size)
+        end += (iop->io_len < (sfp->sf_size - offset)) ? iop->io_len
+                                                       : sfp->sf_size - offset;
+    for (pidx = split_piece_of(sfp, offset); offset < end; pidx++) {
+        split_piece_t *spp  = &sfp->sf_pieces[pidx];
+        uint64_t       plen = (spp->sp_offset + spp->sp_size) - offset;
+
+        if (plen > (end - offset))
+            plen = end - offset;
+        if (!plen)
+            continue;
+        if (lios) {
+            lios[n].io_rh     = (void *)NULL;
+            lios[n].io_buf    = bp;
+            lios[n].io_len    = plen;
+            lios[n].io_offset = offset - spp->sp_offset;
+            lios[n].io_nbytes = 0;
+            lios[n].io_error  = 0;
+            parts[n].pt_piece = spp;
+            parts[n].pt_owner = owner;
+        }
+        bp += plen;
+        offset += plen;
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Carry out a batch of reads as one batch of reads of the pieces, and of
+ * the files which aren't split.
+ */
+static int
+split_batch(sysdep_io_t *iop, uint32_t nio) {
+    sysdep_io_t   sios[SPLIT_NIOS];
+    split_part_t  sparts[SPLIT_NIOS];
+    sysdep_io_t * lios  = sios;
+    split_part_t *parts = sparts;
+    uint32_t      nparts;
+    uint32_t      nheld;
+    uint32_t      iidx;
+    uint32_t      pidx;
+    int           error = 0;
+
+    for (iidx = 0; iidx < nio; iidx++) {
+        iop[iidx].io_nbytes = 0;
+        iop[iidx].io_error  = (iop[iidx].io_rh) ? 0 : EINVAL;
+    }
+    for (iidx = 0, nparts = 0; iidx < nio; iidx++)
+        if (iop[iidx].io_rh)
+            nparts += split_parts((split_file_t *)iop[iidx].io_rh, &iop[iidx],
+                                  iidx, (sysdep_io_t *)NULL,
+                                  (split_part_t *)NULL);
+    if ((nparts > SPLIT_NIOS) &&
+        !(error = (*split_lower->sys_malloc)(
+              &lios, nparts * (sizeof(*lios) + sizeof(*parts)))))
+        parts = (split_part_t *)(lios + nparts);
+    if (error)
+        return error;
+    for (iidx = 0, pidx = 0; iidx < nio; iidx++)
+        if (iop[iidx].io_rh)
+            pidx += split_parts((split_file_t *)iop[iidx].io_rh, &iop[iidx],
+                                iidx, &lios[pidx], &parts[pidx]);
+    for (nheld = 0; !error && (nheld < nparts); nheld++)
+        if (parts[nheld].pt_piece &&
+            !(error = split_piece_hold(parts[nheld].pt_piece)))
+            lios[nheld].io_rh = parts[nheld].pt_piece->sp_fd;
+    if (error)
+        nheld--;
+    else if (nparts == 1)
+        lios[0].io_error = (*split_lower->sys_pread)(
+            lios[0].io_rh, lios[0].io_buf, lios[0].io_len, lios[0].io_offset,
+            &lios[0].io_nbytes);
+    else if (nparts)
+        (void)(*split_lower->sys_pread_batch)(lios, nparts);
+    for (pidx = 0; pidx < nheld; pidx++)
+        if (parts[pidx].pt_piece)
+            split_piece_release(parts[pidx].pt_piece);
+    for (pidx = 0; !error && (pidx < nparts); pidx++) {
+        sysdep_io_t *owner = &iop[parts[pidx].pt_owner];
+
+        owner->io_nbytes += lios[pidx].io_nbytes;
+        if (!owner->io_error)
+            owner->io_error = lios[pidx].io_error;
+    }
+    for (iidx = 0; iidx < nio; iidx++) {
+        if (error)
+            iop[iidx].io_error = error;
+        else if (!iop[iidx].io_error &&
+                 (iop[iidx].io_nbytes != iop[iidx].io_len))
+            iop[iidx].io_error = EIO;
+        if (!error)
+            error = iop[iidx].io_error;
+    }
+    if (lios != sios)
+        (void)(*split_lower->sys_free)(lios);
+
+    return error;
+}
+
+static void
+split_destroy(split_file_t *sfp) {
+    uint32_t pidx;
+
+    SPLIT_LOCK();
+    for (pidx = 0; pidx < sfp->sf_npieces; pidx++) {
+        split_piece_t *spp = &sfp->sf_pieces[pidx];
+
+        if (spp->sp_fd) {
+            split_idle_remove(spp);
+            (void)(*split_lower->sys_close)(spp->sp_fd);
+            split_nopen--;
+        }
+        (void)(*split_lower->sys_free)(spp->sp_path);
+    }
+    SPLIT_UNLOCK();
+    if (sfp->sf_pieces)
+        (void)(*split_lower->sys_free)(sfp->sf_pieces);
+    if (sfp->sf_fd)
+        (void)(*split_lower->sys_close)(sfp->sf_fd);
+    (void)(*split_lower->sys_free)(sfp);
+}
+
+/*
+ * Open a file handle.  A first piece, or the name pieces were split from,
+ * opened read-only gets the pieces; the rest are passed through.  A single
+ * piece is passed through too.
+ */
+static int
+split_open(void *rhp, const char *p, sysdep_open_mode_t omode) {
+    static const char *firsts[] = {".aa", ".00"};
+    split_file_t **    sfpp     = (split_file_t **)rhp;
+    split_file_t *     sfp;
+    void *             first = (void *)NULL;
+    size_t             soff;
+    int                error;
+
+    if ((error = (*split_lower->sys_malloc)(&sfp, sizeof(*sfp))))
+        return error;
+    memset(sfp, 0, sizeof(*sfp));
+    if (omode != SYSDEP_OPEN_RO) {
+        error = (*split_lower->sys_open)(&sfp->sf_fd, p, omode);
+    } else if ((soff = split_suffix(p))) {
+        error = split_index(sfp, p, soff, &first);
+    } else if ((error = (*split_lower->sys_open)(&sfp->sf_fd, p, omode)) ==
+               ENOENT) {
+        char *name;
+        int   fidx;
+
+        if (!(error = (*split_lower->sys_malloc)(&name, strlen(p) + 4))) {
+            for (fidx = 0, error = ENOENT;
+                 (error == ENOENT) &&
+                 (fidx < (int)(sizeof(firsts) / sizeof(firsts[0])));
+                 fidx++) {
+                strcpy(name, p);
+                strcat(name, firsts[fidx]);
+                error = split_index(sfp, name, strlen(p) + 1, &first);
+            }
+            (void)(*split_lower->sys_free)(name);
+        }
+    }
+    if (!error && first) {
+        if (sfp->sf_npieces == 1) {
+            sfp->sf_fd = first;
+        } else {
+            uint64_t psize = sfp->sf_pieces[0].sp_size;
+            uint32_t pidx;
+
+            (void)(*split_lower->sys_close)(first);
+            for (pidx = 1; pidx < sfp->sf_npieces; pidx++)
+                if ((sfp->sf_pieces[pidx].sp_size != psize) &&
+                    ((pidx < (sfp->sf_npieces - 1)) ||
+                     (sfp->sf_pieces[pidx].sp_size > psize)))
+                    psize = 0;
+            sfp->sf_psize = psize;
+        }
+    }
+    if (error) {
+        split_destroy(sfp);
+        sfp = (split_file_t *)NULL;
+    }
+    *sfpp = sfp;
+
+    return error;
+}
+
+static int
+split_close(void *rh) {
+    split_file_t *sfp = (split_file_t *)rh;
+
+    if (!sfp)
+        return EINVAL;
+    split_destroy(sfp);
+
+    return 0;
+}
+
+static int
+split_seek(void *rh, int64_t offset, sysdep_whence_t whence,
+           uint64_t *resoffp) {
+    split_file_t *sfp = (split_file_t *)rh;
+    int64_t       base;
+
+    if (!sfp)
+        return EINVAL;
+    if (sfp->sf_fd)
+        return (*split_lower->sys_seek)(sfp->sf_fd, offset, whence, resoffp);
+    switch (whence) {
+    case SYSDEP_SEEK_ABSOLUTE:
+        base = 0;
+        break;
+    case SYSDEP_SEEK_RELATIVE:
+        base = sfp->sf_offset;
+        break;
+    case SYSDEP_SEEK_END:
+        base = sfp->sf_size;
+        break;
+    default:
+        return EINVAL;
+    }
+    if ((base + offset) < 0)
+        return EINVAL;
+    sfp->sf_offset = base + offset;
+    if (resoffp)
+        *resoffp = sfp->sf_offset;
+
+    return 0;
+}
+
+static int
+split_pread(void *rh, void *buf, uint64_t len, uint64_t offset,
+            uint64_t *nr) {
+    split_file_t *sfp = (split_file_t *)rh;
+    sysdep_io_t   io;
+
+    if (!sfp)
+        return EINVAL;
+    if (sfp->sf_fd)
+        return (*split_lower->sys_pread)(sfp->sf_fd, buf, len, offset, nr);
+    io.io_rh     = rh;
+    io.io_buf    = buf;
+    io.io_len    = len;
+    io.io_offset = offset;
+    (void)split_batch(&io, 1);
+    *nr = io.io_nbytes;
+
+    return io.io_error;
+}
+
+static int
+split_read(void *rh, void *buf, uint64_t len, uint64_t *nr) {
+    split_file_t *sfp = (split_file_t *)rh;
+    int           error;
+
+    if (!sfp)
+        return EINVAL;
+    if (sfp->sf_fd)
+        return (*split_lower->sys_read)(sfp->sf_fd, buf, len, nr);
+    error = split_pread(rh, buf, len, sfp->sf_offset, nr);
+    sfp->sf_offset += *nr;
+
+    return error;
+}
+
+static int
+split_write(void *rh, void *buf, uint64_t len, uint64_t *nw) {
+    split_file_t *sfp = (split_file_t *)rh;
+
+    if (!sfp)
+        return EINVAL;
+
+    return (sfp->sf_fd) ? (*split_lower->sys_write)(sfp->sf_fd, buf, len, nw)
+                        : EROFS;
+}
+
+static int
+split_malloc(void *nmpp, uint64_t nbytes) {
+    return (*split_lower->sys_malloc)(nmpp, nbytes);
+}
+
+static int
+split_free(void *mp) {
+    return (*split_lower->sys_free)(mp);
+}
+
+static int
+split_file_size(void *rh, uint64_t *nbytes) {
+    split_file_t *sfp = (split_file_t *)rh;
+
+    if (!sfp)
+        return EINVAL;
+    if (sfp->sf_fd)
+        return (*split_lower->sys_file_size)(sfp->sf_fd, nbytes);
+    *nbytes = sfp->sf_size;
+
+    return 0;
+}
+
+static int
+split_pwrite(void *rh, void *buf, uint64_t len, uint64_t offset,
+             uint64_t *nw) {
+    split_file_t *sfp = (split_file_t *)rh;
+
+    if (!sfp)
+        return EINVAL;
+
+    return (sfp->sf_fd) ? (*split_lower->sys_pwrite)(sfp->sf_fd, buf, len,
+                                                     offset, nw)
+                        : EROFS;
+}
+
+static int
+split_pwritev(void *rh, const sysdep_iovec_t *iov, uint32_t niov,
+              uint64_t offset, uint64_t *nw) {
+    split_file_t *sfp = (split_file_t *)rh;
+
+    if (!sfp)
+        return EINVAL;
+
+    return (sfp->sf_fd) ? (*split_lower->sys_pwritev)(sfp->sf_fd, iov, niov,
+                                                      offset, nw)
+                        : EROFS;
+}
+
+static int
+split_file_mtime(void *rh, uint64_t *mtime) {
+    split_file_t *sfp = (split_file_t *)rh;
+
+    if (!sfp)
+        return EINVAL;
+    if (sfp->sf_fd)
+        return (*split_lower->sys_file_mtime)(sfp->sf_fd, mtime);
+    *mtime = sfp->sf_mtime;
+
+    return 0;
+}
+
+static int
+split_pread_batch(sysdep_io_t *iop, uint32_t nio) {
+    return split_batch(iop, nio);
+}
+
+static int
+split_fileno(void *rh) {
+    split_file_t *sfp = (split_file_t *)rh;
+
+    return (sfp && sfp->sf_fd) ? (*split_lower->sys_fileno)(sfp->sf_fd) : -1;
+}
+
+static int
+split_sync(void *rh) {
+    split_file_t *sfp = (split_file_t *)rh;
+
+    if (!sfp)
+        return EINVAL;
+
+    return (sfp->sf_fd) ? (*split_lower->sys_sync)(sfp->sf_fd) : 0;
+}
+
+/*
+ * Only files which aren't split can be mapped.
+ */
+static int
+split_map(void *rh, uint64_t offset, uint64_t len, void **addrp) {
+    split_file_t *sfp = (split_file_t *)rh;
+
+    if (!sfp)
+        return EINVAL;
+
+    return (sfp->sf_fd)
+               ? (*split_lower->sys_map)(sfp->sf_fd, offset, len, addrp)
+               : ENOTSUP;
+}
+
+static int
+split_unmap(void *addr, uint64_t len) {
+    return (*split_lower->sys_unmap)(addr, len);
+}
+
+static int
+split_rename(const char *from, const char *to) {
+    return (*split_lower->sys_rename)(from, to);
+}
+
+static const sysdep_dispatch_t split_dispatch = {
+    split_open,   split_close,  split_seek,       split_read,
+    split_write,  split_malloc, split_free,       split_file_size,
+    split_pread,  split_pwrite, split_file_mtime, split_pread_batch,
+    split_fileno, split_sync,   split_map,        split_unmap,
+    split_rename, split_pwritev};
+
+/*
+ * Get the interface for reading split files, over "lower".
+ *
+ * Returns:
+ * - 0: Success.
+ * - EBUSY: It's already in use over another interface.
+ */
+int
+sysdep_split_init(const sysdep_dispatch_t *lower,
+                  const sysdep_dispatch_t **sysdepp) {
+    if (!split_lower)
+        split_lower = lower;
+    if (split_lower != lower)
+        return EBUSY;
+    *sysdepp = &split_dispatch;
+
+    return 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * sysdep_split.h - Split file system dependent module interface.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifndef _SYSDEP_SPLIT_H_
+#define _SYSDEP_SPLIT_H_ 1
+
+#include "sysdep_int.h"
+
+int sysdep_split_init(const sysdep_dispatch_t *lower,
+                      const sysdep_dispatch_t **sysdepp);
+
+#endif /* _SYSDEP_SPLIT_H_ */
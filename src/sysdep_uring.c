@@ -0,0 +1,793 @@
+/*
+ * sysdep_uring.c - System-dependent interface using Linux io_uring.
+ */
+/*
+ * Copyright (c) 2010, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+/*
+ * Positional reads and writes, and batches of reads, are submitted to an
+ * io_uring.  Each thread gets its own ring, set up the first time it does
+ * I/O, so that submission needs no locking.  Open files are given slots in
+ * each ring's registered file table, and buffers registered with
+ * sysdep_uring_register_buffer() are used as fixed buffers.  Everything
+ * else is done as for POSIX.  If a ring can't be set up, or fails, I/O falls
+ * back to pread(2) and pwrite(2).
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "sysdep_uring.h"
+#include "sysdep_posix.h"
+#include <errno.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#    include <fcntl.h>
+#    include <linux/io_uring.h>
+#    include <stdlib.h>
+#    include <string.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    include <sys/types.h>
+#    include <sys/uio.h>
+#    include <unistd.h>
+#    ifdef HAVE_LIBPTHREAD
+#        include <pthread.h>
+#    endif /* HAVE_LIBPTHREAD */
+
+#    define URING_DEPTH       64
+#    define URING_MAX_FILES   64
+#    define URING_MAX_BUFFERS 16
+#    define URING_MAX_LEN     (1U << 30)
+#    define URING_PENDING     INT32_MIN
+
+/*
+ * File handle.  The descriptor comes first, so that the handle may be
+ * passed to the POSIX routines.
+ */
+typedef struct uring_file {
+    int uf_fd;   /* Descriptor */
+    int uf_slot; /* Registered file slot, or -1 */
+} uring_file_t;
+
+/*
+ * Per-thread ring.
+ */
+typedef struct uring_ring {
+    struct uring_ring *  ur_next;       /* Next ring */
+    int                  ur_fd;         /* Ring descriptor */
+    int                  ur_broken;     /* Don't use any more */
+    unsigned char *      ur_sqmap;      /* Submission ring mapping */
+    size_t               ur_sqmaplen;   /* ... and its length */
+    unsigned char *      ur_cqmap;      /* Completion ring mapping */
+    size_t               ur_cqmaplen;   /* ... and its length */
+    struct io_uring_sqe *ur_sqes;       /* Submission entries */
+    size_t               ur_sqeslen;    /* ... and their length */
+    uint32_t *           ur_sqtail;     /* Submission ring tail */
+    uint32_t *           ur_sqmask;     /* Submission ring mask */
+    uint32_t *           ur_sqarray;    /* Submission ring */
+    uint32_t *           ur_cqhead;     /* Completion ring head */
+    uint32_t *           ur_cqtail;     /* Completion ring tail */
+    uint32_t *           ur_cqmask;     /* Completion ring mask */
+    struct io_uring_cqe *ur_cqes;       /* Completion ring */
+    uint32_t             ur_entries;    /* Submission ring size */
+    int                  ur_fixed;      /* Registered file table is set up */
+    int                  ur_files[URING_MAX_FILES]; /* Registered fds */
+    uint64_t             ur_bufgen;   /* Registered buffer generation */
+    uint32_t             ur_nbuffers; /* Registered buffers */
+    struct iovec         ur_buffers[URING_MAX_BUFFERS];
+} uring_ring_t;
+
+/*
+ * Global state, protected by uring_lock.
+ */
+#    ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+#    endif /* HAVE_LIBPTHREAD */
+
+static struct uring_global {
+#    ifdef HAVE_LIBPTHREAD
+    pthread_key_t ug_key; /* Per-thread ring */
+#    else                 /* HAVE_LIBPTHREAD */
+    uring_ring_t *ug_self; /* The ring */
+#    endif                /* HAVE_LIBPTHREAD */
+    int           ug_ready;                     /* Initialized */
+    uring_ring_t *ug_rings;                     /* All rings */
+    unsigned char ug_slots[URING_MAX_FILES];    /* File slots in use */
+    struct iovec  ug_buffers[URING_MAX_BUFFERS]; /* Registered buffers */
+    uint32_t      ug_nbuffers;                   /* ... how many */
+    uint64_t      ug_bufgen;                     /* Bumped on change */
+} uring_global;
+
+/*
+ * Marks a thread whose ring couldn't be set up.
+ */
+static uring_ring_t uring_none;
+
+#    ifdef HAVE_LIBPTHREAD
+#        define URING_LOCK()   pthread_mutex_lock(&uring_lock)
+#        define URING_UNLOCK() pthread_mutex_unlock(&uring_lock)
+#    else /* HAVE_LIBPTHREAD */
+#        define URING_LOCK()
+#        define URING_UNLOCK()
+#    endif /* HAVE_LIBPTHREAD */
+
+static const int omode2flags[] = {0, O_RDONLY | O_LARGEFILE,
+                                  O_RDWR | O_LARGEFILE, O_WRONLY | O_LARGEFILE,
+                                  O_RDWR | O_CREAT | O_LARGEFILE};
+
+static inline int
+uring_register(int fd, unsigned opcode, void *arg, unsigned nargs) {
+    return (syscall(__NR_io_uring_register, fd, opcode, arg, nargs) < 0)
+               ? errno
+               : 0;
+}
+
+/*
+ * Tear down a ring.
+ */
+static void
+uring_ring_destroy(uring_ring_t *urp) {
+    uring_ring_t **linkp;
+
+    URING_LOCK();
+    for (linkp = &uring_global.ug_rings; *linkp && (*linkp != urp);
+         linkp = &(*linkp)->ur_next)
+        ;
+    if (*linkp)
+        *linkp = urp->ur_next;
+    URING_UNLOCK();
+    if (urp->ur_sqes && (urp->ur_sqes != MAP_FAILED))
+        munmap(urp->ur_sqes, urp->ur_sqeslen);
+    if (urp->ur_cqmap && (urp->ur_cqmap != MAP_FAILED) &&
+        (urp->ur_cqmap != urp->ur_sqmap))
+        munmap(urp->ur_cqmap, urp->ur_cqmaplen);
+    if (urp->ur_sqmap && (urp->ur_sqmap != MAP_FAILED))
+        munmap(urp->ur_sqmap, urp->ur_sqmaplen);
+    if (urp->ur_fd >= 0)
+        close(urp->ur_fd);
+    free(urp);
+}
+
+/*
+ * Check that the kernel supports the opcodes uring_prep() uses.  Kernels
+ * before 5.6 have neither IORING_OP_READ nor IORING_OP_WRITE, and fail
+ * every request that uses them with EINVAL.  The probe arrived at the same
+ * time, so a ring that can't be probed isn't used either.
+ */
+static int
+uring_probe(int fd) {
+    static const uint8_t   ops[] = {IORING_OP_READ, IORING_OP_WRITE,
+                                  IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED};
+    struct io_uring_probe *probe;
+    size_t                 i;
+    int                    error;
+
+    if (!(probe = (struct io_uring_probe *)calloc(
+              1, sizeof(*probe) + (256 * sizeof(struct io_uring_probe_op)))))
+        return ENOMEM;
+    if ((error = uring_register(fd, IORING_REGISTER_PROBE, probe, 256)) == 0) {
+        for (i = 0; !error && (i < (sizeof(ops) / sizeof(ops[0]))); i++)
+            if ((ops[i] >= probe->ops_len) ||
+                !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                error = EOPNOTSUPP;
+    }
+    free(probe);
+
+    return error;
+}
+
+/*
+ * Set up a ring.
+ */
+static int
+uring_ring_create(uring_ring_t **urpp) {
+    struct io_uring_params params;
+    uring_ring_t *         urp   = (uring_ring_t *)NULL;
+    int                    error = ENOMEM;
+    int                    fds[URING_MAX_FILES];
+    int                    slot;
+
+    if ((urp = (uring_ring_t *)calloc(1, sizeof(*urp)))) {
+        memset(&params, 0, sizeof(params));
+        if ((urp->ur_fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params)) <
+            0) {
+            error = errno;
+        } else {
+            urp->ur_sqmaplen =
+                params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+            urp->ur_cqmaplen = params.cq_off.cqes +
+                               params.cq_entries * sizeof(struct io_uring_cqe);
+            urp->ur_sqeslen = params.sq_entries * sizeof(struct io_uring_sqe);
+            if ((params.features & IORING_FEAT_SINGLE_MMAP) &&
+                (urp->ur_cqmaplen > urp->ur_sqmaplen))
+                urp->ur_sqmaplen = urp->ur_cqmaplen;
+            urp->ur_sqmap = mmap(NULL, urp->ur_sqmaplen, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, urp->ur_fd,
+                                 IORING_OFF_SQ_RING);
+            urp->ur_cqmap = (params.features & IORING_FEAT_SINGLE_MMAP)
+                                ? urp->ur_sqmap
+                                : mmap(NULL, urp->ur_cqmaplen,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, urp->ur_fd,
+                                       IORING_OFF_CQ_RING);
+            urp->ur_sqes =
+                mmap(NULL, urp->ur_sqeslen, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, urp->ur_fd, IORING_OFF_SQES);
+            if ((urp->ur_sqmap == MAP_FAILED) ||
+                (urp->ur_cqmap == MAP_FAILED) ||
+                (urp->ur_sqes == MAP_FAILED)) {
+                error = errno;
+            } else {
+                urp->ur_sqtail =
+                    (uint32_t *)(urp->ur_sqmap + params.sq_off.tail);
+                urp->ur_sqmask =
+                    (uint32_t *)(urp->ur_sqmap + params.sq_off.ring_mask);
+                urp->ur_sqarray =
+                    (uint32_t *)(urp->ur_sqmap + params.sq_off.array);
+                urp->ur_cqhead =
+                    (uint32_t *)(urp->ur_cqmap + params.cq_off.head);
+                urp->ur_cqtail =
+                    (uint32_t *)(urp->ur_cqmap + params.cq_off.tail);
+                urp->ur_cqmask =
+                    (uint32_t *)(urp->ur_cqmap + params.cq_off.ring_mask);
+                urp->ur_cqes = (struct io_uring_cqe *)(urp->ur_cqmap +
+                                                       params.cq_off.cqes);
+                urp->ur_entries = params.sq_entries;
+                error           = uring_probe(urp->ur_fd);
+            }
+        }
+        if (!error) {
+            /*
+             * Set up an empty file table; files are added on first use.
+             */
+            for (slot = 0; slot < URING_MAX_FILES; slot++) {
+                fds[slot]          = -1;
+                urp->ur_files[slot] = -1;
+            }
+            urp->ur_fixed = !uring_register(urp->ur_fd, IORING_REGISTER_FILES,
+                                            fds, URING_MAX_FILES);
+            urp->ur_bufgen = ~0;
+            URING_LOCK();
+            urp->ur_next           = uring_global.ug_rings;
+            uring_global.ug_rings = urp;
+            URING_UNLOCK();
+        } else {
+            uring_ring_destroy(urp);
+            urp = (uring_ring_t *)NULL;
+        }
+    }
+    *urpp = urp;
+
+    return error;
+}
+
+#    ifdef HAVE_LIBPTHREAD
+/*
+ * Thread exit: tear down its ring.
+ */
+static void
+uring_thread_done(void *arg) {
+    uring_ring_t *urp = (uring_ring_t *)arg;
+
+    if (urp && (urp != &uring_none))
+        uring_ring_destroy(urp);
+}
+#    endif /* HAVE_LIBPTHREAD */
+
+/*
+ * Find this thread's ring, setting it up if need be.
+ */
+static uring_ring_t *
+uring_self(void) {
+    uring_ring_t *urp = (uring_ring_t *)NULL;
+
+    if (uring_global.ug_ready) {
+#    ifdef HAVE_LIBPTHREAD
+        urp = (uring_ring_t *)pthread_getspecific(uring_global.ug_key);
+#    else  /* HAVE_LIBPTHREAD */
+        urp = uring_global.ug_self;
+#    endif /* HAVE_LIBPTHREAD */
+        if (!urp) {
+            if (uring_ring_create(&urp))
+                urp = &uring_none;
+#    ifdef HAVE_LIBPTHREAD
+            pthread_setspecific(uring_global.ug_key, urp);
+#    else  /* HAVE_LIBPTHREAD */
+            uring_global.ug_self = urp;
+#    endif /* HAVE_LIBPTHREAD */
+        }
+        if ((urp == &uring_none) || urp->ur_broken)
+            urp = (uring_ring_t *)NULL;
+    }
+    return urp;
+}
+
+/*
+ * Bring a ring's registered buffers up to date.
+ */
+static void
+uring_sync_buffers(uring_ring_t *urp) {
+    URING_LOCK();
+    if (urp->ur_nbuffers)
+        (void)uring_register(urp->ur_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    urp->ur_nbuffers = 0;
+    if (uring_global.ug_nbuffers &&
+        !uring_register(urp->ur_fd, IORING_REGISTER_BUFFERS,
+                        uring_global.ug_buffers, uring_global.ug_nbuffers)) {
+        urp->ur_nbuffers = uring_global.ug_nbuffers;
+        memcpy(urp->ur_buffers, uring_global.ug_buffers,
+               urp->ur_nbuffers * sizeof(struct iovec));
+    }
+    urp->ur_bufgen = uring_global.ug_bufgen;
+    URING_UNLOCK();
+}
+
+/*
+ * Find the registered file slot to use for a handle, or -1.
+ */
+static int
+uring_file_slot(uring_ring_t *urp, uring_file_t *ufp) {
+    int slot = ufp->uf_slot;
+
+    if (!urp->ur_fixed || (slot < 0))
+        return -1;
+    if (urp->ur_files[slot] != ufp->uf_fd) {
+        struct io_uring_files_update fup;
+
+        memset(&fup, 0, sizeof(fup));
+        fup.offset = slot;
+        fup.fds    = (uintptr_t)&ufp->uf_fd;
+        URING_LOCK();
+        if (uring_register(urp->ur_fd, IORING_REGISTER_FILES_UPDATE, &fup,
+                           1) == 0)
+            urp->ur_files[slot] = ufp->uf_fd;
+        URING_UNLOCK();
+    }
+    return (urp->ur_files[slot] == ufp->uf_fd) ? slot : -1;
+}
+
+/*
+ * Queue a read or write.
+ */
+static void
+uring_prep(uring_ring_t *urp, int write, sysdep_io_t *iop, uint64_t tag) {
+    uint32_t             tail = *urp->ur_sqtail;
+    uint32_t             sidx = tail & *urp->ur_sqmask;
+    struct io_uring_sqe *sqe  = &urp->ur_sqes[sidx];
+    uintptr_t            base = (uintptr_t)iop->io_buf;
+    uint32_t             bidx;
+    int                  slot;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->off       = iop->io_offset;
+    sqe->addr      = base;
+    sqe->len =
+        (iop->io_len > URING_MAX_LEN) ? URING_MAX_LEN : (uint32_t)iop->io_len;
+    sqe->user_data = tag;
+    if ((slot = uring_file_slot(urp, (uring_file_t *)iop->io_rh)) >= 0) {
+        sqe->fd    = slot;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = ((uring_file_t *)iop->io_rh)->uf_fd;
+    }
+    sqe->opcode = (write) ? IORING_OP_WRITE : IORING_OP_READ;
+    for (bidx = 0; bidx < urp->ur_nbuffers; bidx++) {
+        uintptr_t rbase = (uintptr_t)urp->ur_buffers[bidx].iov_base;
+
+        if ((base >= rbase) &&
+            ((base + sqe->len) <= (rbase + urp->ur_buffers[bidx].iov_len))) {
+            sqe->opcode    = (write) ? IORING_OP_WRITE_FIXED
+                                     : IORING_OP_READ_FIXED;
+            sqe->buf_index = bidx;
+            break;
+        }
+    }
+    urp->ur_sqarray[sidx] = sidx;
+    __atomic_store_n(urp->ur_sqtail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submit "nio" queued requests and wait for them, recording results in
+ * "resp".  If the ring fails, it's marked broken and requests which didn't
+ * complete are left URING_PENDING.
+ */
+static void
+uring_wait(uring_ring_t *urp, uint32_t nio, int32_t *resp) {
+    uint32_t nsubmit = nio;
+    uint32_t ndone   = 0;
+
+    while (ndone < nio) {
+        long     rv = syscall(__NR_io_uring_enter, urp->ur_fd, nsubmit, 1,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+        uint32_t head;
+
+        if (rv >= 0)
+            nsubmit -= ((uint32_t)rv > nsubmit) ? nsubmit : (uint32_t)rv;
+        head = *urp->ur_cqhead;
+        while (head != __atomic_load_n(urp->ur_cqtail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &urp->ur_cqes[head & *urp->ur_cqmask];
+
+            if (cqe->user_data < nio) {
+                resp[cqe->user_data] = cqe->res;
+                ndone++;
+            }
+            head++;
+        }
+        __atomic_store_n(urp->ur_cqhead, head, __ATOMIC_RELEASE);
+        if ((rv < 0) && (errno != EINTR) && (errno != EAGAIN) &&
+            (errno != EBUSY)) {
+            /*
+             * Stop submitting; wait only for what's already in flight,
+             * and give up if that fails too.
+             */
+            if (urp->ur_broken || ((nio - ndone) == nsubmit)) {
+                urp->ur_broken = 1;
+                break;
+            }
+            urp->ur_broken = 1;
+            nsubmit        = 0;
+        }
+    }
+}
+
+/*
+ * Perform a batch of positional reads or writes.
+ */
+static int
+uring_batch(sysdep_io_t *iop, uint32_t nio, int write) {
+    uring_ring_t *urp   = uring_self();
+    int           error = 0;
+    int32_t       res[URING_DEPTH];
+    uint32_t      iidx;
+    uint32_t      nchunk;
+
+    while (nio) {
+        nchunk = (nio > URING_DEPTH) ? URING_DEPTH : nio;
+        for (iidx = 0; iidx < nchunk; iidx++)
+            res[iidx] = URING_PENDING;
+        if (urp && (urp->ur_entries >= nchunk) && !urp->ur_broken) {
+            if (urp->ur_bufgen !=
+                __atomic_load_n(&uring_global.ug_bufgen, __ATOMIC_ACQUIRE))
+                uring_sync_buffers(urp);
+            for (iidx = 0; iidx < nchunk; iidx++)
+                uring_prep(urp, write, &iop[iidx], iidx);
+            uring_wait(urp, nchunk, res);
+        }
+        for (iidx = 0; iidx < nchunk; iidx++) {
+            sysdep_io_t *cip  = &iop[iidx];
+            uint64_t     done = (res[iidx] > 0) ? res[iidx] : 0;
+            uint64_t     nx   = 0;
+
+            if ((res[iidx] < 0) && (res[iidx] != URING_PENDING)) {
+                cip->io_nbytes = 0;
+                cip->io_error  = -res[iidx];
+            } else if (done == cip->io_len) {
+                cip->io_nbytes = done;
+                cip->io_error  = 0;
+            } else {
+                /*
+                 * Short, or not done at all: finish it synchronously.
+                 */
+                cip->io_error =
+                    (write) ? (*posix_dispatch.sys_pwrite)(
+                                  cip->io_rh, (char *)cip->io_buf + done,
+                                  cip->io_len - done, cip->io_offset + done,
+                                  &nx)
+                            : (*posix_dispatch.sys_pread)(
+                                  cip->io_rh, (char *)cip->io_buf + done,
+                                  cip->io_len - done, cip->io_offset + done,
+                                  &nx);
+                cip->io_nbytes = done + nx;
+            }
+            if (!error)
+                error = cip->io_error;
+        }
+        iop += nchunk;
+        nio -= nchunk;
+    }
+
+    return error;
+}
+
+/*
+ * Open a file handle and return a pointer to it.
+ */
+static int
+uring_open(void *rhp, const char *p, sysdep_open_mode_t omode) {
+    uring_file_t **ufpp  = (uring_file_t **)rhp;
+    uring_file_t * ufp;
+    int            error = ENOMEM;
+    int            slot;
+
+    if ((ufp = (uring_file_t *)malloc(sizeof(*ufp)))) {
+        ufp->uf_fd   = open(p, omode2flags[(int)omode], 0640);
+        ufp->uf_slot = -1;
+        if (ufp->uf_fd < 0) {
+            error = errno;
+            *ufpp = (uring_file_t *)NULL;
+            free(ufp);
+        } else {
+            URING_LOCK();
+            for (slot = 0; slot < URING_MAX_FILES; slot++) {
+                if (!uring_global.ug_slots[slot]) {
+                    uring_global.ug_slots[slot] = 1;
+                    ufp->uf_slot                = slot;
+                    break;
+                }
+            }
+            URING_UNLOCK();
+            *ufpp = ufp;
+            error = 0;
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Close a file handle and free pointer.  The file is removed from every
+ * ring's file table first.
+ */
+static int
+uring_close(void *rh) {
+    uring_file_t *ufp   = (uring_file_t *)rh;
+    int           error = EINVAL;
+    uring_ring_t *urp;
+
+    if (ufp) {
+        URING_LOCK();
+        if (ufp->uf_slot >= 0) {
+            for (urp = uring_global.ug_rings; urp; urp = urp->ur_next) {
+                if (urp->ur_files[ufp->uf_slot] >= 0) {
+                    struct io_uring_files_update fup;
+                    int                          nofd = -1;
+
+                    memset(&fup, 0, sizeof(fup));
+                    fup.offset = ufp->uf_slot;
+                    fup.fds    = (uintptr_t)&nofd;
+                    (void)uring_register(urp->ur_fd,
+                                         IORING_REGISTER_FILES_UPDATE, &fup, 1);
+                    urp->ur_files[ufp->uf_slot] = -1;
+                }
+            }
+            uring_global.ug_slots[ufp->uf_slot] = 0;
+        }
+        URING_UNLOCK();
+        error = close(ufp->uf_fd);
+        free(ufp);
+    }
+
+    return error;
+}
+
+static int
+uring_pread(void *rh, void *buf, uint64_t len, uint64_t offset, uint64_t *nr) {
+    sysdep_io_t io;
+    int         error = EINVAL;
+
+    if (rh) {
+        io.io_rh     = rh;
+        io.io_buf    = buf;
+        io.io_len    = len;
+        io.io_offset = offset;
+        error        = uring_batch(&io, 1, 0);
+        *nr          = io.io_nbytes;
+    }
+
+    return error;
+}
+
+static int
+uring_pwrite(void *rh, void *buf, uint64_t len, uint64_t offset,
+             uint64_t *nw) {
+    sysdep_io_t io;
+    int         error = EINVAL;
+
+    if (rh) {
+        io.io_rh     = rh;
+        io.io_buf    = buf;
+        io.io_len    = len;
+        io.io_offset = offset;
+        error        = uring_batch(&io, 1, 1);
+        *nw          = io.io_nbytes;
+    }
+
+    return error;
+}
+
+static int
+uring_pread_batch(sysdep_io_t *iop, uint32_t nio) {
+    return uring_batch(iop, nio, 0);
+}
+
+static int
+uring_seek(void *rh, int64_t offset, sysdep_whence_t whence,
+           uint64_t *resoffp) {
+    return (*posix_dispatch.sys_seek)(rh, offset, whence, resoffp);
+}
+
+static int
+uring_read(void *rh, void *buf, uint64_t len, uint64_t *nr) {
+    return (*posix_dispatch.sys_read)(rh, buf, len, nr);
+}
+
+static int
+uring_write(void *rh, void *buf, uint64_t len, uint64_t *nw) {
+    return (*posix_dispatch.sys_write)(rh, buf, len, nw);
+}
+
+static int
+uring_malloc(void *nmpp, uint64_t nbytes) {
+    return (*posix_dispatch.sys_malloc)(nmpp, nbytes);
+}
+
+static int
+uring_free(void *mp) {
+    return (*posix_dispatch.sys_free)(mp);
+}
+
+static int
+uring_file_size(void *rh, uint64_t *nbytes) {
+    return (*posix_dispatch.sys_file_size)(rh, nbytes);
+}
+
+static int
+uring_file_mtime(void *rh, uint64_t *mtime) {
+    return (*posix_dispatch.sys_file_mtime)(rh, mtime);
+}
+
+static int
+uring_fileno(void *rh) {
+    return (*posix_dispatch.sys_fileno)(rh);
+}
+
+static int
+uring_sync(void *rh) {
+    return (*posix_dispatch.sys_sync)(rh);
+}
+
+static int
+uring_map(void *rh, uint64_t offset, uint64_t len, void **addrp) {
+    return (*posix_dispatch.sys_map)(rh, offset, len, addrp);
+}
+
+static int
+uring_unmap(void *addr, uint64_t len) {
+    return (*posix_dispatch.sys_unmap)(addr, len);
+}
+
+static int
+uring_rename(const char *from, const char *to) {
+    return (*posix_dispatch.sys_rename)(from, to);
+}
+
+/*
+ * Gathered writes are made directly.
+ */
+static int
+uring_pwritev(void *rh, const sysdep_iovec_t *iov, uint32_t niov,
+              uint64_t offset, uint64_t *nw) {
+    return (*posix_dispatch.sys_pwritev)(rh, iov, niov, offset, nw);
+}
+
+static const sysdep_dispatch_t uring_dispatch = {
+    uring_open,   uring_close,  uring_seek,       uring_read,
+    uring_write,  uring_malloc, uring_free,       uring_file_size,
+    uring_pread,  uring_pwrite, uring_file_mtime, uring_pread_batch,
+    uring_fileno, uring_sync,   uring_map,        uring_unmap,
+    uring_rename, uring_pwritev};
+
+/*
+ * Set up io_uring for this process.  If the calling thread can't set up a
+ * ring, io_uring isn't usable and the error is returned.
+ */
+int
+sysdep_uring_init(const sysdep_dispatch_t **sysdepp) {
+    int error = 0;
+
+    if (!uring_global.ug_ready) {
+#    ifdef HAVE_LIBPTHREAD
+        if ((error = pthread_key_create(&uring_global.ug_key,
+                                        uring_thread_done)))
+            return error;
+#    endif /* HAVE_LIBPTHREAD */
+        uring_global.ug_ready = 1;
+        if (!uring_self()) {
+            error = ENOSYS;
+            sysdep_uring_finish();
+        }
+    }
+    if (!error)
+        *sysdepp = &uring_dispatch;
+
+    return error;
+}
+
+/*
+ * Register a buffer for use as a fixed buffer.  Rings pick up the change
+ * before their next I/O.
+ */
+int
+sysdep_uring_register_buffer(void *buf, uint64_t len) {
+    int error = ENOSPC;
+
+    URING_LOCK();
+    if (uring_global.ug_nbuffers < URING_MAX_BUFFERS) {
+        uring_global.ug_buffers[uring_global.ug_nbuffers].iov_base = buf;
+        uring_global.ug_buffers[uring_global.ug_nbuffers].iov_len  = len;
+        uring_global.ug_nbuffers++;
+        __atomic_fetch_add(&uring_global.ug_bufgen, 1, __ATOMIC_RELEASE);
+        error = 0;
+    }
+    URING_UNLOCK();
+
+    return error;
+}
+
+/*
+ * Unregister a buffer.  This must be done before it is freed.
+ */
+int
+sysdep_uring_unregister_buffer(void *buf) {
+    int      error = ENOENT;
+    uint32_t bidx;
+
+    URING_LOCK();
+    for (bidx = 0; bidx < uring_global.ug_nbuffers; bidx++) {
+        if (uring_global.ug_buffers[bidx].iov_base == buf) {
+            memmove(&uring_global.ug_buffers[bidx],
+                    &uring_global.ug_buffers[bidx + 1],
+                    (uring_global.ug_nbuffers - bidx - 1) *
+                        sizeof(struct iovec));
+            uring_global.ug_nbuffers--;
+            __atomic_fetch_add(&uring_global.ug_bufgen, 1, __ATOMIC_RELEASE);
+            error = 0;
+            break;
+        }
+    }
+    URING_UNLOCK();
+
+    return error;
+}
+
+/*
+ * Tear down all rings.  I/O after this is done with pread(2) and pwrite(2).
+ */
+void
+sysdep_uring_finish(void) {
+    if (uring_global.ug_ready) {
+        uring_global.ug_ready = 0;
+#    ifdef HAVE_LIBPTHREAD
+        pthread_key_delete(uring_global.ug_key);
+#    else  /* HAVE_LIBPTHREAD */
+        uring_global.ug_self = (uring_ring_t *)NULL;
+#    endif /* HAVE_LIBPTHREAD */
+        while (uring_global.ug_rings)
+            uring_ring_destroy(uring_global.ug_rings);
+    }
+}
+#else  /* HAVE_LINUX_IO_URING_H */
+int
+sysdep_uring_init(const sysdep_dispatch_t **sysdepp) {
+    return ENOSYS;
+}
+
+int
+sysdep_uring_register_buffer(void *buf, uint64_t len) {
+    return ENOSYS;
+}
+
+int
+sysdep_uring_unregister_buffer(void *buf) {
+    return ENOSYS;
+}
+
+void
+sysdep_uring_finish(void) {
+}
+#endif /* HAVE_LINUX_IO_URING_H */
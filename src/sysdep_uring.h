@@ -0,0 +1,23 @@
+/*
+ * sysdep_uring.h - io_uring system dependent module interface.
+ */
+/*
+ * Copyright (c) 2010, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifndef _SYSDEP_URING_H_
+#define _SYSDEP_URING_H_ 1
+
+#include "sysdep_int.h"
+
+int  sysdep_uring_init(const sysdep_dispatch_t **sysdepp);
+int  sysdep_uring_register_buffer(void *buf, uint64_t len);
+int  sysdep_uring_unregister_buffer(void *buf);
+void sysdep_uring_finish(void);
+
+#endif /* _SYSDEP_URING_H_ */
@@ -0,0 +1,1335 @@
+/*
+ * sysdep_zstream.c - System-dependent interface for compressed files.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+/*
+ * Files compressed in independently decodable frames are presented as
+ * their decompressed contents; everything else (change files, index files)
+ * is passed through to the interface underneath.  Two forms are read:
+ *
+ * - zstd in the seekable format: ordinary frames followed by a skippable
+ *   frame holding the compressed and decompressed size of each, and a
+ *   footer saying where that is.
+ * - lz4 frames.  The compressed size of each block is in its header, so
+ *   the blocks can be found without decompressing them.  Independent blocks
+ *   are decoded on their own; a frame of linked blocks is decoded whole.
+ *
+ * Reads find their frames in the index by binary search.  Decoded frames
+ * are kept in a small LRU cache of slots.  When reads go through the file
+ * in order, the frames after the current one are queued for a pool of
+ * decoding threads, so that they're decoded in parallel, ahead of need.
+ *
+ * Compressed files are read-only.
+ */
+#ifdef HAVE_CONFIG_H
+#    include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include "sysdep_zstream.h"
+#include "libstats.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#    include <pthread.h>
+#    include <signal.h>
+#endif /* HAVE_LIBPTHREAD */
+#if defined(HAVE_LIBZSTD) && defined(HAVE_ZSTD_H)
+#    include <zstd.h>
+#    define ZS_HAVE_ZSTD 1
+#endif /* HAVE_LIBZSTD && HAVE_ZSTD_H */
+#if defined(HAVE_LIBLZ4) && defined(HAVE_LZ4_H) && defined(HAVE_LZ4FRAME_H)
+#    include <lz4.h>
+#    include <lz4frame.h>
+#    define ZS_HAVE_LZ4 1
+#endif /* HAVE_LIBLZ4 && HAVE_LZ4_H && HAVE_LZ4FRAME_H */
+
+#define ZS_MAGIC_ZSTD      0xfd2fb528U /* zstd frame */
+#define ZS_MAGIC_SKIPPABLE 0x184d2a50U /* Skippable frame, low 4 bits free */
+#define ZS_MAGIC_SEEKTABLE 0x184d2a5eU /* Skippable frame with seek table */
+#define ZS_MAGIC_SEEKABLE  0x8f92eab1U /* Seek table footer */
+#define ZS_MAGIC_LZ4       0x184d2204U /* lz4 frame */
+#define ZS_FOOTER_SIZE     9           /* Frames, descriptor, magic */
+#define ZS_SEEK_CHECKSUMS  0x80        /* Descriptor: entries have checksums */
+#define ZS_SEEK_RESERVED   0x7c        /* Descriptor: must be zero */
+#define ZS_LZ4_VERSION     0x40        /* FLG: version 01 */
+#define ZS_LZ4_INDEPENDENT 0x20        /* FLG: blocks are independent */
+#define ZS_LZ4_BLOCKSUM    0x10        /* FLG: blocks have checksums */
+#define ZS_LZ4_CSIZE       0x08        /* FLG: content size is present */
+#define ZS_LZ4_CONTENTSUM  0x04        /* FLG: content has a checksum */
+#define ZS_LZ4_DICTID      0x01        /* FLG: dictionary ID is present */
+#define ZS_LZ4_STORED      0x80000000U /* Block is not compressed */
+/*
+ * Largest decoded frame we'll take, how much decoded data to keep, and
+ * how many threads decode ahead of sequential reads.
+ */
+#define ZS_MAX_FRAME   (64 * 1024 * 1024)
+#define ZS_CACHE_BYTES (64 * 1024 * 1024)
+#define ZS_MIN_SLOTS   4
+#define ZS_MAX_SLOTS   256
+#define ZS_MAX_WORKERS 8
+
+typedef enum zs_kind {
+    ZS_KIND_ZSTD = 1,   /* A zstd frame */
+    ZS_KIND_LZ4_BLOCK,  /* An independent lz4 block */
+    ZS_KIND_LZ4_STORED, /* An lz4 block stored uncompressed */
+    ZS_KIND_LZ4_FRAME   /* An lz4 frame of linked blocks */
+} zs_kind_t;
+
+/*
+ * Something which decodes on its own.
+ */
+typedef struct zs_frame {
+    uint64_t zf_coffset; /* Offset in the file */
+    uint64_t zf_doffset; /* Offset in the decompressed contents */
+    uint32_t zf_csize;   /* Compressed size */
+    uint32_t zf_dsize;   /* Decompressed size */
+    uint32_t zf_kind;    /* ZS_KIND_* */
+} zs_frame_t;
+
+typedef enum zs_slot_state {
+    ZS_SLOT_EMPTY = 0, /* Holds nothing */
+    ZS_SLOT_QUEUED,    /* Waiting for a decoding thread */
+    ZS_SLOT_FILLING,   /* Being decoded */
+    ZS_SLOT_READY      /* Holds its frame */
+} zs_slot_state_t;
+
+/*
+ * A decoded frame.  Slots are neither evicted nor changed while they have
+ * references; they are only filled by whoever set them ZS_SLOT_FILLING.
+ */
+typedef struct zs_slot {
+    uint64_t        zl_frame;   /* Frame held */
+    uint64_t        zl_lastuse; /* When it was last used */
+    unsigned char * zl_data;    /* Decoded contents */
+    zs_slot_state_t zl_state;   /* ZS_SLOT_* */
+    int             zl_refs;    /* Readers copying out of it */
+} zs_slot_t;
+
+/*
+ * What a thread needs to decode a frame.
+ */
+typedef struct zs_decoder {
+    struct zs_decoder *zd_next; /* Next free decoder */
+    unsigned char *    zd_cbuf; /* Compressed data */
+#ifdef ZS_HAVE_ZSTD
+    ZSTD_DCtx *zd_zstd; /* zstd decompression context */
+#endif                  /* ZS_HAVE_ZSTD */
+} zs_decoder_t;
+
+/*
+ * File handle.  Without frames, operations are passed through to the
+ * handle underneath.
+ */
+typedef struct zs_file {
+    void *        zs_fd;        /* Handle underneath */
+    zs_frame_t *  zs_frames;    /* Frames, by offset */
+    uint64_t      zs_nframes;   /* Number of frames */
+    uint64_t      zs_maxframes; /* Room for this many */
+    uint64_t      zs_size;      /* Decompressed size */
+    uint64_t      zs_offset;    /* Current offset */
+    uint32_t      zs_maxcsize;  /* Largest compressed frame */
+    uint32_t      zs_maxdsize;  /* Largest decompressed frame */
+    zs_slot_t *   zs_slots;     /* Decoded frames */
+    uint32_t      zs_nslots;    /* Number of slots */
+    uint64_t      zs_tick;      /* Use clock */
+    uint64_t      zs_lastframe; /* Last frame read */
+    zs_decoder_t *zs_decoders;  /* Free decoders */
+    int           zs_nahead;    /* Frames to decode ahead */
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_t zs_lock;     /* Protects the slots and decoders */
+    pthread_cond_t  zs_changed;  /* Signalled when a slot is filled */
+    pthread_cond_t  zs_work;     /* Signalled when slots are queued */
+    int             zs_nworkers; /* Decoding threads started */
+    int             zs_shutdown; /* Decoding threads should finish */
+    pthread_t       zs_workers[ZS_MAX_WORKERS]; /* Decoding threads */
+    struct zs_file *zs_next; /* Next compressed file open */
+#endif                       /* HAVE_LIBPTHREAD */
+} zs_file_t;
+
+#ifdef HAVE_LIBPTHREAD
+#    define ZS_LOCK(_z)    pthread_mutex_lock(&(_z)->zs_lock)
+#    define ZS_UNLOCK(_z)  pthread_mutex_unlock(&(_z)->zs_lock)
+#    define ZS_WAIT(_z)    pthread_cond_wait(&(_z)->zs_changed, &(_z)->zs_lock)
+#    define ZS_CHANGED(_z) pthread_cond_broadcast(&(_z)->zs_changed)
+#else /* HAVE_LIBPTHREAD */
+#    define ZS_LOCK(_z)
+#    define ZS_UNLOCK(_z)
+#    define ZS_WAIT(_z)
+#    define ZS_CHANGED(_z)
+#endif /* HAVE_LIBPTHREAD */
+
+/*
+ * The interface underneath.  A program uses the one, so it's set once.
+ */
+static const sysdep_dispatch_t *zs_lower = (const sysdep_dispatch_t *)NULL;
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * The compressed files open, so that a child process can be left with
+ * them in a state it can use.
+ */
+static pthread_mutex_t zs_files_lock  = PTHREAD_MUTEX_INITIALIZER;
+static zs_file_t *     zs_files       = (zs_file_t *)NULL;
+static pthread_once_t  zs_atfork_once = PTHREAD_ONCE_INIT;
+#endif /* HAVE_LIBPTHREAD */
+
+static inline uint32_t
+zs_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t
+zs_le64(const unsigned char *p) {
+    return (uint64_t)zs_le32(p) | ((uint64_t)zs_le32(p + 4) << 32);
+}
+
+/*
+ * Read exactly "len" bytes at "offset" in the file underneath.
+ */
+static int
+zs_read_exact(zs_file_t *zfp, void *buf, uint64_t len, uint64_t offset) {
+    uint64_t nread;
+    int      error =
+        (*zs_lower->sys_pread)(zfp->zs_fd, buf, len, offset, &nread);
+
+    return (!error && (nread != len)) ? EIO : error;
+}
+
+/*
+ * Add a frame to the index.
+ */
+static int
+zs_add_frame(zs_file_t *zfp, uint64_t coffset, uint64_t csize, uint64_t dsize,
+             zs_kind_t kind) {
+    int         error = 0;
+    zs_frame_t *zf;
+
+    if (!csize || (csize > (2 * ZS_MAX_FRAME)) || (dsize > ZS_MAX_FRAME))
+        return ENOTSUP;
+    if (!dsize)
+        return 0;
+    if (zfp->zs_nframes == zfp->zs_maxframes) {
+        uint64_t    nmax = (zfp->zs_maxframes) ? 2 * zfp->zs_maxframes : 1024;
+        zs_frame_t *nframes;
+
+        if ((error = (*zs_lower->sys_malloc)(&nframes,
+                                             nmax * sizeof(zs_frame_t))))
+            return error;
+        if (zfp->zs_frames) {
+            memcpy(nframes, zfp->zs_frames,
+                   zfp->zs_nframes * sizeof(zs_frame_t));
+            (void)(*zs_lower->sys_free)(zfp->zs_frames);
+        }
+        zfp->zs_frames    = nframes;
+        zfp->zs_maxframes = nmax;
+    }
+    zf             = &zfp->zs_frames[zfp->zs_nframes++];
+    zf->zf_coffset = coffset;
+    zf->zf_doffset = zfp->zs_size;
+    zf->zf_csize   = csize;
+    zf->zf_dsize   = dsize;
+    zf->zf_kind    = kind;
+    zfp->zs_size += dsize;
+    if (csize > zfp->zs_maxcsize)
+        zfp->zs_maxcsize = csize;
+    if (dsize > zfp->zs_maxdsize)
+        zfp->zs_maxdsize = dsize;
+
+    return error;
+}
+
+/*
+ * Is this a seekable zstd file?  Returns the seek table's size and offset.
+ */
+static int
+zs_zstd_seekable(zs_file_t *zfp, uint64_t fsize, uint32_t *nframesp,
+                 uint32_t *entsizep, uint64_t *toffsetp) {
+    unsigned char footer[ZS_FOOTER_SIZE];
+    unsigned char skiphdr[8];
+    uint64_t      tsize;
+    int           error;
+
+    if (fsize < (sizeof(skiphdr) + sizeof(footer)))
+        return EINVAL;
+    if ((error = zs_read_exact(zfp, footer, sizeof(footer),
+                               fsize - sizeof(footer))))
+        return error;
+    if (zs_le32(footer + 5) != ZS_MAGIC_SEEKABLE)
+        return ENOTSUP;
+    if (footer[4] & ZS_SEEK_RESERVED)
+        return EINVAL;
+    *nframesp = zs_le32(footer);
+    *entsizep = (footer[4] & ZS_SEEK_CHECKSUMS) ? 12 : 8;
+    tsize     = ((uint64_t)*nframesp * *entsizep) + sizeof(footer);
+    if ((tsize + sizeof(skiphdr)) > fsize)
+        return EINVAL;
+    *toffsetp = fsize - tsize - sizeof(skiphdr);
+    if ((error = zs_read_exact(zfp, skiphdr, sizeof(skiphdr), *toffsetp)))
+        return error;
+
+    return ((zs_le32(skiphdr) == ZS_MAGIC_SEEKTABLE) &&
+            (zs_le32(skiphdr + 4) == tsize))
+               ? 0
+               : EINVAL;
+}
+
+/*
+ * Index a seekable zstd file from its seek table.
+ */
+static int
+zs_index_zstd(zs_file_t *zfp, uint64_t fsize) {
+    uint32_t       nframes;
+    uint32_t       entsize;
+    uint64_t       toffset;
+    unsigned char *table;
+    int            error;
+
+    if ((error = zs_zstd_seekable(zfp, fsize, &nframes, &entsize, &toffset)))
+        return error;
+    if (!(error = (*zs_lower->sys_malloc)(&table,
+                                          (uint64_t)nframes * entsize + 1))) {
+        if (!(error = zs_read_exact(zfp, table, (uint64_t)nframes * entsize,
+                                    toffset + 8))) {
+            uint64_t coffset = 0;
+            uint32_t fidx;
+
+            for (fidx = 0; !error && (fidx < nframes); fidx++) {
+                uint32_t csize = zs_le32(table + fidx * entsize);
+
+                error = zs_add_frame(zfp, coffset, csize,
+                                     zs_le32(table + fidx * entsize + 4),
+                                     ZS_KIND_ZSTD);
+                coffset += csize;
+            }
+            if (!error && (coffset != toffset))
+                error = EINVAL;
+        }
+        (void)(*zs_lower->sys_free)(table);
+    }
+
+    return error;
+}
+
+#ifdef ZS_HAVE_LZ4
+/*
+ * Find the size of an independent lz4 block by decoding it.
+ */
+static int
+zs_lz4_block_size(zs_file_t *zfp, zs_frame_t *zf, uint32_t blockmax) {
+    unsigned char *cbuf;
+    unsigned char *dbuf;
+    int            error;
+
+    if (!(error = (*zs_lower->sys_malloc)(&cbuf, zf->zf_csize))) {
+        if (!(error = (*zs_lower->sys_malloc)(&dbuf, blockmax))) {
+            if (!(error = zs_read_exact(zfp, cbuf, zf->zf_csize,
+                                        zf->zf_coffset))) {
+                int dsize = LZ4_decompress_safe((const char *)cbuf,
+                                                (char *)dbuf, zf->zf_csize,
+                                                blockmax);
+
+                if (dsize > 0) {
+                    zfp->zs_size  = zfp->zs_size - zf->zf_dsize + dsize;
+                    zf->zf_dsize = dsize;
+                } else {
+                    error = EIO;
+                }
+            }
+            (void)(*zs_lower->sys_free)(dbuf);
+        }
+        (void)(*zs_lower->sys_free)(cbuf);
+    }
+
+    return error;
+}
+
+/*
+ * Index one lz4 frame at "*offsetp", and advance past it.
+ */
+static int
+zs_index_lz4_frame(zs_file_t *zfp, uint64_t fsize, uint64_t *offsetp) {
+    unsigned char hdr[15];
+    uint64_t      fstart = *offsetp;
+    uint64_t      doffset = zfp->zs_size;
+    uint64_t      first   = zfp->zs_nframes;
+    uint64_t      csize   = 0;
+    uint64_t      offset;
+    uint32_t      blockmax;
+    uint32_t      bsize;
+    int           flg;
+    int           error;
+
+    if ((fsize - fstart) < 7)
+        return EINVAL;
+    if ((error = zs_read_exact(zfp, hdr,
+                               ((fsize - fstart) < sizeof(hdr))
+                                   ? (fsize - fstart)
+                                   : sizeof(hdr),
+                               fstart)))
+        return error;
+    flg = hdr[4];
+    if (((flg & 0xc0) != ZS_LZ4_VERSION) || (((hdr[5] >> 4) & 7) < 4))
+        return EINVAL;
+    if (flg & ZS_LZ4_DICTID)
+        return ENOTSUP;
+    blockmax = 1U << (8 + 2 * ((hdr[5] >> 4) & 7));
+    if (flg & ZS_LZ4_CSIZE)
+        csize = zs_le64(hdr + 6);
+    offset = fstart + 7 + ((flg & ZS_LZ4_CSIZE) ? 8 : 0);
+    /*
+     * Walk the block headers.
+     */
+    for (;;) {
+        unsigned char bhdr[4];
+
+        if ((error = zs_read_exact(zfp, bhdr, sizeof(bhdr), offset)))
+            return error;
+        offset += sizeof(bhdr);
+        if (!(bsize = zs_le32(bhdr)))
+            break;
+        if ((flg & ZS_LZ4_INDEPENDENT) &&
+            (error = zs_add_frame(zfp, offset, bsize & ~ZS_LZ4_STORED,
+                                  (bsize & ZS_LZ4_STORED)
+                                      ? (bsize & ~ZS_LZ4_STORED)
+                                      : blockmax,
+                                  (bsize & ZS_LZ4_STORED)
+                                      ? ZS_KIND_LZ4_STORED
+                                      : ZS_KIND_LZ4_BLOCK)))
+            return error;
+        offset += (bsize & ~ZS_LZ4_STORED) + ((flg & ZS_LZ4_BLOCKSUM) ? 4 : 0);
+        if (offset > fsize)
+            return EINVAL;
+    }
+    offset += (flg & ZS_LZ4_CONTENTSUM) ? 4 : 0;
+    if (offset > fsize)
+        return EINVAL;
+    if (!(flg & ZS_LZ4_INDEPENDENT)) {
+        /*
+         * Linked blocks are decoded as a frame, which had better say how
+         * big it is.
+         */
+        if (!(flg & ZS_LZ4_CSIZE))
+            return ENOTSUP;
+        error = zs_add_frame(zfp, fstart, offset - fstart, csize,
+                             ZS_KIND_LZ4_FRAME);
+    } else if (zfp->zs_nframes > first) {
+        /*
+         * Only the last block of a frame may be short.  Its size follows from
+         * the content size if there is one; otherwise we have to decode it.
+         */
+        zs_frame_t *zf = &zfp->zs_frames[zfp->zs_nframes - 1];
+
+        if (flg & ZS_LZ4_CSIZE) {
+            uint64_t before = zf->zf_doffset - doffset;
+
+            if ((csize <= before) || ((csize - before) > zf->zf_dsize))
+                return EINVAL;
+            zfp->zs_size = zfp->zs_size - zf->zf_dsize + (csize - before);
+            zf->zf_dsize = csize - before;
+        } else if (zf->zf_kind == ZS_KIND_LZ4_BLOCK) {
+            error = zs_lz4_block_size(zfp, zf, blockmax);
+        }
+    }
+    *offsetp = offset;
+
+    return error;
+}
+#endif /* ZS_HAVE_LZ4 */
+
+/*
+ * Index a file of lz4 frames, which may have skippable frames between.
+ */
+static int
+zs_index_lz4(zs_file_t *zfp, uint64_t fsize) {
+#ifdef ZS_HAVE_LZ4
+    uint64_t      offset = 0;
+    unsigned char hdr[8];
+    int           error = 0;
+
+    while (!error && (offset < fsize)) {
+        if ((fsize - offset) < sizeof(hdr)) {
+            error = EINVAL;
+        } else if (!(error = zs_read_exact(zfp, hdr, sizeof(hdr), offset))) {
+            if ((zs_le32(hdr) & ~0xfU) == ZS_MAGIC_SKIPPABLE)
+                offset += sizeof(hdr) + zs_le32(hdr + 4);
+            else if (zs_le32(hdr) == ZS_MAGIC_LZ4)
+                error = zs_index_lz4_frame(zfp, fsize, &offset);
+            else
+                error = EINVAL;
+        }
+    }
+
+    return error;
+#else  /* ZS_HAVE_LZ4 */
+    return ENOTSUP;
+#endif /* ZS_HAVE_LZ4 */
+}
+
+/*
+ * Set up to read a compressed file.  Files which aren't compressed are
+ * left to be passed through.
+ */
+static int
+zs_index(zs_file_t *zfp) {
+    unsigned char magic[4];
+    uint64_t      fsize;
+    uint64_t      nread;
+    int           error;
+
+    if ((error = (*zs_lower->sys_file_size)(zfp->zs_fd, &fsize)) ||
+        (error = (*zs_lower->sys_pread)(zfp->zs_fd, magic, sizeof(magic), 0,
+                                        &nread)) ||
+        (nread != sizeof(magic)))
+        return error;
+    switch (zs_le32(magic)) {
+    case ZS_MAGIC_ZSTD:
+#ifdef ZS_HAVE_ZSTD
+        error = zs_index_zstd(zfp, fsize);
+#else  /* ZS_HAVE_ZSTD */
+        error = ENOTSUP;
+#endif /* ZS_HAVE_ZSTD */
+        break;
+    case ZS_MAGIC_LZ4:
+        error = zs_index_lz4(zfp, fsize);
+        break;
+    default:
+        return 0;
+    }
+    if (!error && !zfp->zs_nframes)
+        error = EINVAL;
+    if (!error) {
+        zfp->zs_nslots = ZS_CACHE_BYTES / zfp->zs_maxdsize;
+        if (zfp->zs_nslots < ZS_MIN_SLOTS)
+            zfp->zs_nslots = ZS_MIN_SLOTS;
+        if (zfp->zs_nslots > ZS_MAX_SLOTS)
+            zfp->zs_nslots = ZS_MAX_SLOTS;
+        if (!(error = (*zs_lower->sys_malloc)(
+                  &zfp->zs_slots, zfp->zs_nslots * sizeof(zs_slot_t))))
+            memset(zfp->zs_slots, 0, zfp->zs_nslots * sizeof(zs_slot_t));
+        zfp->zs_lastframe = ~0ULL;
+    }
+
+    return error;
+}
+
+/*
+ * Get a decoder, making one if none is free.
+ */
+static int
+zs_decoder_get(zs_file_t *zfp, zs_decoder_t **zdpp) {
+    zs_decoder_t *zdp;
+    int           error = 0;
+
+    ZS_LOCK(zfp);
+    if ((zdp = zfp->zs_decoders))
+        zfp->zs_decoders = zdp->zd_next;
+    ZS_UNLOCK(zfp);
+    if (!zdp &&
+        !(error = (*zs_lower->sys_malloc)(&zdp, sizeof(zs_decoder_t)))) {
+        memset(zdp, 0, sizeof(*zdp));
+        error = (*zs_lower->sys_malloc)(&zdp->zd_cbuf, zfp->zs_maxcsize);
+#ifdef ZS_HAVE_ZSTD
+        if (!error && !(zdp->zd_zstd = ZSTD_createDCtx()))
+            error = ENOMEM;
+#endif /* ZS_HAVE_ZSTD */
+        if (error) {
+            if (zdp->zd_cbuf)
+                (void)(*zs_lower->sys_free)(zdp->zd_cbuf);
+            (void)(*zs_lower->sys_free)(zdp);
+            zdp = (zs_decoder_t *)NULL;
+        }
+    }
+    *zdpp = zdp;
+
+    return error;
+}
+
+static void
+zs_decoder_put(zs_file_t *zfp, zs_decoder_t *zdp) {
+    ZS_LOCK(zfp);
+    zdp->zd_next     = zfp->zs_decoders;
+    zfp->zs_decoders = zdp;
+    ZS_UNLOCK(zfp);
+}
+
+static void
+zs_decoder_free(zs_decoder_t *zdp) {
+#ifdef ZS_HAVE_ZSTD
+    ZSTD_freeDCtx(zdp->zd_zstd);
+#endif /* ZS_HAVE_ZSTD */
+    (void)(*zs_lower->sys_free)(zdp->zd_cbuf);
+    (void)(*zs_lower->sys_free)(zdp);
+}
+
+#ifdef ZS_HAVE_LZ4
+/*
+ * Decode a whole lz4 frame.
+ */
+static int
+zs_lz4_frame(const unsigned char *src, size_t slen, unsigned char *dst,
+             size_t dlen) {
+    LZ4F_dctx *dctx;
+    size_t     hint  = 1;
+    int        error = 0;
+
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+        return ENOMEM;
+    while (!error && slen && hint) {
+        size_t dn = dlen;
+        size_t sn = slen;
+
+        hint = LZ4F_decompress(dctx, dst, &dn, src, &sn,
+                               (const LZ4F_decompressOptions_t *)NULL);
+        if (LZ4F_isError(hint) || (!dn && !sn)) {
+            error = EIO;
+        } else {
+            dst += dn;
+            dlen -= dn;
+            src += sn;
+            slen -= sn;
+        }
+    }
+    if (!error && (hint || dlen))
+        error = EIO;
+    (void)LZ4F_freeDecompressionContext(dctx);
+
+    return error;
+}
+#endif /* ZS_HAVE_LZ4 */
+
+/*
+ * Decode a frame into "dst".
+ */
+static int
+zs_decode(zs_file_t *zfp, uint64_t frame, unsigned char *dst) {
+    zs_frame_t *  zf    = &zfp->zs_frames[frame];
+    uint64_t      start = stats_start();
+    zs_decoder_t *zdp;
+    int           error;
+
+    if (zf->zf_kind == ZS_KIND_LZ4_STORED) {
+        error = zs_read_exact(zfp, dst, zf->zf_dsize, zf->zf_coffset);
+    } else if (!(error = zs_decoder_get(zfp, &zdp))) {
+        if (!(error = zs_read_exact(zfp, zdp->zd_cbuf, zf->zf_csize,
+                                    zf->zf_coffset))) {
+            switch (zf->zf_kind) {
+#ifdef ZS_HAVE_ZSTD
+            case ZS_KIND_ZSTD: {
+                size_t dsize = ZSTD_decompressDCtx(zdp->zd_zstd, dst,
+                                                   zf->zf_dsize, zdp->zd_cbuf,
+                                                   zf->zf_csize);
+
+                if (ZSTD_isError(dsize) || (dsize != zf->zf_dsize))
+                    error = EIO;
+                break;
+            }
+#endif /* ZS_HAVE_ZSTD */
+#ifdef ZS_HAVE_LZ4
+            case ZS_KIND_LZ4_BLOCK:
+                if (LZ4_decompress_safe((const char *)zdp->zd_cbuf,
+                                        (char *)dst, zf->zf_csize,
+                                        zf->zf_dsize) != (int)zf->zf_dsize)
+                    error = EIO;
+                break;
+            case ZS_KIND_LZ4_FRAME:
+                error = zs_lz4_frame(zdp->zd_cbuf, zf->zf_csize, dst,
+                                     zf->zf_dsize);
+                break;
+#endif /* ZS_HAVE_LZ4 */
+            default:
+                error = ENOTSUP;
+                break;
+            }
+        }
+        zs_decoder_put(zfp, zdp);
+    }
+    stats_end(STATS_ZS_DECODE, start, 1, error);
+
+    return error;
+}
+
+/*
+ * Fill a slot which the caller has set ZS_SLOT_FILLING, and mark it ready
+ * (with a reference for the caller, if "hold") or empty on failure.
+ */
+static int
+zs_fill(zs_file_t *zfp, zs_slot_t *zlp, int hold) {
+    int error = 0;
+
+    if (!zlp->zl_data)
+        error = (*zs_lower->sys_malloc)(&zlp->zl_data, zfp->zs_maxdsize);
+    if (!error)
+        error = zs_decode(zfp, zlp->zl_frame, zlp->zl_data);
+    ZS_LOCK(zfp);
+    if (error) {
+        zlp->zl_state = ZS_SLOT_EMPTY;
+    } else {
+        zlp->zl_state   = ZS_SLOT_READY;
+        zlp->zl_lastuse = ++zfp->zs_tick;
+        if (hold)
+            zlp->zl_refs++;
+    }
+    ZS_CHANGED(zfp);
+    ZS_UNLOCK(zfp);
+
+    return error;
+}
+
+/*
+ * Find the slot holding a frame, and failing that the least recently used
+ * slot which can be given another.  Called with the lock held.
+ */
+static zs_slot_t *
+zs_slot_find(zs_file_t *zfp, uint64_t frame, zs_slot_t **victimp) {
+    zs_slot_t *victim = (zs_slot_t *)NULL;
+    uint32_t   sidx;
+
+    *victimp = (zs_slot_t *)NULL;
+    for (sidx = 0; sidx < zfp->zs_nslots; sidx++) {
+        zs_slot_t *zlp = &zfp->zs_slots[sidx];
+
+        if ((zlp->zl_state != ZS_SLOT_EMPTY) && (zlp->zl_frame == frame))
+            return zlp;
+        if (!zlp->zl_refs &&
+            ((zlp->zl_state == ZS_SLOT_EMPTY) ||
+             (zlp->zl_state == ZS_SLOT_READY)) &&
+            (!victim || (zlp->zl_lastuse < victim->zl_lastuse)))
+            victim = zlp;
+    }
+    *victimp = victim;
+
+    return (zs_slot_t *)NULL;
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * Decode queued frames until told to finish.
+ */
+static void *
+zs_worker(void *arg) {
+    zs_file_t *zfp = (zs_file_t *)arg;
+
+    ZS_LOCK(zfp);
+    while (!zfp->zs_shutdown) {
+        zs_slot_t *next = (zs_slot_t *)NULL;
+        uint32_t   sidx;
+
+        for (sidx = 0; sidx < zfp->zs_nslots; sidx++) {
+            zs_slot_t *zlp = &zfp->zs_slots[sidx];
+
+            if ((zlp->zl_state == ZS_SLOT_QUEUED) &&
+                (!next || (zlp->zl_frame < next->zl_frame)))
+                next = zlp;
+        }
+        if (next) {
+            next->zl_state = ZS_SLOT_FILLING;
+            ZS_UNLOCK(zfp);
+            (void)zs_fill(zfp, next, 0);
+            ZS_LOCK(zfp);
+        } else {
+            pthread_cond_wait(&zfp->zs_work, &zfp->zs_lock);
+        }
+    }
+    ZS_UNLOCK(zfp);
+
+    return (void *)NULL;
+}
+
+/*
+ * Start the decoding threads.  Called with the lock held.  Without them,
+ * there's no decoding ahead.
+ */
+static void
+zs_workers_start(zs_file_t *zfp) {
+    long     ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int      want  = (ncpus > ZS_MAX_WORKERS) ? ZS_MAX_WORKERS : (int)ncpus;
+    sigset_t newmask, oldmask;
+
+    if (want > (int)(zfp->zs_nslots / 2))
+        want = zfp->zs_nslots / 2;
+    /*
+     * Signals are for the application, not the decoding threads.
+     */
+    sigfillset(&newmask);
+    pthread_sigmask(SIG_BLOCK, &newmask, &oldmask);
+    while ((zfp->zs_nworkers < want) &&
+           !pthread_create(&zfp->zs_workers[zfp->zs_nworkers],
+                           (pthread_attr_t *)NULL, zs_worker, zfp))
+        zfp->zs_nworkers++;
+    pthread_sigmask(SIG_SETMASK, &oldmask, (sigset_t *)NULL);
+    zfp->zs_nahead = (zfp->zs_nworkers) ? zfp->zs_nworkers : -1;
+}
+
+/*
+ * Queue the frames after "frame" for decoding, as far as there are slots
+ * for them.  Called with the lock held.
+ */
+static void
+zs_readahead(zs_file_t *zfp, uint64_t frame) {
+    uint64_t next;
+
+    if (!zfp->zs_nahead)
+        zs_workers_start(zfp);
+    for (next = frame + 1; (zfp->zs_nahead > 0) &&
+                           (next <= (frame + zfp->zs_nahead)) &&
+                           (next < zfp->zs_nframes);
+         next++) {
+        zs_slot_t *victim;
+
+        if (!zs_slot_find(zfp, next, &victim)) {
+            if (!victim)
+                break;
+            victim->zl_frame = next;
+            victim->zl_state = ZS_SLOT_QUEUED;
+            pthread_cond_signal(&zfp->zs_work);
+        }
+    }
+}
+
+/*
+ * Hold every compressed file's lock across fork(), so that none is taken
+ * by a thread which the child won't have.
+ */
+static void
+zs_fork_prepare(void) {
+    zs_file_t *zfp;
+
+    pthread_mutex_lock(&zs_files_lock);
+    for (zfp = zs_files; zfp; zfp = zfp->zs_next)
+        ZS_LOCK(zfp);
+}
+
+static void
+zs_fork_parent(void) {
+    zs_file_t *zfp;
+
+    for (zfp = zs_files; zfp; zfp = zfp->zs_next)
+        ZS_UNLOCK(zfp);
+    pthread_mutex_unlock(&zs_files_lock);
+}
+
+/*
+ * The child has only the thread which forked, and none of the decoding
+ * threads.  Frames queued for them, or being decoded, would never be
+ * ready: empty their slots, and drop references held by other threads.
+ * Decoding threads are started again when reads in the child want them.
+ * A decoder that a thread was using is lost.
+ */
+static void
+zs_fork_child(void) {
+    zs_file_t *zfp;
+    uint32_t   sidx;
+
+    for (zfp = zs_files; zfp; zfp = zfp->zs_next) {
+        for (sidx = 0; sidx < zfp->zs_nslots; sidx++) {
+            zs_slot_t *zlp = &zfp->zs_slots[sidx];
+
+            if ((zlp->zl_state == ZS_SLOT_QUEUED) ||
+                (zlp->zl_state == ZS_SLOT_FILLING))
+                zlp->zl_state = ZS_SLOT_EMPTY;
+            zlp->zl_refs = 0;
+        }
+        zfp->zs_nworkers = 0;
+        zfp->zs_nahead   = 0;
+        pthread_cond_init(&zfp->zs_changed, (pthread_condattr_t *)NULL);
+        pthread_cond_init(&zfp->zs_work, (pthread_condattr_t *)NULL);
+        ZS_UNLOCK(zfp);
+    }
+    pthread_mutex_unlock(&zs_files_lock);
+}
+
+static void
+zs_atfork(void) {
+    (void)pthread_atfork(zs_fork_prepare, zs_fork_parent, zs_fork_child);
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/*
+ * Get a reference to the slot holding a frame, decoding it if need be.
+ */
+static int
+zs_hold(zs_file_t *zfp, uint64_t frame, zs_slot_t **zlpp) {
+    zs_slot_t *zlp;
+    zs_slot_t *victim;
+
+    ZS_LOCK(zfp);
+    for (;;) {
+        if ((zlp = zs_slot_find(zfp, frame, &victim))) {
+            if (zlp->zl_state == ZS_SLOT_READY) {
+                zlp->zl_refs++;
+                zlp->zl_lastuse = ++zfp->zs_tick;
+                ZS_UNLOCK(zfp);
+                *zlpp = zlp;
+                return 0;
+            }
+            if (zlp->zl_state == ZS_SLOT_QUEUED)
+                break;
+        } else if (victim) {
+            zlp           = victim;
+            zlp->zl_frame = frame;
+            break;
+        }
+        /*
+         * It's being decoded, or every slot is busy.
+         */
+        ZS_WAIT(zfp);
+    }
+    zlp->zl_state = ZS_SLOT_FILLING;
+    ZS_UNLOCK(zfp);
+    *zlpp = zlp;
+
+    return zs_fill(zfp, zlp, 1);
+}
+
+static void
+zs_release(zs_file_t *zfp, zs_slot_t *zlp) {
+    ZS_LOCK(zfp);
+    if (!--zlp->zl_refs)
+        ZS_CHANGED(zfp);
+    ZS_UNLOCK(zfp);
+}
+
+/*
+ * Which frame holds "offset"?
+ */
+static uint64_t
+zs_frame_of(zs_file_t *zfp, uint64_t offset) {
+    uint64_t lo = 0;
+    uint64_t hi = zfp->zs_nframes;
+
+    while ((hi - lo) > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        if (zfp->zs_frames[mid].zf_doffset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/*
+ * Read decompressed data.
+ */
+static int
+zs_read_at(zs_file_t *zfp, void *buf, uint64_t len, uint64_t offset,
+           uint64_t *nr) {
+    unsigned char *bp    = (unsigned char *)buf;
+    uint64_t       frame = zs_frame_of(zfp, offset);
+    int            error = 0;
+
+    *nr = 0;
+    if (offset >= zfp->zs_size)
+        return 0;
+    if (len > (zfp->zs_size - offset))
+        len = zfp->zs_size - offset;
+    while (!error && len) {
+        zs_frame_t *zf   = &zfp->zs_frames[frame];
+        uint64_t    foff = offset - zf->zf_doffset;
+        uint64_t    flen = zf->zf_dsize - foff;
+        zs_slot_t * zlp;
+
+        if (flen > len)
+            flen = len;
+        if (!(error = zs_hold(zfp, frame, &zlp))) {
+#ifdef HAVE_LIBPTHREAD
+            /*
+             * Reads going through the file in order get the frames after
+             * this one decoded ahead of them.  The frame is held by now, so
+             * queueing them doesn't displace it.
+             */
+            ZS_LOCK(zfp);
+            if ((frame == zfp->zs_lastframe) ||
+                (frame == (zfp->zs_lastframe + 1)))
+                zs_readahead(zfp, frame);
+            zfp->zs_lastframe = frame;
+            ZS_UNLOCK(zfp);
+#endif /* HAVE_LIBPTHREAD */
+            memcpy(bp, zlp->zl_data + foff, flen);
+            zs_release(zfp, zlp);
+            bp += flen;
+            offset += flen;
+            len -= flen;
+            *nr += flen;
+            frame++;
+        }
+    }
+
+    return error;
+}
+
+static void
+zs_destroy(zs_file_t *zfp) {
+    uint32_t sidx;
+
+#ifdef HAVE_LIBPTHREAD
+    if (zfp->zs_frames) {
+        zs_file_t **linkp;
+
+        pthread_mutex_lock(&zs_files_lock);
+        for (linkp = &zs_files; *linkp && (*linkp != zfp);
+             linkp = &(*linkp)->zs_next)
+            ;
+        if (*linkp)
+            *linkp = zfp->zs_next;
+        pthread_mutex_unlock(&zs_files_lock);
+    }
+    if (zfp->zs_nworkers) {
+        ZS_LOCK(zfp);
+        zfp->zs_shutdown = 1;
+        pthread_cond_broadcast(&zfp->zs_work);
+        ZS_UNLOCK(zfp);
+        while (zfp->zs_nworkers--)
+            pthread_join(zfp->zs_workers[zfp->zs_nworkers], (void **)NULL);
+    }
+    pthread_cond_destroy(&zfp->zs_work);
+    pthread_cond_destroy(&zfp->zs_changed);
+    pthread_mutex_destroy(&zfp->zs_lock);
+#endif /* HAVE_LIBPTHREAD */
+    while (zfp->zs_decoders) {
+        zs_decoder_t *zdp = zfp->zs_decoders;
+
+        zfp->zs_decoders = zdp->zd_next;
+        zs_decoder_free(zdp);
+    }
+    if (zfp->zs_slots) {
+        for (sidx = 0; sidx < zfp->zs_nslots; sidx++)
+            if (zfp->zs_slots[sidx].zl_data)
+                (void)(*zs_lower->sys_free)(zfp->zs_slots[sidx].zl_data);
+        (void)(*zs_lower->sys_free)(zfp->zs_slots);
+    }
+    if (zfp->zs_frames)
+        (void)(*zs_lower->sys_free)(zfp->zs_frames);
+    if (zfp->zs_fd)
+        (void)(*zs_lower->sys_close)(zfp->zs_fd);
+    (void)(*zs_lower->sys_free)(zfp);
+}
+
+/*
+ * Open a file handle.  Compressed files are indexed; the rest are passed
+ * through.
+ */
+static int
+zs_open(void *rhp, const char *p, sysdep_open_mode_t omode) {
+    zs_file_t **zfpp = (zs_file_t **)rhp;
+    zs_file_t * zfp;
+    int         error;
+
+    if ((error = (*zs_lower->sys_malloc)(&zfp, sizeof(*zfp))))
+        return error;
+    memset(zfp, 0, sizeof(*zfp));
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_init(&zfp->zs_lock, (pthread_mutexattr_t *)NULL);
+    pthread_cond_init(&zfp->zs_changed, (pthread_condattr_t *)NULL);
+    pthread_cond_init(&zfp->zs_work, (pthread_condattr_t *)NULL);
+#endif /* HAVE_LIBPTHREAD */
+    if (!(error = (*zs_lower->sys_open)(&zfp->zs_fd, p, omode)) &&
+        ((omode == SYSDEP_OPEN_RO) || (omode == SYSDEP_OPEN_RW)))
+        error = zs_index(zfp);
+    if (error) {
+        zs_destroy(zfp);
+        zfp = (zs_file_t *)NULL;
+    }
+#ifdef HAVE_LIBPTHREAD
+    if (zfp && zfp->zs_frames) {
+        pthread_mutex_lock(&zs_files_lock);
+        zfp->zs_next = zs_files;
+        zs_files     = zfp;
+        pthread_mutex_unlock(&zs_files_lock);
+    }
+#endif /* HAVE_LIBPTHREAD */
+    *zfpp = zfp;
+
+    return error;
+}
+
+static int
+zs_close(void *rh) {
+    zs_file_t *zfp = (zs_file_t *)rh;
+
+    if (!zfp)
+        return EINVAL;
+    zs_destroy(zfp);
+
+    return 0;
+}
+
+static int
+zs_seek(void *rh, int64_t offset, sysdep_whence_t whence, uint64_t *resoffp) {
+    zs_file_t *zfp = (zs_file_t *)rh;
+    int64_t    base;
+
+    if (!zfp)
+        return EINVAL;
+    if (!zfp->zs_frames)
+        return (*zs_lower->sys_seek)(zfp->zs_fd, offset, whence, resoffp);
+    switch (whence) {
+    case SYSDEP_SEEK_ABSOLUTE:
+        base = 0;
+        break;
+    case SYSDEP_SEEK_RELATIVE:
+        base = zfp->zs_offset;
+        break;
+    case SYSDEP_SEEK_END:
+        base = zfp->zs_size;
+        break;
+    default:
+        return EINVAL;
+    }
+    if ((base + offset) < 0)
+        return EINVAL;
+    zfp->zs_offset = base + offset;
+    if (resoffp)
+        *resoffp = zfp->zs_offset;
+
+    return 0;
+}
+
+static int
+zs_read(void *rh, void *buf, uint64_t len, uint64_t *nr) {
+    zs_file_t *zfp = (zs_file_t *)rh;
+    int        error;
+
+    if (!zfp)
+        return EINVAL;
+    if (!zfp->zs_frames)
+        return (*zs_lower->sys_read)(zfp->zs_fd, buf, len, nr);
+    if (!(error = zs_read_at(zfp, buf, len, zfp->zs_offset, nr)))
+        zfp->zs_offset += *nr;
+
+    return error;
+}
+
+static int
+zs_write(void *rh, void *buf, uint64_t len, uint64_t *nw) {
+    zs_file_t *zfp = (zs_file_t *)rh;
+
+    if (!zfp)
+        return EINVAL;
+
+    return (zfp->zs_frames) ? EROFS
+                            : (*zs_lower->sys_write)(zfp->zs_fd, buf, len, nw);
+}
+
+static int
+zs_malloc(void *nmpp, uint64_t nbytes) {
+    return (*zs_lower->sys_malloc)(nmpp, nbytes);
+}
+
+static int
+zs_free(void *mp) {
+    return (*zs_lower->sys_free)(mp);
+}
+
+static int
+zs_file_size(void *rh, uint64_t *nbytes) {
+    zs_file_t *zfp = (zs_file_t *)rh;
+
+    if (!zfp)
+        return EINVAL;
+    if (!zfp->zs_frames)
+        return (*zs_lower->sys_file_size)(zfp->zs_fd, nbytes);
+    *nbytes = zfp->zs_size;
+
+    return 0;
+}
+
+static int
+zs_pread(void *rh, void *buf, uint64_t len, uint64_t offset, uint64_t *nr) {
+    zs_file_t *zfp = (zs_file_t *)rh;
+
+    if (!zfp)
+        return EINVAL;
+
+    return (zfp->zs_frames)
+               ? zs_read_at(zfp, buf, len, offset, nr)
+               : (*zs_lower->sys_pread)(zfp->zs_fd, buf, len, offset, nr);
+}
+
+static int
+zs_pwrite(void *rh, void *buf, uint64_t len, uint64_t offset, uint64_t *nw) {
+    zs_file_t *zfp = (zs_file_t *)rh;
+
+    if (!zfp)
+        return EINVAL;
+
+    return (zfp->zs_frames)
+               ? EROFS
+               : (*zs_lower->sys_pwrite)(zfp->zs_fd, buf, len, offset, nw);
+}
+
+static int
+zs_pwritev(void *rh, const sysdep_iovec_t *iov, uint32_t niov, uint64_t offset,
+           uint64_t *nw) {
+    zs_file_t *zfp = (zs_file_t *)rh;
+
+    if (!zfp)
+        return EINVAL;
+
+    return (zfp->zs_frames)
+               ? EROFS
+               : (*zs_lower->sys_pwritev)(zfp->zs_fd, iov, niov, offset, nw);
+}
+
+static int
+zs_file_mtime(void *rh, uint64_t *mtime) {
+    zs_file_t *zfp = (zs_file_t *)rh;
+
+    return (zfp) ? (*zs_lower->sys_file_mtime)(zfp->zs_fd, mtime) : EINVAL;
+}
+
+/*
+ * The reads of a batch are done in turn.
+ */
+static int
+zs_pread_batch(sysdep_io_t *iop, uint32_t nio) {
+    int      error = 0;
+    uint32_t iidx;
+
+    for (iidx = 0; iidx < nio; iidx++) {
+        iop[iidx].io_error =
+            zs_pread(iop[iidx].io_rh, iop[iidx].io_buf, iop[iidx].io_len,
+                     iop[iidx].io_offset, &iop[iidx].io_nbytes);
+        if (!error)
+            error = iop[iidx].io_error;
+    }
+
+    return error;
+}
+
+static int
+zs_fileno(void *rh) {
+    zs_file_t *zfp = (zs_file_t *)rh;
+
+    return (zfp && !zfp->zs_frames) ? (*zs_lower->sys_fileno)(zfp->zs_fd)
+                                    : -1;
+}
+
+static int
+zs_sync(void *rh) {
+    zs_file_t *zfp = (zs_file_t *)rh;
+
+    if (!zfp)
+        return EINVAL;
+
+    return (zfp->zs_frames) ? 0 : (*zs_lower->sys_sync)(zfp->zs_fd);
+}
+
+/*
+ * Only files which aren't compressed can be mapped.
+ */
+static int
+zs_map(void *rh, uint64_t offset, uint64_t len, void **addrp) {
+    zs_file_t *zfp = (zs_file_t *)rh;
+
+    if (!zfp)
+        return EINVAL;
+
+    return (zfp->zs_frames)
+               ? ENOTSUP
+               : (*zs_lower->sys_map)(zfp->zs_fd, offset, len, addrp);
+}
+
+static int
+zs_unmap(void *addr, uint64_t len) {
+    return (*zs_lower->sys_unmap)(addr, len);
+}
+
+static int
+zs_rename(const char *from, const char *to) {
+    return (*zs_lower->sys_rename)(from, to);
+}
+
+static const sysdep_dispatch_t zstream_dispatch = {
+    zs_open,   zs_close,  zs_seek,       zs_read,
+    zs_write,  zs_malloc, zs_free,       zs_file_size,
+    zs_pread,  zs_pwrite, zs_file_mtime, zs_pread_batch,
+    zs_fileno, zs_sync,   zs_map,        zs_unmap,
+    zs_rename, zs_pwritev};
+
+/*
+ * Get the interface for reading compressed files, over "lower".
+ *
+ * Returns:
+ * - 0: Success.
+ * - EBUSY: It's already in use over another interface.
+ */
+int
+sysdep_zstream_init(const sysdep_dispatch_t *lower,
+                    const sysdep_dispatch_t **sysdepp) {
+    if (!zs_lower)
+        zs_lower = lower;
+    if (zs_lower != lower)
+        return EBUSY;
+#ifdef HAVE_LIBPTHREAD
+    pthread_once(&zs_atfork_once, zs_atfork);
+#endif /* HAVE_LIBPTHREAD */
+    *sysdepp = &zstream_dispatch;
+
+    return 0;
+}
+
+/*
+ * Cheaply decide whether "path" is a compressed file we can read.
+ *
+ * Returns:
+ * - 0: It is.
+ * - EINVAL: It isn't compressed.
+ * - ENOTSUP: It's compressed, but not so that it can be read at random
+ *   (a zstd file without a seek table), or we lack the decompressor.
+ * - error: Otherwise.
+ */
+int
+sysdep_zstream_probe(const char *path, const sysdep_dispatch_t *lower) {
+    const sysdep_dispatch_t *zsysdep;
+    zs_file_t                zf;
+    unsigned char            magic[4];
+    uint64_t                 fsize;
+    int                      error;
+
+    if ((error = sysdep_zstream_init(lower, &zsysdep)))
+        return error;
+    memset(&zf, 0, sizeof(zf));
+    if ((error = (*lower->sys_open)(&zf.zs_fd, path, SYSDEP_OPEN_RO)))
+        return error;
+    if (!(error = (*lower->sys_file_size)(zf.zs_fd, &fsize)) &&
+        !(error = zs_read_exact(&zf, magic, sizeof(magic), 0))) {
+        switch (zs_le32(magic)) {
+        case ZS_MAGIC_ZSTD: {
+#ifdef ZS_HAVE_ZSTD
+            uint32_t nframes;
+            uint32_t entsize;
+            uint64_t toffset;
+
+            error = zs_zstd_seekable(&zf, fsize, &nframes, &entsize, &toffset);
+#else  /* ZS_HAVE_ZSTD */
+            error = ENOTSUP;
+#endif /* ZS_HAVE_ZSTD */
+            break;
+        }
+        case ZS_MAGIC_LZ4:
+#ifdef ZS_HAVE_LZ4
+            error = 0;
+#else  /* ZS_HAVE_LZ4 */
+            error = ENOTSUP;
+#endif /* ZS_HAVE_LZ4 */
+            break;
+        default:
+            error = EINVAL;
+            break;
+        }
+    }
+    (void)(*lower->sys_close)(zf.zs_fd);
+
+    return error;
+}
@@ -0,0 +1,22 @@
+/*
+ * sysdep_zstream.h - Compressed stream system dependent module interface.
+ */
+/*
+ * Copyright (c) 2014, Ideal World, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#ifndef _SYSDEP_ZSTREAM_H_
+#define _SYSDEP_ZSTREAM_H_ 1
+
+#include "sysdep_int.h"
+
+int sysdep_zstream_init(const sysdep_dispatch_t *lower,
+                        const sysdep_dispatch_t **sysdepp);
+int sysdep_zstream_probe(const char *path, const sysdep_dispatch_t *lower);
+
+#endif /* _SYSDEP_ZSTREAM_H_ */